@@ -1,593 +1,2618 @@
-#include "pch.h"
-//#include "ErrorHelpers.hpp"
-//#include <stdarg.h>
-
-//-------------------------------- ErrorHelpers.cpp ---------------------------
-
-//////////////// general helper functions /////////////////////////////
-
-std::wstring __cdecl wstrprintf(
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...)
-{
-	std::wstring res;
-	va_list args;
-	va_start(args, fmt);
-	vwstrAppendF(res, fmt, args);
-	va_end(args);
-	return res;
-}
-
-std::wstring __cdecl vwstrprintf(
-	_In_z_ const WCHAR *fmt,
-	__in va_list args)
-{
-	std::wstring res;
-	vwstrAppendF(res, fmt, args);
-	return res;
-}
-
-void __cdecl wstrAppendF(
-	__inout std::wstring &dest,
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...
-)
-{
-	va_list args;
-	va_start(args, fmt);
-	vwstrAppendF(dest, fmt, args);
-	va_end(args);
-}
-
-void __cdecl vwstrAppendF(
-	__inout std::wstring &dest,
-	_In_z_ const WCHAR *fmt,
-	__in va_list args)
-{
-	va_list cpargs;
-
-	cpargs = args; // in standard form would be va_copy(cpargs, args);
-	int reqlen = _vscwprintf(fmt, cpargs) + 1; // +1 for \0
-	va_end(cpargs);
-
-	PWCHAR buf = new WCHAR[reqlen];
-	int result = _vsnwprintf_s(buf, reqlen, _TRUNCATE, fmt, args);
-
-	if (result < 0) 
-	{ // should never happen
-		dest.append(L"[vwstrAppendF: Internal error: could not compute the required string length]");
-	}
-	else 
-	{
-		dest.append(buf);
-	}
-
-	delete[] buf;
-}
-
-////////////////////// ErrorMsg::InternalErrorSource //////////////////
-// The Source for the internal errors.
-static WCHAR internalErrorSourceName[] = L"ErrorMsg";
-static ErrorMsg::InternalErrorSource internalErrorSource(internalErrorSourceName);
-
-////////////////////// Erref //////////////////////////////////////////
-
-void Erref::splice(const std::shared_ptr<ErrorMsg> &other)
-{
-	if (!other)
-		return;
-	if (!*this) 
-	{
-		*this = other;
-		return;
-	}
-
-	ErrorMsg *msg = get();
-	if (!msg->chain_) 
-	{
-		msg->chain_ = other;
-		return;
-	}
-
-	Erref oldChain = msg->chain_;
-	msg->chain_ = other;
-
-	Erref eit = other;
-	for (; eit->chain_; eit = eit->chain_) 
-	{
-		;
-	}
-	eit->chain_ = oldChain;
-}
-
-void Erref::append(const std::shared_ptr<ErrorMsg> &other)
-{
-	if (!other)
-		return;
-	if (!*this) 
-	{
-		*this = other;
-		return;
-	}
-
-	Erref eit = *this;
-	for (; eit->chain_; eit = eit->chain_) 
-	{
-	}
-	eit->chain_ = other;
-}
-
-void Erref::printAndExitOnError()
-{
-	if (hasError()) 
-	{
-		wstring s = get()->toString();
-		wprintf(L"%ls", s.c_str());
-		exit(1);
-	}
-}
-
-Erref Erref::copy()
-{
-	return ErrorMsg::mkCopy(*this);
-}
-
-////////////////////// ErrorMsg ///////////////////////////////////////
-
-ErrorMsg::Source ErrnoSource(L"Errno", NULL);
-
-ErrorMsg::ErrorMsg(const ErrorMsg &orig) :
-	source_(orig.source_), code_(orig.code_), msg_(orig.msg_)
-{
-	if (orig.chain_)
-		chain_ = mkCopy(orig.chain_);
-}
-
-ErrorMsg::~ErrorMsg()
-{ 
-}
-
-std::shared_ptr<ErrorMsg> ErrorMsg::mkCopy(const ErrorMsg &orig)
-{
-	return make_shared<ErrorMsg>(orig);
-}
-
-std::shared_ptr<ErrorMsg> ErrorMsg::mkCopy(const Erref &orig)
-{
-	if (orig)
-		return make_shared<ErrorMsg>(*orig.get());
-	return NULL;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkString(
-	__in const Source *source,
-	__in DWORD code,
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...)
-{
-	va_list args;
-	va_start(args, fmt);
-	std::shared_ptr<ErrorMsg> err = mkStringVa(source, code, fmt, args);
-	va_end(args);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkStringVa(
-	__in const Source *source,
-	__in DWORD code,
-	_In_z_ const WCHAR *fmt,
-	__in va_list args
-)
-{
-	Erref err = make_shared<ErrorMsg>(source, code);
-	err->msg_ = vwstrprintf(fmt, args);
-
-	// if the message includes \r\n, drop them
-	size_t msize = err->msg_.size();
-	while (msize > 0
-		&& (err->msg_[msize - 1] == L'\n' || err->msg_[msize - 1] == L'\r')) 
-	{
-		--msize;
-		err->msg_.resize(msize);
-	}
-
-	if (source->muiModule_ != NULL) 
-	{
-		// Return at least the original error code but chain the internal error message
-		err.splice(internalErrorSource.mkString(
-			InternalErrorSource::MUST_USE_MUI,
-			L"Internal error: used a plain-text error on the MUIsource '%ls'.",
-			source->name_));
-	}
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkSystem(
-	__in DWORD code
-)
-{
-	std::shared_ptr<ErrorMsg> err = make_shared<ErrorMsg>((Source *)NULL, code);
-	LPWSTR buf = NULL;
-	FormatMessageW(
-		FORMAT_MESSAGE_ALLOCATE_BUFFER |
-		FORMAT_MESSAGE_FROM_SYSTEM |
-		FORMAT_MESSAGE_IGNORE_INSERTS,
-		NULL,
-		code,
-		MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-		(LPWSTR)&buf,
-		0, NULL);
-	if (buf) 
-	{
-		err->msg_ = buf;
-	}
-	else 
-	{
-		err->msg_ = L"[error text not found]";
-	}
-
-	// for whatever reason, the system message tends to include \r\n
-	size_t msize = err->msg_.size();
-	while (msize > 0
-		&& (err->msg_[msize - 1] == L'\n' || err->msg_[msize - 1] == L'\r')) 
-	{
-		--msize;
-		err->msg_.resize(msize);
-	}
-	LocalFree(buf);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkErrno(
-	__in DWORD code
-)
-{
-	std::shared_ptr<ErrorMsg> err = make_shared<ErrorMsg>(&ErrnoSource, code);
-	err->msg_ = _wcserror(code);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkErrno()
-{
-	int eval;
-	_get_errno(&eval);
-	return mkErrno(eval);
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkSystem(
-	__in DWORD sysCode,
-	__in const Source *source,
-	__in DWORD appCode,
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...)
-{
-	va_list args;
-	va_start(args, fmt);
-	std::shared_ptr<ErrorMsg> err = mkSystemVa(sysCode, source, appCode, fmt, args);
-	va_end(args);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkSystemVa(
-	__in DWORD sysCode,
-	__in const Source *source,
-	__in DWORD appCode,
-	_In_z_ const WCHAR *fmt,
-	__in va_list args
-)
-{
-	Erref err = make_shared<ErrorMsg>(source, appCode);
-	err->msg_ = vwstrprintf(fmt, args);
-	err->chain_ = mkSystem(sysCode);
-	if (source->muiModule_ != NULL) 
-	{
-		// Return at least the original error code but chain the internal error message
-		err.splice(internalErrorSource.mkString(
-			InternalErrorSource::MUST_USE_MUI,
-			L"Internal error: used a plain-text error on the MUIsource '%ls'.",
-			source->name_));
-	}
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkMui(
-	__in const Source *source,
-	__in DWORD code,
-	...
-)
-{
-	va_list args;
-	va_start(args, code);
-	std::shared_ptr<ErrorMsg> err = mkMuiVa(source, code, args);
-	va_end(args);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::mkMuiVa(
-	__in const Source *source,
-	__in DWORD code,
-	__in va_list args
-)
-{
-	Erref err = make_shared<ErrorMsg>(source, code);
-
-	if (source->muiModule_ == NULL) 
-	{
-		// Return at least the original error code but chain the internal error message
-		err.splice(internalErrorSource.mkString(
-			InternalErrorSource::NO_MUI_HANDLE,
-			L"Internal error: attempted to use a MUI error reporting on the source '%ls' without MUI support.",
-			source->name_));
-	}
-	else 
-	{
-		LPWSTR buf = NULL;
-		DWORD res = FormatMessageW(
-			FORMAT_MESSAGE_ALLOCATE_BUFFER
-			| FORMAT_MESSAGE_FROM_HMODULE,
-			source->muiModule_,
-			code,
-			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-			(LPWSTR)&buf,
-			0, &args);
-		if (res == 0) 
-		{
-			err.splice(internalErrorSource.mkSystem(GetLastError(),
-				InternalErrorSource::MUI_NO_MESSAGE,
-				L"Internal error: cannot find a MUI message for source '%ls' code 0x%x.",
-				source->name_, code));
-		}
-		if (buf != NULL) 
-		{
-			err->msg_ = buf;
-
-			// for whatever reason, the message always includes \r\n
-			size_t msize = err->msg_.size();
-			while (msize > 0
-				&& (err->msg_[msize - 1] == L'\n' || err->msg_[msize - 1] == L'\r')) 
-			{
-				--msize;
-				err->msg_.resize(msize);
-			}
-
-			LocalFree(buf);
-		}
-	}
-
-	return err;
-}
-
-std::shared_ptr<ErrorMsg> ErrorMsg::mkMuiSystem(
-	__in DWORD sysCode,
-	__in const Source *source,
-	__in DWORD appCode,
-	...)
-{
-	va_list args;
-	va_start(args, appCode);
-	std::shared_ptr<ErrorMsg> err = mkMuiSystemVa(sysCode, source, appCode, args);
-	va_end(args);
-	return err;
-}
-
-std::shared_ptr<ErrorMsg> ErrorMsg::mkMuiSystemVa(
-	__in DWORD sysCode,
-	__in const Source *source,
-	__in DWORD appCode,
-	__in va_list args
-)
-{
-	Erref err = mkMuiVa(source, appCode, args);
-	err.splice(mkSystem(sysCode));
-	return err;
-}
-
-std::wstring ErrorMsg::toString()
-{
-	std::wstring res;
-	bool outer = true;
-	ErrorMsg *err;
-	size_t estimate;
-
-	// first estimate the required string size, to avoid reallocating it continuously
-	estimate = 0;
-	for (err = this; err != NULL; err = err->chain_.get()) 
-	{
-		estimate += 40; // for the source name and error number, and better estimate high
-		estimate += err->msg_.size();
-	}
-	res.reserve(estimate);
-
-	// now print the messages
-	for (err = this; err != NULL; err = err->chain_.get())
-	{
-		if (!outer) 
-		{
-			res.append(L"  "); // indent the dependent errors
-		}
-		else
-		{
-			outer = false;
-		}
-		if (err->source_ == NULL)
-		{
-			res.append(L"NT");
-		}
-		else
-		{
-			res.append(err->source_->name_);
-		}
-		res.append(wstrprintf(L":%d:0x%x: ", (err->code_ & 0x3FFFFFFF), err->code_));
-		res.append(err->msg_); // if contains \n, would not follow the indenting nicely
-		if (res[res.size() - 1] != L'\n')
-			res.append(L"\n");
-	}
-
-	return res;
-}
-
-std::wstring ErrorMsg::toLimitedString(
-	__in size_t limit,
-	__out Erref &next)
-{
-	std::wstring res;
-	bool outer = true;
-	ErrorMsg *err;
-	size_t estimate;
-
-	// first estimate the required string size, to avoid reallocating it continuously
-	estimate = 0;
-	for (err = this; err != NULL; err = err->chain_.get())
-	{
-		estimate += 40; // for the source name and error number, and better estimate high
-		estimate += err->msg_.size();
-		if (estimate > limit)
-			break;
-	}
-	res.reserve(estimate);
-
-	// now print the messages
-	ErrorMsg *lasterr = NULL;
-	for (err = this; err != NULL; lasterr = err, err = err->chain_.get())
-	{
-		size_t prevsz = res.size();
-
-		if (!outer)
-		{
-			res.append(L"  "); // indent the dependent errors
-		}
-		else
-		{
-			outer = false;
-		}
-		if (err->source_ == NULL)
-		{
-			res.append(L"NT");
-		}
-		else
-		{
-			res.append(err->source_->name_);
-		}
-		res.append(wstrprintf(L":%d:0x%x: ", (err->code_ & 0x3FFFFFFF), err->code_));
-
-		if (res.size() + err->msg_.size() >= limit && lasterr)
-		{
-			res.resize(prevsz); // throw away the partial last message
-			next = lasterr->chain_; // continue from this point on the next call
-			return res;
-		}
-
-		res.append(err->msg_); // if contains \n, would not follow the indenting nicely
-		if (res[res.size() - 1] != L'\n')
-			res.append(L"\n");
-	}
-
-	next.reset();
-	return res;
-}
-////////////////////// ErrorMsg::Source ///////////////////////////////
-
-shared_ptr<ErrorMsg> ErrorMsg::Source::mkString(
-	__in DWORD code,
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...)
-{
-	va_list args;
-	va_start(args, fmt);
-	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkStringVa(this, code, fmt, args);
-	va_end(args);
-	return err;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::Source::mkSystem(
-	__in DWORD sysCode,
-	__in DWORD appCode,
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...)
-{
-	va_list args;
-	va_start(args, fmt);
-	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkSystemVa(sysCode, this, appCode, fmt, args);
-	va_end(args);
-	return err;
-}
-
-////////////////////// ErrorMsg::MuiSource ////////////////////////////
-
-ErrorMsg::MuiSource::MuiSource(
-	__in const wchar_t *name,
-	__in_opt const GUID *guid,
-	__in uint32_t testFlags
-) :
-	Source(name, guid, testFlags)
-{
-	HMODULE m = NULL;
-
-	// Normally this would be static, located inside the module, so it
-	// can be used to find the module itself.
-	LPCWSTR anchor = (LPCWSTR)this;
-	if (testFlags_ & STF_INIT_ERR1)
-		anchor = NULL;
-
-	do
-	{
-		// This logic can handle the situations
-		// when this object is defined in either a DLL or an EXE.
-		if (!GetModuleHandleExW(
-			GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
-			| GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
-			anchor,
-			&m))
-		{
-			testError_ = internalErrorSource.mkSystem(GetLastError(),
-				InternalErrorSource::MODULE_LOAD_FAILURE,
-				L"Internal error: failed to load the MUI module for MuiSource '%ls' at address %p.",
-				name, anchor);
-			break;
-		}
-
-		muiModule_ = m;
-#pragma warning(suppress: 4127) // constant conditional expression
-	} while (0);
-
-	if (!(testFlags_ & STF_INIT_ERR1)
-		&& testError_.hasError())
-	{
-		wstring msg = testError_->toString();
-		// Print the error everywhere we can reach
-		wprintf(L"%s", msg.c_str()); fflush(stdout);
-		fwprintf(stderr, L"%s", msg.c_str()); fflush(stderr);
-		abort();
-	}
-}
-
-ErrorMsg::MuiSource::~MuiSource()
-{
-	// Because of GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT on opening
-	// the handle, no need to call FreeLibrary().
-	muiModule_ = NULL;
-}
-
-shared_ptr<ErrorMsg> ErrorMsg::MuiSource::mkMui(
-	__in DWORD code,
-	...)
-{
-	va_list args;
-	va_start(args, code);
-	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkMuiVa(this, code, args);
-	va_end(args);
-	return err;
-}
-
-std::shared_ptr<ErrorMsg> ErrorMsg::MuiSource::mkMuiSystem(
-	__in DWORD sysCode,
-	__in DWORD appCode,
-	...)
-{
-	va_list args;
-	va_start(args, appCode);
-	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkMuiSystemVa(sysCode, this, appCode, args);
-	va_end(args);
-	return err;
-}
-
+#include "pch.h"
+//#include "ErrorHelpers.hpp"
+//#include <stdarg.h>
+#include <algorithm>
+#include <assert.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//-------------------------------- ErrorHelpers.cpp ---------------------------
+
+//////////////// general helper functions /////////////////////////////
+
+std::wstring __cdecl wstrprintf(
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...)
+{
+	std::wstring res;
+	va_list args;
+	va_start(args, fmt);
+	vwstrAppendF(res, fmt, args);
+	va_end(args);
+	return res;
+}
+
+std::wstring __cdecl vwstrprintf(
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	std::wstring res;
+	vwstrAppendF(res, fmt, args);
+	return res;
+}
+
+void __cdecl wstrAppendF(
+	__inout std::wstring &dest,
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...
+)
+{
+	va_list args;
+	va_start(args, fmt);
+	vwstrAppendF(dest, fmt, args);
+	va_end(args);
+}
+
+// The formatting is normally done in one pass into a stack buffer
+// of this size (in characters). Only the longer results need a second
+// pass, formatting directly into the destination string.
+enum { STACK_FORMAT_LIMIT = 512 };
+
+// Format into a buffer.
+// Returns the length of the result, or -1 if it doesn't fit.
+static int formatInto(
+	__out_ecount(size) WCHAR *buf,
+	__in size_t size,
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+#ifdef _WIN32
+	return _vsnwprintf_s(buf, size, _TRUNCATE, fmt, args);
+#else
+	return vswprintf(buf, size, fmt, args);
+#endif
+}
+
+#ifdef _WIN32
+// Find the length of the formatted result, in characters without the \0.
+// Returns -1 on a format error.
+static int formatLength(
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	return _vscwprintf(fmt, args);
+}
+#endif
+
+void __cdecl vwstrAppendF(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	WCHAR buf[STACK_FORMAT_LIMIT];
+	va_list cpargs;
+
+	va_copy(cpargs, args);
+	int len = formatInto(buf, STACK_FORMAT_LIMIT, fmt, cpargs);
+	va_end(cpargs);
+
+	if (len >= 0)
+	{
+		dest.append(buf, len);
+		return;
+	}
+
+#ifdef _WIN32
+	va_copy(cpargs, args);
+	int reqlen = formatLength(fmt, cpargs);
+	va_end(cpargs);
+
+	if (reqlen < 0)
+	{ // should never happen
+		dest.append(L"[vwstrAppendF: Internal error: could not compute the required string length]");
+		return;
+	}
+
+	size_t oldsz = dest.size();
+	dest.resize(oldsz + reqlen + 1); // +1 for \0
+	va_copy(cpargs, args);
+	len = formatInto(&dest[oldsz], reqlen + 1, fmt, cpargs);
+	va_end(cpargs);
+	dest.resize(oldsz + (len < 0 ? 0 : len));
+#else
+	// vswprintf() can't tell the length of the result, so the longer
+	// results get formatted into a memory stream, that grows as needed
+	// in one pass, and then copied. There is no limit on the length
+	// besides the memory.
+	WCHAR *big = NULL;
+	size_t bigsz = 0;
+	FILE *f = open_wmemstream(&big, &bigsz);
+	if (f != NULL)
+	{
+		va_copy(cpargs, args);
+		len = vfwprintf(f, fmt, cpargs);
+		va_end(cpargs);
+		fclose(f); // sets big and bigsz
+		if (len >= 0)
+			dest.append(big, bigsz);
+		free(big);
+		if (len >= 0)
+			return;
+	}
+	dest.append(L"[vwstrAppendF: Internal error: the format failed]");
+#endif
+}
+
+void wstrAppendDec(
+	__inout std::wstring &dest,
+	__in int64_t val)
+{
+	WCHAR buf[24];
+	WCHAR *p = buf + _countof(buf);
+	// work in the negative range, where the minimal value fits
+	bool neg = (val < 0);
+	if (!neg)
+		val = -val;
+	do
+	{
+		*--p = (WCHAR)(L'0' - (val % 10));
+		val /= 10;
+	} while (val != 0);
+	if (neg)
+		*--p = L'-';
+	dest.append(p, buf + _countof(buf) - p);
+}
+
+void wstrAppendHex(
+	__inout std::wstring &dest,
+	__in uint64_t val)
+{
+	static const WCHAR digits[] = L"0123456789abcdef";
+	WCHAR buf[16];
+	WCHAR *p = buf + _countof(buf);
+	do
+	{
+		*--p = digits[val & 0xF];
+		val >>= 4;
+	} while (val != 0);
+	dest.append(p, buf + _countof(buf) - p);
+}
+
+void strListSep(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *sep)
+{
+	if (!dest.empty())
+		dest.append(sep);
+}
+
+std::wstring strFromGuid(
+	__in const GUID &guid)
+{
+	return wstrprintf(L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+		(unsigned)guid.Data1, (unsigned)guid.Data2, (unsigned)guid.Data3,
+		guid.Data4[0], guid.Data4[1], guid.Data4[2], guid.Data4[3],
+		guid.Data4[4], guid.Data4[5], guid.Data4[6], guid.Data4[7]);
+}
+
+#ifndef _WIN32
+std::string narrowPath(
+	_In_z_ const WCHAR *path)
+{
+	std::string res;
+	size_t len = wcstombs(NULL, path, 0);
+	if (len != (size_t)-1)
+	{
+		res.resize(len);
+		wcstombs(&res[0], path, len);
+	}
+	return res;
+}
+#endif
+
+////////////////////// FormatArgs /////////////////////////////////////
+
+FormatArgs::FormatArgs() :
+	data_(inline_), size_(0), capacity_(sizeof(inline_))
+{
+}
+
+FormatArgs::FormatArgs(const FormatArgs &orig) :
+	data_(inline_), size_(0), capacity_(sizeof(inline_))
+{
+	if (orig.size_ > capacity_)
+	{
+		capacity_ = orig.size_;
+		data_ = new uint64_t[capacity_ / sizeof(uint64_t)];
+	}
+	memcpy(data_, orig.data_, orig.size_);
+	size_ = orig.size_;
+}
+
+FormatArgs::~FormatArgs()
+{
+	if (data_ != inline_)
+		delete[] data_;
+}
+
+void FormatArgs::clear()
+{
+	if (data_ != inline_)
+		delete[] data_;
+	data_ = inline_;
+	size_ = 0;
+	capacity_ = sizeof(inline_);
+}
+
+uint8_t *FormatArgs::addEntry(ArgType type, uint32_t len)
+{
+	size_t vlen = (len == NULL_STR) ? 0 : len;
+	// keep every entry aligned to 8 bytes
+	size_t need = sizeof(Entry) + ((vlen + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+
+	if (size_ + need > capacity_)
+	{
+		size_t newcap = capacity_ * 2;
+		while (newcap < size_ + need)
+			newcap *= 2;
+		uint64_t *newdata = new uint64_t[newcap / sizeof(uint64_t)];
+		memcpy(newdata, data_, size_);
+		if (data_ != inline_)
+			delete[] data_;
+		data_ = newdata;
+		capacity_ = newcap;
+	}
+
+	uint8_t *p = (uint8_t *)data_ + size_;
+	Entry *e = (Entry *)p;
+	e->type_ = type;
+	e->len_ = len;
+	size_ += need;
+	return p + sizeof(Entry);
+}
+
+void FormatArgs::addInt(int v)
+{
+	*(int *)addEntry(AT_INT, sizeof(v)) = v;
+}
+
+void FormatArgs::addInt64(int64_t v)
+{
+	*(int64_t *)addEntry(AT_INT64, sizeof(v)) = v;
+}
+
+void FormatArgs::addDouble(double v)
+{
+	*(double *)addEntry(AT_DOUBLE, sizeof(v)) = v;
+}
+
+void FormatArgs::addPtr(const void *v)
+{
+	*(const void **)addEntry(AT_PTR, sizeof(v)) = v;
+}
+
+void FormatArgs::addWstr(const WCHAR *v)
+{
+	if (v == NULL)
+	{
+		addEntry(AT_WSTR, NULL_STR);
+		return;
+	}
+	uint32_t len = (uint32_t)((wcslen(v) + 1) * sizeof(WCHAR));
+	memcpy(addEntry(AT_WSTR, len), v, len);
+}
+
+void FormatArgs::addStr(const char *v)
+{
+	if (v == NULL)
+	{
+		addEntry(AT_STR, NULL_STR);
+		return;
+	}
+	uint32_t len = (uint32_t)(strlen(v) + 1);
+	memcpy(addEntry(AT_STR, len), v, len);
+}
+
+bool FormatArgs::captureVa(
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	for (const WCHAR *p = fmt; *p != 0; )
+	{
+		if (*p != L'%')
+		{
+			++p;
+			continue;
+		}
+		if (p[1] == L'%')
+		{
+			p += 2;
+			continue;
+		}
+
+		int stars;
+		ArgType type;
+		const WCHAR *end = parseSpec(p, stars, type);
+		if (end == NULL)
+			return false;
+		p = end;
+
+		for (; stars > 0; --stars)
+			addInt(va_arg(args, int));
+
+		switch (type)
+		{
+		case AT_INT:
+			addInt(va_arg(args, int));
+			break;
+		case AT_INT64:
+			addInt64(va_arg(args, int64_t));
+			break;
+		case AT_DOUBLE:
+			addDouble(va_arg(args, double));
+			break;
+		case AT_PTR:
+			addPtr(va_arg(args, const void *));
+			break;
+		case AT_WSTR:
+			addWstr(va_arg(args, const WCHAR *));
+			break;
+		case AT_STR:
+			addStr(va_arg(args, const char *));
+			break;
+		}
+	}
+	return true;
+}
+
+// Format one value with the star arguments for width and precision.
+template <typename T>
+static void appendSpec(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *spec,
+	__in int nstars,
+	__in_ecount(2) const int *stars,
+	__in T value)
+{
+	switch (nstars)
+	{
+	case 0:
+		wstrAppendF(dest, spec, value);
+		break;
+	case 1:
+		wstrAppendF(dest, spec, stars[0], value);
+		break;
+	default:
+		wstrAppendF(dest, spec, stars[0], stars[1], value);
+		break;
+	}
+}
+
+void FormatArgs::render(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *fmt) const
+{
+	const uint8_t *ap = (const uint8_t *)data_;
+	const uint8_t *aend = ap + size_;
+
+	const WCHAR *lit = fmt; // start of the pending literal text
+	for (const WCHAR *p = fmt; *p != 0; )
+	{
+		if (*p != L'%')
+		{
+			++p;
+			continue;
+		}
+		dest.append(lit, p - lit);
+		if (p[1] == L'%')
+		{
+			dest.push_back(L'%');
+			p += 2;
+			lit = p;
+			continue;
+		}
+
+		int nstars;
+		ArgType type;
+		const WCHAR *end = parseSpec(p, nstars, type);
+		if (end == NULL)
+			break; // can't happen if the same format was captured
+
+		WCHAR spec[SPEC_LIMIT];
+		memcpy(spec, p, (end - p) * sizeof(WCHAR));
+		spec[end - p] = 0;
+		p = lit = end;
+
+		int stars[2] = { 0, 0 };
+		const Entry *e = NULL;
+		for (int i = 0; i <= nstars; ++i)
+		{
+			if (ap >= aend)
+			{
+				dest.append(L"[FormatArgs: missing argument]");
+				return;
+			}
+			e = (const Entry *)ap;
+			ap = nextEntry(e);
+			if (i < nstars)
+			{
+				int64_t v = 0;
+				entryToInt64(e, v);
+				stars[i] = (int)v;
+			}
+		}
+
+		appendValue(dest, spec, type, nstars, stars, e);
+	}
+	dest.append(lit);
+}
+
+void FormatArgs::appendValue(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *spec,
+	__in ArgType type,
+	__in int nstars,
+	__in_ecount(2) const int *stars,
+	__in const Entry *e)
+{
+	const uint8_t *value = (const uint8_t *)(e + 1);
+
+	// The typed factories store the values by their C++ types,
+	// so convert them to what the format expects.
+	int64_t ival = 0;
+	bool isInt = entryToInt64(e, ival);
+	bool ok = true;
+	switch (type)
+	{
+	case AT_INT:
+		ok = isInt;
+		if (ok)
+			appendSpec(dest, spec, nstars, stars, (int)ival);
+		break;
+	case AT_INT64:
+		ok = isInt;
+		if (ok)
+			appendSpec(dest, spec, nstars, stars, ival);
+		break;
+	case AT_DOUBLE:
+		if (e->type_ == AT_DOUBLE)
+			appendSpec(dest, spec, nstars, stars, *(const double *)value);
+		else if (isInt)
+			appendSpec(dest, spec, nstars, stars, (double)ival);
+		else
+			ok = false;
+		break;
+	case AT_PTR:
+		if (e->type_ == AT_WSTR || e->type_ == AT_STR)
+			ok = false;
+		else
+			appendSpec(dest, spec, nstars, stars, (const void *)(intptr_t)ival);
+		break;
+	case AT_WSTR:
+		// a NULL pointer, such as from a nullptr, is a NULL string
+		if (e->type_ == AT_PTR && isInt && ival == 0)
+			appendSpec(dest, spec, nstars, stars, (const WCHAR *)NULL);
+		else if (e->type_ == AT_WSTR)
+			appendSpec(dest, spec, nstars, stars,
+				(e->len_ == NULL_STR) ? (const WCHAR *)NULL : (const WCHAR *)value);
+		else
+			ok = false;
+		break;
+	case AT_STR:
+		if (e->type_ == AT_PTR && isInt && ival == 0)
+			appendSpec(dest, spec, nstars, stars, (const char *)NULL);
+		else if (e->type_ == AT_STR)
+			appendSpec(dest, spec, nstars, stars,
+				(e->len_ == NULL_STR) ? (const char *)NULL : (const char *)value);
+		else
+			ok = false;
+		break;
+	}
+	if (!ok)
+		dest.append(L"[FormatArgs: bad argument type]");
+}
+
+int FormatArgs::index(
+	__out_ecount(limit) const Entry **entries,
+	__in int limit) const
+{
+	const uint8_t *ap = (const uint8_t *)data_;
+	const uint8_t *aend = ap + size_;
+	int count = 0;
+
+	for (; ap < aend; ++count)
+	{
+		if (count >= limit)
+			return -1;
+		entries[count] = (const Entry *)ap;
+		ap = nextEntry(entries[count]);
+	}
+	return count;
+}
+
+bool FormatArgs::entryToInt64(
+	__in const Entry *e,
+	__out int64_t &v)
+{
+	const uint8_t *value = (const uint8_t *)(e + 1);
+	switch (e->type_)
+	{
+	case AT_INT:
+		v = *(const int *)value;
+		return true;
+	case AT_INT64:
+		v = *(const int64_t *)value;
+		return true;
+	case AT_PTR:
+		v = (int64_t)(intptr_t)*(const void * const *)value;
+		return true;
+	}
+	return false;
+}
+
+int FormatArgs::toArray(
+	__out_ecount(limit) DWORD_PTR *arr,
+	__in int limit) const
+{
+	const uint8_t *ap = (const uint8_t *)data_;
+	const uint8_t *aend = ap + size_;
+	int count = 0;
+
+	while (ap < aend)
+	{
+		if (count >= limit)
+			return -1;
+
+		const Entry *e = (const Entry *)ap;
+		const uint8_t *value = ap + sizeof(Entry);
+		ap = nextEntry(e);
+
+		int64_t ival;
+		switch (e->type_)
+		{
+		case AT_WSTR:
+		case AT_STR:
+			arr[count] = (e->len_ == NULL_STR) ? 0 : (DWORD_PTR)value;
+			break;
+		case AT_DOUBLE:
+			return -1;
+		default:
+			entryToInt64(e, ival);
+			arr[count] = (DWORD_PTR)ival;
+			break;
+		}
+		++count;
+	}
+	return count;
+}
+
+void FormatArgs::pack(__inout std::string &dest) const
+{
+	const uint8_t *ap = (const uint8_t *)data_;
+	const uint8_t *aend = ap + size_;
+	uint64_t count = 0;
+	for (const uint8_t *cp = ap; cp < aend; cp = nextEntry((const Entry *)cp))
+		++count;
+	appendVarint(dest, count);
+
+	while (ap < aend)
+	{
+		const Entry *e = (const Entry *)ap;
+		const uint8_t *value = ap + sizeof(Entry);
+		ap = nextEntry(e);
+
+		dest.push_back((char)e->type_);
+		switch (e->type_)
+		{
+		case AT_INT:
+		case AT_INT64:
+			{
+				int64_t v;
+				entryToInt64(e, v);
+				appendVarint(dest, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+			}
+			break;
+		case AT_DOUBLE:
+			{
+				uint64_t bits;
+				memcpy(&bits, value, sizeof(bits));
+				for (int i = 0; i < 8; ++i, bits >>= 8)
+					dest.push_back((char)(bits & 0xFF));
+			}
+			break;
+		case AT_PTR:
+			appendVarint(dest, (uint64_t)(uintptr_t)*(const void * const *)value);
+			break;
+		case AT_WSTR:
+			if (e->len_ == NULL_STR)
+			{
+				appendVarint(dest, 0);
+			}
+			else
+			{
+				// the length is not known until converted
+				static thread_local std::string text;
+				text.clear();
+				appendUtf8(text, (const WCHAR *)value, e->len_ / sizeof(WCHAR) - 1);
+				appendVarint(dest, text.size() + 1);
+				dest.append(text);
+			}
+			break;
+		case AT_STR:
+			if (e->len_ == NULL_STR)
+			{
+				appendVarint(dest, 0);
+			}
+			else
+			{
+				appendVarint(dest, e->len_);
+				dest.append((const char *)value, e->len_ - 1);
+			}
+			break;
+		}
+	}
+}
+
+bool FormatArgs::unpack(
+	__inout const uint8_t *&p,
+	__in const uint8_t *end)
+{
+	uint64_t count;
+	if (!readVarint(p, end, count))
+		return false;
+
+	std::wstring wtext;
+	std::string text;
+	for (; count > 0; --count)
+	{
+		if (p >= end)
+			return false;
+		uint8_t type = *p++;
+		uint64_t v;
+		switch (type)
+		{
+		case AT_INT:
+		case AT_INT64:
+			if (!readVarint(p, end, v))
+				return false;
+			v = (v >> 1) ^ (0 - (v & 1));
+			if (type == AT_INT)
+				addInt((int)(int64_t)v);
+			else
+				addInt64((int64_t)v);
+			break;
+		case AT_DOUBLE:
+			{
+				if (end - p < 8)
+					return false;
+				uint64_t bits = 0;
+				for (int i = 7; i >= 0; --i)
+					bits = (bits << 8) | p[i];
+				p += 8;
+				double d;
+				memcpy(&d, &bits, sizeof(d));
+				addDouble(d);
+			}
+			break;
+		case AT_PTR:
+			if (!readVarint(p, end, v))
+				return false;
+			addPtr((const void *)(uintptr_t)v);
+			break;
+		case AT_WSTR:
+		case AT_STR:
+			if (!readVarint(p, end, v))
+				return false;
+			if (v == 0)
+			{
+				if (type == AT_WSTR)
+					addWstr(NULL);
+				else
+					addStr(NULL);
+				break;
+			}
+			if (v - 1 > (uint64_t)(end - p))
+				return false;
+			if (type == AT_WSTR)
+			{
+				wtext.clear();
+				appendFromUtf8(wtext, p, (size_t)(v - 1));
+				addWstr(wtext.c_str());
+			}
+			else
+			{
+				text.assign((const char *)p, (size_t)(v - 1));
+				addStr(text.c_str());
+			}
+			p += v - 1;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+////////////////////// ErrorMsgPool ///////////////////////////////////
+// The ErrorMsg objects together with their shared_ptr control blocks
+// get allocated as fixed-size blocks. Each thread keeps a cache of
+// the free blocks, so building and discarding an error normally takes
+// no locks and no heap calls. The blocks freed by the other threads
+// (such as a logger's flusher) go into the freeing thread's cache,
+// and the overflow gets returned to the common pool in batches.
+// The memory is never returned to the heap, so the pool size is
+// bounded by the peak number of the live errors.
+
+class ErrorMsgPool
+{
+public:
+	enum {
+		// The allocate_shared() control block of the standard libraries
+		// adds to the ErrorMsg a vtable pointer and the two reference
+		// counts; leave room for up to 4 pointers, rounded to 16 bytes.
+		// ErrorMsgAllocator checks that the real block fits.
+		BLOCK_SIZE = (sizeof(ErrorMsg) + 4 * sizeof(void *) + 15) & ~(size_t)15,
+		SLAB_BLOCKS = 64, // blocks allocated from the heap at once
+		CACHE_LIMIT = 256, // up to how many free blocks a thread keeps
+		BATCH = 64, // blocks moved between a thread and the common pool at once
+	};
+
+	static void *allocBlock();
+	static void freeBlock(void *p);
+
+protected:
+	struct FreeBlock {
+	public:
+		FreeBlock *next_;
+	};
+
+	// The per-thread cache. It's a plain structure, to stay accessible
+	// even after the thread's destructors have run.
+	struct ThreadCache {
+	public:
+		FreeBlock *head_;
+		size_t count_;
+		int state_; // CacheState
+	};
+	enum CacheState {
+		CS_UNUSED, // the thread has not touched the pool yet
+		CS_ALIVE,
+		CS_EXITED, // the thread's destructors have run
+	};
+
+	// Returns the cache to the common pool on thread exit.
+	class CacheGuard
+	{
+	public:
+		~CacheGuard();
+	};
+
+	// Make sure that the thread cache is initialized.
+	static void initCache(ThreadCache &tc);
+
+	// Move up to BATCH blocks from the common pool (or a new slab)
+	// to the thread cache.
+	static void refill(ThreadCache &tc);
+
+	// Move count blocks from the thread cache to the common pool.
+	static void spill(ThreadCache &tc, size_t count);
+
+	static Critical &commonCr();
+
+	static thread_local ThreadCache tcache_;
+	static FreeBlock *common_; // the common free list, protected by commonCr()
+};
+
+thread_local ErrorMsgPool::ThreadCache ErrorMsgPool::tcache_;
+ErrorMsgPool::FreeBlock *ErrorMsgPool::common_;
+
+Critical &ErrorMsgPool::commonCr()
+{
+	// Constructed on the first use, since the errors may be
+	// created from the static constructors.
+	static Critical cr;
+	return cr;
+}
+
+void ErrorMsgPool::initCache(ThreadCache &tc)
+{
+	static thread_local CacheGuard guard;
+	(void)guard; // forces the construction of the guard for this thread
+	tc.state_ = CS_ALIVE;
+}
+
+ErrorMsgPool::CacheGuard::~CacheGuard()
+{
+	ThreadCache &tc = tcache_;
+	spill(tc, tc.count_);
+	tc.state_ = CS_EXITED;
+}
+
+void ErrorMsgPool::refill(ThreadCache &tc)
+{
+	ScopeCritical sc(commonCr());
+
+	if (common_ == NULL)
+	{
+		char *slab = (char *)::operator new(BLOCK_SIZE * SLAB_BLOCKS);
+		for (int i = 0; i < SLAB_BLOCKS; ++i)
+		{
+			FreeBlock *b = (FreeBlock *)(slab + i * BLOCK_SIZE);
+			b->next_ = tc.head_;
+			tc.head_ = b;
+		}
+		tc.count_ += SLAB_BLOCKS;
+		return;
+	}
+
+	for (int i = 0; i < BATCH && common_ != NULL; ++i)
+	{
+		FreeBlock *b = common_;
+		common_ = b->next_;
+		b->next_ = tc.head_;
+		tc.head_ = b;
+		++tc.count_;
+	}
+}
+
+void ErrorMsgPool::spill(ThreadCache &tc, size_t count)
+{
+	if (count == 0)
+		return;
+
+	ScopeCritical sc(commonCr());
+
+	for (; count > 0 && tc.head_ != NULL; --count)
+	{
+		FreeBlock *b = tc.head_;
+		tc.head_ = b->next_;
+		--tc.count_;
+		b->next_ = common_;
+		common_ = b;
+	}
+}
+
+void *ErrorMsgPool::allocBlock()
+{
+	ThreadCache &tc = tcache_;
+	if (tc.head_ == NULL)
+	{
+		if (tc.state_ == CS_UNUSED)
+			initCache(tc);
+		refill(tc);
+	}
+
+	FreeBlock *b = tc.head_;
+	tc.head_ = b->next_;
+	--tc.count_;
+	return b;
+}
+
+void ErrorMsgPool::freeBlock(void *p)
+{
+	ThreadCache &tc = tcache_;
+	FreeBlock *b = (FreeBlock *)p;
+
+	if (tc.state_ == CS_UNUSED)
+		initCache(tc);
+	if (tc.state_ == CS_EXITED)
+	{
+		// the objects destroyed late in the thread exit
+		ScopeCritical sc(commonCr());
+		b->next_ = common_;
+		common_ = b;
+		return;
+	}
+
+	b->next_ = tc.head_;
+	tc.head_ = b;
+	if (++tc.count_ > CACHE_LIMIT)
+		spill(tc, BATCH);
+}
+
+// The allocator for allocate_shared() that takes the blocks from
+// ErrorMsgPool. The larger allocations go to the heap.
+template <class T>
+class ErrorMsgAllocator
+{
+public:
+	typedef T value_type;
+
+	ErrorMsgAllocator()
+	{
+	}
+
+	template <class U>
+	ErrorMsgAllocator(const ErrorMsgAllocator<U> &)
+	{
+	}
+
+	// allocate_shared() rebinds the allocator to its control block
+	// with the ErrorMsg inside, so T here is that block, and its real
+	// size is known only at this point.
+	T *allocate(size_t n)
+	{
+		static_assert(sizeof(T) <= ErrorMsgPool::BLOCK_SIZE,
+			"the shared_ptr control block of ErrorMsg doesn't fit into ErrorMsgPool::BLOCK_SIZE");
+		static_assert(alignof(T) <= alignof(max_align_t),
+			"the ErrorMsgPool blocks are aligned only as by operator new");
+		if (n == 1)
+			return (T *)ErrorMsgPool::allocBlock();
+		return (T *)::operator new(n * sizeof(T));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (n == 1)
+			ErrorMsgPool::freeBlock(p);
+		else
+			::operator delete(p);
+	}
+
+	template <class U>
+	bool operator==(const ErrorMsgAllocator<U> &) const
+	{
+		return true;
+	}
+
+	template <class U>
+	bool operator!=(const ErrorMsgAllocator<U> &) const
+	{
+		return false;
+	}
+};
+
+////////////////////// ErrorMsg::InternalErrorSource //////////////////
+// The Source for the internal errors.
+static WCHAR internalErrorSourceName[] = L"ErrorMsg";
+static ErrorMsg::InternalErrorSource internalErrorSource(internalErrorSourceName);
+
+////////////////////// Erref //////////////////////////////////////////
+
+ErrorMsg *Erref::findTail()
+{
+	ErrorMsg *msg = tail_;
+	if (msg == NULL)
+		msg = get();
+	while (msg->chain_)
+		msg = msg->chain_.get();
+	tail_ = msg;
+	return msg;
+}
+
+void Erref::splice(const std::shared_ptr<ErrorMsg> &other)
+{
+	spliceInternal(other, NULL);
+}
+
+void Erref::splice(const Erref &other)
+{
+	spliceInternal(other, other.tail_);
+}
+
+void Erref::spliceInternal(
+	__in const std::shared_ptr<ErrorMsg> &other,
+	__in_opt ErrorMsg *otherTail)
+{
+	if (!other)
+		return;
+	if (!*this) 
+	{
+		*this = other;
+		tail_ = otherTail;
+		return;
+	}
+
+	ErrorMsg *msg = get();
+	if (!msg->chain_) 
+	{
+		msg->chain_ = other;
+		tail_ = otherTail;
+		return;
+	}
+
+	std::shared_ptr<ErrorMsg> oldChain = msg->chain_;
+	msg->chain_ = other;
+
+	// Only the other chain needs to be walked, the tail of this one stays.
+	ErrorMsg *eit = (otherTail != NULL) ? otherTail : other.get();
+	for (; eit->chain_; eit = eit->chain_.get()) 
+	{
+		;
+	}
+	eit->chain_ = oldChain;
+}
+
+void Erref::append(const std::shared_ptr<ErrorMsg> &other)
+{
+	appendInternal(other, NULL);
+}
+
+void Erref::append(const Erref &other)
+{
+	appendInternal(other, other.tail_);
+}
+
+void Erref::appendInternal(
+	__in const std::shared_ptr<ErrorMsg> &other,
+	__in_opt ErrorMsg *otherTail)
+{
+	if (!other)
+		return;
+	if (!*this) 
+	{
+		*this = other;
+		tail_ = otherTail;
+		return;
+	}
+
+	findTail()->chain_ = other;
+	tail_ = (otherTail != NULL) ? otherTail : other.get();
+}
+
+void Erref::printAndExitOnError()
+{
+	if (hasError()) 
+	{
+		wstring s = get()->toString();
+		wprintf(L"%ls", s.c_str());
+		exit(1);
+	}
+}
+
+Erref Erref::copy()
+{
+	return ErrorMsg::mkCopy(*this);
+}
+
+////////////////////// ErrorMsg ///////////////////////////////////////
+
+ErrorMsg::Source ErrnoSource(L"Errno", NULL);
+
+ErrorMsg::ErrorMsg(const ErrorMsg &orig) :
+	source_(orig.source_), code_(orig.code_), msg_(const_cast<ErrorMsg &>(orig).getMsg()),
+	kind_(MK_TEXT), fmt_(NULL), state_(MS_READY)
+{
+	if (orig.chain_)
+		chain_ = mkCopy(orig.chain_);
+}
+
+ErrorMsg::~ErrorMsg()
+{ 
+	// Unlink the chain iteratively, since the recursive destruction
+	// of a long accumulated chain would overflow the stack.
+	std::shared_ptr<ErrorMsg> next = std::move(chain_);
+	while (next && next.use_count() == 1)
+	{
+		std::shared_ptr<ErrorMsg> after = std::move(next->chain_);
+		next = std::move(after);
+	}
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkCopy(const ErrorMsg &orig)
+{
+#ifdef ERRORMSG_NO_POOL
+	return make_shared<ErrorMsg>(orig);
+#else
+	return allocate_shared<ErrorMsg>(ErrorMsgAllocator<ErrorMsg>(), orig);
+#endif
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkCopy(const Erref &orig)
+{
+	if (orig)
+		return mkCopy(*orig.get());
+	return NULL;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkNew(
+	__in const Source *source,
+	__in DWORD code
+)
+{
+#ifdef ERRORMSG_NO_POOL
+	return make_shared<ErrorMsg>(source, code);
+#else
+	return allocate_shared<ErrorMsg>(ErrorMsgAllocator<ErrorMsg>(), source, code);
+#endif
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkString(
+	__in const Source *source,
+	__in DWORD code,
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...)
+{
+	va_list args;
+	va_start(args, fmt);
+	std::shared_ptr<ErrorMsg> err = mkStringVa(source, code, fmt, args);
+	va_end(args);
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkStringVa(
+	__in const Source *source,
+	__in DWORD code,
+	_In_z_ const WCHAR *fmt,
+	__in va_list args
+)
+{
+	std::shared_ptr<ErrorMsg> err = mkNew(source, code);
+	err->setPrintf(fmt, args);
+	return checkPlainSource(err);
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkSystem(
+	__in DWORD code
+)
+{
+	std::shared_ptr<ErrorMsg> err = mkNew(NULL, code);
+	err->kind_ = MK_SYSTEM;
+	err->state_ = MS_DEFERRED;
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkErrno(
+	__in DWORD code
+)
+{
+	std::shared_ptr<ErrorMsg> err = mkNew(&ErrnoSource, code);
+	err->kind_ = MK_ERRNO;
+	err->state_ = MS_DEFERRED;
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkErrno()
+{
+	int eval;
+	_get_errno(&eval);
+	return mkErrno(eval);
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkSystem(
+	__in DWORD sysCode,
+	__in const Source *source,
+	__in DWORD appCode,
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...)
+{
+	va_list args;
+	va_start(args, fmt);
+	std::shared_ptr<ErrorMsg> err = mkSystemVa(sysCode, source, appCode, fmt, args);
+	va_end(args);
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkSystemVa(
+	__in DWORD sysCode,
+	__in const Source *source,
+	__in DWORD appCode,
+	_In_z_ const WCHAR *fmt,
+	__in va_list args
+)
+{
+	std::shared_ptr<ErrorMsg> err = mkNew(source, appCode);
+	err->setPrintf(fmt, args);
+	err->chain_ = mkSystem(sysCode);
+	return checkPlainSource(err);
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkMui(
+	__in const Source *source,
+	__in DWORD code,
+	...
+)
+{
+	va_list args;
+	va_start(args, code);
+	std::shared_ptr<ErrorMsg> err = mkMuiVa(source, code, args);
+	va_end(args);
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::mkMuiVa(
+	__in const Source *source,
+	__in DWORD code,
+	__in va_list args
+)
+{
+	Erref err = mkNew(source, code);
+
+	const MuiCatalog::Template *tpl = (source->muiCatalog_ == NULL)
+		? NULL : source->muiCatalog_->find(code);
+	if (!source->isMui()) 
+	{
+		checkMuiSource(err);
+	}
+	else if (tpl != NULL)
+	{
+		// The template knows the types, so the formatting can be deferred.
+		tpl->captureVa(err->args_, args);
+		err->setDeferred(MK_MUI, NULL);
+	}
+	else if (source->muiModule_ == NULL)
+	{
+		err.splice(internalErrorSource.mkString(
+			InternalErrorSource::MUI_NO_MESSAGE,
+			L"Internal error: cannot find a MUI message for source '%ls' code 0x%x.",
+			source->name_, code));
+	}
+	else 
+	{
+		LPWSTR buf = NULL;
+		// A va_list parameter may have decayed to a pointer,
+		// so pass the address of a real va_list.
+		va_list cpargs;
+		va_copy(cpargs, args);
+		DWORD res = FormatMessageW(
+			FORMAT_MESSAGE_ALLOCATE_BUFFER
+			| FORMAT_MESSAGE_FROM_HMODULE,
+			source->muiModule_,
+			code,
+			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+			(LPWSTR)&buf,
+			0, &cpargs);
+		va_end(cpargs);
+		if (res == 0) 
+		{
+			err.splice(internalErrorSource.mkSystem(GetLastError(),
+				InternalErrorSource::MUI_NO_MESSAGE,
+				L"Internal error: cannot find a MUI message for source '%ls' code 0x%x.",
+				source->name_, code));
+		}
+		if (buf != NULL) 
+		{
+			err->msg_ = buf;
+
+			// for whatever reason, the message always includes \r\n
+			size_t msize = err->msg_.size();
+			while (msize > 0
+				&& (err->msg_[msize - 1] == L'\n' || err->msg_[msize - 1] == L'\r')) 
+			{
+				--msize;
+				err->msg_.resize(msize);
+			}
+
+			LocalFree(buf);
+		}
+	}
+
+	return err;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkMuiSystem(
+	__in DWORD sysCode,
+	__in const Source *source,
+	__in DWORD appCode,
+	...)
+{
+	va_list args;
+	va_start(args, appCode);
+	std::shared_ptr<ErrorMsg> err = mkMuiSystemVa(sysCode, source, appCode, args);
+	va_end(args);
+	return err;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkMuiSystemVa(
+	__in DWORD sysCode,
+	__in const Source *source,
+	__in DWORD appCode,
+	__in va_list args
+)
+{
+	Erref err = mkMuiVa(source, appCode, args);
+	err.splice(mkSystem(sysCode));
+	return err;
+}
+
+void ErrorMsg::setPrintf(
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	va_list cpargs;
+	va_copy(cpargs, args);
+	bool captured = args_.captureVa(fmt, cpargs);
+	va_end(cpargs);
+
+	if (captured)
+	{
+		kind_ = MK_PRINTF;
+		fmt_ = fmt;
+		state_ = MS_DEFERRED;
+	}
+	else
+	{
+		// something exotic in the format, do it the old way
+		args_.clear();
+		msg_ = vwstrprintf(fmt, args);
+		stripNewlines(msg_);
+	}
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::checkPlainSource(
+	__in const std::shared_ptr<ErrorMsg> &err)
+{
+	const Source *source = err->source_;
+	if (source->isMui()) 
+	{
+		// Return at least the original error code but chain the internal error message
+		Erref ref = err;
+		ref.splice(internalErrorSource.mkString(
+			InternalErrorSource::MUST_USE_MUI,
+			L"Internal error: used a plain-text error on the MUIsource '%ls'.",
+			source->name_));
+	}
+	return err;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::checkMuiSource(
+	__in const std::shared_ptr<ErrorMsg> &err)
+{
+	const Source *source = err->source_;
+	if (!source->isMui()) 
+	{
+		// Return at least the original error code but chain the internal error message
+		Erref ref = err;
+		ref.splice(internalErrorSource.mkString(
+			InternalErrorSource::NO_MUI_HANDLE,
+			L"Internal error: attempted to use a MUI error reporting on the source '%ls' without MUI support.",
+			source->name_));
+	}
+	return err;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::checkFormat(
+	__in const std::shared_ptr<ErrorMsg> &err,
+	__in bool matched)
+{
+	if (!matched) 
+	{
+		// Return at least the original error code but chain the internal error message
+		Erref ref = err;
+		ref.splice(internalErrorSource.mkString(
+			InternalErrorSource::BAD_FORMAT_ARGS,
+			L"Internal error: the arguments don't match the format '%ls'.",
+			err->fmt_));
+	}
+	return err;
+}
+
+void ErrorMsg::stripNewlines(__inout std::wstring &msg)
+{
+	size_t msize = msg.size();
+	while (msize > 0
+		&& (msg[msize - 1] == L'\n' || msg[msize - 1] == L'\r'))
+	{
+		--msize;
+	}
+	msg.resize(msize);
+}
+
+void ErrorMsg::render()
+{
+	int expected = MS_DEFERRED;
+	while (!state_.compare_exchange_strong(expected, MS_RENDERING))
+	{
+		if (expected == MS_READY)
+			return;
+		// Some other thread is rendering (or packing, after which the
+		// message stays deferred), wait for it.
+		SwitchToThread();
+		expected = MS_DEFERRED;
+	}
+
+	switch (kind_)
+	{
+	case MK_PRINTF:
+		args_.render(msg_, fmt_);
+		args_.clear();
+		// if the message includes \r\n, drop them
+		stripNewlines(msg_);
+		break;
+	case MK_SYSTEM:
+		systemTextCache.get(SystemTextCache::SK_SYSTEM, code_, msg_);
+		// for whatever reason, the system message tends to include \r\n
+		stripNewlines(msg_);
+		break;
+	case MK_ERRNO:
+		systemTextCache.get(SystemTextCache::SK_ERRNO, code_, msg_);
+		break;
+	case MK_MUI:
+		{
+			const MuiCatalog::Template *tpl = (source_->muiCatalog_ == NULL)
+				? NULL : source_->muiCatalog_->find(code_);
+			if (tpl != NULL)
+			{
+				tpl->render(msg_, args_);
+				args_.clear();
+				stripNewlines(msg_);
+				break;
+			}
+
+			// up to 99 insertions are possible in a message
+			DWORD_PTR arr[MuiCatalog::MAX_ARGS + 1];
+			int count = args_.toArray(arr, _countof(arr));
+			LPWSTR buf = NULL;
+			DWORD res = 0;
+			if (count >= 0 && source_->muiModule_ != NULL)
+			{
+				res = FormatMessageW(
+					FORMAT_MESSAGE_ALLOCATE_BUFFER
+					| FORMAT_MESSAGE_FROM_HMODULE
+					| FORMAT_MESSAGE_ARGUMENT_ARRAY,
+					source_->muiModule_,
+					code_,
+					MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+					(LPWSTR)&buf,
+					0, (va_list *)arr);
+			}
+			if (res == 0 || buf == NULL)
+			{
+				// The chain can't be changed here, since the other
+				// threads might be reading it, so report in the text.
+				DWORD syserr = GetLastError();
+				msg_.clear();
+				if (source_->muiModule_ == NULL)
+					wstrAppendF(msg_,
+						L"[Internal error: cannot find a MUI message for source '%ls' code 0x%x]",
+						source_->name_, code_);
+				else
+					wstrAppendF(msg_,
+						L"[Internal error: cannot find a MUI message for source '%ls' code 0x%x, system error %d]",
+						source_->name_, code_, syserr);
+			}
+			else
+			{
+				msg_ = buf;
+			}
+			LocalFree(buf);
+			args_.clear();
+			// for whatever reason, the message always includes \r\n
+			stripNewlines(msg_);
+		}
+		break;
+	default:
+		break;
+	}
+
+	state_.store(MS_READY, std::memory_order_release);
+}
+
+bool ErrorMsg::packDeferred(
+	__out MsgKind &kind,
+	__out const WCHAR *&fmt,
+	__inout std::string &dest)
+{
+	kind = kind_;
+	fmt = fmt_;
+	// Keep the other threads from rendering (and clearing args_)
+	// while they're being packed, then return to the deferred state.
+	int expected = MS_DEFERRED;
+	if (!state_.compare_exchange_strong(expected, MS_RENDERING))
+		return false;
+	args_.pack(dest);
+	state_.store(MS_DEFERRED, std::memory_order_release);
+	return true;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::mkUnpacked(
+	__in const Source *source,
+	__in DWORD code,
+	__in MsgKind kind,
+	_In_opt_z_ const WCHAR *fmt,
+	__inout const uint8_t *&p,
+	__in const uint8_t *end)
+{
+	std::shared_ptr<ErrorMsg> err = mkNew(source, code);
+	if (!err->args_.unpack(p, end))
+		return NULL;
+	err->setDeferred(kind, fmt);
+	return err;
+}
+
+// Append the ":%d:0x%x: " part of the printout.
+static void appendCodes(
+	__inout std::wstring &res,
+	__in DWORD code)
+{
+	res.push_back(L':');
+	wstrAppendDec(res, (code & 0x3FFFFFFF));
+	res.append(L":0x");
+	wstrAppendHex(res, code);
+	res.append(L": ");
+}
+
+std::wstring ErrorMsg::toString()
+{
+	std::wstring res;
+	bool outer = true;
+	ErrorMsg *err;
+	size_t estimate;
+
+	// first estimate the required string size, to avoid reallocating it continuously
+	estimate = 0;
+	for (err = this; err != NULL; err = err->chain_.get()) 
+	{
+		estimate += 40; // for the source name and error number, and better estimate high
+		estimate += err->getMsg().size();
+	}
+	res.reserve(estimate);
+
+	// now print the messages
+	for (err = this; err != NULL; err = err->chain_.get())
+	{
+		if (!outer) 
+		{
+			res.append(L"  "); // indent the dependent errors
+		}
+		else
+		{
+			outer = false;
+		}
+		if (err->source_ == NULL)
+		{
+			res.append(L"NT");
+		}
+		else
+		{
+			res.append(err->source_->name_);
+		}
+		appendCodes(res, err->code_);
+		res.append(err->getMsg()); // if contains \n, would not follow the indenting nicely
+		if (res[res.size() - 1] != L'\n')
+			res.append(L"\n");
+	}
+
+	return res;
+}
+
+std::wstring ErrorMsg::toLimitedString(
+	__in size_t limit,
+	__out Erref &next)
+{
+	std::wstring res;
+	bool outer = true;
+	ErrorMsg *err;
+	size_t estimate;
+
+	// first estimate the required string size, to avoid reallocating it continuously
+	estimate = 0;
+	for (err = this; err != NULL; err = err->chain_.get())
+	{
+		estimate += 40; // for the source name and error number, and better estimate high
+		estimate += err->getMsg().size();
+		if (estimate > limit)
+			break;
+	}
+	res.reserve(estimate);
+
+	// now print the messages
+	ErrorMsg *lasterr = NULL;
+	for (err = this; err != NULL; lasterr = err, err = err->chain_.get())
+	{
+		size_t prevsz = res.size();
+
+		if (!outer)
+		{
+			res.append(L"  "); // indent the dependent errors
+		}
+		else
+		{
+			outer = false;
+		}
+		if (err->source_ == NULL)
+		{
+			res.append(L"NT");
+		}
+		else
+		{
+			res.append(err->source_->name_);
+		}
+		appendCodes(res, err->code_);
+
+		if (res.size() + err->getMsg().size() >= limit && lasterr)
+		{
+			res.resize(prevsz); // throw away the partial last message
+			next = lasterr->chain_; // continue from this point on the next call
+			return res;
+		}
+
+		res.append(err->getMsg()); // if contains \n, would not follow the indenting nicely
+		if (res[res.size() - 1] != L'\n')
+			res.append(L"\n");
+	}
+
+	next.reset();
+	return res;
+}
+////////////////////// ErrorMsg::Source ///////////////////////////////
+
+shared_ptr<ErrorMsg> ErrorMsg::Source::mkString(
+	__in DWORD code,
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...)
+{
+	va_list args;
+	va_start(args, fmt);
+	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkStringVa(this, code, fmt, args);
+	va_end(args);
+	return err;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::Source::mkSystem(
+	__in DWORD sysCode,
+	__in DWORD appCode,
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...)
+{
+	va_list args;
+	va_start(args, fmt);
+	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkSystemVa(sysCode, this, appCode, fmt, args);
+	va_end(args);
+	return err;
+}
+
+////////////////////// SystemTextCache ////////////////////////////////
+
+SystemTextCache systemTextCache;
+
+bool SystemTextCache::get(
+	__in Kind kind,
+	__in DWORD code,
+	__out std::wstring &dest)
+{
+	uint64_t key = mkKey(kind, code);
+	size_t h = hash(key);
+	for (int i = 0; i < PROBE_LIMIT; ++i)
+	{
+		const Entry *e = slots_[(h + i) & (SLOTS - 1)].load(std::memory_order_acquire);
+		if (e == NULL)
+			break; // the entries are never removed, so the code can't be further
+		if (e->key_ == key)
+		{
+			counters().hits_.fetch_add(1, std::memory_order_relaxed);
+			dest = e->text_;
+			return true;
+		}
+	}
+
+	counters().misses_.fetch_add(1, std::memory_order_relaxed);
+	if (!lookup(kind, code, dest))
+		return false; // might be a transient failure, don't cache it
+	insert(key, dest);
+	return true;
+}
+
+void SystemTextCache::insert(
+	__in uint64_t key,
+	__in const std::wstring &text)
+{
+	if (count_.load(std::memory_order_relaxed) >= CAPACITY)
+		return;
+
+	Entry *ne = new Entry;
+	ne->key_ = key;
+	ne->text_ = text;
+
+	size_t h = hash(key);
+	for (int i = 0; i < PROBE_LIMIT; ++i)
+	{
+		std::atomic<Entry *> &slot = slots_[(h + i) & (SLOTS - 1)];
+		Entry *e = NULL;
+		if (slot.compare_exchange_strong(e, ne, std::memory_order_acq_rel))
+		{
+			count_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		// e now contains the current value of the slot
+		if (e->key_ == key)
+			break; // another thread was faster
+	}
+	delete ne;
+}
+
+SystemTextCache::CounterShard &SystemTextCache::counters()
+{
+	// The threads get the shards round-robin on their first lookup.
+	static std::atomic<unsigned> nextShard;
+	static thread_local int shard = -1;
+	if (shard < 0)
+		shard = (int)(nextShard.fetch_add(1, std::memory_order_relaxed) & (COUNTER_SHARDS - 1));
+	return counters_[shard];
+}
+
+void SystemTextCache::getStats(__out Stats &st) const
+{
+	st.hits_ = 0;
+	st.misses_ = 0;
+	for (int i = 0; i < COUNTER_SHARDS; ++i)
+	{
+		st.hits_ += counters_[i].hits_.load(std::memory_order_relaxed);
+		st.misses_ += counters_[i].misses_.load(std::memory_order_relaxed);
+	}
+	st.entries_ = (size_t)count_.load(std::memory_order_relaxed);
+}
+
+#ifndef _WIN32
+// Accomodate both versions of strerror_r(): the XSI one returns
+// an int and fills the buffer, the GNU one returns the string.
+static const char *strerrorResult(
+	__in int res,
+	_In_z_ const char *buf)
+{
+	return (res == 0) ? buf : NULL;
+}
+
+static const char *strerrorResult(
+	_In_opt_z_ const char *res,
+	_In_z_ const char *)
+{
+	return res;
+}
+#endif
+
+bool SystemTextCache::lookup(
+	__in Kind kind,
+	__in DWORD code,
+	__out std::wstring &dest)
+{
+#ifdef _WIN32
+	if (kind == SK_ERRNO)
+	{
+		WCHAR buf[256];
+		if (_wcserror_s(buf, _countof(buf), (int)code) != 0)
+		{
+			dest = L"[error text not found]";
+			return false;
+		}
+		dest = buf;
+		return true;
+	}
+
+	LPWSTR buf = NULL;
+	FormatMessageW(
+		FORMAT_MESSAGE_ALLOCATE_BUFFER |
+		FORMAT_MESSAGE_FROM_SYSTEM |
+		FORMAT_MESSAGE_IGNORE_INSERTS,
+		NULL,
+		code,
+		MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+		(LPWSTR)&buf,
+		0, NULL);
+	if (buf == NULL)
+	{
+		dest = L"[error text not found]";
+		return false;
+	}
+	dest = buf;
+	LocalFree(buf);
+	return true;
+#else
+	(void)kind;
+	char buf[256];
+	buf[0] = 0;
+	const char *text = strerrorResult(strerror_r((int)code, buf, sizeof(buf)), buf);
+	if (text == NULL)
+	{
+		dest = L"[error text not found]";
+		return false;
+	}
+	dest.clear();
+	for (; *text != 0; ++text)
+		dest.push_back((WCHAR)(unsigned char)*text); // the C locale messages are ASCII
+	return true;
+#endif
+}
+
+////////////////////// MuiCatalog /////////////////////////////////////
+
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+	MappedFile() :
+		data_(NULL), size_(0)
+#ifdef _WIN32
+		, file_(INVALID_HANDLE_VALUE), mapping_(NULL)
+#else
+		, fd_(-1)
+#endif
+	{ }
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (data_ != NULL)
+			UnmapViewOfFile(data_);
+		if (mapping_ != NULL)
+			CloseHandle(mapping_);
+		if (file_ != INVALID_HANDLE_VALUE)
+			CloseHandle(file_);
+#else
+		if (data_ != NULL)
+			munmap((void *)data_, size_);
+		if (fd_ >= 0)
+			close(fd_);
+#endif
+	}
+
+	// Map the file. An empty file gets no mapping, with data_ left NULL.
+	Erref open(
+		_In_z_ const WCHAR *path)
+	{
+#ifdef _WIN32
+		file_ = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file_ == INVALID_HANDLE_VALUE)
+			return fail(GetLastError(), L"open", path);
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file_, &size))
+			return fail(GetLastError(), L"get the size of", path);
+		size_ = (size_t)size.QuadPart;
+		if (size_ == 0)
+			return Erref();
+		mapping_ = CreateFileMappingW(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping_ == NULL)
+			return fail(GetLastError(), L"map", path);
+		data_ = (const uint8_t *)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+		if (data_ == NULL)
+			return fail(GetLastError(), L"map", path);
+#else
+		std::string npath = narrowPath(path);
+		fd_ = ::open(npath.c_str(), O_RDONLY);
+		if (fd_ < 0)
+			return fail(errno, L"open", path);
+		struct stat st;
+		if (fstat(fd_, &st) < 0)
+			return fail(errno, L"get the size of", path);
+		size_ = (size_t)st.st_size;
+		if (size_ == 0)
+			return Erref();
+		void *p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+		if (p == MAP_FAILED)
+			return fail(errno, L"map", path);
+		data_ = (const uint8_t *)p;
+#endif
+		return Erref();
+	}
+
+	const uint8_t *data_;
+	size_t size_;
+
+protected:
+	// Build the error of an operation on the file.
+	// code - the system error code (errno on POSIX)
+	static Erref fail(
+		__in DWORD code,
+		_In_z_ const WCHAR *what,
+		_In_z_ const WCHAR *path)
+	{
+#ifdef _WIN32
+		return internalErrorSource.mkSystem(code,
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: failed to %ls the MUI catalog file '%ls':", what, path);
+#else
+		Erref err = internalErrorSource.mkString(
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: failed to %ls the MUI catalog file '%ls':", what, path);
+		err.splice(ErrorMsg::mkErrno(code));
+		return err;
+#endif
+	}
+
+#ifdef _WIN32
+	HANDLE file_;
+	HANDLE mapping_;
+#else
+	int fd_;
+#endif
+
+private:
+	MappedFile(const MappedFile &);
+	void operator=(const MappedFile &);
+};
+
+void appendUtf16(
+	__inout std::wstring &dest,
+	_In_reads_(units) const uint8_t *p,
+	__in size_t units)
+{
+	for (size_t i = 0; i < units; ++i, p += 2)
+	{
+		uint32_t c = p[0] | (p[1] << 8);
+		if (sizeof(WCHAR) > 2 && c >= 0xD800 && c < 0xDC00 && i + 1 < units)
+		{
+			uint32_t low = p[2] | (p[3] << 8);
+			if (low >= 0xDC00 && low < 0xE000)
+			{
+				c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+				++i;
+				p += 2;
+			}
+		}
+		dest.push_back((WCHAR)c);
+	}
+}
+
+void appendAsUtf16(
+	__inout std::string &dest,
+	__in const std::wstring &text)
+{
+#ifdef _WIN32
+	// WCHAR is already UTF-16 in little-endian.
+	dest.append((const char *)text.data(), sizeof(WCHAR) * text.size());
+#else
+	dest.reserve(dest.size() + 2 * text.size());
+	for (size_t i = 0; i < text.size(); ++i)
+	{
+		uint32_t c = (uint32_t)text[i];
+		if (c >= 0x10000)
+		{
+			c -= 0x10000;
+			uint32_t high = 0xD800 + (c >> 10);
+			dest.push_back((char)(high & 0xFF));
+			dest.push_back((char)(high >> 8));
+			c = 0xDC00 + (c & 0x3FF);
+		}
+		dest.push_back((char)(c & 0xFF));
+		dest.push_back((char)((c >> 8) & 0xFF));
+	}
+#endif
+}
+
+void appendUtf8(
+	__inout std::string &dest,
+	_In_reads_(len) const WCHAR *text,
+	__in size_t len)
+{
+	for (size_t i = 0; i < len; ++i)
+	{
+		uint32_t c = (uint32_t)text[i];
+		if (c < 0x80)
+		{
+			dest.push_back((char)c);
+			continue;
+		}
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < len
+			&& text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000)
+		{
+			// a surrogate pair in UTF-16
+			c = 0x10000 + ((c - 0xD800) << 10) + ((uint32_t)text[i + 1] - 0xDC00);
+			++i;
+		}
+		if (c < 0x800)
+		{
+			dest.push_back((char)(0xC0 | (c >> 6)));
+		}
+		else
+		{
+			if (c < 0x10000)
+			{
+				dest.push_back((char)(0xE0 | (c >> 12)));
+			}
+			else
+			{
+				dest.push_back((char)(0xF0 | (c >> 18)));
+				dest.push_back((char)(0x80 | ((c >> 12) & 0x3F)));
+			}
+			dest.push_back((char)(0x80 | ((c >> 6) & 0x3F)));
+		}
+		dest.push_back((char)(0x80 | (c & 0x3F)));
+	}
+}
+
+void appendFromUtf8(
+	__inout std::wstring &dest,
+	_In_reads_(len) const uint8_t *p,
+	__in size_t len)
+{
+	const uint8_t *end = p + len;
+	while (p < end)
+	{
+		uint32_t c = *p++;
+		if (c >= 0x80)
+		{
+			int more;
+			uint32_t min;
+			if (c >= 0xC0 && c < 0xE0)
+			{
+				more = 1;
+				min = 0x80;
+				c &= 0x1F;
+			}
+			else if (c >= 0xE0 && c < 0xF0)
+			{
+				more = 2;
+				min = 0x800;
+				c &= 0x0F;
+			}
+			else if (c >= 0xF0 && c < 0xF8)
+			{
+				more = 3;
+				min = 0x10000;
+				c &= 0x07;
+			}
+			else
+			{
+				dest.push_back((WCHAR)0xFFFD);
+				continue;
+			}
+			for (; more > 0 && p < end && (*p & 0xC0) == 0x80; --more)
+				c = (c << 6) | (*p++ & 0x3F);
+			if (more != 0 || c < min || c > 0x10FFFF)
+			{
+				dest.push_back((WCHAR)0xFFFD);
+				continue;
+			}
+			if (sizeof(WCHAR) == 2 && c >= 0x10000)
+			{
+				c -= 0x10000;
+				dest.push_back((WCHAR)(0xD800 + (c >> 10)));
+				c = 0xDC00 + (c & 0x3FF);
+			}
+		}
+		dest.push_back((WCHAR)c);
+	}
+}
+
+void appendVarint(
+	__inout std::string &dest,
+	__in uint64_t val)
+{
+	while (val >= 0x80)
+	{
+		dest.push_back((char)(0x80 | (val & 0x7F)));
+		val >>= 7;
+	}
+	dest.push_back((char)val);
+}
+
+bool readVarint(
+	__inout const uint8_t *&p,
+	__in const uint8_t *end,
+	__out uint64_t &val)
+{
+	val = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (p >= end)
+			return false;
+		uint8_t b = *p++;
+		val |= (uint64_t)(b & 0x7F) << shift;
+		if ((b & 0x80) == 0)
+			return true;
+	}
+	return false;
+}
+
+#ifdef _WIN32
+static Erref corruptedModule(
+	__in HMODULE module)
+{
+	return internalErrorSource.mkString(
+		ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+		L"Internal error: the message table in the module at %p is corrupted.",
+		module);
+}
+#endif
+
+static Erref corruptedFile(
+	_In_z_ const WCHAR *path)
+{
+	return internalErrorSource.mkString(
+		ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+		L"Internal error: the MUI catalog file '%ls' is corrupted.",
+		path);
+}
+
+static uint32_t readLe32(
+	_In_reads_(4) const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void appendLe32(
+	__inout std::string &dest,
+	__in uint32_t v)
+{
+	for (int i = 0; i < 4; ++i, v >>= 8)
+		dest.push_back((char)(v & 0xFF));
+}
+
+bool MuiCatalog::Template::parse(
+	_In_reads_(len) const WCHAR *text,
+	__in size_t len)
+{
+	text_.assign(text, len);
+	pieces_.clear();
+	nargs_ = 0;
+	bool ok = true;
+
+	Piece cur;
+	cur.arg_ = -1;
+	cur.nstars_ = 0;
+	cur.type_ = FormatArgs::AT_WSTR;
+
+	const WCHAR *p = text;
+	const WCHAR *end = text + len;
+	while (p < end)
+	{
+		WCHAR c = *p++;
+		if (c != L'%')
+		{
+			cur.literal_.push_back(c);
+			continue;
+		}
+		if (p >= end)
+			break; // a stray '%' at the end gets dropped
+
+		c = *p;
+		if (c < L'1' || c > L'9')
+		{
+			++p;
+			switch (c)
+			{
+			case L'0':
+				p = end; // ends the message without the line break
+				break;
+			case L'n':
+				cur.literal_.append(L"\r\n");
+				break;
+			case L'r':
+				cur.literal_.push_back(L'\r');
+				break;
+			case L't':
+				cur.literal_.push_back(L'\t');
+				break;
+			default:
+				// %%, %space, %. and %! produce the character itself
+				cur.literal_.push_back(c);
+				break;
+			}
+			continue;
+		}
+
+		const WCHAR *start = p - 1; // for keeping the text if it's bad
+		int n = c - L'0';
+		++p;
+		if (p < end && *p >= L'0' && *p <= L'9')
+		{
+			n = n * 10 + (*p - L'0');
+			++p;
+		}
+
+		// The default is !s!, a string, in FormatMessageW() a wide one.
+		std::wstring spec = L"%ls";
+		if (p < end && *p == L'!')
+		{
+			const WCHAR *close = p + 1;
+			while (close < end && *close != L'!')
+				++close;
+			if (close >= end || close == p + 1 || close - p >= FormatArgs::SPEC_LIMIT - 2)
+			{
+				ok = false;
+				cur.literal_.append(start, p - start);
+				continue;
+			}
+			spec.assign(L"%");
+			spec.append(p + 1, close - p - 1);
+			p = close + 1;
+
+			// Like in the MSVC wide functions, a plain 's' or 'c' means
+			// a wide value and 'S' or 'C' a narrow one. Make it explicit,
+			// so that it means the same everywhere.
+			size_t last = spec.size() - 1;
+			WCHAR conv = spec[last];
+			WCHAR prefix = (last > 1) ? spec[last - 1] : 0;
+			if ((conv == L's' || conv == L'S' || conv == L'c' || conv == L'C')
+				&& prefix != L'h' && prefix != L'l' && prefix != L'w')
+			{
+				spec.insert(last, 1, (conv == L's' || conv == L'c') ? L'l' : L'h');
+				spec[last + 1] = (WCHAR)towlower(conv);
+			}
+		}
+
+		int nstars;
+		FormatArgs::ArgType type;
+		if (FormatArgs::parseSpec(spec.c_str(), nstars, type) != spec.c_str() + spec.size()
+			|| n + nstars > MAX_ARGS) // such as %99!*.*d!
+		{
+			ok = false;
+			cur.literal_.append(start, p - start);
+			continue;
+		}
+
+		// The values for '*' come from the arguments following %n,
+		// and the value itself after them.
+		cur.arg_ = n - 1;
+		cur.nstars_ = nstars;
+		cur.type_ = type;
+		cur.spec_.swap(spec);
+		if (n + nstars > nargs_)
+			nargs_ = n + nstars;
+		pieces_.push_back(cur);
+
+		cur.literal_.clear();
+		cur.spec_.clear();
+		cur.arg_ = -1;
+		cur.nstars_ = 0;
+	}
+
+	if (!cur.literal_.empty() || pieces_.empty())
+		pieces_.push_back(cur);
+	return ok;
+}
+
+void MuiCatalog::Template::render(
+	__inout std::wstring &dest,
+	__in const FormatArgs &args) const
+{
+	const FormatArgs::Entry *entries[MAX_ARGS];
+	int count = args.index(entries, MAX_ARGS);
+	if (count < 0)
+		count = 0; // can't happen with the correct messages
+
+	for (const Piece &piece : pieces_)
+	{
+		dest.append(piece.literal_);
+		if (piece.arg_ < 0)
+			continue;
+		assert(piece.arg_ + piece.nstars_ < MAX_ARGS); // checked by parse()
+		if (piece.arg_ + piece.nstars_ >= count)
+		{
+			dest.append(L"[FormatArgs: missing argument]");
+			continue;
+		}
+
+		int stars[2] = { 0, 0 };
+		for (int i = 0; i < piece.nstars_; ++i)
+		{
+			int64_t v = 0;
+			FormatArgs::entryToInt64(entries[piece.arg_ + i], v);
+			stars[i] = (int)v;
+		}
+		FormatArgs::appendValue(dest, piece.spec_.c_str(), piece.type_,
+			piece.nstars_, stars, entries[piece.arg_ + piece.nstars_]);
+	}
+}
+
+void MuiCatalog::Template::captureVa(
+	__inout FormatArgs &args,
+	__in va_list va) const
+{
+	// The arguments not used in the message are skipped as
+	// pointer-sized, like FormatMessage() does.
+	FormatArgs::ArgType types[MAX_ARGS];
+	assert(nargs_ <= MAX_ARGS); // checked by parse()
+	for (int i = 0; i < nargs_; ++i)
+		types[i] = FormatArgs::AT_PTR;
+	for (size_t i = pieces_.size(); i > 0; --i)
+	{
+		// Go backwards, so that the first use of an argument wins.
+		const Piece &piece = pieces_[i - 1];
+		if (piece.arg_ < 0)
+			continue;
+		assert(piece.arg_ + piece.nstars_ < MAX_ARGS);
+		for (int j = 0; j < piece.nstars_; ++j)
+			types[piece.arg_ + j] = FormatArgs::AT_INT;
+		types[piece.arg_ + piece.nstars_] = piece.type_;
+	}
+
+	for (int i = 0; i < nargs_; ++i)
+	{
+		switch (types[i])
+		{
+		case FormatArgs::AT_INT:
+			args.addInt(va_arg(va, int));
+			break;
+		case FormatArgs::AT_INT64:
+			args.addInt64(va_arg(va, int64_t));
+			break;
+		case FormatArgs::AT_DOUBLE:
+			args.addDouble(va_arg(va, double));
+			break;
+		case FormatArgs::AT_PTR:
+			args.addPtr(va_arg(va, const void *));
+			break;
+		case FormatArgs::AT_WSTR:
+			args.addWstr(va_arg(va, const WCHAR *));
+			break;
+		case FormatArgs::AT_STR:
+			args.addStr(va_arg(va, const char *));
+			break;
+		}
+	}
+}
+
+bool MuiCatalog::add(
+	__in DWORD code,
+	_In_reads_(len) const WCHAR *text,
+	__in size_t len)
+{
+	return templates_[code].parse(text, len);
+}
+
+Erref MuiCatalog::loadModule(
+	__in HMODULE module)
+{
+#ifdef _WIN32
+	// mc places all the messages into the message table number 1.
+	HRSRC res = FindResourceW(module, MAKEINTRESOURCEW(1), RT_MESSAGETABLE);
+	HGLOBAL hg = NULL;
+	if (res != NULL)
+		hg = LoadResource(module, res);
+	const uint8_t *base = NULL;
+	if (hg != NULL)
+		base = (const uint8_t *)LockResource(hg);
+	if (base == NULL)
+	{
+		return internalErrorSource.mkSystem(GetLastError(),
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: failed to load the message table from the module at %p:",
+			module);
+	}
+	size_t size = SizeofResource(module, res);
+
+	const MESSAGE_RESOURCE_DATA *data = (const MESSAGE_RESOURCE_DATA *)base;
+	if (size < sizeof(DWORD)
+		|| size < sizeof(DWORD) + data->NumberOfBlocks * sizeof(MESSAGE_RESOURCE_BLOCK))
+		return corruptedModule(module);
+
+	for (DWORD b = 0; b < data->NumberOfBlocks; ++b)
+	{
+		const MESSAGE_RESOURCE_BLOCK &block = data->Blocks[b];
+		size_t offset = block.OffsetToEntries;
+		for (DWORD code = block.LowId; code <= block.HighId; ++code)
+		{
+			if (offset + 4 > size)
+				return corruptedModule(module);
+			const MESSAGE_RESOURCE_ENTRY *entry = (const MESSAGE_RESOURCE_ENTRY *)(base + offset);
+			if (entry->Length < 4 || offset + entry->Length > size)
+				return corruptedModule(module);
+			offset += entry->Length;
+
+			// the text is padded with \0 to the aligned length
+			size_t tlen = entry->Length - 4;
+			if (entry->Flags & MESSAGE_RESOURCE_UNICODE)
+			{
+				const WCHAR *text = (const WCHAR *)entry->Text;
+				tlen /= sizeof(WCHAR);
+				while (tlen > 0 && text[tlen - 1] == 0)
+					--tlen;
+				add(code, text, tlen);
+			}
+			else
+			{
+				const char *text = (const char *)entry->Text;
+				while (tlen > 0 && text[tlen - 1] == 0)
+					--tlen;
+				std::wstring wtext(tlen, L'\0');
+				int wlen = (tlen == 0) ? 0
+					: MultiByteToWideChar(CP_ACP, 0, text, (int)tlen, &wtext[0], (int)tlen);
+				add(code, wtext.c_str(), wlen);
+			}
+
+			if (code == block.HighId)
+				break; // don't let the code wrap around
+		}
+	}
+	return Erref();
+#else
+	return internalErrorSource.mkString(
+		ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+		L"Internal error: the message tables of the modules (at %p) are not supported on this platform, use a catalog file.",
+		module);
+#endif
+}
+
+Erref MuiCatalog::loadFile(
+	_In_z_ const WCHAR *path)
+{
+	MappedFile mf;
+	Erref err = mf.open(path);
+	if (err)
+		return err;
+	return loadImage(path, mf.data_, mf.size_);
+}
+
+Erref MuiCatalog::loadImage(
+	_In_z_ const WCHAR *path,
+	_In_reads_(size) const uint8_t *data,
+	__in size_t size)
+{
+	enum { HEADER_SIZE = 12, ENTRY_SIZE = 12 };
+
+	if (size < HEADER_SIZE || memcmp(data, "MUIC", 4) != 0)
+	{
+		return internalErrorSource.mkString(
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: the file '%ls' is not a MUI catalog.",
+			path);
+	}
+	uint32_t version = readLe32(data + 4);
+	if (version != FILE_VERSION)
+	{
+		return internalErrorSource.mkString(
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: the MUI catalog file '%ls' has the unsupported version %u.",
+			path, version);
+	}
+	uint64_t count = readLe32(data + 8);
+	if (HEADER_SIZE + count * ENTRY_SIZE > size)
+		return corruptedFile(path);
+
+	std::wstring text;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const uint8_t *ep = data + HEADER_SIZE + i * ENTRY_SIZE;
+		uint64_t offset = readLe32(ep + 4);
+		uint64_t units = readLe32(ep + 8);
+		if (offset + units * 2 > size)
+			return corruptedFile(path);
+
+		text.clear();
+		appendUtf16(text, data + offset, (size_t)units);
+		add(readLe32(ep), text.c_str(), text.size());
+	}
+	return Erref();
+}
+
+Erref MuiCatalog::saveFile(
+	_In_z_ const WCHAR *path) const
+{
+	// write in the order of the codes, to keep the files reproducible
+	std::vector<DWORD> codes;
+	codes.reserve(templates_.size());
+	for (const auto &it : templates_)
+		codes.push_back(it.first);
+	std::sort(codes.begin(), codes.end());
+
+	std::string header("MUIC");
+	appendLe32(header, FILE_VERSION);
+	appendLe32(header, (uint32_t)codes.size());
+	std::string texts;
+	size_t base = header.size() + codes.size() * 12;
+	for (DWORD code : codes)
+	{
+		const std::wstring &text = templates_.find(code)->second.text_;
+		size_t offset = base + texts.size();
+		appendAsUtf16(texts, text);
+		appendLe32(header, code);
+		appendLe32(header, (uint32_t)offset);
+		appendLe32(header, (uint32_t)((base + texts.size() - offset) / 2));
+	}
+
+#ifdef _WIN32
+	FILE *f = NULL;
+	errno_t ferr = _wfopen_s(&f, path, L"wb");
+	if (ferr != 0)
+		f = NULL;
+#else
+	FILE *f = fopen(narrowPath(path).c_str(), "wb");
+#endif
+	if (f == NULL)
+	{
+		Erref err = internalErrorSource.mkString(
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: failed to create the MUI catalog file '%ls':", path);
+		err.splice(ErrorMsg::mkErrno());
+		return err;
+	}
+	bool ok = fwrite(header.data(), 1, header.size(), f) == header.size()
+		&& fwrite(texts.data(), 1, texts.size(), f) == texts.size();
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+	{
+		Erref err = internalErrorSource.mkString(
+			ErrorMsg::InternalErrorSource::MUI_CATALOG_FAILURE,
+			L"Internal error: failed to write the MUI catalog file '%ls':", path);
+		err.splice(ErrorMsg::mkErrno());
+		return err;
+	}
+	return Erref();
+}
+
+////////////////////// ErrorMsg::MuiSource ////////////////////////////
+
+ErrorMsg::MuiSource::MuiSource(
+	__in const wchar_t *name,
+	__in_opt const GUID *guid,
+	__in uint32_t testFlags
+) :
+	Source(name, guid, testFlags)
+{
+	HMODULE m = NULL;
+
+	// Normally this would be static, located inside the module, so it
+	// can be used to find the module itself.
+	LPCWSTR anchor = (LPCWSTR)this;
+	if (testFlags_ & STF_INIT_ERR1)
+		anchor = NULL;
+
+	do
+	{
+		// This logic can handle the situations
+		// when this object is defined in either a DLL or an EXE.
+		if (!GetModuleHandleExW(
+			GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+			| GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+			anchor,
+			&m))
+		{
+			testError_ = internalErrorSource.mkSystem(GetLastError(),
+				InternalErrorSource::MODULE_LOAD_FAILURE,
+				L"Internal error: failed to load the MUI module for MuiSource '%ls' at address %p.",
+				name, anchor);
+			break;
+		}
+
+		muiModule_ = m;
+
+		// Parse the messages once. If the message table can't be read,
+		// they still get looked up through FormatMessage() on every use.
+		if (!catalog_.loadModule(m))
+			muiCatalog_ = &catalog_;
+#pragma warning(suppress: 4127) // constant conditional expression
+	} while (0);
+
+	checkInit();
+}
+
+ErrorMsg::MuiSource::MuiSource(
+	__in const wchar_t *name,
+	__in_opt const GUID *guid,
+	__in const std::wstring &catalogPath,
+	__in uint32_t testFlags
+) :
+	Source(name, guid, testFlags)
+{
+	const WCHAR *path = catalogPath.c_str();
+	if (testFlags_ & STF_INIT_ERR1)
+		path = L"";
+
+	testError_ = catalog_.loadFile(path);
+	if (!testError_)
+		muiCatalog_ = &catalog_;
+
+	checkInit();
+}
+
+void ErrorMsg::MuiSource::checkInit()
+{
+	if (!(testFlags_ & STF_INIT_ERR1)
+		&& testError_.hasError())
+	{
+		wstring msg = testError_->toString();
+		// Print the error everywhere we can reach
+		wprintf(L"%s", msg.c_str()); fflush(stdout);
+		fwprintf(stderr, L"%s", msg.c_str()); fflush(stderr);
+		abort();
+	}
+}
+
+ErrorMsg::MuiSource::~MuiSource()
+{
+	// Because of GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT on opening
+	// the handle, no need to call FreeLibrary().
+	muiModule_ = NULL;
+	muiCatalog_ = NULL;
+}
+
+shared_ptr<ErrorMsg> ErrorMsg::MuiSource::mkMui(
+	__in DWORD code,
+	...)
+{
+	va_list args;
+	va_start(args, code);
+	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkMuiVa(this, code, args);
+	va_end(args);
+	return err;
+}
+
+std::shared_ptr<ErrorMsg> ErrorMsg::MuiSource::mkMuiSystem(
+	__in DWORD sysCode,
+	__in DWORD appCode,
+	...)
+{
+	va_list args;
+	va_start(args, appCode);
+	std::shared_ptr<ErrorMsg> err = ErrorMsg::mkMuiSystemVa(sysCode, this, appCode, args);
+	va_end(args);
+	return err;
+}
+
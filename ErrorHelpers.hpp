@@ -1,448 +1,1601 @@
-#pragma once
-
-/*++
-//-------------------------------- ErrorHelpers.hpp ---------------------------
-
-Copyright (c) 2014 Microsoft Corporation
-
---*/
-
-using namespace std;
-
-class LogEntity;
-class Logger;
-
-//////////////// general helper functions /////////////////////////////
-
-// Like [v]sprintf() but returns a string with the result.
-std::wstring __cdecl wstrprintf(
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...
-);
-std::wstring __cdecl vwstrprintf(
-	_In_z_ const WCHAR *fmt,
-	__in va_list args);
-
-// Like wstrprintf, only appends to an existing string object
-// instead of making a new one.
-void __cdecl wstrAppendF(
-	__inout std::wstring &dest, // destination string to append to
-	_In_z_ _Printf_format_string_ const WCHAR *fmt,
-	...
-);
-void __cdecl vwstrAppendF(
-	__inout std::wstring &dest, // destination string to append to
-	_In_z_ const WCHAR *fmt,
-	__in va_list args);
-
-////////////////////// ErrorMsg ///////////////////////////////////////
-
-class ErrorMsg;
-
-// It's convenient to report the errors as a single counted reference,
-// returning NULL if there is no error.
-class Erref : public std::shared_ptr<ErrorMsg>
-{
-public:
-	Erref()
-	{
-
-	}
-
-	Erref(const std::shared_ptr<ErrorMsg> &other) :
-		std::shared_ptr<ErrorMsg>(other)
-	{ 
-
-	}
-
-	// copy operator= inherited from std::shared_ptr
-
-	// The inlined methods are defined below, after ErrorMsg definition.
-
-	// Check whether there is an error referenced.
-	bool hasError();
-	// Get the error code, if any (or return ERROR_SUCCESS on on error).
-	DWORD getCode();
-	// Get the chained error. Returns NULL if either the chained error
-	// is not present, or this reference is NULL.
-	Erref getChain();
-	// Get the error code of the chained error, if any (or return ERROR_SUCCESS on on error).
-	DWORD getChainCode();
-
-	// Splice the chain contained in the other error object between
-	// this object and the rest of its chain.
-	// If the other object is NULL, does nothing.
-	// If this object is NULL, makes it refer to the other object.
-	// Be careful not to splice an error into itself, that would create reference loops!
-	void splice(const std::shared_ptr<ErrorMsg> &other);
-
-	// Wrap this error into the other one.
-	// It's an operation symmetrical to splicing, only with the reverse argument order.
-	// The contents of this reference will be replaced by the other object,
-	// which in turn will contain the object formerly held here.
-	void wrap(const std::shared_ptr<ErrorMsg> &other)
-	{
-		Erref dup = other;
-		dup.splice(*this);
-		*this = dup;
-	}
-
-	// Append the other error object at the end of the current chain.
-	// If this object is NULL, it will refer to the othe robject.
-	void append(const std::shared_ptr<ErrorMsg> &other);
-
-	// Make a copy of the object in this reference, with its whole chain.
-	Erref copy();
-
-	// If this reference contains an error, print the message from it
-	// on stdout and exit(1).
-	void printAndExitOnError();
-};
-
-// A high-level way to report the variety of user-defined errors,
-// combining both the detailed reporting of the reasons in strings
-// and the reasonably easy computational checks by error codes.
-class ErrorMsg
-{
-public:
-	// The definition for the simple error sources that don't
-	// differentiate between the error codes but always use
-	// the code OTHER for all their error reports.
-	enum CommonErrors {
-		// The code 0 is reserved for ERROR_SUCCESS
-		OTHER = 1
-	};
-
-	// The source defines the namespace for the error codes.
-	// Each library/class/whatever defines its own static source object.
-	// of FormatMessage() source.
-	class Source
-	{
-	public:
-		Source(
-			__in const wchar_t *name,
-			__in_opt const GUID *guid,
-			__in uint32_t testFlags = 0
-		) :
-			name_(name), guid_(guid), muiModule_(NULL), testFlags_(testFlags)
-		{ 
-
-		}
-
-		enum TestFlags {
-			STF_INIT_ERR1 = 0x00000001, // simulate an error in initialization
-		};
-
-		const wchar_t *name_; // Name of the source, which can be used to
-			// convert the message to a pure-string, for reporting
-			// up to the layers that don't have the knowledge of
-			// the details of the lower levels.
-			// Normally the name must point to a static string.
-		const GUID *guid_; // Pointer to a static location with GUID,
-			// will be NULL if this source has no GUID. A GUID is
-			// needed only of the library wants to be an ETW provider
-			// on its own.
-		HMODULE muiModule_; // Handle of the MUI module with the
-			// messages. If this source does not use MUI, the
-			// handle will be NULL.
-			// The handle is defined in the base class to let the
-			// general functions find out whether this is a MUI
-			// source or not.
-		uint32_t testFlags_; // Enable the special handling that allows
-			// to exercise the otherwise practically unreachable code.
-		Erref testError_; // A special way to save the
-			// test-generated error when otherwise the code would be aborted.
-
-		// Wrappers around the ErrorMsg static methods to avoid specifying the class hierarchies twice.
-		std::shared_ptr<ErrorMsg> __cdecl mkString(
-			__in DWORD code,
-			_In_z_ _Printf_format_string_ const WCHAR *fmt,
-			...);
-		std::shared_ptr<ErrorMsg> __cdecl mkSystem(
-			__in DWORD sysCode,
-			__in DWORD appCode,
-			_In_z_ _Printf_format_string_ const WCHAR *fmt,
-			...);
-
-	private:
-		Source();
-	};
-
-	// The source for internal errors.
-	class InternalErrorSource : public Source
-	{
-	public:
-		InternalErrorSource(
-			__in const wchar_t *name
-		) :
-			Source(name, NULL)
-		{
-
-		}
-
-		enum Errors {
-			MODULE_LOAD_FAILURE = OTHER + 1, // A source's module failed to load.
-			NO_MUI_HANDLE, // mkMui() was used on a source that doesn't support MUI.
-			MUST_USE_MUI, // A plain mkString() or such was used on a MUI source.
-			MUI_NO_MESSAGE, // Found no message for the requested error code.
-		};
-	};
-
-
-	// A source that uses MUI for the localized strings.
-	// Define a static object of this type, and it will
-	// automatically open the MUI handle in the constructor
-	// and close it in the destructor.
-	class MuiSource : public Source
-	{
-	public:
-		// Open a MUI handle on construction and close on destruction.
-		// The name and guid arguments must point to static memory,
-		// since these pointers will be kept in the object as-is.
-		//ErrorMsg::MuiSource::MuiSource(
-        MuiSource(
-			__in const wchar_t *name,
-			__in_opt const GUID *guid,
-			__in uint32_t testFlags = 0
-		);
-		~MuiSource();
-
-		// Wrappers around the ErrorMsg static methods to avoid specifying the class hierarchies twice.
-		std::shared_ptr<ErrorMsg> __cdecl mkMui(
-			__in DWORD code,
-			... // Arguments for the format specified in MUI
-		);
-		std::shared_ptr<ErrorMsg> __cdecl mkMuiSystem(
-			__in DWORD sysCode,
-			__in DWORD appCode,
-			...);
-
-	private:
-		MuiSource();
-		MuiSource(const MuiSource &);
-		void operator=(const MuiSource &);
-
-		// These must not be used with a MUI source.
-		std::shared_ptr<ErrorMsg> __cdecl mkString(
-			__in DWORD code,
-			_In_z_ _Printf_format_string_ const WCHAR *fmt,
-			...);
-		std::shared_ptr<ErrorMsg> __cdecl mkSystem(
-			__in DWORD sysCode,
-			__in DWORD appCode,
-			_In_z_ _Printf_format_string_ const WCHAR *fmt,
-			...);
-	};
-
-public:
-	virtual ~ErrorMsg(); // allows extension
-
-	// The constructed objects MUST ALWAYS be wrapped in an std::shared_ptr
-	// and only then can be assigned somewhere. For example:
-	// err->chain_ = std::make_shared<ErrorMsg>(source, code);
-	// err->chain_ = std::shared_ptr<ErrorMsg>(new ErrorMsg(source, code));
-
-	ErrorMsg() :
-		source_(NULL), code_(ERROR_SUCCESS)
-	{
-
-	}
-
-	ErrorMsg(
-		__in const Source *source,
-		__in DWORD code
-	) :
-		source_(source), code_(code)
-	{
-		
-	}
-
-	// Copies the whole chain, completely separating from the original.
-	ErrorMsg(const ErrorMsg &orig);
-
-	// Construct by making a copy. Copies the whole chain.
-	static std::shared_ptr<ErrorMsg> mkCopy(const ErrorMsg &orig);
-	static std::shared_ptr<ErrorMsg> mkCopy(const Erref &orig);
-
-	// Construct by printing an arbitrary non-localized message.
-	// source - identity of the source
-	// code - the error code
-	// fmt - the printf-like format string
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkString(
-		__in const Source *source,
-		__in DWORD code,
-		_In_z_ _Printf_format_string_ const WCHAR *fmt,
-		...);
-	// Construct by printing an arbitrary non-localized message with variable args.
-	// source - identity of the source
-	// code - the error code
-	// fmt - the printf-like format string
-	// args - the printf-like variable arguments
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkStringVa(
-		__in const Source *source,
-		__in DWORD code,
-		_In_z_ const WCHAR *fmt,
-		__in va_list args
-	);
-
-	// Construct by printing the explanation of a system error.
-	// code - the NT error code
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> mkSystem(
-		__in DWORD code
-	);
-
-	// Construct by printing the explanation of a stdio error.
-	// code - the stdio error code
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> mkErrno(
-		__in DWORD code // not a Windows arror but an errno!
-	);
-	// Calls _get_errno() to get the value.
-	static std::shared_ptr<ErrorMsg> mkErrno();
-
-	// Construct an error by printing a non-localized error message,
-	// and chaining another error with the system error message
-	// that caused the application-level error.
-	// sysCode - code of the underlying system error
-	// source - identity of the source of the application error
-	// appCode - the application-level error code
-	// fmt - the printf-like format string
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkSystem(
-		__in DWORD sysCode,
-		__in const Source *source,
-		__in DWORD appCode,
-		_In_z_ _Printf_format_string_ const WCHAR *fmt,
-		...);
-	// sysCode - code of the underlying system error
-	// source - identity of the source of the application error
-	// appCode - the application-level error code
-	// fmt - the printf-like format string
-	// args - the printf-like variable arguments
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkSystemVa(
-		__in DWORD sysCode,
-		__in const Source *source,
-		__in DWORD appCode,
-		_In_z_ const WCHAR *fmt,
-		__in va_list args
-	);
-
-	// Constuct an error by printing a MUI-localized error message.
-	// source - identity of the source
-	// code - the error code
-	// ... - arguments for the format string specified in MUI
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkMui(
-		__in const Source *source, // must be a MUI source
-		__in DWORD code,
-		... // Arguments for the format specified in MUI
-	);
-	// source - identity of the source
-	// code - the error code
-	// args - variable arguments for the format string specified in MUI
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkMuiVa(
-		__in const Source *source, // must be a MUI source
-		__in DWORD code,
-		__in va_list args // Arguments for the format specified in MUI
-	);
-
-	// Construct a MUI error originating from a system error.
-	// The system message gets chained to the MUI message.
-	// sysCode - code of the underlying system error
-	// source - identity of the source of the application error
-	// appCode - the application-level error code
-	// ... - arguments for the format string specified in MUI
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkMuiSystem(
-		__in DWORD sysCode,
-		__in const Source *source,
-		__in DWORD appCode,
-		...);
-	// sysCode - code of the underlying system error
-	// source - identity of the source of the application error
-	// appCode - the application-level error code
-	// args - arguments for the format string specified in MUI
-	// Returns the new ErrorMsg object.
-	static std::shared_ptr<ErrorMsg> __cdecl mkMuiSystemVa(
-		__in DWORD sysCode,
-		__in const Source *source,
-		__in DWORD appCode,
-		__in va_list args
-	);
-
-	// Convert the whole error chain to a single printable string.
-	std::wstring toString();
-
-	// Convert the error chain to a printable string, up to the size limit.
-	// The rest of the chain that didn't fit within the limit will be returned
-	// and can be used for the next call, to get the next chunk.
-	// The break is always done on the message boundary. At least one
-	// message is always included, it might be longer than the limit.
-	// 
-	// limit - the size limit for the resulting string, in characters
-	//      (not bytes, if in Unicode then twice more bytes will be used)
-	// next - place to return the continuation (will point into the middle
-	//      of the original chain); if everything is converted then
-	//      next will be set to NULL
-	// Returns the converted string.
-	std::wstring toLimitedString(
-		__in size_t limit,
-		__out Erref &next);
-
-public:
-	const Source *source_; // The source of this error. NULL means "Windows NT errors."
-	DWORD code_; // The error code, convenient for the machine checking.
-	std::wstring msg_; // The error message in a human-readable format.
-	std::shared_ptr<ErrorMsg> chain_; // The chained error, or NULL.
-};
-
-// The stdio functions return their error codes as the C standard library errno,
-// with values different from the Windows errors. So here we go,
-// the special source for Errno messages.
-extern ErrorMsg::Source ErrnoSource;
-
-///////////////////////// Erref methods /////////////////////////////////////////
-
-// Check whether there is an error referenced.
-inline bool Erref::hasError()
-{
-	ErrorMsg *msg = get();
-	return (msg != NULL && msg->code_ != ERROR_SUCCESS);
-}
-
-// Get the error code, if any (or return ERROR_SUCCESS on on error).
-inline DWORD Erref::getCode()
-{
-	ErrorMsg *msg = get();
-	if (msg == NULL)
-		return ERROR_SUCCESS; // no error
-	return msg->code_;
-}
-
-// Get the chained error. Returns NULL if either the chained error
-// is not present, or this reference is NULL.
-inline Erref Erref::getChain()
-{
-	ErrorMsg *msg = get();
-	if (msg == NULL)
-		return (Erref)0; // no error
-	return msg->chain_;
-}
-
-// Get the error code of the chained error, if any (or return ERROR_SUCCESS on on error).
-inline DWORD Erref::getChainCode()
-{
-	ErrorMsg *msg = get();
-	if (msg == NULL)
-		return ERROR_SUCCESS; // no error
-	msg = msg->chain_.get();
-	if (msg == NULL)
-		return ERROR_SUCCESS; // no error
-	return msg->code_;
-}
-
+#pragma once
+
+/*++
+//-------------------------------- ErrorHelpers.hpp ---------------------------
+
+Copyright (c) 2014 Microsoft Corporation
+
+--*/
+
+using namespace std;
+
+class LogEntity;
+class Logger;
+
+//////////////// general helper functions /////////////////////////////
+
+// Like [v]sprintf() but returns a string with the result.
+std::wstring __cdecl wstrprintf(
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...
+);
+std::wstring __cdecl vwstrprintf(
+	_In_z_ const WCHAR *fmt,
+	__in va_list args);
+
+// Like wstrprintf, only appends to an existing string object
+// instead of making a new one.
+void __cdecl wstrAppendF(
+	__inout std::wstring &dest, // destination string to append to
+	_In_z_ _Printf_format_string_ const WCHAR *fmt,
+	...
+);
+void __cdecl vwstrAppendF(
+	__inout std::wstring &dest, // destination string to append to
+	_In_z_ const WCHAR *fmt,
+	__in va_list args);
+
+// Append an integer in decimal, without going through the printf
+// format parsing.
+void wstrAppendDec(
+	__inout std::wstring &dest, // destination string to append to
+	__in int64_t val);
+// Append an unsigned integer in lowercase hex, without the 0x prefix.
+void wstrAppendHex(
+	__inout std::wstring &dest, // destination string to append to
+	__in uint64_t val);
+
+// Append a separator if the list in the string is not empty,
+// before appending the next element.
+void strListSep(
+	__inout std::wstring &dest, // destination string to append to
+	_In_z_ const WCHAR *sep = L", ");
+// Format a GUID in the registry form, {xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}.
+std::wstring strFromGuid(
+	__in const GUID &guid);
+
+// Append the text in UTF-16 (little-endian) from an unaligned location.
+// Where WCHAR is wider than 16 bits, the surrogate pairs get combined.
+void appendUtf16(
+	__inout std::wstring &dest, // destination string to append to
+	_In_reads_(units) const uint8_t *p,
+	__in size_t units); // length of the source text, in UTF-16 units
+// Append the text converted to UTF-16, as bytes in little-endian.
+void appendAsUtf16(
+	__inout std::string &dest, // destination string to append to
+	__in const std::wstring &text);
+// Append the text converted to UTF-8.
+void appendUtf8(
+	__inout std::string &dest, // destination string to append to
+	_In_reads_(len) const WCHAR *text,
+	__in size_t len); // length of the source text, in WCHARs
+// Append the text from UTF-8. The broken sequences become U+FFFD.
+// Where WCHAR is 16 bits wide, the characters above U+FFFF become
+// the surrogate pairs.
+void appendFromUtf8(
+	__inout std::wstring &dest, // destination string to append to
+	_In_reads_(len) const uint8_t *p,
+	__in size_t len); // length of the source text, in bytes
+
+// Append an unsigned integer as a varint: 7 bits per byte, the lowest
+// bits first, with the high bit set in every byte but the last one.
+void appendVarint(
+	__inout std::string &dest, // destination string to append to
+	__in uint64_t val);
+// Read a varint and advance p past it.
+// Returns false if it runs past the end or is longer than 64 bits.
+bool readVarint(
+	__inout const uint8_t *&p,
+	__in const uint8_t *end,
+	__out uint64_t &val);
+
+#ifndef _WIN32
+// Convert a path to the multibyte form, for the POSIX calls.
+std::string narrowPath(
+	_In_z_ const WCHAR *path);
+#endif
+
+// A compact binary copy of the arguments of a printf-like format,
+// used to defer the formatting until the text is actually needed.
+// The strings are copied, so the original arguments don't need to
+// stay alive. The small argument sets are kept inline, without
+// any heap allocation.
+class FormatArgs
+{
+public:
+	// The types of the stored values.
+	enum ArgType {
+		AT_INT, // int and everything that gets promoted to int
+		AT_INT64, // long long, size_t and such
+		AT_DOUBLE,
+		AT_PTR,
+		AT_WSTR, // a wide string, copied
+		AT_STR, // a narrow string, copied
+	};
+
+	FormatArgs();
+	FormatArgs(const FormatArgs &orig);
+	~FormatArgs();
+
+	// Copy the arguments from a va_list, as described by the format.
+	// Returns false if the format contains something that can't be
+	// captured (such as %n), then the caller must format the message
+	// right away.
+	bool captureVa(
+		_In_z_ const WCHAR *fmt,
+		__in va_list args);
+
+	// Append the individual values.
+	void addInt(int v);
+	void addInt64(int64_t v);
+	void addDouble(double v);
+	void addPtr(const void *v);
+	void addWstr(const WCHAR *v);
+	void addStr(const char *v);
+
+	// Format the stored arguments according to the format and
+	// append the result to dest. The format must be the same as
+	// used to capture the arguments.
+	void render(
+		__inout std::wstring &dest,
+		_In_z_ const WCHAR *fmt) const;
+
+	// Drop the contents and free the heap buffer, if any.
+	void clear();
+
+	// Append the values in a compact portable form, for the binary logs:
+	// a varint count of the values, then for each value its ArgType in
+	// one byte and the value itself. The integers and pointers are
+	// varints (the signed ones zigzag-encoded), a double is 8 bytes
+	// little-endian, a string is a varint of its length in bytes plus 1
+	// (0 stands for a NULL pointer) and the text, the wide strings
+	// converted to UTF-8.
+	void pack(__inout std::string &dest) const;
+
+	// Append the values from the packed form (see pack()), advancing p.
+	// Returns false if the data is corrupted.
+	bool unpack(
+		__inout const uint8_t *&p,
+		__in const uint8_t *end);
+
+	bool empty() const
+	{
+		return (size_ == 0);
+	}
+
+	// The longest conversion specification that can be captured.
+	enum { SPEC_LIMIT = 32 };
+
+	// Parse one conversion specification. It's constexpr, to be usable
+	// for the compile-time checks (see FormatCheck).
+	// p - points to the '%' that starts the specification
+	// stars - returns the number of '*' in the width and precision
+	// type - returns the type of the value
+	// Returns the pointer past the specification, or NULL if it's
+	// not supported.
+	static constexpr const WCHAR *parseSpec(
+		_In_z_ const WCHAR *p,
+		__out int &stars,
+		__out ArgType &type);
+
+	// Append a value of a C++ type, as used by the typed ErrorMsg
+	// factories. All the integers get stored as 64-bit values with the
+	// right sign extension, and narrowed on rendering as the format says.
+	void add(int v)
+	{
+		addInt64(v);
+	}
+	void add(unsigned int v)
+	{
+		addInt64((int64_t)(uint64_t)v);
+	}
+	void add(long v)
+	{
+		addInt64(v);
+	}
+	void add(unsigned long v)
+	{
+		addInt64((int64_t)(uint64_t)v);
+	}
+	void add(long long v)
+	{
+		addInt64(v);
+	}
+	void add(unsigned long long v)
+	{
+		addInt64((int64_t)v);
+	}
+	void add(double v)
+	{
+		addDouble(v);
+	}
+	void add(const WCHAR *v)
+	{
+		addWstr(v);
+	}
+	void add(const char *v)
+	{
+		addStr(v);
+	}
+	void add(const void *v)
+	{
+		addPtr(v);
+	}
+	// A literal nullptr would be ambiguous between the pointer types.
+	// It's kept as a NULL pointer, that renders as a NULL string too.
+	void add(std::nullptr_t)
+	{
+		addPtr(nullptr);
+	}
+
+	// Append all the values.
+	template <typename... Args>
+	void addAll(const Args &... args)
+	{
+		int dummy[] = { 0, (add(args), 0)... };
+		(void)dummy;
+	}
+
+	// Fill an array of the arguments in the form used by
+	// FormatMessage() with FORMAT_MESSAGE_ARGUMENT_ARRAY.
+	// The strings point into this object.
+	// Returns the number of arguments, or -1 if they don't fit
+	// or a floating-point value is present.
+	int toArray(
+		__out_ecount(limit) DWORD_PTR *arr,
+		__in int limit) const;
+
+	// Every entry starts at a 8-byte boundary with this header,
+	// followed by the value (the strings include the terminating \0).
+	struct Entry {
+	public:
+		uint32_t type_;
+		uint32_t len_; // length of the value in bytes; for the strings
+			// NULL_STR means that the argument was a NULL pointer
+	};
+	enum { NULL_STR = 0xFFFFFFFF };
+
+	// Collect the pointers to the entries, for the formats that refer
+	// to the arguments by number (such as the MUI messages).
+	// Returns the number of entries, or -1 if they don't fit.
+	int index(
+		__out_ecount(limit) const Entry **entries,
+		__in int limit) const;
+
+	// Format one value by a conversion specification, converting
+	// it to the type that the specification expects.
+	// spec - the specification, as checked by parseSpec()
+	// type - the type returned by parseSpec()
+	// nstars - the number of '*' returned by parseSpec()
+	// stars - the values for the '*'
+	// e - the entry with the value
+	static void appendValue(
+		__inout std::wstring &dest,
+		_In_z_ const WCHAR *spec,
+		__in ArgType type,
+		__in int nstars,
+		__in_ecount(2) const int *stars,
+		__in const Entry *e);
+
+	// Read an integer-like entry.
+	// Returns false if the entry is not an integer or pointer.
+	static bool entryToInt64(
+		__in const Entry *e,
+		__out int64_t &v);
+
+protected:
+	// The size categories of the conversion specification, for parseSpec().
+	enum SizePrefix { SZ_DEFAULT, SZ_SHORT, SZ_LONG, SZ_LONGLONG, SZ_SIZET, SZ_LONGDOUBLE };
+
+	// Make space for an entry and fill its header.
+	// Returns the pointer to the entry's value.
+	uint8_t *addEntry(ArgType type, uint32_t len);
+
+	enum { INLINE_WORDS = 12 }; // fits 6 numeric arguments
+
+	// Get the entry following this one.
+	static const uint8_t *nextEntry(__in const Entry *e)
+	{
+		size_t vlen = (e->len_ == NULL_STR) ? 0 : e->len_;
+		return (const uint8_t *)(e + 1)
+			+ ((vlen + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1));
+	}
+
+	uint64_t *data_; // points either to inline_ or to the heap
+	size_t size_; // bytes used
+	size_t capacity_; // bytes available
+	uint64_t inline_[INLINE_WORDS];
+
+private:
+	void operator=(const FormatArgs &);
+};
+
+inline constexpr const WCHAR *FormatArgs::parseSpec(
+	_In_z_ const WCHAR *p,
+	__out int &stars,
+	__out ArgType &type)
+{
+	const WCHAR *start = p;
+	stars = 0;
+
+	++p; // skip the '%'
+	while (*p == L'-' || *p == L'+' || *p == L' ' || *p == L'#' || *p == L'0' || *p == L'\'')
+		++p;
+	if (*p == L'*')
+	{
+		++stars;
+		++p;
+	}
+	while (*p >= L'0' && *p <= L'9')
+		++p;
+	if (*p == L'.')
+	{
+		++p;
+		if (*p == L'*')
+		{
+			++stars;
+			++p;
+		}
+		while (*p >= L'0' && *p <= L'9')
+			++p;
+	}
+
+	// the size prefixes
+	int size = SZ_DEFAULT;
+	switch (*p)
+	{
+	case L'h':
+		size = SZ_SHORT;
+		++p;
+		if (*p == L'h')
+			++p;
+		break;
+	case L'l':
+		size = SZ_LONG;
+		++p;
+		if (*p == L'l')
+		{
+			size = SZ_LONGLONG;
+			++p;
+		}
+		break;
+	case L'w':
+		size = SZ_LONG;
+		++p;
+		break;
+	case L'L':
+		size = SZ_LONGDOUBLE;
+		++p;
+		break;
+	case L'q':
+	case L'j':
+		size = SZ_LONGLONG;
+		++p;
+		break;
+	case L'z':
+	case L't':
+		size = SZ_SIZET;
+		++p;
+		break;
+	case L'I':
+		++p;
+		if (p[0] == L'6' && p[1] == L'4')
+		{
+			size = SZ_LONGLONG;
+			p += 2;
+		}
+		else if (p[0] == L'3' && p[1] == L'2')
+		{
+			p += 2;
+		}
+		else
+		{
+			size = SZ_SIZET;
+		}
+		break;
+	}
+
+	switch (*p)
+	{
+	case L'd':
+	case L'i':
+	case L'o':
+	case L'u':
+	case L'x':
+	case L'X':
+		if (size == SZ_LONGLONG
+			|| (size == SZ_LONG && sizeof(long) == sizeof(int64_t))
+			|| (size == SZ_SIZET && sizeof(size_t) == sizeof(int64_t)))
+			type = AT_INT64;
+		else
+			type = AT_INT;
+		break;
+	case L'c':
+	case L'C':
+		type = AT_INT;
+		break;
+	case L'e':
+	case L'E':
+	case L'f':
+	case L'F':
+	case L'g':
+	case L'G':
+	case L'a':
+	case L'A':
+		if (size == SZ_LONGDOUBLE)
+			return nullptr;
+		type = AT_DOUBLE;
+		break;
+	case L'p':
+		type = AT_PTR;
+		break;
+	case L's':
+	case L'S':
+		if (size == SZ_LONG)
+			type = AT_WSTR;
+		else if (size == SZ_SHORT)
+			type = AT_STR;
+#if defined(_MSC_VER) && !defined(_CRT_STDIO_ISO_WIDE_SPECIFIERS)
+		// the legacy MSVC meaning in the wide functions
+		else
+			type = (*p == L's') ? AT_WSTR : AT_STR;
+#else
+		else
+			type = (*p == L'S') ? AT_WSTR : AT_STR;
+#endif
+		break;
+	default:
+		// including %n and the unknown characters
+		return nullptr;
+	}
+	++p;
+
+	if (p - start >= SPEC_LIMIT)
+		return nullptr;
+	return p;
+}
+
+// The compile-time check of a printf-like format against the types
+// of the arguments, for the typed ErrorMsg factories. Normally used
+// through ERRMSG_CHECK_FORMAT() or ERRMSG_STRING().
+class FormatCheck
+{
+public:
+	// The categories of the argument types.
+	enum Category {
+		FC_END, // marks the end of the list
+		FC_INTEGER,
+		FC_FLOAT,
+		FC_WSTR,
+		FC_STR,
+		FC_PTR,
+		FC_NULL, // nullptr, goes for a pointer or a string
+		FC_OTHER, // can't be used with printf
+	};
+
+	// An empty type to carry the list of argument types.
+	template <typename... Args>
+	struct TypeList {
+	};
+
+	// Used only in decltype(), to get the types of the arguments.
+	template <typename... Args>
+	static TypeList<Args...> typeList(const Args &...);
+
+	template <typename T>
+	static constexpr int category()
+	{
+		typedef typename std::decay<T>::type D;
+		return (std::is_integral<D>::value || std::is_enum<D>::value) ? FC_INTEGER
+			: std::is_floating_point<D>::value ? FC_FLOAT
+			: (std::is_same<D, const WCHAR *>::value || std::is_same<D, WCHAR *>::value) ? FC_WSTR
+			: (std::is_same<D, const char *>::value || std::is_same<D, char *>::value) ? FC_STR
+			: std::is_pointer<D>::value ? FC_PTR
+			: std::is_same<D, std::nullptr_t>::value ? FC_NULL
+			: FC_OTHER;
+	}
+
+	// Check that the format matches the list of the argument categories,
+	// terminated by FC_END.
+	static constexpr bool matchCategories(
+		_In_z_ const WCHAR *fmt,
+		__in const int *cats)
+	{
+		for (const WCHAR *p = fmt; *p != 0; )
+		{
+			if (*p != L'%')
+			{
+				++p;
+				continue;
+			}
+			if (p[1] == L'%')
+			{
+				p += 2;
+				continue;
+			}
+
+			int stars = 0;
+			FormatArgs::ArgType type = FormatArgs::AT_INT;
+			const WCHAR *end = FormatArgs::parseSpec(p, stars, type);
+			if (end == nullptr)
+				return false;
+			p = end;
+
+			for (; stars > 0; --stars)
+			{
+				if (*cats++ != FC_INTEGER)
+					return false;
+			}
+
+			int c = *cats;
+			if (c == FC_END)
+				return false; // too few arguments
+			++cats;
+			switch (type)
+			{
+			case FormatArgs::AT_INT:
+			case FormatArgs::AT_INT64:
+				if (c != FC_INTEGER)
+					return false;
+				break;
+			case FormatArgs::AT_DOUBLE:
+				if (c != FC_FLOAT)
+					return false;
+				break;
+			case FormatArgs::AT_PTR:
+				if (c != FC_PTR && c != FC_WSTR && c != FC_STR && c != FC_NULL)
+					return false;
+				break;
+			case FormatArgs::AT_WSTR:
+				if (c != FC_WSTR && c != FC_NULL)
+					return false;
+				break;
+			case FormatArgs::AT_STR:
+				if (c != FC_STR && c != FC_NULL)
+					return false;
+				break;
+			}
+		}
+		return (*cats == FC_END); // or too many arguments
+	}
+
+	template <typename... Args>
+	static constexpr bool matches(
+		_In_z_ const WCHAR *fmt,
+		__in TypeList<Args...> *)
+	{
+		const int cats[] = { category<Args>()..., FC_END };
+		return matchCategories(fmt, cats);
+	}
+
+	// Same, with the list of the types that starts with the format itself.
+	template <typename Fmt, typename... Args>
+	static constexpr bool matchesCall(
+		_In_z_ const WCHAR *fmt,
+		__in TypeList<Fmt, Args...> *)
+	{
+		return matches(fmt, (TypeList<Args...> *)nullptr);
+	}
+};
+
+// Pick the first of the macro arguments (the format), with the workaround
+// for the MSVC preprocessor that passes __VA_ARGS__ on as one argument.
+#define ERRMSG_EXPAND(x) x
+#define ERRMSG_FIRST_(first, ...) first
+#define ERRMSG_FIRST(...) ERRMSG_EXPAND(ERRMSG_FIRST_(__VA_ARGS__, ~))
+
+// Check at compile time that the format literal (the first argument)
+// matches the arguments after it.
+#define ERRMSG_CHECK_FORMAT(...) \
+	static_assert(FormatCheck::matchesCall(ERRMSG_FIRST(__VA_ARGS__), \
+			(decltype(FormatCheck::typeList(__VA_ARGS__)) *)nullptr), \
+		"the format does not match the argument types")
+
+// Build an error through Source::mkString(), with the format checked at
+// compile time: ERRMSG_STRING(source, code, fmt, args...).
+#define ERRMSG_STRING(source, code, ...) \
+	([&]() { \
+		ERRMSG_CHECK_FORMAT(__VA_ARGS__); \
+		return ErrorMsg::mkStringPrechecked(&(source), code, __VA_ARGS__); \
+	}())
+
+// Same with Source::mkSystem(): ERRMSG_SYSTEM(source, sysCode, appCode, fmt, args...).
+#define ERRMSG_SYSTEM(source, sysCode, appCode, ...) \
+	([&]() { \
+		ERRMSG_CHECK_FORMAT(__VA_ARGS__); \
+		return ErrorMsg::mkSystemPrechecked(sysCode, &(source), appCode, __VA_ARGS__); \
+	}())
+
+////////////////////// ErrorMsg ///////////////////////////////////////
+
+class ErrorMsg;
+
+// It's convenient to report the errors as a single counted reference,
+// returning NULL if there is no error.
+class Erref : public std::shared_ptr<ErrorMsg>
+{
+public:
+	Erref() :
+		tail_(NULL)
+	{
+
+	}
+
+	Erref(const std::shared_ptr<ErrorMsg> &other) :
+		std::shared_ptr<ErrorMsg>(other),
+		tail_(NULL)
+	{ 
+
+	}
+
+	Erref(const Erref &other) :
+		std::shared_ptr<ErrorMsg>(other),
+		tail_(other.tail_)
+	{
+	}
+
+	// The moved-from reference must not keep the tail hint into
+	// a chain that it doesn't hold any more.
+	Erref(Erref &&other) :
+		std::shared_ptr<ErrorMsg>(std::move(other)),
+		tail_(other.tail_)
+	{
+		other.tail_ = NULL;
+	}
+
+	Erref &operator=(const Erref &other)
+	{
+		std::shared_ptr<ErrorMsg>::operator=(other);
+		tail_ = other.tail_;
+		return *this;
+	}
+
+	Erref &operator=(Erref &&other)
+	{
+		if (this != &other) {
+			std::shared_ptr<ErrorMsg>::operator=(std::move(other));
+			tail_ = other.tail_;
+			other.tail_ = NULL;
+		}
+		return *this;
+	}
+
+	// the assignment of a std::shared_ptr works through the conversion
+
+	// Swap the references together with their tail hints
+	// (std::shared_ptr::swap() would leave the hints behind).
+	void swap(Erref &other)
+	{
+		std::shared_ptr<ErrorMsg>::swap(other);
+		std::swap(tail_, other.tail_);
+	}
+
+	// Drop the reference (and the tail hint with it).
+	void reset()
+	{
+		std::shared_ptr<ErrorMsg>::reset();
+		tail_ = NULL;
+	}
+
+	// The inlined methods are defined below, after ErrorMsg definition.
+
+	// Check whether there is an error referenced.
+	bool hasError();
+	// Get the error code, if any (or return ERROR_SUCCESS on on error).
+	DWORD getCode();
+	// Get the chained error. Returns NULL if either the chained error
+	// is not present, or this reference is NULL.
+	Erref getChain();
+	// Get the error code of the chained error, if any (or return ERROR_SUCCESS on on error).
+	DWORD getChainCode();
+
+	// Splice the chain contained in the other error object between
+	// this object and the rest of its chain.
+	// If the other object is NULL, does nothing.
+	// If this object is NULL, makes it refer to the other object.
+	// Be careful not to splice an error into itself, that would create reference loops!
+	void splice(const std::shared_ptr<ErrorMsg> &other);
+	// Same but uses the tail hint of the other chain.
+	void splice(const Erref &other);
+
+	// Wrap this error into the other one.
+	// It's an operation symmetrical to splicing, only with the reverse argument order.
+	// The contents of this reference will be replaced by the other object,
+	// which in turn will contain the object formerly held here.
+	void wrap(const std::shared_ptr<ErrorMsg> &other)
+	{
+		Erref dup = other;
+		dup.splice(*this);
+		*this = dup;
+	}
+
+	// Append the other error object at the end of the current chain.
+	// If this object is NULL, it will refer to the othe robject.
+	// Takes constant time when appending repeatedly to the same Erref.
+	void append(const std::shared_ptr<ErrorMsg> &other);
+	// Same but uses the tail hint of the other chain.
+	void append(const Erref &other);
+
+	// Make a copy of the object in this reference, with its whole chain.
+	Erref copy();
+
+	// If this reference contains an error, print the message from it
+	// on stdout and exit(1).
+	void printAndExitOnError();
+
+protected:
+	// Find the last element of the chain, starting from the hint,
+	// and update the hint. This reference must not be NULL.
+	ErrorMsg *findTail();
+
+	// The common implementation of splice().
+	// otherTail - the tail hint of the other chain, or NULL
+	void spliceInternal(
+		__in const std::shared_ptr<ErrorMsg> &other,
+		__in_opt ErrorMsg *otherTail);
+
+	// The common implementation of append().
+	// otherTail - the tail hint of the other chain, or NULL
+	void appendInternal(
+		__in const std::shared_ptr<ErrorMsg> &other,
+		__in_opt ErrorMsg *otherTail);
+
+	ErrorMsg *tail_; // Hint: the last known element of the chain,
+		// to avoid walking the chain on every append. Since the chains
+		// only grow through splice() and append(), the real tail is
+		// either this one or somewhere after it. This requires that
+		// nobody cuts the chain by assigning chain_ directly.
+};
+
+// An in-memory catalog of the MUI messages, parsed once into the
+// templates with the insertion points, so that rendering a message
+// needs neither a resource lookup nor the parsing of its text.
+// The messages use the FormatMessage() syntax: %1 to %99 with an optional
+// !printf-spec!, and the escapes %0, %n, %r, %t, %%, %space, %. and %!.
+//
+// The catalog can be loaded from the message table of a module (on Windows)
+// or from a binary file that gets read through a memory mapping (portable).
+// The file format, all little-endian:
+//   header: "MUIC", uint32 version (1), uint32 count of messages
+//   count entries: uint32 code, uint32 offset of the text from the start
+//     of the file, uint32 length of the text in UTF-16 units
+//   the texts, in UTF-16
+class MuiCatalog
+{
+public:
+	enum {
+		FILE_VERSION = 1,
+		MAX_ARGS = 99, // the insertions can refer to %1 to %99
+	};
+
+	// A piece of a template: the literal text, followed by an insertion.
+	struct Piece {
+	public:
+		std::wstring literal_; // text before the insertion, with the escapes resolved
+		int arg_; // index of the first argument used by the insertion (from 0),
+			// or -1 if there is no insertion after the text
+		int nstars_; // number of arguments for the width and precision,
+			// they go before the value
+		FormatArgs::ArgType type_; // the type of the value
+		std::wstring spec_; // the printf-like conversion specification
+	};
+
+	// A pre-parsed message.
+	class Template
+	{
+	public:
+		Template() :
+			nargs_(0)
+		{ }
+
+		// Parse the text of the message.
+		// Returns false if some of the insertions were not understood,
+		// they are then kept as literal text.
+		bool parse(
+			_In_reads_(len) const WCHAR *text,
+			__in size_t len);
+
+		// Append the message with the arguments inserted to dest.
+		void render(
+			__inout std::wstring &dest,
+			__in const FormatArgs &args) const;
+
+		// Copy the arguments from a va_list, with the types that
+		// the insertions expect.
+		void captureVa(
+			__inout FormatArgs &args,
+			__in va_list va) const;
+
+		std::wstring text_; // the original text
+		std::vector<Piece> pieces_;
+		int nargs_; // number of the arguments referred to by the insertions
+	};
+
+	// Load the messages from the message table resource of a module.
+	// Returns the error if the message table can't be read.
+	Erref loadModule(
+		__in HMODULE module);
+
+	// Load the messages from a file in the format described above.
+	// Returns the error if the file can't be read or is corrupted.
+	Erref loadFile(
+		_In_z_ const WCHAR *path);
+
+	// Write the messages into a file in the format described above.
+	// This allows to export a message table for use on other platforms.
+	Erref saveFile(
+		_In_z_ const WCHAR *path) const;
+
+	// Add or replace a message.
+	// Returns false if some of the insertions were not understood.
+	bool add(
+		__in DWORD code,
+		_In_reads_(len) const WCHAR *text,
+		__in size_t len);
+
+	// Find the template for the code, or return NULL.
+	const Template *find(
+		__in DWORD code) const
+	{
+		auto it = templates_.find(code);
+		return (it == templates_.end()) ? NULL : &it->second;
+	}
+
+	size_t size() const
+	{
+		return templates_.size();
+	}
+
+protected:
+	// Parse the contents of a catalog file.
+	Erref loadImage(
+		_In_z_ const WCHAR *path, // for the error messages
+		_In_reads_(size) const uint8_t *data,
+		__in size_t size);
+
+	std::unordered_map<DWORD, Template> templates_;
+};
+
+// A high-level way to report the variety of user-defined errors,
+// combining both the detailed reporting of the reasons in strings
+// and the reasonably easy computational checks by error codes.
+class ErrorMsg
+{
+public:
+	// The definition for the simple error sources that don't
+	// differentiate between the error codes but always use
+	// the code OTHER for all their error reports.
+	enum CommonErrors {
+		// The code 0 is reserved for ERROR_SUCCESS
+		OTHER = 1
+	};
+
+	// The source defines the namespace for the error codes.
+	// Each library/class/whatever defines its own static source object.
+	// of FormatMessage() source.
+	class Source
+	{
+	public:
+		Source(
+			__in const wchar_t *name,
+			__in_opt const GUID *guid,
+			__in uint32_t testFlags = 0
+		) :
+			name_(name), guid_(guid), muiModule_(NULL), muiCatalog_(NULL),
+			testFlags_(testFlags)
+		{ 
+
+		}
+
+		// Check whether this source provides the MUI messages.
+		bool isMui() const
+		{
+			return (muiModule_ != NULL || muiCatalog_ != NULL);
+		}
+
+		enum TestFlags {
+			STF_INIT_ERR1 = 0x00000001, // simulate an error in initialization
+		};
+
+		const wchar_t *name_; // Name of the source, which can be used to
+			// convert the message to a pure-string, for reporting
+			// up to the layers that don't have the knowledge of
+			// the details of the lower levels.
+			// Normally the name must point to a static string.
+		const GUID *guid_; // Pointer to a static location with GUID,
+			// will be NULL if this source has no GUID. A GUID is
+			// needed only of the library wants to be an ETW provider
+			// on its own.
+		HMODULE muiModule_; // Handle of the MUI module with the
+			// messages. If this source does not use MUI, the
+			// handle will be NULL.
+			// The handle is defined in the base class to let the
+			// general functions find out whether this is a MUI
+			// source or not.
+		const MuiCatalog *muiCatalog_; // The pre-parsed messages of
+			// a MUI source, or NULL if the messages must be looked up
+			// through FormatMessage() every time.
+		uint32_t testFlags_; // Enable the special handling that allows
+			// to exercise the otherwise practically unreachable code.
+		Erref testError_; // A special way to save the
+			// test-generated error when otherwise the code would be aborted.
+
+		// Wrappers around the ErrorMsg static methods to avoid specifying the class hierarchies twice.
+		std::shared_ptr<ErrorMsg> __cdecl mkString(
+			__in DWORD code,
+			_In_z_ _Printf_format_string_ const WCHAR *fmt,
+			...);
+		std::shared_ptr<ErrorMsg> __cdecl mkSystem(
+			__in DWORD sysCode,
+			__in DWORD appCode,
+			_In_z_ _Printf_format_string_ const WCHAR *fmt,
+			...);
+
+		// The typed versions, preferred by the compiler whenever there
+		// are any arguments after the format.
+		template <typename... Args>
+		std::shared_ptr<ErrorMsg> mkString(
+			__in DWORD code,
+			_In_z_ const WCHAR *fmt,
+			__in const Args &... args)
+		{
+			return ErrorMsg::mkString(this, code, fmt, args...);
+		}
+		template <typename... Args>
+		std::shared_ptr<ErrorMsg> mkSystem(
+			__in DWORD sysCode,
+			__in DWORD appCode,
+			_In_z_ const WCHAR *fmt,
+			__in const Args &... args)
+		{
+			return ErrorMsg::mkSystem(sysCode, this, appCode, fmt, args...);
+		}
+
+	private:
+		Source();
+	};
+
+	// The source for internal errors.
+	class InternalErrorSource : public Source
+	{
+	public:
+		InternalErrorSource(
+			__in const wchar_t *name
+		) :
+			Source(name, NULL)
+		{
+
+		}
+
+		enum Errors {
+			MODULE_LOAD_FAILURE = OTHER + 1, // A source's module failed to load.
+			NO_MUI_HANDLE, // mkMui() was used on a source that doesn't support MUI.
+			MUST_USE_MUI, // A plain mkString() or such was used on a MUI source.
+			MUI_NO_MESSAGE, // Found no message for the requested error code.
+			MUI_CATALOG_FAILURE, // Failed to load or save a MUI message catalog.
+			BAD_FORMAT_ARGS, // The arguments of a typed mkString() or such don't match the format.
+		};
+	};
+
+
+	// A source that uses MUI for the localized strings.
+	// Define a static object of this type, and it will
+	// automatically open the MUI handle in the constructor
+	// and close it in the destructor. The message table gets
+	// loaded into a catalog once, in the constructor.
+	class MuiSource : public Source
+	{
+	public:
+		// Open a MUI handle on construction and close on destruction.
+		// The name and guid arguments must point to static memory,
+		// since these pointers will be kept in the object as-is.
+		//ErrorMsg::MuiSource::MuiSource(
+        MuiSource(
+			__in const wchar_t *name,
+			__in_opt const GUID *guid,
+			__in uint32_t testFlags = 0
+		);
+		// Take the messages from a catalog file instead of the module
+		// (see MuiCatalog), this works on any platform.
+		MuiSource(
+			__in const wchar_t *name,
+			__in_opt const GUID *guid,
+			__in const std::wstring &catalogPath,
+			__in uint32_t testFlags = 0
+		);
+		~MuiSource();
+
+		// Wrappers around the ErrorMsg static methods to avoid specifying the class hierarchies twice.
+		std::shared_ptr<ErrorMsg> __cdecl mkMui(
+			__in DWORD code,
+			... // Arguments for the format specified in MUI
+		);
+		std::shared_ptr<ErrorMsg> __cdecl mkMuiSystem(
+			__in DWORD sysCode,
+			__in DWORD appCode,
+			...);
+
+		// The typed versions, preferred by the compiler whenever there
+		// are any arguments.
+		template <typename... Args>
+		std::shared_ptr<ErrorMsg> mkMui(
+			__in DWORD code,
+			__in const Args &... args)
+		{
+			return ErrorMsg::mkMui(this, code, args...);
+		}
+		template <typename... Args>
+		std::shared_ptr<ErrorMsg> mkMuiSystem(
+			__in DWORD sysCode,
+			__in DWORD appCode,
+			__in const Args &... args)
+		{
+			return ErrorMsg::mkMuiSystem(sysCode, this, appCode, args...);
+		}
+
+	protected:
+		// Abort if the construction has failed, unless it's a test.
+		void checkInit();
+
+		MuiCatalog catalog_; // the pre-parsed messages
+
+	private:
+		MuiSource();
+		MuiSource(const MuiSource &);
+		void operator=(const MuiSource &);
+
+		// These must not be used with a MUI source.
+		std::shared_ptr<ErrorMsg> __cdecl mkString(
+			__in DWORD code,
+			_In_z_ _Printf_format_string_ const WCHAR *fmt,
+			...);
+		std::shared_ptr<ErrorMsg> __cdecl mkSystem(
+			__in DWORD sysCode,
+			__in DWORD appCode,
+			_In_z_ _Printf_format_string_ const WCHAR *fmt,
+			...);
+	};
+
+public:
+	virtual ~ErrorMsg(); // allows extension
+
+	// The constructed objects MUST ALWAYS be wrapped in an std::shared_ptr
+	// and only then can be assigned somewhere. For example:
+	// err->chain_ = ErrorMsg::mkNew(source, code);
+	// err->chain_ = std::make_shared<ErrorMsg>(source, code);
+	// err->chain_ = std::shared_ptr<ErrorMsg>(new ErrorMsg(source, code));
+	// The first way is preferred, since it takes the memory from
+	// the per-thread pool (see ErrorMsgPool).
+
+	ErrorMsg() :
+		source_(NULL), code_(ERROR_SUCCESS),
+		kind_(MK_TEXT), fmt_(NULL), state_(MS_READY)
+	{
+
+	}
+
+	ErrorMsg(
+		__in const Source *source,
+		__in DWORD code
+	) :
+		source_(source), code_(code),
+		kind_(MK_TEXT), fmt_(NULL), state_(MS_READY)
+	{
+		
+	}
+
+	// Copies the whole chain, completely separating from the original.
+	ErrorMsg(const ErrorMsg &orig);
+
+	// Construct by making a copy. Copies the whole chain.
+	static std::shared_ptr<ErrorMsg> mkCopy(const ErrorMsg &orig);
+	static std::shared_ptr<ErrorMsg> mkCopy(const Erref &orig);
+
+	// Construct an empty message, with the memory for both the object
+	// and the shared_ptr control block taken from the per-thread pool
+	// in one piece. Unless ERRORMSG_NO_POOL is defined, in which case
+	// it's the same as make_shared.
+	static std::shared_ptr<ErrorMsg> mkNew(
+		__in const Source *source,
+		__in DWORD code
+	);
+
+	// Construct by printing an arbitrary non-localized message.
+	// The formatting is deferred until the text is actually needed,
+	// only the arguments get copied, so the format string must be
+	// static (normally, a literal).
+	// source - identity of the source
+	// code - the error code
+	// fmt - the printf-like format string
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkString(
+		__in const Source *source,
+		__in DWORD code,
+		_In_z_ _Printf_format_string_ const WCHAR *fmt,
+		...);
+	// Construct by printing an arbitrary non-localized message with variable args.
+	// source - identity of the source
+	// code - the error code
+	// fmt - the printf-like format string
+	// args - the printf-like variable arguments
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkStringVa(
+		__in const Source *source,
+		__in DWORD code,
+		_In_z_ const WCHAR *fmt,
+		__in va_list args
+	);
+
+	// Construct by printing the explanation of a system error.
+	// The text gets looked up only when it's actually needed.
+	// code - the NT error code
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> mkSystem(
+		__in DWORD code
+	);
+
+	// Construct by printing the explanation of a stdio error.
+	// code - the stdio error code
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> mkErrno(
+		__in DWORD code // not a Windows arror but an errno!
+	);
+	// Calls _get_errno() to get the value.
+	static std::shared_ptr<ErrorMsg> mkErrno();
+
+	// Construct an error by printing a non-localized error message,
+	// and chaining another error with the system error message
+	// that caused the application-level error.
+	// Both messages are formatted lazily, as in mkString() and mkSystem().
+	// sysCode - code of the underlying system error
+	// source - identity of the source of the application error
+	// appCode - the application-level error code
+	// fmt - the printf-like format string
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkSystem(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		_In_z_ _Printf_format_string_ const WCHAR *fmt,
+		...);
+	// sysCode - code of the underlying system error
+	// source - identity of the source of the application error
+	// appCode - the application-level error code
+	// fmt - the printf-like format string
+	// args - the printf-like variable arguments
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkSystemVa(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		_In_z_ const WCHAR *fmt,
+		__in va_list args
+	);
+
+	// Constuct an error by printing a MUI-localized error message.
+	// source - identity of the source
+	// code - the error code
+	// ... - arguments for the format string specified in MUI
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkMui(
+		__in const Source *source, // must be a MUI source
+		__in DWORD code,
+		... // Arguments for the format specified in MUI
+	);
+	// source - identity of the source
+	// code - the error code
+	// args - variable arguments for the format string specified in MUI
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkMuiVa(
+		__in const Source *source, // must be a MUI source
+		__in DWORD code,
+		__in va_list args // Arguments for the format specified in MUI
+	);
+
+	// Construct a MUI error originating from a system error.
+	// The system message gets chained to the MUI message.
+	// sysCode - code of the underlying system error
+	// source - identity of the source of the application error
+	// appCode - the application-level error code
+	// ... - arguments for the format string specified in MUI
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkMuiSystem(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		...);
+	// sysCode - code of the underlying system error
+	// source - identity of the source of the application error
+	// appCode - the application-level error code
+	// args - arguments for the format string specified in MUI
+	// Returns the new ErrorMsg object.
+	static std::shared_ptr<ErrorMsg> __cdecl mkMuiSystemVa(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		__in va_list args
+	);
+
+	// The typed versions of the factories. The compiler prefers them over
+	// the C varargs versions whenever there are any arguments after
+	// the format. The arguments get copied by their C++ types, and
+	// the format gets checked against their types at run time, by the
+	// same FormatCheck that ERRMSG_STRING() and ERRMSG_SYSTEM() apply at
+	// compile time. On a mismatch, an internal error gets chained to
+	// the result, and the rendering marks the bad arguments. The macros
+	// are preferred, since they don't pay for parsing the format at
+	// run time.
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkString(
+		__in const Source *source,
+		__in DWORD code,
+		_In_z_ const WCHAR *fmt,
+		__in const Args &... args)
+	{
+		return checkFormat(mkStringPrechecked(source, code, fmt, args...),
+			FormatCheck::matches(fmt, (FormatCheck::TypeList<Args...> *)nullptr));
+	}
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkSystem(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		_In_z_ const WCHAR *fmt,
+		__in const Args &... args)
+	{
+		return checkFormat(mkSystemPrechecked(sysCode, source, appCode, fmt, args...),
+			FormatCheck::matches(fmt, (FormatCheck::TypeList<Args...> *)nullptr));
+	}
+	// The same without the check at run time, for ERRMSG_STRING() and
+	// ERRMSG_SYSTEM(), that have done it at compile time.
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkStringPrechecked(
+		__in const Source *source,
+		__in DWORD code,
+		_In_z_ const WCHAR *fmt,
+		__in const Args &... args)
+	{
+		std::shared_ptr<ErrorMsg> err = mkNew(source, code);
+		err->args_.addAll(args...);
+		err->setDeferred(MK_PRINTF, fmt);
+		return checkPlainSource(err);
+	}
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkSystemPrechecked(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		_In_z_ const WCHAR *fmt,
+		__in const Args &... args)
+	{
+		std::shared_ptr<ErrorMsg> err = mkNew(source, appCode);
+		err->args_.addAll(args...);
+		err->setDeferred(MK_PRINTF, fmt);
+		err->chain_ = mkSystem(sysCode);
+		return checkPlainSource(err);
+	}
+	// The insertion types of the MUI messages can't be checked at
+	// compile time, since the messages live in the resources, but
+	// at least the arguments get passed by their real types, and
+	// the formatting gets deferred.
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkMui(
+		__in const Source *source, // must be a MUI source
+		__in DWORD code,
+		__in const Args &... args)
+	{
+		static_assert(!anyFloat<Args...>(),
+			"the floating-point values are not supported in the MUI messages");
+		std::shared_ptr<ErrorMsg> err = mkNew(source, code);
+		if (!source->isMui())
+			return checkMuiSource(err);
+		err->args_.addAll(args...);
+		err->setDeferred(MK_MUI, NULL);
+		return err;
+	}
+	template <typename... Args>
+	static std::shared_ptr<ErrorMsg> mkMuiSystem(
+		__in DWORD sysCode,
+		__in const Source *source,
+		__in DWORD appCode,
+		__in const Args &... args)
+	{
+		Erref err = mkMui(source, appCode, args...);
+		err.splice(mkSystem(sysCode));
+		return err;
+	}
+
+	// Convert the whole error chain to a single printable string.
+	std::wstring toString();
+
+	// Convert the error chain to a printable string, up to the size limit.
+	// The rest of the chain that didn't fit within the limit will be returned
+	// and can be used for the next call, to get the next chunk.
+	// The break is always done on the message boundary. At least one
+	// message is always included, it might be longer than the limit.
+	// 
+	// limit - the size limit for the resulting string, in characters
+	//      (not bytes, if in Unicode then twice more bytes will be used)
+	// next - place to return the continuation (will point into the middle
+	//      of the original chain); if everything is converted then
+	//      next will be set to NULL
+	// Returns the converted string.
+	std::wstring toLimitedString(
+		__in size_t limit,
+		__out Erref &next);
+
+	// Get the error message in a human-readable format.
+	// If the formatting has been deferred, does it now.
+	// Safe to call from multiple threads.
+	const std::wstring &getMsg()
+	{
+		if (state_.load(std::memory_order_acquire) != MS_READY)
+			render();
+		return msg_;
+	}
+
+	// How the message text gets produced.
+	enum MsgKind {
+		MK_TEXT, // msg_ is filled directly
+		MK_PRINTF, // from fmt_ and args_
+		MK_SYSTEM, // from the system message for code_
+		MK_ERRNO, // from the errno text for code_
+		MK_MUI, // from the source's MUI message for code_ and args_
+	};
+
+	// Get the unformatted parts of the message, for the binary logs
+	// that leave the formatting to the reader (see BinaryLogger).
+	// kind - returns how the message text gets produced
+	// fmt - returns the format for MK_PRINTF
+	// dest - the arguments get appended here in the packed form
+	//      (see FormatArgs::pack())
+	// Returns true if the formatting is still deferred and the arguments
+	// got packed. Otherwise the arguments are gone, and the text must be
+	// taken from getMsg() (the kind still tells, where it came from).
+	bool packDeferred(
+		__out MsgKind &kind,
+		__out const WCHAR *&fmt,
+		__inout std::string &dest);
+
+	// Construct a message with the deferred formatting from the packed
+	// arguments, as read from a binary log. Nothing gets chained to it.
+	// source - identity of the source; for MK_MUI it must have
+	//      a catalog with the message
+	// code - the error code
+	// kind - MK_PRINTF or MK_MUI
+	// fmt - the format for MK_PRINTF, must stay alive as long as the message
+	// p - the packed arguments, gets advanced past them
+	// end - end of the data
+	// Returns NULL if the packed arguments are corrupted.
+	static std::shared_ptr<ErrorMsg> mkUnpacked(
+		__in const Source *source,
+		__in DWORD code,
+		__in MsgKind kind,
+		_In_opt_z_ const WCHAR *fmt,
+		__inout const uint8_t *&p,
+		__in const uint8_t *end);
+
+protected:
+	// The state of msg_.
+	enum MsgState {
+		MS_READY, // msg_ contains the text
+		MS_DEFERRED, // msg_ has not been formatted yet
+		MS_RENDERING, // some thread is formatting msg_ (or packing args_) right now
+	};
+
+	// Format the deferred message into msg_.
+	void render();
+
+	// Remember the format and arguments for the deferred formatting.
+	// If the arguments can't be captured, formats the message right away.
+	void setPrintf(
+		_In_z_ const WCHAR *fmt,
+		__in va_list args);
+
+	// Mark the message for the deferred formatting, with the
+	// arguments already placed into args_.
+	void setDeferred(
+		__in MsgKind kind,
+		_In_opt_z_ const WCHAR *fmt)
+	{
+		kind_ = kind;
+		fmt_ = fmt;
+		state_.store(MS_DEFERRED, std::memory_order_relaxed);
+	}
+
+	// If the source of a plain-text error is a MUI source,
+	// chain an internal error to it. Returns err.
+	static std::shared_ptr<ErrorMsg> checkPlainSource(
+		__in const std::shared_ptr<ErrorMsg> &err);
+
+	// For a MUI error from a source without MUI, chain
+	// an internal error to it. Returns err.
+	static std::shared_ptr<ErrorMsg> checkMuiSource(
+		__in const std::shared_ptr<ErrorMsg> &err);
+
+	// If the arguments of a typed factory didn't match the format,
+	// chain an internal error to the result. Returns err.
+	// matched - the result of FormatCheck::matches()
+	static std::shared_ptr<ErrorMsg> checkFormat(
+		__in const std::shared_ptr<ErrorMsg> &err,
+		__in bool matched);
+
+	// Check whether any of the types is floating-point.
+	template <typename... Args>
+	static constexpr bool anyFloat()
+	{
+		const bool flags[] = { false, std::is_floating_point<Args>::value... };
+		for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i)
+		{
+			if (flags[i])
+				return true;
+		}
+		return false;
+	}
+
+	// Drop the trailing \r and \n from the message.
+	static void stripNewlines(__inout std::wstring &msg);
+
+public:
+	const Source *source_; // The source of this error. NULL means "Windows NT errors."
+	DWORD code_; // The error code, convenient for the machine checking.
+	std::wstring msg_; // The error message in a human-readable format.
+		// May be not formatted yet, so it's better to read it through getMsg().
+	std::shared_ptr<ErrorMsg> chain_; // The chained error, or NULL.
+
+protected:
+	MsgKind kind_; // how msg_ gets produced
+	const WCHAR *fmt_; // the static format for MK_PRINTF
+	FormatArgs args_; // the arguments for MK_PRINTF
+	std::atomic<int> state_; // MsgState of msg_
+};
+
+// The stdio functions return their error codes as the C standard library errno,
+// with values different from the Windows errors. So here we go,
+// the special source for Errno messages.
+extern ErrorMsg::Source ErrnoSource;
+
+// A cache of the texts of the system and errno errors, since during
+// an outage the same few codes tend to get formatted over and over.
+// The lookups of the cached texts take no locks: the entries never
+// change or get removed, so the readers only need to load the pointers.
+// The entries live until the process exits, even past the destruction
+// of the cache, since the destructors of the other static objects and
+// the threads still running at the exit may be formatting the messages
+// through it. The number of entries is bounded, and when the cache is
+// full, the new codes just get looked up every time.
+//
+// The texts come from FormatMessage() and _wcserror_s() on Windows,
+// and from strerror_r() elsewhere (where both kinds of codes are
+// treated as errno values).
+class SystemTextCache
+{
+public:
+	// The kinds of the codes.
+	enum Kind {
+		SK_SYSTEM, // a Windows system error
+		SK_ERRNO, // an errno value
+	};
+
+	enum {
+		CAPACITY = 256, // the limit on the number of entries
+		SLOTS = 512, // the size of the hash table, a power of 2
+		PROBE_LIMIT = 8, // the number of slots to try for a code
+		COUNTER_SHARDS = 16, // the copies of the counters, a power of 2
+	};
+
+	struct Stats {
+	public:
+		uint64_t hits_; // the number of lookups served from the cache
+		uint64_t misses_; // the number of lookups that went to the system
+		size_t entries_; // the number of cached codes
+	};
+
+	// No constructor: the zeroed static storage is the initial state,
+	// so the cache works even for the constructors of the other
+	// static objects. No destructor either: the entries are never freed.
+
+	// Get the text of an error.
+	// Returns false if the text was not found, then dest gets
+	// a placeholder text.
+	bool get(
+		__in Kind kind,
+		__in DWORD code,
+		__out std::wstring &dest);
+
+	void getStats(__out Stats &st) const;
+
+protected:
+	struct Entry {
+	public:
+		uint64_t key_;
+		std::wstring text_;
+	};
+
+	static uint64_t mkKey(
+		__in Kind kind,
+		__in DWORD code)
+	{
+		return ((uint64_t)kind << 32) | code;
+	}
+
+	static size_t hash(
+		__in uint64_t key)
+	{
+		return (size_t)((key * 0x9E3779B97F4A7C15ull) >> 40);
+	}
+
+	// Remember the text. Does nothing if the cache is full or
+	// another thread has already added the same code.
+	void insert(
+		__in uint64_t key,
+		__in const std::wstring &text);
+
+	// Get the text from the system.
+	static bool lookup(
+		__in Kind kind,
+		__in DWORD code,
+		__out std::wstring &dest);
+
+	// The counters, each on its own cache line. A thread always
+	// updates the same shard, so the threads that keep hitting
+	// the cache don't bounce one line between them.
+	struct alignas(64) CounterShard {
+	public:
+		std::atomic<uint64_t> hits_;
+		std::atomic<uint64_t> misses_;
+	};
+
+	// The shard of the counters for the current thread.
+	CounterShard &counters();
+
+	std::atomic<Entry *> slots_[SLOTS];
+	std::atomic<int> count_; // the number of entries in the table
+	// The counters get updated with relaxed increments,
+	// getStats() sums them up.
+	CounterShard counters_[COUNTER_SHARDS];
+};
+
+// The cache used by ErrorMsg.
+extern SystemTextCache systemTextCache;
+
+///////////////////////// Erref methods /////////////////////////////////////////
+
+// Check whether there is an error referenced.
+inline bool Erref::hasError()
+{
+	ErrorMsg *msg = get();
+	return (msg != NULL && msg->code_ != ERROR_SUCCESS);
+}
+
+// Get the error code, if any (or return ERROR_SUCCESS on on error).
+inline DWORD Erref::getCode()
+{
+	ErrorMsg *msg = get();
+	if (msg == NULL)
+		return ERROR_SUCCESS; // no error
+	return msg->code_;
+}
+
+// Get the chained error. Returns NULL if either the chained error
+// is not present, or this reference is NULL.
+inline Erref Erref::getChain()
+{
+	ErrorMsg *msg = get();
+	if (msg == NULL)
+		return (Erref)0; // no error
+	return msg->chain_;
+}
+
+// Get the error code of the chained error, if any (or return ERROR_SUCCESS on on error).
+inline DWORD Erref::getChainCode()
+{
+	ErrorMsg *msg = get();
+	if (msg == NULL)
+		return ERROR_SUCCESS; // no error
+	msg = msg->chain_.get();
+	if (msg == NULL)
+		return ERROR_SUCCESS; // no error
+	return msg->code_;
+}
+
@@ -0,0 +1,86 @@
+#include "pch.h"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <locale.h>
+#endif
+
+/**
+ *  LogDecode: converts a binary log written by BinaryLogger
+ *  into the same text as FileLogger would have written.
+ */
+
+static ErrorMsg::Source LogDecodeErrorSource(L"LogDecode", NULL);
+
+// Write out the collected text when it grows to this size, in bytes.
+enum { OUTPUT_BLOCK_SIZE = 64 * 1024 };
+
+/**
+ * Main Entry Point
+ */
+int __cdecl wmain(
+	__in long argc,
+	__in_ecount(argc) PWSTR argv[]
+)
+{
+	shared_ptr<Logger> logger = make_shared<StdoutLogger>(Logger::SV_DEBUG);
+
+	if (argc != 2)
+	{
+		logger->logAndExitOnError(ERRMSG_STRING(LogDecodeErrorSource, 1,
+			L"Usage: LogDecode binary-log-file\n"
+			L"The decoded text gets written to stdout in UTF-8."),
+			LogEntity::NONE);
+	}
+
+#ifdef _WIN32
+	// the text is already in UTF-8 with \n line endings
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	BinaryLogReader reader(argv[1]);
+	BinaryLogReader::Record rec;
+	std::string text;
+	text.reserve(OUTPUT_BLOCK_SIZE + OUTPUT_BLOCK_SIZE / 4);
+	while (reader.next(rec))
+	{
+		BinaryLogReader::formatRecord(text, rec);
+		if (text.size() >= OUTPUT_BLOCK_SIZE)
+		{
+			fwrite(text.data(), 1, text.size(), stdout);
+			text.clear();
+		}
+	}
+	fwrite(text.data(), 1, text.size(), stdout);
+	fflush(stdout);
+
+	// the records before a corrupted place are still good
+	logger->logAndExitOnError(reader.error(), LogEntity::NONE);
+	return 0;
+}
+
+#ifndef _WIN32
+// The POSIX entry point converts the arguments to the wide form,
+// by the current locale, the reverse of narrowPath().
+int main(
+	__in int argc,
+	__in_ecount(argc) char *argv[]
+)
+{
+	setlocale(LC_ALL, "");
+	std::vector<std::wstring> wargs(argc);
+	std::vector<PWSTR> wargv(argc + 1);
+	for (int i = 0; i < argc; ++i)
+	{
+		size_t len = mbstowcs(NULL, argv[i], 0);
+		if (len != (size_t)-1)
+		{
+			wargs[i].resize(len);
+			mbstowcs(&wargs[i][0], argv[i], len);
+		}
+		wargv[i] = &wargs[i][0];
+	}
+	return wmain(argc, &wargv[0]);
+}
+#endif
@@ -1,357 +1,3659 @@
-#include "pch.h"
-
-static ErrorMsg::MuiSource LogErrorSource(L"Service", NULL);
-
-// -------------------- Logger ---------------------------------
-
-Logger::~Logger()
-{
-}
-
-void Logger::poll()
-{
-}
-
-void Logger::logAndExitOnError(
-	__in Erref err,
-	__in_opt std::shared_ptr<LogEntity> entity
-)
-{
-	if (!err)
-		return;
-	if (this != NULL) 
-	{
-		log(err, Severity::SV_ERROR, entity);
-	}
-	else 
-	{
-		wprintf(L"%ls", err->toString().c_str());
-	}
-	exit(1);
-}
-
-void Logger::setMinSeverity(Severity sv)
-{
-	minSeverity_ = sv;
-}
-
-WCHAR Logger::oneLetterSeverity(Severity sv)
-{
-	switch (sv) 
-	{
-		case SV_DEBUG:
-			return L'D';
-		case SV_VERBOSE:
-			return L'V';
-		case SV_INFO:
-			return L'I';
-		case SV_WARNING:
-			return L'W';
-		case SV_ERROR:
-			return L'E';
-	}
-	return L'?';
-}
-
-const WCHAR *Logger::strSeverity(Severity sv)
-{
-	switch (sv) {
-		case SV_DEBUG:
-			return L"DEBUG";
-		case SV_VERBOSE:
-			return L"VERBOSE";
-		case SV_INFO:
-			return L"INFO";
-		case SV_WARNING:
-			return L"WARNING";
-		case SV_ERROR:
-			return L"ERROR";
-	}
-	return NULL;
-}
-
-Logger::Severity Logger::severityFromName(const std::wstring &svname)
-{
-	if (svname.empty())
-		return SV_NEVER;
-	// just look at the first letter
-	switch (towlower(svname[0])) 
-	{
-		case 'd':
-			return SV_DEBUG;
-		case 'v':
-			return SV_VERBOSE;
-		case 'i':
-			return SV_INFO;
-		case 'w':
-			return SV_WARNING;
-		case 'e':
-			return SV_ERROR;
-	};
-	return SV_NEVER;
-}
-
-std::wstring Logger::listAllSeverities()
-{
-	std::wstring result;
-
-	for (int sv = 0; sv < (int)SV_NEVER; ++sv) 
-	{
-		strListSep(result);
-		result.append(strSeverity((Severity)sv));
-	}
-
-	return result;
-}
-
-/**
- *  EtwLogger
- */
-
-EtwLogger::EtwLogger(
-	LPCGUID guid,
-	_In_ Severity minSeverity
-) :
-	Logger(minSeverity),
-	guidName_(strFromGuid(*guid)), h_(NULL),
-	origMinSeverity_(minSeverity), enabled_(false)
-{
-	NTSTATUS status = EventRegister(guid, &callback, this, &h_);
-	if (status != STATUS_SUCCESS) {
-		err_ = LogErrorSource.mkMuiSystem(status, EPEM_LOG_EVENT_REGISTER_FAIL,
-			guidName_.c_str());
-		return;
-	}
-}
-
-EtwLogger::~EtwLogger()
-{
-	close();
-}
-
-void EtwLogger::close()
-{
-	ScopeCritical sc(cr_);
-
-	if (h_ == NULL)
-		return;
-
-	NTSTATUS status = EventUnregister(h_);
-	if (status != STATUS_SUCCESS) 
-	{
-		Erref newerr = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_EVENT_UNREGISTER_FAIL, guidName_.c_str());
-		err_.append(newerr);
-	}
-	h_ = NULL;
-	enabled_ = false;
-}
-
-void EtwLogger::logBody(
-	__in Erref err,
-	__in Severity sev,
-	__in_opt std::shared_ptr<LogEntity> entity
-)
-{
-	ScopeCritical sc(cr_);
-
-	if (sev < minSeverity_ || h_ == NULL)
-		return;
-
-	if (enabled_)
-	{
-		// The backlog cannot be written from the callback when
-		// the logger gets enabled, so write on the next message.
-		processBacklogL();
-		logBodyInternalL(err, sev, entity);
-	}
-	else 
-	{
-		backlog_.push_back(BacklogEntry(err, sev, entity));
-		while (backlog_.size() > BACKLOG_LIMIT)
-			backlog_.pop_front();
-	}
-}
-
-void EtwLogger::poll()
-{
-	ScopeCritical sc(cr_);
-
-	if (h_ == NULL || !enabled_)
-		return;
-
-	processBacklogL();
-}
-
-void EtwLogger::processBacklogL()
-{
-	while (!backlog_.empty()) 
-	{
-		if (h_ != NULL) 
-		{
-			BacklogEntry &entry = backlog_.front();
-			logBodyInternalL(entry.err_, entry.sev_, entry.entity_);
-		}
-		backlog_.pop_front();
-	}
-}
-
-void EtwLogger::logBodyInternalL(
-	__in Erref err,
-	__in Severity sev,
-	__in_opt std::shared_ptr<LogEntity> entity
-)
-{
-	const wchar_t *entname = L"[general]";
-	if (entity && !entity->name_.empty())
-		entname = entity->name_.c_str();
-
-	PCEVENT_DESCRIPTOR event;
-
-	switch (sev) 
-	{
-	case SV_ERROR:
-		event = &ETWMSG_LOG_INST_ERROR2;
-		break;
-	case SV_WARNING:
-		event = &ETWMSG_LOG_INST_WARNING2;
-		break;
-	default:
-		// The .man validation doesn't allow to use any other levels for the
-		// Admin messages, so just sweep everything else into INFO.
-		// Theoretically, VERBOSE and DEBUG can be placed into a separate
-		// channel but doing it well will require more thinking.
-		event = &ETWMSG_LOG_INST_INFO2;
-		break;
-	}
-
-	wstring text;
-	Erref cur, next;
-	for (cur = err; cur; cur = next) 
-	{
-		text.clear();
-		text.push_back(oneLetterSeverity(sev));
-		text.push_back(L' ');
-		if (next) 
-		{
-			text.append(L"(continued)\n  ");
-		}
-		text.append(cur->toLimitedString(STRING_LIMIT, next));
-
-		uint32_t intval[MSG_FIELD_LIMIT];
-		EVENT_DATA_DESCRIPTOR ddesc[MSG_FIELD_LIMIT];
-		int fcount = 0;
-
-		EventDataDescCreate(ddesc + fcount, text.c_str(), (ULONG)(sizeof(WCHAR) * (text.size() + 1)));
-		++fcount;
-
-		intval[fcount] = (err.getCode() & 0x3FFFFFFF);
-		EventDataDescCreate(ddesc + fcount, intval + fcount, (ULONG)(sizeof(uint32_t)));
-		++fcount;
-
-		// build the message array
-		uint32_t *szptr = intval + fcount;
-		*szptr = 0; // the value will be updated as the array gets built
-		EventDataDescCreate(ddesc + fcount, intval + fcount, (ULONG)(sizeof(uint32_t)));
-		++fcount;
-
-		// can the whole array be placed in a single ddesc instead?
-		for (Erref eit = cur; eit != next && fcount < MSG_FIELD_LIMIT; eit = eit->chain_) 
-		{
-			intval[fcount] = (eit.getCode() & 0x3FFFFFFF);
-			EventDataDescCreate(ddesc + fcount, intval + fcount, (ULONG)(sizeof(uint32_t)));
-			++fcount;
-			++*szptr;
-		}
-
-		NTSTATUS status = EventWrite(h_, event, fcount, ddesc);
-
-		switch (status) 
-		{
-		case STATUS_SUCCESS:
-			break;
-		case ERROR_ARITHMETIC_OVERFLOW:
-		case ERROR_MORE_DATA:
-		case ERROR_NOT_ENOUGH_MEMORY:
-		case STATUS_LOG_FILE_FULL:
-			// TODO: some better reporting of these non-fatal errors
-			break;
-		default:
-			Erref newerr = LogErrorSource.mkMuiSystem(status, EPEM_LOG_EVENT_WRITE_FAIL, guidName_.c_str());
-			err_.append(newerr);
-			close(); // and give up
-			return;
-		}
-	}
-}
-
-void NTAPI EtwLogger::callback(
-	_In_ LPCGUID sourceId,
-	_In_ ULONG isEnabled,
-	_In_ UCHAR level,
-	_In_ ULONGLONG matchAnyKeyword,
-	_In_ ULONGLONG matchAllKeywords,
-	_In_opt_ PEVENT_FILTER_DESCRIPTOR filterData,
-	_In_opt_ PVOID context
-)
-{
-	EtwLogger *logger = (EtwLogger *)context;
-	if (logger == NULL)
-		return;
-
-	ScopeCritical sc(logger->cr_);
-
-	switch (isEnabled)
-	{
-	case EVENT_CONTROL_CODE_DISABLE_PROVIDER:
-		logger->enabled_ = false;
-		logger->minSeverity_ = SV_NEVER;
-		break;
-	case EVENT_CONTROL_CODE_ENABLE_PROVIDER:
-		logger->enabled_ = true;
-		switch (level) {
-		case TRACE_LEVEL_CRITICAL:
-		case TRACE_LEVEL_ERROR:
-			logger->minSeverity_ = SV_ERROR;
-			break;
-		case TRACE_LEVEL_WARNING:
-			logger->minSeverity_ = SV_WARNING;
-			break;
-		case TRACE_LEVEL_INFORMATION:
-			logger->minSeverity_ = SV_INFO;
-			break;
-		case TRACE_LEVEL_VERBOSE:
-			logger->minSeverity_ = SV_VERBOSE;
-			break;
-		default: // the level value may be any, up to 255
-			logger->minSeverity_ = SV_DEBUG;
-			break;
-		}
-		if ((int)logger->origMinSeverity_ > (int)logger->minSeverity_)
-			logger->minSeverity_ = logger->origMinSeverity_;
-		break;
-	default:
-		// do nothing
-		break;
-	}
-}
-
-/**
- *  StdoutLogger
- */
-
-StdoutLogger::~StdoutLogger()
-{
-
-}
-
-// The internal implementation of log()
-// This function must be internally synchronized, since it will
-// be called from multiple threads. Implemented in subclasses.
-void StdoutLogger::logBody(
-    __in Erref err,
-    __in Severity sev,
-    __in_opt std::shared_ptr<LogEntity> entity)
-{
-
-}
-
+#include "pch.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#endif
+
+static ErrorMsg::MuiSource LogErrorSource(L"Service", NULL);
+
+// -------------------- LogEntity ------------------------------
+
+// The registry behind LogEntity. The entries get placed into the chunks
+// that never move, so that the lookup by ID needs no locks, only the
+// registration does. The registry is created on the first use, so that
+// the entities can be registered from the static initializers.
+
+class LogEntityRegistry
+{
+public:
+	enum {
+		CHUNK_SIZE = 256, // entries per chunk
+		CHUNK_COUNT = LogEntity::LIMIT / CHUNK_SIZE,
+	};
+
+	// A registered entity.
+	struct Entry {
+	public:
+		Entry(
+			__in const std::wstring &name,
+			__in ULONGLONG keywords
+		) :
+			name_(name), keywords_(keywords)
+		{
+		}
+
+		std::wstring name_;
+		ULONGLONG keywords_;
+	};
+
+	static LogEntityRegistry &instance()
+	{
+		static LogEntityRegistry registry;
+		return registry;
+	}
+
+	LogEntityRegistry() :
+		next_(LogEntity::NONE + 1)
+	{
+		for (size_t i = 0; i < CHUNK_COUNT; ++i)
+			chunks_[i].store(NULL, std::memory_order_relaxed);
+	}
+
+	LogEntity::Id intern(
+		__in const std::wstring &name,
+		__in ULONGLONG keywords);
+
+	// Returns NULL for an unknown ID.
+	const Entry *find(
+		__in LogEntity::Id id)
+	{
+		if (id >= LogEntity::LIMIT)
+			return NULL;
+		Chunk *chunk = chunks_[id / CHUNK_SIZE].load(std::memory_order_acquire);
+		if (chunk == NULL)
+			return NULL;
+		return chunk->entries_[id % CHUNK_SIZE].load(std::memory_order_acquire);
+	}
+
+protected:
+	struct Chunk {
+	public:
+		Chunk()
+		{
+			for (size_t i = 0; i < CHUNK_SIZE; ++i)
+				entries_[i].store(NULL, std::memory_order_relaxed);
+		}
+
+		std::atomic<const Entry *> entries_[CHUNK_SIZE];
+	};
+
+	Critical cr_; // synchronizes the registration
+	std::unordered_map<std::wstring, LogEntity::Id> ids_; // the registered names
+	LogEntity::Id next_; // the next ID to allocate
+	std::atomic<Chunk *> chunks_[CHUNK_COUNT]; // the entries by ID,
+		// never freed since the other threads may be using them
+};
+
+LogEntity::Id LogEntityRegistry::intern(
+	__in const std::wstring &name,
+	__in ULONGLONG keywords)
+{
+	ScopeCritical sc(cr_);
+
+	std::unordered_map<std::wstring, LogEntity::Id>::iterator it = ids_.find(name);
+	if (it != ids_.end())
+		return it->second;
+
+	if (next_ >= LogEntity::LIMIT)
+		return LogEntity::NONE;
+
+	LogEntity::Id id = next_++;
+	std::atomic<Chunk *> &slot = chunks_[id / CHUNK_SIZE];
+	Chunk *chunk = slot.load(std::memory_order_relaxed);
+	if (chunk == NULL)
+	{
+		chunk = new Chunk;
+		slot.store(chunk, std::memory_order_release);
+	}
+	chunk->entries_[id % CHUNK_SIZE].store(new Entry(name, keywords), std::memory_order_release);
+
+	ids_[name] = id;
+	return id;
+}
+
+LogEntity::Id LogEntity::intern(
+	__in const std::wstring &name,
+	__in ULONGLONG keywords)
+{
+	return LogEntityRegistry::instance().intern(name, keywords);
+}
+
+const std::wstring *LogEntity::name(
+	__in Id id)
+{
+	const LogEntityRegistry::Entry *entry = LogEntityRegistry::instance().find(id);
+	return entry == NULL ? NULL : &entry->name_;
+}
+
+ULONGLONG LogEntity::keywords(
+	__in Id id)
+{
+	const LogEntityRegistry::Entry *entry = LogEntityRegistry::instance().find(id);
+	return entry == NULL ? 0 : entry->keywords_;
+}
+
+// -------------------- StateSources ---------------------------
+
+StateSource::~StateSource()
+{
+}
+
+// The registry behind StateSources. The sources get called on a copy
+// of the list, without holding the lock, since they may log and take
+// the loggers' locks, and the loggers register and unregister under
+// theirs. Instead the copies of the snapshots in progress are listed,
+// and remove() waits for the ones that have the source, so that
+// a source can't go away in the middle.
+// The registry is created on the first use, so that the sources can be
+// registered from the static initializers.
+
+class StateSourceRegistry
+{
+public:
+	// How long remove() sleeps between the checks for the snapshots
+	// in progress, in milliseconds.
+	enum { WAIT_MS = 1 };
+
+	static StateSourceRegistry &instance()
+	{
+		static StateSourceRegistry registry;
+		return registry;
+	}
+
+	// Check whether a snapshot in progress may still call the source.
+	// The caller must hold cr_.
+	bool capturingL(
+		__in StateSource *source)
+	{
+		for (size_t i = 0; i < active_.size(); ++i)
+		{
+			if (std::find(active_[i]->begin(), active_[i]->end(), source) != active_[i]->end())
+				return true;
+		}
+		return false;
+	}
+
+	Critical cr_; // synchronizes the object
+	std::vector<StateSource *> sources_;
+	std::vector<const std::vector<StateSource *> *> active_; // the copies
+		// of sources_ taken by the snapshots in progress
+};
+
+void StateSources::add(
+	__in StateSource *source)
+{
+	StateSourceRegistry &reg = StateSourceRegistry::instance();
+	ScopeCritical sc(reg.cr_);
+	reg.sources_.push_back(source);
+}
+
+void StateSources::remove(
+	__in StateSource *source)
+{
+	StateSourceRegistry &reg = StateSourceRegistry::instance();
+	{
+		ScopeCritical sc(reg.cr_);
+		std::vector<StateSource *>::iterator it =
+			std::find(reg.sources_.begin(), reg.sources_.end(), source);
+		if (it == reg.sources_.end())
+			return;
+		reg.sources_.erase(it);
+	}
+
+	// The snapshots started from now on don't see the source, but
+	// the ones in progress may be still calling it. The snapshots are
+	// rare, so polling is good enough.
+	for (;;)
+	{
+		{
+			ScopeCritical sc(reg.cr_);
+			if (!reg.capturingL(source))
+				return;
+		}
+		Sleep(StateSourceRegistry::WAIT_MS);
+	}
+}
+
+void StateSources::capture(
+	__out std::vector<Erref> &states)
+{
+	states.clear();
+
+	StateSourceRegistry &reg = StateSourceRegistry::instance();
+	std::vector<StateSource *> sources;
+	{
+		ScopeCritical sc(reg.cr_);
+		sources = reg.sources_;
+		reg.active_.push_back(&sources);
+	}
+
+	for (size_t i = 0; i < sources.size(); ++i)
+	{
+		Erref state = sources[i]->captureState();
+		if (state)
+			states.push_back(state);
+	}
+
+	ScopeCritical sc(reg.cr_);
+	reg.active_.erase(std::find(reg.active_.begin(), reg.active_.end(), &sources));
+}
+
+void StateSources::capture(
+	__in Logger *logger)
+{
+	if (logger == NULL)
+		return;
+
+	std::vector<Erref> states;
+	capture(states);
+	for (size_t i = 0; i < states.size(); ++i)
+		logger->log(states[i], Logger::SV_INFO, LogEntity::NONE);
+}
+
+// -------------------- Logger ---------------------------------
+
+Logger::~Logger()
+{
+}
+
+void Logger::poll()
+{
+}
+
+void Logger::logAndExitOnError(
+	__in Erref err,
+	__in LogEntity::Id entity
+)
+{
+	if (!err)
+		return;
+	log(err, Severity::SV_ERROR, entity);
+	exit(1);
+}
+
+void Logger::setMinSeverity(Severity sv)
+{
+	minSeverity_.store(sv, std::memory_order_relaxed);
+}
+
+WCHAR Logger::oneLetterSeverity(Severity sv)
+{
+	switch (sv) 
+	{
+		case SV_DEBUG:
+			return L'D';
+		case SV_VERBOSE:
+			return L'V';
+		case SV_INFO:
+			return L'I';
+		case SV_WARNING:
+			return L'W';
+		case SV_ERROR:
+			return L'E';
+	}
+	return L'?';
+}
+
+const WCHAR *Logger::strSeverity(Severity sv)
+{
+	switch (sv) {
+		case SV_DEBUG:
+			return L"DEBUG";
+		case SV_VERBOSE:
+			return L"VERBOSE";
+		case SV_INFO:
+			return L"INFO";
+		case SV_WARNING:
+			return L"WARNING";
+		case SV_ERROR:
+			return L"ERROR";
+	}
+	return NULL;
+}
+
+Logger::Severity Logger::severityFromName(const std::wstring &svname)
+{
+	if (svname.empty())
+		return SV_NEVER;
+	// just look at the first letter
+	switch (towlower(svname[0])) 
+	{
+		case 'd':
+			return SV_DEBUG;
+		case 'v':
+			return SV_VERBOSE;
+		case 'i':
+			return SV_INFO;
+		case 'w':
+			return SV_WARNING;
+		case 'e':
+			return SV_ERROR;
+	};
+	return SV_NEVER;
+}
+
+std::wstring Logger::listAllSeverities()
+{
+	std::wstring result;
+
+	for (int sv = 0; sv < (int)SV_NEVER; ++sv) 
+	{
+		strListSep(result);
+		result.append(strSeverity((Severity)sv));
+	}
+
+	return result;
+}
+
+// Append a number in decimal, padded with zeroes to the width.
+static void appendPadded(
+	__inout std::string &dest,
+	__in unsigned val,
+	__in int width)
+{
+	char buf[10];
+	int len = 0;
+	do
+	{
+		buf[len++] = (char)('0' + val % 10);
+		val /= 10;
+	} while (val != 0 && len < (int)sizeof(buf));
+	for (int i = len; i < width; ++i)
+		dest.push_back('0');
+	while (len > 0)
+		dest.push_back(buf[--len]);
+}
+
+// Append the time as "YYYY-MM-DD hh:mm:ss.mmm ".
+static void appendTime(
+	__inout std::string &dest,
+	__in unsigned year,
+	__in unsigned month,
+	__in unsigned day,
+	__in unsigned hour,
+	__in unsigned minute,
+	__in unsigned second,
+	__in unsigned msec)
+{
+	appendPadded(dest, year, 4);
+	dest.push_back('-');
+	appendPadded(dest, month, 2);
+	dest.push_back('-');
+	appendPadded(dest, day, 2);
+	dest.push_back(' ');
+	appendPadded(dest, hour, 2);
+	dest.push_back(':');
+	appendPadded(dest, minute, 2);
+	dest.push_back(':');
+	appendPadded(dest, second, 2);
+	dest.push_back('.');
+	appendPadded(dest, msec, 3);
+	dest.push_back(' ');
+}
+
+// Append the part of a text record that follows the time.
+static void appendRecordBody(
+	__inout std::string &dest,
+	__in const Erref &err,
+	__in Logger::Severity sev,
+	__in_opt const std::wstring *entname)
+{
+	dest.push_back((char)Logger::oneLetterSeverity(sev));
+	dest.push_back(' ');
+	if (entname != NULL)
+	{
+		appendUtf8(dest, entname->data(), entname->size());
+		dest.append(": ");
+	}
+	// toString() ends every message with a \n
+	std::wstring text = err->toString();
+	appendUtf8(dest, text.data(), text.size());
+}
+
+void Logger::formatRecord(
+	__inout std::string &dest,
+	__in const Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+#ifdef _WIN32
+	SYSTEMTIME st;
+	GetLocalTime(&st);
+	appendTime(dest, st.wYear, st.wMonth, st.wDay,
+		st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	struct tm tm;
+	localtime_r(&ts.tv_sec, &tm);
+	appendTime(dest, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+		tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned)(ts.tv_nsec / 1000000));
+#endif
+	appendRecordBody(dest, err, sev, LogEntity::name(entity));
+}
+
+#ifndef _WIN32
+// The difference between the FILETIME and Unix epochs, in seconds.
+static const uint64_t FILETIME_UNIX_EPOCH = 11644473600ULL;
+#endif
+
+uint64_t Logger::recordTime()
+{
+#ifdef _WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	return ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec + FILETIME_UNIX_EPOCH) * 10000000
+		+ (uint64_t)ts.tv_nsec / 100;
+#endif
+}
+
+void Logger::formatRecordAt(
+	__inout std::string &dest,
+	__in const Erref &err,
+	__in Severity sev,
+	__in_opt const std::wstring *entname,
+	__in uint64_t time
+)
+{
+#ifdef _WIN32
+	FILETIME ft, lft;
+	ft.dwLowDateTime = (DWORD)time;
+	ft.dwHighDateTime = (DWORD)(time >> 32);
+	SYSTEMTIME st;
+	if (FileTimeToLocalFileTime(&ft, &lft) && FileTimeToSystemTime(&lft, &st))
+		appendTime(dest, st.wYear, st.wMonth, st.wDay,
+			st.wHour, st.wMinute, st.wSecond, st.wMilliseconds);
+	else
+		appendTime(dest, 0, 0, 0, 0, 0, 0, 0);
+#else
+	time_t sec = (time_t)(time / 10000000) - (time_t)FILETIME_UNIX_EPOCH;
+	struct tm tm;
+	if (localtime_r(&sec, &tm) != NULL)
+		appendTime(dest, tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned)(time % 10000000 / 10000));
+	else
+		appendTime(dest, 0, 0, 0, 0, 0, 0, 0);
+#endif
+	appendRecordBody(dest, err, sev, entname);
+}
+
+/**
+ *  EtwBatch
+ */
+
+// Append an integer in little-endian.
+static void appendLe(
+	__inout std::string &dest,
+	__in uint32_t val,
+	__in size_t bytes)
+{
+	char buf[4];
+	for (size_t i = 0; i < bytes; ++i, val >>= 8)
+		buf[i] = (char)(val & 0xFF);
+	dest.append(buf, bytes);
+}
+
+// Read an integer in little-endian from an unaligned location.
+static uint32_t readLe(
+	_In_reads_(bytes) const uint8_t *p,
+	__in size_t bytes)
+{
+	uint32_t val = 0;
+	for (size_t i = bytes; i > 0; --i)
+		val = (val << 8) | p[i - 1];
+	return val;
+}
+
+EtwBatch::EtwBatch() :
+	count_(0), maxSev_(Logger::SV_DEBUG)
+{
+}
+
+void EtwBatch::clear()
+{
+	data_.clear();
+	count_ = 0;
+	maxSev_ = Logger::SV_DEBUG;
+}
+
+bool EtwBatch::append(
+	__in Logger::Severity sev,
+	_In_reads_(ncodes) const uint32_t *codes,
+	__in size_t ncodes,
+	__in const std::wstring &text,
+	__in size_t limit)
+{
+	size_t oldSize = data_.size();
+	if (count_ == 0)
+	{
+		oldSize = 0;
+		data_.clear();
+		appendLe(data_, MAGIC, 4);
+		appendLe(data_, 0, 4); // the count gets filled below
+	}
+
+	if (ncodes > 0xFFFF)
+		ncodes = 0xFFFF;
+
+	appendLe(data_, (uint32_t)sev, 1);
+	appendLe(data_, 0, 1);
+	appendLe(data_, (uint32_t)ncodes, 2);
+	size_t lenPos = data_.size();
+	appendLe(data_, 0, 4); // the length gets filled below
+	for (size_t i = 0; i < ncodes; ++i)
+		appendLe(data_, codes[i], 4);
+	size_t textPos = data_.size();
+	appendAsUtf16(data_, text);
+
+	if (count_ != 0 && data_.size() > limit)
+	{
+		data_.resize(oldSize);
+		return false;
+	}
+
+	uint32_t len = (uint32_t)((data_.size() - textPos) / 2);
+	for (size_t i = 0; i < 4; ++i, len >>= 8)
+		data_[lenPos + i] = (char)(len & 0xFF);
+
+	++count_;
+	uint32_t cnt = count_;
+	for (size_t i = 0; i < 4; ++i, cnt >>= 8)
+		data_[4 + i] = (char)(cnt & 0xFF);
+
+	if (sev > maxSev_)
+		maxSev_ = sev;
+	return true;
+}
+
+bool EtwBatch::decode(
+	_In_reads_bytes_(size) const void *data,
+	__in size_t size,
+	__out std::vector<Record> &records)
+{
+	records.clear();
+
+	const uint8_t *p = (const uint8_t *)data;
+	const uint8_t *end = p + size;
+
+	if (size < HEADER_SIZE || readLe(p, 4) != MAGIC)
+		return false;
+	uint32_t count = readLe(p + 4, 4);
+	p += HEADER_SIZE;
+
+	for (; count > 0; --count)
+	{
+		if ((size_t)(end - p) < RECORD_HEADER_SIZE)
+			return false;
+		uint32_t sev = p[0];
+		size_t ncodes = readLe(p + 2, 2);
+		size_t len = readLe(p + 4, 4);
+		p += RECORD_HEADER_SIZE;
+
+		if (sev > Logger::SV_NEVER
+		|| (size_t)(end - p) / 4 < ncodes
+		|| (size_t)(end - p - 4 * ncodes) / 2 < len)
+			return false;
+
+		records.push_back(Record());
+		Record &rec = records.back();
+		rec.sev_ = (Logger::Severity)sev;
+		rec.codes_.resize(ncodes);
+		for (size_t i = 0; i < ncodes; ++i, p += 4)
+			rec.codes_[i] = readLe(p, 4);
+		appendUtf16(rec.text_, p, len);
+		p += 2 * len;
+	}
+
+	return p == end;
+}
+
+/**
+ *  EtwLogger
+ */
+
+EtwLogger::EtwLogger(
+	LPCGUID guid,
+	_In_ Severity minSeverity,
+	__in bool batch
+) :
+	Logger(minSeverity),
+	guidName_(strFromGuid(*guid)), h_(0),
+	origMinSeverity_(minSeverity),
+	backlog_(new BacklogEntry[BACKLOG_LIMIT]),
+	backlogHead_(0), backlogCount_(0), backlogDropped_(0),
+	replayWork_(NULL), enabled_(false), batching_(batch), batchKeywords_(0)
+{
+	// The work must exist before the callback may get called.
+	// If it can't be created, the backlog still gets replayed,
+	// only later, with the next message.
+	replayWork_ = CreateThreadpoolWork(&replayCallback, this, NULL);
+
+	NTSTATUS status = EventRegister(guid, &callback, this, &h_);
+	if (status != STATUS_SUCCESS) {
+		err_ = LogErrorSource.mkMuiSystem(status, EPEM_LOG_EVENT_REGISTER_FAIL,
+			guidName_.c_str());
+		return;
+	}
+}
+
+EtwLogger::~EtwLogger()
+{
+	close();
+	if (replayWork_ != NULL) {
+		WaitForThreadpoolWorkCallbacks(replayWork_, FALSE);
+		CloseThreadpoolWork(replayWork_);
+	}
+	delete[] backlog_;
+}
+
+void EtwLogger::close()
+{
+	ScopeCritical sc(cr_);
+
+	if (h_ == 0)
+		return;
+
+	if (!writeBatchL())
+		return; // already closed on the error
+
+	NTSTATUS status = EventUnregister(h_);
+	if (status != STATUS_SUCCESS) 
+	{
+		Erref newerr = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_EVENT_UNREGISTER_FAIL, guidName_.c_str());
+		err_.append(newerr);
+	}
+	h_ = 0;
+	enabled_ = false;
+}
+
+void EtwLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	// The keyword filter gets checked without taking the lock.
+	if (!allowsEntity(entity))
+		return;
+
+	// An overwritten entry gets moved here, to be destroyed
+	// after the lock is released.
+	Erref olderr;
+
+	ScopeCritical sc(cr_);
+
+	if (sev < minSeverity_.load(std::memory_order_relaxed) || h_ == 0)
+		return;
+
+	if (enabled_)
+	{
+		// The backlog is normally replayed by replayWork_, and the new
+		// messages don't wait for it. Only if there is no work item,
+		// the backlog gets written on the next message.
+		if (replayWork_ == NULL)
+			processBacklogL(BACKLOG_LIMIT);
+		logBodyInternalL(err, sev, entity);
+	}
+	else 
+	{
+		size_t idx;
+		if (backlogCount_ < BACKLOG_LIMIT) {
+			idx = (backlogHead_ + backlogCount_) & (BACKLOG_LIMIT - 1);
+			++backlogCount_;
+		} else {
+			// Overwrite the oldest entry.
+			idx = backlogHead_;
+			backlogHead_ = (backlogHead_ + 1) & (BACKLOG_LIMIT - 1);
+			++backlogDropped_;
+		}
+		BacklogEntry &entry = backlog_[idx];
+		olderr = entry.err_;
+		entry.err_ = err;
+		entry.sev_ = sev;
+		entry.entity_ = entity;
+	}
+}
+
+void EtwLogger::poll()
+{
+	// Replay in batches, letting the logging threads through
+	// in between.
+	for (;;) {
+		ScopeCritical sc(cr_);
+
+		if (h_ == 0 || !enabled_)
+			return;
+
+		if (!processBacklogL(REPLAY_BATCH)) {
+			writeBatchL();
+			return;
+		}
+	}
+}
+
+bool EtwLogger::processBacklogL(__in size_t limit)
+{
+	if (backlogDropped_ != 0 && h_ != 0)
+	{
+		Erref summary = LogErrorSource.mkMui(EPEM_LOG_BACKLOG_DROPPED,
+			backlogDropped_, guidName_.c_str());
+		backlogDropped_ = 0;
+		logBodyInternalL(summary, SV_WARNING, LogEntity::NONE);
+	}
+
+	for (; backlogCount_ != 0 && limit != 0; --limit)
+	{
+		BacklogEntry &entry = backlog_[backlogHead_];
+		Erref err = entry.err_;
+		entry.err_.reset();
+		backlogHead_ = (backlogHead_ + 1) & (BACKLOG_LIMIT - 1);
+		--backlogCount_;
+
+		if (h_ != 0 && entry.sev_ >= minSeverity_.load(std::memory_order_relaxed)
+		&& allowsEntity(entry.entity_))
+			logBodyInternalL(err, entry.sev_, entry.entity_);
+	}
+	return backlogCount_ != 0;
+}
+
+VOID CALLBACK EtwLogger::replayCallback(
+	_Inout_ PTP_CALLBACK_INSTANCE instance,
+	_Inout_opt_ PVOID context,
+	_Inout_ PTP_WORK work
+)
+{
+	EtwLogger *logger = (EtwLogger *)context;
+	if (logger != NULL)
+		logger->poll();
+}
+
+void EtwLogger::logBodyInternalL(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	const wchar_t *entname = L"[general]";
+	const std::wstring *name = LogEntity::name(entity);
+	if (name != NULL && !name->empty())
+		entname = name->c_str();
+
+	EVENT_DESCRIPTOR event;
+
+	switch (sev) 
+	{
+	case SV_ERROR:
+		event = ETWMSG_LOG_INST_ERROR2;
+		break;
+	case SV_WARNING:
+		event = ETWMSG_LOG_INST_WARNING2;
+		break;
+	default:
+		// The .man validation doesn't allow to use any other levels for the
+		// Admin messages, so just sweep everything else into INFO.
+		// Theoretically, VERBOSE and DEBUG can be placed into a separate
+		// channel but doing it well will require more thinking.
+		event = ETWMSG_LOG_INST_INFO2;
+		break;
+	}
+	// Let the session's keyword filter see the entity's keywords too.
+	ULONGLONG keywords = LogEntity::keywords(entity);
+	event.Keyword |= keywords;
+
+	Erref cur, next;
+	for (cur = err; cur; cur = next) 
+	{
+		text_.clear();
+		text_.push_back(oneLetterSeverity(sev));
+		text_.push_back(L' ');
+		if (next) 
+		{
+			text_.append(L"(continued)\n  ");
+		}
+		text_.append(cur->toLimitedString(STRING_LIMIT, next));
+
+		uint32_t codes[MSG_FIELD_LIMIT];
+		uint32_t ncodes = 0;
+		for (Erref eit = cur; eit != next && ncodes < MSG_FIELD_LIMIT; eit = eit->chain_) 
+			codes[ncodes++] = (eit.getCode() & 0x3FFFFFFF);
+
+		if (batching_)
+		{
+			if (!batch_.append(sev, codes, ncodes, text_, BATCH_LIMIT))
+			{
+				if (!writeBatchL())
+					return;
+				batch_.append(sev, codes, ncodes, text_, BATCH_LIMIT);
+			}
+			batchKeywords_ |= keywords;
+			continue;
+		}
+
+		uint32_t code = (err.getCode() & 0x3FFFFFFF);
+		EVENT_DATA_DESCRIPTOR ddesc[4];
+
+		EventDataDescCreate(ddesc + 0, text_.c_str(), (ULONG)(sizeof(WCHAR) * (text_.size() + 1)));
+		EventDataDescCreate(ddesc + 1, &code, (ULONG)(sizeof(uint32_t)));
+		// The array of codes goes as a single descriptor, the resulting
+		// payload is the same as with a descriptor per element.
+		EventDataDescCreate(ddesc + 2, &ncodes, (ULONG)(sizeof(uint32_t)));
+		EventDataDescCreate(ddesc + 3, codes, (ULONG)(sizeof(uint32_t) * ncodes));
+
+		if (!checkWriteL(EventWrite(h_, &event, 4, ddesc)))
+			return;
+	}
+
+	// The errors don't wait.
+	if (batching_ && sev >= SV_ERROR)
+		writeBatchL();
+}
+
+bool EtwLogger::writeBatchL()
+{
+	if (batch_.empty())
+		return true;
+
+	EVENT_DESCRIPTOR event = {};
+	event.Id = BATCH_EVENT_ID;
+	event.Keyword = batchKeywords_;
+	switch (batch_.maxSeverity())
+	{
+	case SV_ERROR:
+		event.Level = TRACE_LEVEL_ERROR;
+		break;
+	case SV_WARNING:
+		event.Level = TRACE_LEVEL_WARNING;
+		break;
+	default:
+		// same as with the single events
+		event.Level = TRACE_LEVEL_INFORMATION;
+		break;
+	}
+
+	EVENT_DATA_DESCRIPTOR ddesc;
+	EventDataDescCreate(&ddesc, batch_.data().data(), (ULONG)batch_.data().size());
+
+	ULONG status = EventWrite(h_, &event, 1, &ddesc);
+	batch_.clear();
+	batchKeywords_ = 0;
+	return checkWriteL(status);
+}
+
+void EtwLogger::writeStates()
+{
+	std::vector<Erref> states;
+	StateSources::capture(states);
+
+	ScopeCritical sc(cr_);
+
+	if (h_ == 0 || !enabled_)
+		return;
+
+	// The snapshot was requested explicitly, so it bypasses
+	// the keyword filter, and goes at the lowest severity that the
+	// session accepts, but not below SV_INFO, so that the session
+	// doesn't filter it out by the level.
+	Severity sev = minSeverity_.load(std::memory_order_relaxed);
+	if (sev < SV_INFO)
+		sev = SV_INFO;
+	for (size_t i = 0; i < states.size() && h_ != 0; ++i)
+		logBodyInternalL(states[i], sev, LogEntity::NONE);
+	if (h_ != 0)
+		writeBatchL();
+}
+
+bool EtwLogger::checkWriteL(__in ULONG status)
+{
+	switch (status) 
+	{
+	case STATUS_SUCCESS:
+		return true;
+	case ERROR_ARITHMETIC_OVERFLOW:
+	case ERROR_MORE_DATA:
+	case ERROR_NOT_ENOUGH_MEMORY:
+	case STATUS_LOG_FILE_FULL:
+		// TODO: some better reporting of these non-fatal errors
+		return true;
+	default:
+		Erref newerr = LogErrorSource.mkMuiSystem(status, EPEM_LOG_EVENT_WRITE_FAIL, guidName_.c_str());
+		err_.append(newerr);
+		close(); // and give up
+		return false;
+	}
+}
+
+void NTAPI EtwLogger::callback(
+	_In_ LPCGUID sourceId,
+	_In_ ULONG isEnabled,
+	_In_ UCHAR level,
+	_In_ ULONGLONG matchAnyKeyword,
+	_In_ ULONGLONG matchAllKeywords,
+	_In_opt_ PEVENT_FILTER_DESCRIPTOR filterData,
+	_In_opt_ PVOID context
+)
+{
+	EtwLogger *logger = (EtwLogger *)context;
+	if (logger == NULL)
+		return;
+
+	// The state sources may be logging on their own while holding
+	// their locks, so they must be called without holding cr_.
+	if (isEnabled == EVENT_CONTROL_CODE_CAPTURE_STATE)
+	{
+		logger->writeStates();
+		return;
+	}
+
+	ScopeCritical sc(logger->cr_);
+
+	switch (isEnabled)
+	{
+	case EVENT_CONTROL_CODE_DISABLE_PROVIDER:
+		logger->enabled_ = false;
+		logger->minSeverity_.store(SV_NEVER, std::memory_order_relaxed);
+		logger->keywords_.set(0, 0);
+		break;
+	case EVENT_CONTROL_CODE_ENABLE_PROVIDER: {
+		logger->enabled_ = true;
+		// Compute the severity first, so that the logging threads
+		// never see the intermediate value.
+		Severity sv;
+		switch (level) {
+		case TRACE_LEVEL_CRITICAL:
+		case TRACE_LEVEL_ERROR:
+			sv = SV_ERROR;
+			break;
+		case TRACE_LEVEL_WARNING:
+			sv = SV_WARNING;
+			break;
+		case TRACE_LEVEL_INFORMATION:
+			sv = SV_INFO;
+			break;
+		case TRACE_LEVEL_VERBOSE:
+			sv = SV_VERBOSE;
+			break;
+		default: // the level value may be any, up to 255
+			sv = SV_DEBUG;
+			break;
+		}
+		if ((int)logger->origMinSeverity_ > (int)sv)
+			sv = logger->origMinSeverity_;
+		logger->minSeverity_.store(sv, std::memory_order_relaxed);
+		// The filterData is not supported, the filtering is only by
+		// the level and the keywords of the entities.
+		logger->keywords_.set(matchAnyKeyword, matchAllKeywords);
+		// The backlog cannot be written from the callback,
+		// so hand it over to the thread pool. Checked under cr_,
+		// since the logging threads keep adding to it.
+		if (logger->replayWork_ != NULL && logger->hasBacklogL())
+			SubmitThreadpoolWork(logger->replayWork_);
+		break;
+	}
+	default:
+		// do nothing
+		break;
+	}
+}
+
+#ifndef _WIN32
+/**
+ *  EtwStandIn
+ */
+
+EtwStandIn etwStandIn;
+
+EtwStandIn::EtwStandIn() :
+	lastHandle_(0), count_(0), level_(0), keep_(true)
+{
+}
+
+void EtwStandIn::enable(
+	__in UCHAR level,
+	__in ULONGLONG matchAny,
+	__in ULONGLONG matchAll)
+{
+	{
+		ScopeCritical sc(cr_);
+		level_ = level;
+	}
+	notify(EVENT_CONTROL_CODE_ENABLE_PROVIDER, level, matchAny, matchAll);
+}
+
+void EtwStandIn::disable()
+{
+	{
+		ScopeCritical sc(cr_);
+		level_ = 0;
+	}
+	notify(EVENT_CONTROL_CODE_DISABLE_PROVIDER, 0, 0, 0);
+}
+
+void EtwStandIn::captureState()
+{
+	notify(EVENT_CONTROL_CODE_CAPTURE_STATE, 0, 0, 0);
+}
+
+void EtwStandIn::notify(
+	__in ULONG code,
+	__in UCHAR level,
+	__in ULONGLONG matchAny,
+	__in ULONGLONG matchAll)
+{
+	// The callbacks take the loggers' locks, and the loggers call
+	// write() under these locks, so call the callbacks on a copy.
+	std::vector<Provider> providers;
+	{
+		ScopeCritical sc(cr_);
+		providers = providers_;
+	}
+	for (size_t i = 0; i < providers.size(); ++i)
+	{
+		Provider &prov = providers[i];
+		if (prov.callback_ != NULL)
+			prov.callback_(&prov.guid_, code, level, matchAny, matchAll, NULL, prov.context_);
+	}
+}
+
+void EtwStandIn::keepEvents(__in bool keep)
+{
+	ScopeCritical sc(cr_);
+	keep_ = keep;
+}
+
+void EtwStandIn::takeEvents(__out std::vector<Event> &events)
+{
+	events.clear();
+	ScopeCritical sc(cr_);
+	events.swap(events_);
+}
+
+uint64_t EtwStandIn::count()
+{
+	ScopeCritical sc(cr_);
+	return count_;
+}
+
+ULONG EtwStandIn::registerProvider(
+	_In_ LPCGUID guid,
+	_In_opt_ PENABLECALLBACK callback,
+	_In_opt_ PVOID context,
+	__out REGHANDLE *h)
+{
+	ScopeCritical sc(cr_);
+
+	Provider prov;
+	prov.h_ = ++lastHandle_;
+	prov.guid_ = *guid;
+	prov.callback_ = callback;
+	prov.context_ = context;
+	providers_.push_back(prov);
+
+	*h = prov.h_;
+	return STATUS_SUCCESS;
+}
+
+ULONG EtwStandIn::unregisterProvider(
+	__in REGHANDLE h)
+{
+	ScopeCritical sc(cr_);
+
+	for (size_t i = 0; i < providers_.size(); ++i)
+	{
+		if (providers_[i].h_ == h)
+		{
+			providers_.erase(providers_.begin() + i);
+			return STATUS_SUCCESS;
+		}
+	}
+	return ERROR_INVALID_HANDLE;
+}
+
+ULONG EtwStandIn::write(
+	__in REGHANDLE h,
+	_In_ PCEVENT_DESCRIPTOR desc,
+	__in ULONG count,
+	_In_reads_opt_(count) PEVENT_DATA_DESCRIPTOR data)
+{
+	ScopeCritical sc(cr_);
+
+	// Like a session, drops the events above its level, except that
+	// level 0 means all of them.
+	if (level_ != 0 && desc->Level > level_)
+		return STATUS_SUCCESS;
+	++count_;
+	if (!keep_)
+		return STATUS_SUCCESS;
+
+	events_.push_back(Event());
+	Event &ev = events_.back();
+	ev.desc_ = *desc;
+	for (ULONG i = 0; i < count; ++i)
+		ev.data_.append((const char *)(uintptr_t)data[i].Ptr, data[i].Size);
+	return STATUS_SUCCESS;
+}
+
+ULONG EventRegister(
+	_In_ LPCGUID guid,
+	_In_opt_ PENABLECALLBACK callback,
+	_In_opt_ PVOID context,
+	__out REGHANDLE *h)
+{
+	return etwStandIn.registerProvider(guid, callback, context, h);
+}
+
+ULONG EventUnregister(
+	__in REGHANDLE h)
+{
+	return etwStandIn.unregisterProvider(h);
+}
+
+ULONG EventWrite(
+	__in REGHANDLE h,
+	_In_ PCEVENT_DESCRIPTOR desc,
+	__in ULONG count,
+	_In_reads_opt_(count) PEVENT_DATA_DESCRIPTOR data)
+{
+	return etwStandIn.write(h, desc, count, data);
+}
+#endif // _WIN32
+
+/**
+ *  StdoutLogger
+ */
+
+StdoutLogger::StdoutLogger(
+	_In_ Severity minSeverity
+) :
+	Logger(minSeverity),
+	writing_(false), terminal_(false), dropped_(0)
+{
+#ifdef _WIN32
+	h_ = GetStdHandle(STD_OUTPUT_HANDLE);
+	DWORD mode;
+	terminal_ = (h_ != NULL && h_ != INVALID_HANDLE_VALUE
+		&& GetConsoleMode(h_, &mode));
+#else
+	terminal_ = (isatty(STDOUT_FILENO) != 0);
+#endif
+	if (!terminal_)
+	{
+		buf_.reserve(BLOCK_SIZE + BLOCK_SIZE / 4);
+		out_.reserve(BLOCK_SIZE + BLOCK_SIZE / 4);
+	}
+}
+
+StdoutLogger::~StdoutLogger()
+{
+	writeOut(true);
+}
+
+void StdoutLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed))
+		return;
+
+	// The formatting is done before taking the lock, into a per-thread
+	// buffer that keeps its memory between the calls.
+	static thread_local std::string line;
+	line.clear();
+	formatRecord(line, err, sev, entity);
+
+	bool ready;
+	{
+		ScopeCritical sc(cr_);
+		if (buf_.size() + line.size() > PENDING_LIMIT)
+		{
+			++dropped_;
+			return;
+		}
+		buf_.append(line);
+		ready = (terminal_ || buf_.size() >= BLOCK_SIZE);
+	}
+
+	// The errors are often followed by an exit, so make sure
+	// that they get out.
+	if (sev >= SV_ERROR)
+		writeOut(true);
+	else if (ready)
+		writeOut(false);
+}
+
+void StdoutLogger::poll()
+{
+	writeOut(false);
+}
+
+void StdoutLogger::flush()
+{
+	writeOut(true);
+}
+
+uint64_t StdoutLogger::dropped()
+{
+	ScopeCritical sc(cr_);
+	return dropped_;
+}
+
+void StdoutLogger::writeOut(__in bool wait)
+{
+	for (;;)
+	{
+		{
+			ScopeCritical sc(cr_);
+			if (!writing_)
+			{
+				if (buf_.empty())
+					return;
+				writing_ = true;
+				break;
+			}
+			if (!wait)
+				return;
+		}
+		SwitchToThread();
+	}
+
+	// This thread is the writer now, keep writing until nothing is left.
+	for (;;)
+	{
+		{
+			ScopeCritical sc(cr_);
+			if (buf_.empty())
+			{
+				writing_ = false;
+				return;
+			}
+			buf_.swap(out_);
+		}
+		writeStdout(out_);
+		out_.clear();
+	}
+}
+
+void StdoutLogger::writeStdout(__in const std::string &data)
+{
+	// There is nowhere to report the errors of writing to stdout,
+	// so the data just gets thrown away.
+#ifdef _WIN32
+	if (h_ == NULL || h_ == INVALID_HANDLE_VALUE)
+		return;
+	if (terminal_)
+	{
+		// The console wants the text in UTF-16.
+		int len = MultiByteToWideChar(CP_UTF8, 0, data.data(), (int)data.size(), NULL, 0);
+		wout_.resize(len);
+		if (len > 0)
+			MultiByteToWideChar(CP_UTF8, 0, data.data(), (int)data.size(), &wout_[0], len);
+		const WCHAR *p = wout_.data();
+		DWORD left = (DWORD)len;
+		while (left > 0)
+		{
+			DWORD done = 0;
+			if (!WriteConsoleW(h_, p, left, &done, NULL) || done == 0)
+				return;
+			p += done;
+			left -= done;
+		}
+		return;
+	}
+
+	const char *p = data.data();
+	size_t left = data.size();
+	while (left > 0)
+	{
+		DWORD done = 0;
+		if (!WriteFile(h_, p, (DWORD)((left > (1 << 30)) ? (1 << 30) : left), &done, NULL)
+			|| done == 0)
+			return;
+		p += done;
+		left -= done;
+	}
+#else
+	const char *p = data.data();
+	size_t left = data.size();
+	while (left > 0)
+	{
+		ssize_t done = write(STDOUT_FILENO, p, left);
+		if (done < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		p += done;
+		left -= (size_t)done;
+	}
+#endif
+}
+
+/**
+ *  LogCompressor
+ */
+
+LogCompressor::LogCompressor() :
+	stopping_(false), wakeup_(NULL), thread_(NULL), ticksPerSec_(1),
+	files_(0), bytes_(0), ns_(0), failures_(0)
+{
+	LARGE_INTEGER freq;
+	if (QueryPerformanceFrequency(&freq) && freq.QuadPart > 0)
+		ticksPerSec_ = freq.QuadPart;
+
+	wakeup_ = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (wakeup_ == NULL) {
+		err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_COMPRESS_START_FAIL);
+		return;
+	}
+
+	thread_ = CreateThread(NULL, 0, &compressorThread, (LPVOID)this, 0, NULL);
+	if (thread_ == NULL) {
+		err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_COMPRESS_START_FAIL);
+		return;
+	}
+}
+
+LogCompressor::~LogCompressor()
+{
+	{
+		ScopeCritical sc(cr_);
+		stopping_ = true;
+	}
+	if (thread_ != NULL)
+	{
+		SetEvent(wakeup_);
+		WaitForSingleObject(thread_, INFINITE);
+		CloseHandle(thread_);
+	}
+	if (wakeup_ != NULL)
+		CloseHandle(wakeup_);
+}
+
+void LogCompressor::add(__in const std::wstring &fname)
+{
+	{
+		ScopeCritical sc(cr_);
+		if (thread_ == NULL)
+		{
+			++failures_;
+			return;
+		}
+		queue_.push_back(fname);
+	}
+	SetEvent(wakeup_);
+}
+
+void LogCompressor::getStats(__out Stats &st)
+{
+	ScopeCritical sc(cr_);
+	st.files_ = files_;
+	st.bytes_ = bytes_;
+	st.ns_ = ns_;
+	st.failures_ = failures_;
+	st.pending_ = queue_.size();
+}
+
+DWORD WINAPI LogCompressor::compressorThread(LPVOID arg)
+{
+	LogCompressor *comp = (LogCompressor *)arg;
+
+	// lowers both the CPU and the I/O priority
+	SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+
+	for (;;)
+	{
+		std::wstring fname;
+		{
+			ScopeCritical sc(comp->cr_);
+			if (comp->stopping_)
+				break;
+			if (!comp->queue_.empty())
+			{
+				fname.swap(comp->queue_.front());
+				comp->queue_.pop_front();
+			}
+		}
+		if (fname.empty())
+		{
+			WaitForSingleObject(comp->wakeup_, INFINITE);
+			continue;
+		}
+
+		LARGE_INTEGER start, end;
+		QueryPerformanceCounter(&start);
+		uint64_t bytes = 0;
+		Erref err = comp->compressFile(fname, bytes);
+		QueryPerformanceCounter(&end);
+
+		ScopeCritical sc(comp->cr_);
+		if (err)
+		{
+			++comp->failures_;
+			if (!comp->err_)
+				comp->err_ = err;
+			continue;
+		}
+		++comp->files_;
+		comp->bytes_ += bytes;
+		comp->ns_ += (uint64_t)((double)(end.QuadPart - start.QuadPart) * 1e9 / (double)comp->ticksPerSec_);
+	}
+	return 0;
+}
+
+Erref LogCompressor::compressFile(
+	__in const std::wstring &fname,
+	__out uint64_t &bytes)
+{
+	bytes = 0;
+#ifdef _WIN32
+	HANDLE h = CreateFileW(fname.c_str(), GENERIC_READ | GENERIC_WRITE,
+		FILE_SHARE_READ | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE)
+		return LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(h, &size))
+		bytes = (uint64_t)size.QuadPart;
+
+	// Compresses the existing data before returning.
+	Erref err;
+	USHORT format = COMPRESSION_FORMAT_DEFAULT;
+	DWORD returned = 0;
+	if (!DeviceIoControl(h, FSCTL_SET_COMPRESSION, &format, sizeof(format),
+			NULL, 0, &returned, NULL))
+		err = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	CloseHandle(h);
+	return err;
+#else
+	// The file gets replaced by <fname>.gz, so it stays readable by zcat.
+	// The original is removed only after the compressed copy is on the disk.
+	std::string src = narrowPath(fname.c_str());
+	std::string dst = src + ".gz";
+
+	int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return LogErrorSource.mkMuiSystem((DWORD)errno, EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	struct stat st;
+	if (fstat(in, &st) == 0)
+		bytes = (uint64_t)st.st_size;
+
+	int out = open(dst.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (out < 0)
+	{
+		int code = errno;
+		::close(in);
+		return LogErrorSource.mkMuiSystem((DWORD)code, EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	}
+	gzFile gz = gzdopen(out, "wb");
+	if (gz == NULL)
+	{
+		::close(in);
+		::close(out);
+		unlink(dst.c_str());
+		return LogErrorSource.mkMuiSystem((DWORD)ENOMEM, EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	}
+
+	// The zlib errors other than Z_ERRNO have no errno, they become EIO.
+	int code = 0;
+	std::vector<char> buf(64 * 1024);
+	for (;;)
+	{
+		ssize_t len = read(in, buf.data(), buf.size());
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			code = errno;
+			break;
+		}
+		if (len == 0)
+			break;
+		if (gzwrite(gz, buf.data(), (unsigned)len) != (int)len)
+		{
+			int zcode;
+			gzerror(gz, &zcode);
+			code = (zcode == Z_ERRNO) ? errno : EIO;
+			break;
+		}
+	}
+	::close(in);
+	if (code == 0 && gzflush(gz, Z_FINISH) != Z_OK)
+		code = EIO;
+	if (code == 0 && fsync(out) != 0)
+		code = errno;
+	if (gzclose(gz) != Z_OK && code == 0)
+		code = EIO;
+
+	if (code != 0)
+	{
+		unlink(dst.c_str());
+		return LogErrorSource.mkMuiSystem((DWORD)code, EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	}
+	if (unlink(src.c_str()) != 0)
+		return LogErrorSource.mkMuiSystem((DWORD)errno, EPEM_LOG_COMPRESS_FAIL, fname.c_str());
+	return Erref();
+#endif
+}
+
+/**
+ *  FileLogger
+ */
+
+#ifndef _WIN32
+// Rename the file, failing with EEXIST if the target exists, like
+// MoveFileExW() without MOVEFILE_REPLACE_EXISTING. Where renameat2() is
+// missing or not supported by the file system, the file gets linked
+// under the new name and unlinked under the old one, which fails the
+// same way on an existing target.
+// Returns 0 on success, -1 on error with the code in errno.
+static int renameNoReplace(
+	_In_z_ const char *from,
+	_In_z_ const char *to)
+{
+#ifdef RENAME_NOREPLACE
+	if (renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+#endif
+	if (link(from, to) != 0)
+		return -1;
+	if (unlink(from) != 0)
+	{
+		int code = errno;
+		unlink(to);
+		errno = code;
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+FileLogger::FileLogger(
+	_In_z_ const WCHAR *fname,
+	_In_ Severity minSeverity,
+	__in const Options &opts
+) :
+	Logger(minSeverity),
+	fname_(fname), opts_(opts), closed_(false),
+	lastWrite_(GetTickCount64()), lastSync_(lastWrite_.load()), unsynced_(false),
+#ifdef _WIN32
+	fh_(INVALID_HANDLE_VALUE),
+#else
+	fd_(-1),
+#endif
+	fileSize_(0), fileStart_(0), ticksPerSec_(1),
+	records_(0), bytes_(0), writes_(0), syncs_(0),
+	rotations_(0), rotateNsTotal_(0), rotateNsMax_(0)
+{
+	// a little extra room for the records that come while writing
+	buf_.reserve(opts_.bufferSize_ + opts_.bufferSize_ / 4);
+	spare_.reserve(opts_.bufferSize_ + opts_.bufferSize_ / 4);
+
+	LARGE_INTEGER freq;
+	if (QueryPerformanceFrequency(&freq) && freq.QuadPart > 0)
+		ticksPerSec_ = freq.QuadPart;
+
+	if (!openW())
+	{
+		closed_ = true;
+		return;
+	}
+	if (opts_.compress_ && (opts_.rotateSize_ != 0 || opts_.rotatePeriodMs_ != 0))
+		compressor_.reset(new LogCompressor);
+}
+
+bool FileLogger::openW()
+{
+#ifdef _WIN32
+	// With only FILE_APPEND_DATA, every write goes to the end of file.
+	fh_ = CreateFileW(fname_.c_str(), FILE_APPEND_DATA | FILE_READ_ATTRIBUTES,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+	fd_ = open(narrowPath(fname_.c_str()).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+	if (!isOpen())
+	{
+		recordError(EPEM_LOG_FILE_OPEN_FAIL);
+		return false;
+	}
+
+	// the size is needed only for the rotation, so it's not critical
+	fileSize_ = 0;
+#ifdef _WIN32
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(fh_, &size))
+		fileSize_ = (uint64_t)size.QuadPart;
+#else
+	struct stat st;
+	if (fstat(fd_, &st) == 0)
+		fileSize_ = (uint64_t)st.st_size;
+#endif
+	fileStart_ = GetTickCount64();
+	return true;
+}
+
+FileLogger::~FileLogger()
+{
+	close();
+}
+
+void FileLogger::close()
+{
+	{
+		ScopeCritical sc(cr_);
+		closed_ = true;
+	}
+
+	writeBuffer(true);
+
+	ScopeCritical sw(writeCr_);
+	if (!isOpen())
+		return;
+
+	if (opts_.syncPeriodMs_ != NO_SYNC)
+		syncW(true);
+
+#ifdef _WIN32
+	BOOL ok = CloseHandle(fh_);
+	fh_ = INVALID_HANDLE_VALUE;
+#else
+	bool ok = (::close(fd_) == 0);
+	fd_ = -1;
+#endif
+	if (!ok)
+		recordError(EPEM_LOG_FILE_CLOSE_FAIL);
+}
+
+void FileLogger::flush()
+{
+	writeBuffer(true);
+}
+
+void FileLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed))
+		return;
+
+	// The formatting is done before taking the lock, into a per-thread
+	// buffer that keeps its memory between the calls.
+	static thread_local std::string line;
+	line.clear();
+	formatRecord(line, err, sev, entity);
+
+	bool full;
+	{
+		ScopeCritical sc(cr_);
+		if (closed_)
+			return;
+		buf_.append(line);
+		++records_;
+		full = (buf_.size() >= opts_.bufferSize_);
+	}
+
+	checkFlush(sev, full);
+}
+
+void FileLogger::checkFlush(
+	__in Severity sev,
+	__in bool full)
+{
+	if ((opts_.flushFlags_ & FF_ON_ERROR) && sev >= SV_ERROR)
+		writeBuffer(true);
+	else if (full)
+		writeBuffer(false);
+	else if ((opts_.flushFlags_ & FF_PERIODIC)
+		&& GetTickCount64() - lastWrite_.load(std::memory_order_relaxed) >= opts_.flushPeriodMs_)
+		writeBuffer(true);
+}
+
+void FileLogger::writeRaw(
+	_In_reads_(len) const char *data,
+	__in size_t len)
+{
+	bool full;
+	{
+		ScopeCritical sc(cr_);
+		if (closed_)
+			return;
+		buf_.append(data, len);
+		full = (buf_.size() >= opts_.bufferSize_);
+	}
+
+	checkFlush(SV_INFO, full);
+}
+
+void FileLogger::poll()
+{
+	if ((opts_.flushFlags_ & FF_PERIODIC)
+		&& GetTickCount64() - lastWrite_.load(std::memory_order_relaxed) >= opts_.flushPeriodMs_)
+		writeBuffer(true);
+
+	ScopeCritical sw(writeCr_);
+	syncW(false);
+}
+
+void FileLogger::writeBuffer(__in bool force)
+{
+	// Only one thread writes at a time, but the others keep adding
+	// the records to buf_ in the meantime.
+	ScopeCritical sw(writeCr_);
+	{
+		ScopeCritical sc(cr_);
+		if (buf_.empty() || (!force && buf_.size() < opts_.bufferSize_))
+			return; // another thread has already written it
+		buf_.swap(spare_);
+	}
+
+	if (isOpen())
+		checkRotateW(spare_.size());
+	if (isOpen())
+		writeFileW(spare_.data(), spare_.size());
+	spare_.clear();
+	lastWrite_.store(GetTickCount64(), std::memory_order_relaxed);
+	syncW(false);
+}
+
+bool FileLogger::writeFileW(
+	_In_reads_(len) const char *data,
+	__in size_t len
+)
+{
+	while (len > 0)
+	{
+		size_t chunk = (len > (1 << 30)) ? (1 << 30) : len;
+#ifdef _WIN32
+		DWORD done = 0;
+		if (!WriteFile(fh_, data, (DWORD)chunk, &done, NULL))
+		{
+			recordError(EPEM_LOG_FILE_WRITE_FAIL);
+			return false;
+		}
+#else
+		ssize_t done = write(fd_, data, chunk);
+		if (done < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			recordError(EPEM_LOG_FILE_WRITE_FAIL);
+			return false;
+		}
+#endif
+		writes_.fetch_add(1, std::memory_order_relaxed);
+		bytes_.fetch_add((uint64_t)done, std::memory_order_relaxed);
+		fileSize_ += (uint64_t)done;
+		data += done;
+		len -= (size_t)done;
+		unsynced_ = true;
+	}
+	return true;
+}
+
+void FileLogger::checkRotateW(__in size_t len)
+{
+	// an empty file has nothing to rotate
+	if (fileSize_ == 0)
+		return;
+	if ((opts_.rotateSize_ != 0 && fileSize_ + len > opts_.rotateSize_)
+		|| (opts_.rotatePeriodMs_ != 0 && GetTickCount64() - fileStart_ >= opts_.rotatePeriodMs_))
+		rotateW();
+}
+
+void FileLogger::rotateW()
+{
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+
+	if (opts_.syncPeriodMs_ != NO_SYNC)
+		syncW(true);
+#ifdef _WIN32
+	BOOL ok = CloseHandle(fh_);
+	fh_ = INVALID_HANDLE_VALUE;
+#else
+	bool ok = (::close(fd_) == 0);
+	fd_ = -1;
+#endif
+	if (!ok)
+		recordError(EPEM_LOG_FILE_CLOSE_FAIL);
+
+	// The segment is named by the local time, with a counter added
+	// if there are multiple rotations within a second.
+	std::wstring base = fname_;
+	base.push_back(L'.');
+#ifdef _WIN32
+	SYSTEMTIME st;
+	GetLocalTime(&st);
+	wstrAppendF(base, L"%04u%02u%02u-%02u%02u%02u",
+		st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+#else
+	time_t now = time(NULL);
+	struct tm tm;
+	localtime_r(&now, &tm);
+	wstrAppendF(base, L"%04u%02u%02u-%02u%02u%02u",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+#endif
+
+	std::wstring segment;
+	bool renamed = false;
+	for (int n = 0; n < ROTATE_ATTEMPTS; ++n)
+	{
+		segment = base;
+		if (n != 0)
+		{
+			segment.push_back(L'-');
+			wstrAppendDec(segment, n);
+		}
+#ifdef _WIN32
+		// without MOVEFILE_REPLACE_EXISTING, fails if the segment exists
+		if (MoveFileExW(fname_.c_str(), segment.c_str(), 0))
+		{
+			renamed = true;
+			break;
+		}
+		DWORD code = GetLastError();
+		if (code != ERROR_ALREADY_EXISTS && code != ERROR_FILE_EXISTS)
+			break;
+#else
+		if (renameNoReplace(narrowPath(fname_.c_str()).c_str(), narrowPath(segment.c_str()).c_str()) == 0)
+		{
+			renamed = true;
+			break;
+		}
+		if (errno != EEXIST)
+			break;
+#endif
+	}
+	if (!renamed)
+		recordError(EPEM_LOG_FILE_ROTATE_FAIL);
+
+	// If the rename has failed, keep appending to the same file.
+	if (openW() && renamed)
+	{
+		std::string header;
+		segmentHeaderW(header);
+		if (!header.empty())
+			writeFileW(header.data(), header.size());
+	}
+
+	QueryPerformanceCounter(&end);
+	uint64_t ns = (uint64_t)((double)(end.QuadPart - start.QuadPart) * 1e9 / (double)ticksPerSec_);
+	rotations_.fetch_add(1, std::memory_order_relaxed);
+	rotateNsTotal_.fetch_add(ns, std::memory_order_relaxed);
+	if (ns > rotateNsMax_.load(std::memory_order_relaxed))
+		rotateNsMax_.store(ns, std::memory_order_relaxed); // only the writer updates it
+
+	if (renamed && compressor_)
+		compressor_->add(segment);
+}
+
+void FileLogger::segmentHeaderW(__inout std::string &dest)
+{
+}
+
+void FileLogger::syncW(__in bool force)
+{
+	if (!unsynced_ || !isOpen())
+		return;
+	if (!force)
+	{
+		if (opts_.syncPeriodMs_ == NO_SYNC)
+			return;
+		if (GetTickCount64() - lastSync_ < opts_.syncPeriodMs_)
+			return;
+	}
+
+#ifdef _WIN32
+	bool ok = (FlushFileBuffers(fh_) != FALSE);
+#else
+	bool ok = (fsync(fd_) == 0);
+#endif
+	if (!ok)
+		recordError(EPEM_LOG_FILE_SYNC_FAIL);
+	syncs_.fetch_add(1, std::memory_order_relaxed);
+	lastSync_ = GetTickCount64();
+	unsynced_ = false;
+}
+
+void FileLogger::recordError(__in DWORD msgCode)
+{
+#ifdef _WIN32
+	DWORD code = GetLastError();
+#else
+	DWORD code = (DWORD)errno;
+#endif
+
+	ScopeCritical sc(cr_);
+	if (err_)
+		return;
+	err_ = LogErrorSource.mkMuiSystem(code, msgCode, fname_.c_str());
+}
+
+void FileLogger::getStats(__out Stats &st)
+{
+	{
+		ScopeCritical sc(cr_);
+		st.records_ = records_;
+	}
+	st.bytes_ = bytes_.load(std::memory_order_relaxed);
+	st.writes_ = writes_.load(std::memory_order_relaxed);
+	st.syncs_ = syncs_.load(std::memory_order_relaxed);
+	st.rotations_ = rotations_.load(std::memory_order_relaxed);
+	st.rotateNsTotal_ = rotateNsTotal_.load(std::memory_order_relaxed);
+	st.rotateNsMax_ = rotateNsMax_.load(std::memory_order_relaxed);
+	if (compressor_)
+		compressor_->getStats(st.compressor_);
+	else
+		memset(&st.compressor_, 0, sizeof(st.compressor_));
+}
+
+/**
+ *  OutputPump
+ */
+
+OutputPump::OutputPump(
+	__in Pipe pipe,
+	__in std::shared_ptr<FileLogger> file
+) :
+	pipe_(pipe), file_(file), thread_(NULL)
+{
+}
+
+OutputPump::~OutputPump()
+{
+	wait();
+#ifdef _WIN32
+	CloseHandle(pipe_);
+#else
+	::close(pipe_);
+#endif
+}
+
+Erref OutputPump::start()
+{
+	thread_ = CreateThread(NULL, 0, &pumpThread, (LPVOID)this, 0, NULL);
+	if (thread_ == NULL)
+		return LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_PUMP_START_FAIL);
+	return Erref();
+}
+
+void OutputPump::wait()
+{
+	if (thread_ != NULL)
+	{
+		WaitForSingleObject(thread_, INFINITE); // ignore any errors...
+		CloseHandle(thread_);
+		thread_ = NULL;
+	}
+}
+
+DWORD WINAPI OutputPump::pumpThread(LPVOID arg)
+{
+	OutputPump *pump = (OutputPump *)arg;
+	std::vector<char> buf(BUFFER_SIZE);
+
+	for (;;)
+	{
+#ifdef _WIN32
+		DWORD done = 0;
+		// fails with ERROR_BROKEN_PIPE after the process exits
+		if (!ReadFile(pump->pipe_, &buf[0], BUFFER_SIZE, &done, NULL) || done == 0)
+			break;
+#else
+		ssize_t done = read(pump->pipe_, &buf[0], BUFFER_SIZE);
+		if (done < 0 && errno == EINTR)
+			continue;
+		// returns 0 after the process exits
+		if (done <= 0)
+			break;
+#endif
+		// the process wrote this data, so don't keep it waiting in the buffer
+		pump->file_->writeRaw(&buf[0], (size_t)done);
+		pump->file_->flush();
+	}
+	return 0;
+}
+
+/**
+ *  BinaryLogger
+ */
+
+BinaryLogger::BinaryLogger(
+	_In_z_ const WCHAR *fname,
+	_In_ Severity minSeverity,
+	__in const Options &opts
+) :
+	FileLogger(fname, minSeverity, opts),
+	lastId_(0)
+{
+	ScopeCritical sc(cr_);
+	if (closed_)
+		return;
+	block_.clear();
+	appendLe(block_, MAGIC, 4);
+	appendBlockL(BT_SESSION, block_);
+}
+
+void BinaryLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed))
+		return;
+
+	uint64_t time = recordTime();
+
+	// The arguments get packed before taking the lock, into the per-thread
+	// buffers that keep their memory between the calls.
+	static thread_local std::vector<Part> parts;
+	static thread_local std::string data;
+	parts.clear();
+	data.clear();
+	for (ErrorMsg *msg = err.get(); msg != NULL; msg = msg->chain_.get())
+	{
+		Part part;
+		part.msg_ = msg;
+		part.key_ = NULL;
+		part.offset_ = data.size();
+		part.sourceId_ = 0;
+		part.stringId_ = 0;
+
+		const WCHAR *fmt;
+		bool packed = msg->packDeferred(part.kind_, fmt, data);
+		if (part.kind_ == ErrorMsg::MK_SYSTEM || part.kind_ == ErrorMsg::MK_ERRNO)
+		{
+			// the text depends only on the code, so it gets written once
+			data.resize(part.offset_);
+			part.form_ = RF_STRING;
+		}
+		else if (packed && part.kind_ == ErrorMsg::MK_PRINTF && fmt != NULL)
+		{
+			part.form_ = RF_PRINTF;
+			part.key_ = fmt;
+		}
+		else if (packed && part.kind_ == ErrorMsg::MK_MUI
+			&& msg->source_->muiCatalog_ != NULL
+			&& (part.key_ = msg->source_->muiCatalog_->find(msg->code_)) != NULL)
+		{
+			part.form_ = RF_MUI;
+		}
+		else
+		{
+			// Already formatted, or the MUI text can come only from the module.
+			data.resize(part.offset_);
+			const std::wstring &text = msg->getMsg();
+			appendUtf8(data, text.data(), text.size());
+			part.form_ = RF_TEXT;
+		}
+		part.len_ = data.size() - part.offset_;
+		parts.push_back(part);
+	}
+
+	bool full;
+	{
+		ScopeCritical sc(cr_);
+		if (closed_)
+			return;
+
+		// The definitions go before the record that uses them.
+		entityL(entity);
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			Part &part = parts[i];
+			part.sourceId_ = sourceIdL(part.msg_->source_);
+			switch (part.form_)
+			{
+			case RF_STRING:
+				part.stringId_ = systemIdL(part.msg_, part.kind_);
+				break;
+			case RF_PRINTF:
+				{
+					const WCHAR *fmt = (const WCHAR *)part.key_;
+					part.stringId_ = stringIdL(fmt, fmt, wcslen(fmt));
+				}
+				break;
+			case RF_MUI:
+				{
+					const std::wstring &text = ((const MuiCatalog::Template *)part.key_)->text_;
+					part.stringId_ = stringIdL(part.key_, text.data(), text.size());
+				}
+				break;
+			default:
+				break;
+			}
+		}
+
+		block_.clear();
+		appendVarint(block_, time);
+		appendVarint(block_, sev);
+		appendVarint(block_, entity);
+		appendVarint(block_, parts.size());
+		for (size_t i = 0; i < parts.size(); ++i)
+		{
+			const Part &part = parts[i];
+			appendVarint(block_, part.sourceId_);
+			appendVarint(block_, part.msg_->code_);
+			appendVarint(block_, part.form_);
+			if (part.form_ == RF_TEXT)
+				appendVarint(block_, part.len_);
+			else
+				appendVarint(block_, part.stringId_);
+			block_.append(data, part.offset_, part.len_);
+		}
+		appendBlockL(BT_RECORD, block_);
+
+		++records_;
+		full = (buf_.size() >= opts_.bufferSize_);
+	}
+
+	checkFlush(sev, full);
+}
+
+void BinaryLogger::appendBlockL(
+	__in BlockType type,
+	__in const std::string &payload)
+{
+	buf_.push_back((char)type);
+	appendVarint(buf_, payload.size());
+	buf_.append(payload);
+}
+
+void BinaryLogger::defineL(
+	__in BlockType type,
+	__in const std::string &payload)
+{
+	appendBlockL(type, payload);
+	defs_.push_back((char)type);
+	appendVarint(defs_, payload.size());
+	defs_.append(payload);
+}
+
+void BinaryLogger::segmentHeaderW(__inout std::string &dest)
+{
+	std::string magic;
+	appendLe(magic, MAGIC, 4);
+	dest.push_back((char)BT_SESSION);
+	appendVarint(dest, magic.size());
+	dest.append(magic);
+
+	// Some of these might be also waiting in buf_, and will get
+	// repeated after the rotation, which does no harm.
+	ScopeCritical sc(cr_);
+	dest.append(defs_);
+}
+
+uint32_t BinaryLogger::stringIdL(
+	__in const void *key,
+	_In_reads_(len) const WCHAR *text,
+	__in size_t len)
+{
+	auto it = strings_.find(key);
+	if (it != strings_.end())
+		return it->second;
+
+	uint32_t id = ++lastId_;
+	strings_[key] = id;
+	std::string def;
+	appendVarint(def, id);
+	appendUtf8(def, text, len);
+	defineL(BT_STRING, def);
+	return id;
+}
+
+uint32_t BinaryLogger::systemIdL(
+	__in ErrorMsg *msg,
+	__in ErrorMsg::MsgKind kind)
+{
+	uint64_t key = ((uint64_t)kind << 32) | msg->code_;
+	auto it = systemTexts_.find(key);
+	if (it != systemTexts_.end())
+		return it->second;
+
+	uint32_t id = ++lastId_;
+	systemTexts_[key] = id;
+	const std::wstring &text = msg->getMsg();
+	std::string def;
+	appendVarint(def, id);
+	appendUtf8(def, text.data(), text.size());
+	defineL(BT_STRING, def);
+	return id;
+}
+
+uint32_t BinaryLogger::sourceIdL(
+	__in_opt const ErrorMsg::Source *source)
+{
+	if (source == NULL)
+		return 0;
+	auto it = sources_.find(source);
+	if (it != sources_.end())
+		return it->second;
+
+	uint32_t id = ++lastId_;
+	sources_[source] = id;
+	std::string def;
+	appendVarint(def, id);
+	appendUtf8(def, source->name_, wcslen(source->name_));
+	defineL(BT_SOURCE, def);
+	return id;
+}
+
+void BinaryLogger::entityL(
+	__in LogEntity::Id entity)
+{
+	if (entity == LogEntity::NONE)
+		return;
+	if (entity >= entities_.size())
+		entities_.resize(entity + 1);
+	if (entities_[entity])
+		return;
+
+	const std::wstring *name = LogEntity::name(entity);
+	if (name == NULL)
+		return;
+	entities_[entity] = true;
+	std::string def;
+	appendVarint(def, entity);
+	appendUtf8(def, name->data(), name->size());
+	defineL(BT_ENTITY, def);
+}
+
+/**
+ *  BinaryLogReader
+ */
+
+BinaryLogReader::BinaryLogReader(
+	_In_z_ const WCHAR *fname
+) :
+	fname_(fname),
+#ifdef _WIN32
+	fh_(INVALID_HANDLE_VALUE),
+#else
+	fd_(-1),
+#endif
+	pos_(0), offset_(0), eof_(false), session_(false)
+{
+#ifdef _WIN32
+	// The file might be still written by a logger.
+	fh_ = CreateFileW(fname, GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fh_ == INVALID_HANDLE_VALUE)
+	{
+		err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_BINARY_READ_FAIL, fname);
+		eof_ = true;
+	}
+#else
+	fd_ = open(narrowPath(fname).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+	{
+		err_ = LogErrorSource.mkMuiSystem((DWORD)errno, EPEM_LOG_BINARY_READ_FAIL, fname);
+		eof_ = true;
+	}
+#endif
+}
+
+BinaryLogReader::~BinaryLogReader()
+{
+#ifdef _WIN32
+	if (fh_ != INVALID_HANDLE_VALUE)
+		CloseHandle(fh_);
+#else
+	if (fd_ >= 0)
+		close(fd_);
+#endif
+}
+
+bool BinaryLogReader::next(__out Record &rec)
+{
+	for (;;)
+	{
+		if (err_ || !fill(1))
+			return false;
+		// The header is a type byte and a varint of up to 10 bytes,
+		// near the end of file there might be less than that.
+		fill(11);
+		if (err_)
+			return false;
+
+		const uint8_t *start = (const uint8_t *)buf_.data() + pos_;
+		const uint8_t *p = start;
+		const uint8_t *end = (const uint8_t *)buf_.data() + buf_.size();
+		int type = *p++;
+		uint64_t len;
+		if (!readVarint(p, end, len) || len > BLOCK_LIMIT)
+		{
+			corrupted();
+			return false;
+		}
+		size_t hlen = (size_t)(p - start);
+		if (!fill(hlen + (size_t)len))
+		{
+			// a partially written block at the end of file
+			if (!err_)
+				corrupted();
+			return false;
+		}
+
+		// the buffer might have moved
+		p = (const uint8_t *)buf_.data() + pos_ + hlen;
+		int res = parseBlock(type, p, p + len, rec);
+		if (res == 0)
+		{
+			corrupted();
+			return false;
+		}
+		pos_ += hlen + (size_t)len;
+		offset_ += hlen + len;
+		if (res == BinaryLogger::BT_RECORD)
+			return true;
+	}
+}
+
+void BinaryLogReader::formatRecord(
+	__inout std::string &dest,
+	__in const Record &rec)
+{
+	Logger::formatRecordAt(dest, rec.err_, rec.sev_, rec.entityName_, rec.time_);
+}
+
+bool BinaryLogReader::fill(__in size_t need)
+{
+	while (buf_.size() - pos_ < need)
+	{
+		if (eof_ || err_)
+			return false;
+		if (pos_ > 0)
+		{
+			buf_.erase(0, pos_);
+			pos_ = 0;
+		}
+
+		size_t had = buf_.size();
+		buf_.resize(had + READ_SIZE);
+#ifdef _WIN32
+		DWORD done = 0;
+		if (!ReadFile(fh_, &buf_[had], READ_SIZE, &done, NULL))
+		{
+			buf_.resize(had);
+			err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_BINARY_READ_FAIL, fname_.c_str());
+			return false;
+		}
+#else
+		ssize_t done = read(fd_, &buf_[had], READ_SIZE);
+		if (done < 0)
+		{
+			buf_.resize(had);
+			if (errno == EINTR)
+				continue;
+			err_ = LogErrorSource.mkMuiSystem((DWORD)errno, EPEM_LOG_BINARY_READ_FAIL, fname_.c_str());
+			return false;
+		}
+#endif
+		buf_.resize(had + (size_t)done);
+		if (done == 0)
+			eof_ = true;
+	}
+	return true;
+}
+
+int BinaryLogReader::parseBlock(
+	__in int type,
+	__in const uint8_t *p,
+	__in const uint8_t *end,
+	__out Record &rec)
+{
+	if (type == BinaryLogger::BT_SESSION)
+	{
+		if (end - p < 4 || readLe(p, 4) != BinaryLogger::MAGIC)
+			return 0;
+		session_ = true;
+		strings_.clear();
+		sources_.clear();
+		entities_.clear();
+		return type;
+	}
+	if (!session_)
+		return 0;
+
+	uint64_t id;
+	switch (type)
+	{
+	case BinaryLogger::BT_STRING:
+	case BinaryLogger::BT_ENTITY:
+		if (!readVarint(p, end, id))
+			return 0;
+		texts_.emplace_back();
+		appendFromUtf8(texts_.back(), p, (size_t)(end - p));
+		if (type == BinaryLogger::BT_STRING)
+			strings_[id] = &texts_.back();
+		else
+			entities_[id] = &texts_.back();
+		return type;
+	case BinaryLogger::BT_SOURCE:
+		{
+			if (!readVarint(p, end, id) || id == 0)
+				return 0;
+			sourceDefs_.emplace_back();
+			SourceDef &def = sourceDefs_.back();
+			appendFromUtf8(def.name_, p, (size_t)(end - p));
+			def.source_ = std::make_shared<ErrorMsg::Source>(def.name_.c_str(), (const GUID *)NULL);
+			// lets the MUI messages find their templates
+			def.source_->muiCatalog_ = &def.catalog_;
+			sources_[id] = &def;
+		}
+		return type;
+	case BinaryLogger::BT_RECORD:
+		{
+			uint64_t time, sev, entity;
+			if (!readVarint(p, end, time)
+				|| !readVarint(p, end, sev) || sev >= Logger::SV_NEVER
+				|| !readVarint(p, end, entity) || entity >= LogEntity::LIMIT)
+				return 0;
+			rec.time_ = time;
+			rec.sev_ = (Logger::Severity)sev;
+			rec.entity_ = (LogEntity::Id)entity;
+			auto it = entities_.find(entity);
+			rec.entityName_ = (it == entities_.end()) ? NULL : it->second;
+			if (!parseMessages(p, end, rec.err_) || p != end)
+				return 0;
+		}
+		return type;
+	}
+	// the unknown blocks get skipped, to allow the future extensions
+	return (type == 0) ? 0 : type;
+}
+
+bool BinaryLogReader::parseMessages(
+	__inout const uint8_t *&p,
+	__in const uint8_t *end,
+	__out Erref &err)
+{
+	err.reset();
+	uint64_t count;
+	if (!readVarint(p, end, count) || count == 0)
+		return false;
+
+	for (; count > 0; --count)
+	{
+		uint64_t sid, code, form, id;
+		if (!readVarint(p, end, sid)
+			|| !readVarint(p, end, code) || code > 0xFFFFFFFF
+			|| !readVarint(p, end, form))
+			return false;
+
+		SourceDef *def = NULL;
+		if (sid != 0)
+		{
+			auto it = sources_.find(sid);
+			if (it == sources_.end())
+				return false;
+			def = it->second;
+		}
+		const ErrorMsg::Source *source = (def == NULL) ? NULL : def->source_.get();
+
+		std::shared_ptr<ErrorMsg> msg;
+		if (form == BinaryLogger::RF_TEXT)
+		{
+			msg = ErrorMsg::mkNew(source, (DWORD)code);
+			if (!readText(p, end, msg->msg_))
+				return false;
+		}
+		else
+		{
+			if (!readVarint(p, end, id))
+				return false;
+			auto it = strings_.find(id);
+			if (it == strings_.end())
+				return false;
+			const std::wstring *text = it->second;
+
+			switch (form)
+			{
+			case BinaryLogger::RF_STRING:
+				msg = ErrorMsg::mkNew(source, (DWORD)code);
+				msg->msg_ = *text;
+				break;
+			case BinaryLogger::RF_PRINTF:
+				msg = ErrorMsg::mkUnpacked(source, (DWORD)code,
+					ErrorMsg::MK_PRINTF, text->c_str(), p, end);
+				break;
+			case BinaryLogger::RF_MUI:
+				if (def == NULL)
+					return false;
+				if (def->catalog_.find((DWORD)code) == NULL)
+					def->catalog_.add((DWORD)code, text->data(), text->size());
+				msg = ErrorMsg::mkUnpacked(source, (DWORD)code,
+					ErrorMsg::MK_MUI, NULL, p, end);
+				break;
+			default:
+				return false;
+			}
+			if (!msg)
+				return false;
+		}
+		err.append(msg);
+	}
+	return true;
+}
+
+bool BinaryLogReader::readText(
+	__inout const uint8_t *&p,
+	__in const uint8_t *end,
+	__out std::wstring &text)
+{
+	uint64_t len;
+	if (!readVarint(p, end, len) || len > (uint64_t)(end - p))
+		return false;
+	text.clear();
+	appendFromUtf8(text, p, (size_t)len);
+	p += len;
+	return true;
+}
+
+void BinaryLogReader::corrupted()
+{
+	err_ = LogErrorSource.mkMui(EPEM_LOG_BINARY_CORRUPTED, fname_.c_str(), offset_);
+}
+
+/**
+ *  AsyncLogger
+ */
+
+AsyncLogger::AsyncLogger(
+	__in std::shared_ptr<Logger> sink,
+	_In_ Severity minSeverity,
+	__in size_t queueSize
+) :
+	Logger(minSeverity),
+	sink_(sink), queue_(NULL), mask_(0),
+	enqueuePos_(0), dequeuePos_(0), sleeping_(false), stopping_(false),
+	wakeup_(NULL), thread_(NULL),
+	enqueued_(0), dropped_(0), written_(0), ticksPerSec_(1)
+{
+	size_t size = 2;
+	while (size < queueSize)
+		size <<= 1;
+	queue_ = new Slot[size];
+	mask_ = size - 1;
+	filterEntitiesBy(*sink_);
+	for (size_t i = 0; i < size; ++i)
+		queue_[i].seq_.store(i, std::memory_order_relaxed);
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+		latency_[i].store(0, std::memory_order_relaxed);
+
+	StateSources::add(this);
+
+	LARGE_INTEGER freq;
+	if (QueryPerformanceFrequency(&freq) && freq.QuadPart > 0)
+		ticksPerSec_ = freq.QuadPart;
+
+	wakeup_ = CreateEventW(NULL, FALSE, FALSE, NULL);
+	if (wakeup_ == NULL) {
+		err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_ASYNC_START_FAIL);
+		stopping_ = true;
+		return;
+	}
+
+	thread_ = CreateThread(NULL, 0, &flusherThread, (LPVOID)this, 0, NULL);
+	if (thread_ == NULL) {
+		err_ = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_ASYNC_START_FAIL);
+		stopping_ = true;
+		return;
+	}
+}
+
+AsyncLogger::~AsyncLogger()
+{
+	StateSources::remove(this);
+	close();
+	if (wakeup_ != NULL)
+		CloseHandle(wakeup_);
+	delete[] queue_;
+}
+
+void AsyncLogger::close()
+{
+	ScopeCritical sc(cr_);
+
+	if (thread_ == NULL)
+		return;
+
+	stopping_ = true;
+	// A producer that has checked stopping_ just before it got set may
+	// still be on the way to enqueue(). Seal the queue, so that such
+	// a producer either gets a slot below endPos or writes directly.
+	size_t endPos = enqueuePos_.fetch_or(POS_CLOSED);
+
+	SetEvent(wakeup_);
+	if (WaitForSingleObject(thread_, INFINITE) == WAIT_FAILED)
+	{
+		Erref newerr = LogErrorSource.mkMuiSystem(GetLastError(), EPEM_LOG_ASYNC_STOP_FAIL);
+		err_.append(newerr);
+	}
+	CloseHandle(thread_);
+	thread_ = NULL;
+
+	drainClosed(endPos);
+}
+
+void AsyncLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed) || !sink_->allows(sev, entity))
+		return;
+
+	if (stopping_.load(std::memory_order_relaxed))
+	{
+		writeDirect(err, sev, entity);
+		return;
+	}
+
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	EnqueueResult res = enqueue(err, sev, entity);
+	QueryPerformanceCounter(&end);
+
+	if (res == EQ_CLOSED)
+	{
+		writeDirect(err, sev, entity);
+		return;
+	}
+	if (res == EQ_FULL)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	enqueued_.fetch_add(1, std::memory_order_relaxed);
+	recordLatency(end.QuadPart - start.QuadPart);
+
+	// Pairs with the fence in flusherThread(): either the flusher sees
+	// the new record before going to sleep, or we see it sleeping.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping_.load(std::memory_order_relaxed)
+		&& sleeping_.exchange(false))
+	{
+		SetEvent(wakeup_);
+	}
+}
+
+void AsyncLogger::writeDirect(
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	// Waits for close() to finish draining, then the records
+	// go to the sink one at a time and after the queued ones.
+	ScopeCritical sc(cr_);
+	sink_->log(err, sev, entity);
+}
+
+AsyncLogger::EnqueueResult AsyncLogger::enqueue(
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		// the sealing fails the compare-exchange below, so it can't be missed
+		if (pos & POS_CLOSED)
+			return EQ_CLOSED;
+
+		Slot *slot = &queue_[pos & mask_];
+		size_t seq = slot->seq_.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+		if (diff == 0)
+		{
+			if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot->err_ = std::move(err);
+				slot->sev_ = sev;
+				slot->entity_ = entity;
+				slot->seq_.store(pos + 1, std::memory_order_release);
+				return EQ_OK;
+			}
+			// on failure pos has been reloaded, try again
+		}
+		else if (diff < 0)
+		{
+			return EQ_FULL;
+		}
+		else
+		{
+			pos = enqueuePos_.load(std::memory_order_relaxed);
+		}
+	}
+}
+
+bool AsyncLogger::hasRecords()
+{
+	size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+	return (queue_[pos & mask_].seq_.load(std::memory_order_acquire) == pos + 1);
+}
+
+bool AsyncLogger::drain()
+{
+	bool any = false;
+	for (;;)
+	{
+		size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+		Slot *slot = &queue_[pos & mask_];
+		if (slot->seq_.load(std::memory_order_acquire) != pos + 1)
+			return any;
+
+		Erref err = std::move(slot->err_);
+		Severity sev = slot->sev_;
+		LogEntity::Id entity = slot->entity_;
+
+		// release the slot to the producers before doing the slow part
+		dequeuePos_.store(pos + 1, std::memory_order_relaxed);
+		slot->seq_.store(pos + mask_ + 1, std::memory_order_release);
+
+		sink_->log(err, sev, entity);
+		written_.fetch_add(1, std::memory_order_relaxed);
+		any = true;
+	}
+}
+
+void AsyncLogger::drainClosed(
+	__in size_t endPos
+)
+{
+	for (;;)
+	{
+		size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+		if (pos == endPos)
+			return;
+		// the slot is claimed, wait for its producer to fill it
+		Slot *slot = &queue_[pos & mask_];
+		while (slot->seq_.load(std::memory_order_acquire) != pos + 1)
+			SwitchToThread();
+		drain();
+	}
+}
+
+void AsyncLogger::recordLatency(LONGLONG ticks)
+{
+	if (ticks < 0)
+		ticks = 0;
+	uint64_t ns = (uint64_t)ticks * 1000000000ULL / (uint64_t)ticksPerSec_;
+	int bucket = 0;
+	while (ns != 0 && bucket < LATENCY_BUCKETS - 1)
+	{
+		ns >>= 1;
+		++bucket;
+	}
+	latency_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void AsyncLogger::getStats(__out Stats &st)
+{
+	size_t enq = enqueuePos_.load(std::memory_order_relaxed) & ~POS_CLOSED;
+	size_t deq = dequeuePos_.load(std::memory_order_relaxed);
+
+	st.queueDepth_ = (enq > deq) ? enq - deq : 0;
+	st.queueSize_ = mask_ + 1;
+	st.enqueued_ = enqueued_.load(std::memory_order_relaxed);
+	st.dropped_ = dropped_.load(std::memory_order_relaxed);
+	st.written_ = written_.load(std::memory_order_relaxed);
+
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; ++i)
+	{
+		counts[i] = latency_[i].load(std::memory_order_relaxed);
+		total += counts[i];
+	}
+
+	st.p99EnqueueNs_ = 0;
+	uint64_t target = total - total / 100; // the records below the 99th percentile
+	uint64_t seen = 0;
+	for (int i = 0; i < LATENCY_BUCKETS && total != 0; ++i)
+	{
+		seen += counts[i];
+		if (seen >= target)
+		{
+			st.p99EnqueueNs_ = (1ULL << i);
+			break;
+		}
+	}
+}
+
+Erref AsyncLogger::captureState()
+{
+	Stats st;
+	getStats(st);
+	return LogErrorSource.mkMui(EPEM_LOG_ASYNC_STATE,
+		(unsigned long long)st.queueDepth_, (unsigned long long)st.queueSize_,
+		st.enqueued_, st.dropped_, st.written_, st.p99EnqueueNs_);
+}
+
+DWORD WINAPI AsyncLogger::flusherThread(LPVOID arg)
+{
+	AsyncLogger *logger = (AsyncLogger *)arg;
+	ULONGLONG lastPoll = GetTickCount64();
+
+	for (;;)
+	{
+		// Read the flag before draining, so that everything enqueued
+		// before close() is guaranteed to be written.
+		bool stopping = logger->stopping_.load();
+		logger->drain();
+		if (stopping)
+			break;
+
+		ULONGLONG now = GetTickCount64();
+		if (now - lastPoll >= POLL_PERIOD_MS)
+		{
+			logger->sink_->poll();
+			lastPoll = now;
+		}
+
+		logger->sleeping_.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!logger->hasRecords() && !logger->stopping_.load())
+			WaitForSingleObject(logger->wakeup_, POLL_PERIOD_MS);
+		logger->sleeping_.store(false, std::memory_order_relaxed);
+	}
+
+	logger->sink_->poll();
+	return 0;
+}
+
+/**
+ *  FlightRecorder
+ */
+
+#ifdef _WIN32
+std::atomic<FlightRecorder *> FlightRecorder::crashRecorder_(NULL);
+LPTOP_LEVEL_EXCEPTION_FILTER FlightRecorder::prevFilter_;
+#endif
+std::atomic<uint64_t> FlightRecorder::nextSerial_(1);
+thread_local FlightRecorder::ThreadRingList FlightRecorder::threadRings_;
+
+// Synchronizes the list of the live recorders with the threads that
+// release their rings on exit.
+static Critical &flightRecorderCr()
+{
+	static Critical cr;
+	return cr;
+}
+
+// The serial numbers of the recorders that exist, synchronized
+// by flightRecorderCr().
+static std::vector<uint64_t> &flightRecorderSerials()
+{
+	static std::vector<uint64_t> serials;
+	return serials;
+}
+
+// The caller must hold flightRecorderCr().
+static bool flightRecorderLive(__in uint64_t serial)
+{
+	std::vector<uint64_t> &serials = flightRecorderSerials();
+	return std::find(serials.begin(), serials.end(), serial) != serials.end();
+}
+
+bool FlightRecorder::Ring::freeze()
+{
+	frozen_.fetch_add(1);
+	for (int i = 0; writing_.load(); ++i)
+	{
+		if (i >= FREEZE_SPINS)
+		{
+			thaw();
+			return false;
+		}
+		SwitchToThread();
+	}
+	return true;
+}
+
+void FlightRecorder::Ring::release()
+{
+	waitWrite();
+	count_.store(0, std::memory_order_relaxed);
+	for (size_t i = 0; i <= mask_; ++i)
+		entries_[i].err_.reset();
+	header_.reset();
+	inUse_.store(false, std::memory_order_release);
+	endWrite();
+}
+
+FlightRecorder::ThreadRingList::~ThreadRingList()
+{
+	ScopeCritical sc(flightRecorderCr());
+	for (size_t i = 0; i < rings_.size(); ++i)
+	{
+		if (flightRecorderLive(rings_[i].serial_))
+			rings_[i].ring_->release();
+	}
+}
+
+void FlightRecorder::ThreadRingList::prune()
+{
+	ScopeCritical sc(flightRecorderCr());
+	size_t n = 0;
+	for (size_t i = 0; i < rings_.size(); ++i)
+	{
+		if (flightRecorderLive(rings_[i].serial_))
+			rings_[n++] = rings_[i];
+	}
+	rings_.resize(n);
+}
+
+FlightRecorder::FlightRecorder(
+	__in std::shared_ptr<Logger> sink,
+	_In_ Severity minSeverity,
+	__in size_t ringSize
+) :
+	Logger(minSeverity),
+	sink_(sink), ringSize_(2),
+	serial_(nextSerial_.fetch_add(1, std::memory_order_relaxed)),
+	rings_(NULL)
+{
+	while (ringSize_ < ringSize)
+		ringSize_ <<= 1;
+
+	ScopeCritical sc(flightRecorderCr());
+	flightRecorderSerials().push_back(serial_);
+}
+
+FlightRecorder::~FlightRecorder()
+{
+#ifdef _WIN32
+	FlightRecorder *expected = this;
+	if (crashRecorder_.compare_exchange_strong(expected, NULL))
+		SetUnhandledExceptionFilter(prevFilter_);
+#endif
+
+	{
+		// After this the exiting threads leave the rings alone.
+		ScopeCritical sc(flightRecorderCr());
+		std::vector<uint64_t> &serials = flightRecorderSerials();
+		serials.erase(std::find(serials.begin(), serials.end(), serial_));
+	}
+
+	Ring *ring = rings_.load();
+	while (ring != NULL)
+	{
+		Ring *next = ring->next_;
+		delete ring;
+		ring = next;
+	}
+}
+
+void FlightRecorder::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed))
+		return;
+
+	if (!sink_->allowsSeverity(sev))
+	{
+		Ring *ring = threadRing(true);
+		// A ring frozen by flushAllThreads() loses the record.
+		if (!ring->beginWrite())
+			return;
+		uint64_t count = ring->count_.load(std::memory_order_relaxed);
+		Entry &entry = ring->entries_[count & ring->mask_];
+		entry.err_ = std::move(err);
+		entry.sev_ = sev;
+		entry.entity_ = entity;
+		ring->count_.store(count + 1, std::memory_order_relaxed);
+		ring->endWrite();
+		return;
+	}
+
+	if (sev >= SV_ERROR)
+		dump(sev);
+	sink_->log(err, sev, entity);
+}
+
+void FlightRecorder::poll()
+{
+	sink_->poll();
+}
+
+void FlightRecorder::flushThread()
+{
+	Severity sev = sink_->getMinSeverity();
+	if (sev < SV_INFO)
+		sev = SV_INFO;
+	dump(sev);
+}
+
+void FlightRecorder::flushAllThreads()
+{
+	Severity sev = sink_->getMinSeverity();
+	if (sev < SV_INFO)
+		sev = SV_INFO;
+	dumpAll(sev);
+}
+
+FlightRecorder::Ring *FlightRecorder::threadRing(__in bool create)
+{
+	std::vector<ThreadRing> &rings = threadRings_.rings_;
+	for (size_t i = 0; i < rings.size(); ++i)
+	{
+		if (rings[i].serial_ == serial_)
+			return rings[i].ring_;
+	}
+
+	if (!create)
+		return NULL;
+
+	// A good time to drop the references to the destroyed recorders,
+	// since this happens once per thread and recorder.
+	threadRings_.prune();
+
+	ThreadRing tr;
+	tr.serial_ = serial_;
+	tr.ring_ = claimRing();
+	rings.push_back(tr);
+	return tr.ring_;
+}
+
+FlightRecorder::Ring *FlightRecorder::claimRing()
+{
+	Ring *ring = NULL;
+	for (Ring *r = rings_.load(std::memory_order_acquire); r != NULL; r = r->next_)
+	{
+		bool expected = false;
+		if (!r->inUse_.load(std::memory_order_relaxed)
+		&& r->inUse_.compare_exchange_strong(expected, true, std::memory_order_acquire))
+		{
+			ring = r;
+			break;
+		}
+	}
+
+	Erref header = LogErrorSource.mkMui(EPEM_LOG_FLIGHT_THREAD, GetCurrentThreadId());
+
+	if (ring != NULL)
+	{
+		// A reader may have seen the ring in use by its previous owner.
+		ring->waitWrite();
+		ring->header_ = header;
+		ring->endWrite();
+		return ring;
+	}
+
+	ring = new Ring(ringSize_);
+	ring->header_ = header;
+	ring->next_ = rings_.load(std::memory_order_relaxed);
+	while (!rings_.compare_exchange_weak(ring->next_, ring,
+		std::memory_order_release, std::memory_order_relaxed))
+	{ }
+	return ring;
+}
+
+void FlightRecorder::dump(__in Severity sev)
+{
+	Ring *ring = threadRing(false);
+	if (ring == NULL)
+		return;
+	uint64_t count = ring->count_.load(std::memory_order_relaxed);
+	if (count == 0)
+		return;
+
+	uint64_t size = ring->mask_ + 1;
+	// The records before first have been overwritten.
+	uint64_t first = (count > size) ? count - size : 0;
+
+	Erref records = LogErrorSource.mkMui(EPEM_LOG_FLIGHT_RECORDER,
+		GetCurrentThreadId(), count - first, first);
+	ring->waitWrite();
+	for (uint64_t i = first; i < count; ++i)
+	{
+		Entry &entry = ring->entries_[i & ring->mask_];
+		// The recorded errors may still be referenced by their creators,
+		// so they get chained as copies.
+		records.append(entry.err_.copy());
+		entry.err_.reset();
+	}
+	ring->count_.store(0, std::memory_order_relaxed);
+	ring->endWrite();
+
+	sink_->log(records, sev, LogEntity::NONE);
+}
+
+void FlightRecorder::dumpAll(__in Severity sev)
+{
+	for (Ring *ring = rings_.load(std::memory_order_acquire); ring != NULL; ring = ring->next_)
+	{
+		if (!ring->inUse_.load(std::memory_order_acquire))
+			continue;
+		if (!ring->freeze())
+			continue;
+
+		// Frozen, the ring can't change, not even get released.
+		uint64_t count = ring->count_.load(std::memory_order_relaxed);
+		if (ring->inUse_.load(std::memory_order_relaxed) && count != 0)
+		{
+			uint64_t size = ring->mask_ + 1;
+			uint64_t first = (count > size) ? count - size : 0;
+
+			// The header and the records are logged as they are, since
+			// chaining them together would need copies.
+			sink_->log(ring->header_, sev, LogEntity::NONE);
+			for (uint64_t i = first; i < count; ++i)
+			{
+				Entry &entry = ring->entries_[i & ring->mask_];
+				sink_->log(entry.err_, sev, entry.entity_);
+			}
+		}
+		ring->thaw();
+	}
+}
+
+#ifdef _WIN32
+void FlightRecorder::installCrashHandler()
+{
+	FlightRecorder *prev = crashRecorder_.exchange(this);
+	if (prev == NULL)
+		prevFilter_ = SetUnhandledExceptionFilter(&crashFilter);
+}
+
+LONG WINAPI FlightRecorder::crashFilter(__in PEXCEPTION_POINTERS ep)
+{
+	FlightRecorder *recorder = crashRecorder_.load();
+	if (recorder != NULL)
+	{
+		recorder->dumpAll(SV_ERROR);
+		recorder->sink_->poll();
+	}
+
+	if (prevFilter_ != NULL)
+		return prevFilter_(ep);
+	return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif
+
+/**
+ *  RateLimitLogger
+ */
+
+// Mix one more value into a hash key.
+static uint64_t mixKey(
+	__in uint64_t h,
+	__in uint64_t v
+)
+{
+	h ^= v + 0x9E3779B97F4A7C15ull + (h << 6) + (h >> 2);
+	return h * 0xBF58476D1CE4E5B9ull;
+}
+
+RateLimitLogger::RateLimitLogger(
+	__in std::shared_ptr<Logger> sink,
+	_In_ Severity minSeverity,
+	__in const Options &opts
+) :
+	Logger(minSeverity),
+	sink_(sink), opts_(opts), lastSweep_(GetTickCount64()),
+	passed_(0), repeated_(0), dropped_(0), reports_(0)
+{
+	if (opts_.burst_ < 1)
+		opts_.burst_ = 1;
+	filterEntitiesBy(*sink_);
+	StateSources::add(this);
+}
+
+RateLimitLogger::~RateLimitLogger()
+{
+	StateSources::remove(this);
+	sweep(true);
+}
+
+uint64_t RateLimitLogger::repeatKey(
+	__in const Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	uint64_t h = mixKey((uint64_t)sev, (uint64_t)entity);
+	for (const ErrorMsg *e = err.get(); e != NULL; e = e->chain_.get())
+	{
+		h = mixKey(h, (uint64_t)(uintptr_t)e->source_);
+		h = mixKey(h, (uint64_t)e->code_);
+	}
+	return h;
+}
+
+uint64_t RateLimitLogger::bucketKey(
+	__in const Erref &err,
+	__in LogEntity::Id entity
+)
+{
+	return mixKey((uint64_t)entity, (uint64_t)(uintptr_t)err->source_);
+}
+
+bool RateLimitLogger::sameChain(
+	__in const ErrorMsg *a,
+	__in const ErrorMsg *b
+)
+{
+	for (; a != NULL && b != NULL; a = a->chain_.get(), b = b->chain_.get())
+	{
+		if (a->source_ != b->source_ || a->code_ != b->code_)
+			return false;
+	}
+	return (a == NULL && b == NULL);
+}
+
+bool RateLimitLogger::Repeat::matches(
+	__in const Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+) const
+{
+	if (sev_.load(std::memory_order_relaxed) != (int)sev
+	|| entity_.load(std::memory_order_relaxed) != entity)
+		return false;
+	uint32_t len = chainLen_.load(std::memory_order_relaxed);
+	if (len > CHAIN_LIMIT)
+		return false;
+	uint32_t i = 0;
+	for (const ErrorMsg *e = err.get(); e != NULL; e = e->chain_.get(), ++i)
+	{
+		if (i >= len
+		|| sources_[i].load(std::memory_order_relaxed) != e->source_
+		|| codes_[i].load(std::memory_order_relaxed) != e->code_)
+			return false;
+	}
+	return (i == len);
+}
+
+void RateLimitLogger::logBody(
+	__in Erref err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	if (sev < minSeverity_.load(std::memory_order_relaxed))
+		return;
+
+	ULONGLONG now = GetTickCount64();
+
+	if (opts_.windowMs_ != 0)
+	{
+		uint64_t key = repeatKey(err, sev, entity);
+		Shard &shard = shards_[key & (SHARDS - 1)];
+		if (countRepeat(shard, key, err, sev, entity, now))
+			return;
+
+		Erref repeats;
+		{
+			ScopeCritical sc(shard.cr_);
+			if (collapseL(shard, key, err, sev, entity, now, repeats))
+				return;
+		}
+		if (repeats)
+			report(repeats, sev, entity);
+	}
+
+	passLimited(err, sev, entity, now);
+}
+
+bool RateLimitLogger::countRepeat(
+	__in Shard &shard,
+	__in uint64_t key,
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity,
+	__in ULONGLONG now
+)
+{
+	size_t base = (size_t)(key / SHARDS);
+	for (int i = 0; i < REPEAT_PROBES; ++i)
+	{
+		Repeat &rep = shard.repeats_[(base + i) & (REPEAT_SLOTS - 1)];
+		uint64_t state = rep.state_.load(std::memory_order_acquire);
+		if ((state & RS_CLOSED) || rep.key_.load(std::memory_order_relaxed) != key)
+			continue;
+		bool same = rep.matches(err, sev, entity);
+		bool current = (now - rep.start_.load(std::memory_order_relaxed) < opts_.windowMs_);
+		// If the entry is getting reused, the fields above may come from
+		// its next record. Then the state has changed, and addRepeat()
+		// fails. Pairs with the fence in openL().
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (!same)
+			continue;
+		if (!current)
+			return false;
+		return addRepeat(rep, state, err);
+	}
+	return false;
+}
+
+bool RateLimitLogger::collapseL(
+	__in Shard &shard,
+	__in uint64_t key,
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity,
+	__in ULONGLONG now,
+	__out Erref &repeats
+)
+{
+	size_t base = (size_t)(key / SHARDS);
+	Repeat *unused = NULL;
+	for (int i = 0; i < REPEAT_PROBES; ++i)
+	{
+		Repeat &rep = shard.repeats_[(base + i) & (REPEAT_SLOTS - 1)];
+		// Under the lock the entries don't get opened or closed,
+		// only their counts may change.
+		uint64_t state = rep.state_.load(std::memory_order_relaxed);
+		if (state & RS_CLOSED)
+		{
+			if (unused == NULL)
+				unused = &rep;
+			continue;
+		}
+		if (rep.key_.load(std::memory_order_relaxed) != key)
+			continue;
+
+		if (rep.sev_.load(std::memory_order_relaxed) != (int)sev
+		|| rep.entity_.load(std::memory_order_relaxed) != entity
+		|| !sameChain(rep.first_.get(), err.get()))
+			return false; // a collision of the keys, the record just passes through
+
+		if (now - rep.start_.load(std::memory_order_relaxed) < opts_.windowMs_)
+			return addRepeat(rep, state, err);
+
+		// The window has ended, this record starts the next one.
+		repeats = closeL(rep, now);
+		openL(rep, key, err, sev, entity, now);
+		return false;
+	}
+
+	if (unused != NULL)
+		openL(*unused, key, err, sev, entity, now);
+	// else the table is full around this key, and the record
+	// passes without collapsing
+	return false;
+}
+
+bool RateLimitLogger::addRepeat(
+	__inout Repeat &rep,
+	__in uint64_t state,
+	__in Erref &err
+)
+{
+	uint64_t gen = state & ~(uint64_t)RS_COUNT_MASK;
+	while (!rep.state_.compare_exchange_weak(state, state + 1,
+		std::memory_order_acq_rel, std::memory_order_acquire))
+	{
+		// The other repeats only change the count.
+		if ((state & ~(uint64_t)RS_COUNT_MASK) != gen)
+			return false;
+	}
+	repeated_.fetch_add(1, std::memory_order_relaxed);
+
+	// The last record is kept by whichever thread gets to it first,
+	// the others only count. A thread delayed past the end of the window
+	// may leave its record here with the old generation, then it doesn't
+	// get reported.
+	Erref old;
+	if (!rep.lastBusy_.exchange(true, std::memory_order_acquire))
+	{
+		old = std::move(rep.last_);
+		rep.last_ = std::move(err);
+		rep.lastGen_ = gen;
+		rep.lastBusy_.store(false, std::memory_order_release);
+	}
+	return true;
+}
+
+Erref RateLimitLogger::closeL(
+	__inout Repeat &rep,
+	__in ULONGLONG now
+)
+{
+	uint64_t state = rep.state_.fetch_or(RS_CLOSED, std::memory_order_acq_rel);
+	uint64_t count = state & RS_COUNT_MASK;
+
+	while (rep.lastBusy_.exchange(true, std::memory_order_acquire))
+		SwitchToThread();
+	Erref last;
+	if (rep.lastGen_ == (state & ~(uint64_t)RS_COUNT_MASK))
+		last = std::move(rep.last_);
+	rep.last_.reset();
+	rep.lastBusy_.store(false, std::memory_order_release);
+
+	Erref repeats;
+	if (count != 0)
+	{
+		repeats = LogErrorSource.mkMui(EPEM_LOG_REPEATED,
+			count, (unsigned long long)(now - rep.start_.load(std::memory_order_relaxed)));
+		// The recorded errors may still be referenced by their creators,
+		// so they get chained as copies.
+		if (last)
+			repeats.append(last.copy());
+	}
+	rep.first_.reset();
+	return repeats;
+}
+
+void RateLimitLogger::openL(
+	__inout Repeat &rep,
+	__in uint64_t key,
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity,
+	__in ULONGLONG now
+)
+{
+	uint64_t state = rep.state_.load(std::memory_order_relaxed);
+	// The lock-free readers that see the fields below also see
+	// the entry closed, by the time they try to count.
+	std::atomic_thread_fence(std::memory_order_release);
+
+	rep.key_.store(key, std::memory_order_relaxed);
+	rep.start_.store(now, std::memory_order_relaxed);
+	rep.sev_.store((int)sev, std::memory_order_relaxed);
+	rep.entity_.store(entity, std::memory_order_relaxed);
+	uint32_t len = 0;
+	for (const ErrorMsg *e = err.get(); e != NULL; e = e->chain_.get(), ++len)
+	{
+		if (len < CHAIN_LIMIT)
+		{
+			rep.sources_[len].store(e->source_, std::memory_order_relaxed);
+			rep.codes_[len].store(e->code_, std::memory_order_relaxed);
+		}
+	}
+	rep.chainLen_.store(len, std::memory_order_relaxed);
+	rep.first_ = err;
+
+	// The next generation, open, with no repeats.
+	uint64_t gen = (state & ~(uint64_t)RS_COUNT_MASK) + (1ull << RS_COUNT_BITS);
+	rep.state_.store(gen & ~(uint64_t)RS_CLOSED, std::memory_order_release);
+}
+
+void RateLimitLogger::refillL(
+	__inout Bucket &b,
+	__in ULONGLONG now
+)
+{
+	b.tokens_ += (double)(now - b.last_) * opts_.ratePerSec_ / 1000.;
+	if (b.tokens_ > opts_.burst_)
+		b.tokens_ = opts_.burst_;
+	b.last_ = now;
+}
+
+void RateLimitLogger::passLimited(
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity,
+	__in ULONGLONG now
+)
+{
+	if (opts_.ratePerSec_ != 0)
+	{
+		uint64_t key = bucketKey(err, entity);
+		Shard &shard = shards_[key & (SHARDS - 1)];
+		Erref drops;
+		Severity dropSev = sev;
+		{
+			ScopeCritical sc(shard.cr_);
+			auto ins = shard.buckets_.emplace(key, Bucket());
+			Bucket &b = ins.first->second;
+			if (ins.second)
+			{
+				b.tokens_ = opts_.burst_;
+				b.last_ = now;
+				b.dropped_ = 0;
+				b.sev_ = sev;
+				b.entity_ = entity;
+			}
+			else
+			{
+				refillL(b, now);
+			}
+			if (b.tokens_ < 1.)
+			{
+				if (b.dropped_ == 0 || sev > b.sev_)
+					b.sev_ = sev;
+				++b.dropped_;
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			b.tokens_ -= 1.;
+			if (b.dropped_ != 0)
+			{
+				drops = LogErrorSource.mkMui(EPEM_LOG_RATE_LIMITED, b.dropped_);
+				dropSev = b.sev_;
+				b.dropped_ = 0;
+			}
+		}
+		if (drops)
+			report(drops, dropSev, entity);
+	}
+
+	passed_.fetch_add(1, std::memory_order_relaxed);
+	sink_->log(err, sev, entity);
+}
+
+void RateLimitLogger::report(
+	__in Erref &err,
+	__in Severity sev,
+	__in LogEntity::Id entity
+)
+{
+	reports_.fetch_add(1, std::memory_order_relaxed);
+	sink_->log(err, sev, entity);
+}
+
+void RateLimitLogger::sweep(__in bool all)
+{
+	// Collected first and written after unlocking, to keep the sink's
+	// time out of the locks.
+	struct Report {
+	public:
+		Erref err_;
+		Severity sev_;
+		LogEntity::Id entity_;
+	};
+	std::vector<Report> reports;
+	ULONGLONG now = GetTickCount64();
+
+	for (int i = 0; i < SHARDS; ++i)
+	{
+		Shard &shard = shards_[i];
+		ScopeCritical sc(shard.cr_);
+
+		for (int j = 0; j < REPEAT_SLOTS; ++j)
+		{
+			Repeat &rep = shard.repeats_[j];
+			if ((rep.state_.load(std::memory_order_relaxed) & RS_CLOSED)
+			|| (!all && now - rep.start_.load(std::memory_order_relaxed) < opts_.windowMs_))
+				continue;
+			// The next record will start a new window.
+			Report r;
+			r.err_ = closeL(rep, now);
+			if (r.err_)
+			{
+				r.sev_ = (Severity)rep.sev_.load(std::memory_order_relaxed);
+				r.entity_ = rep.entity_.load(std::memory_order_relaxed);
+				reports.push_back(r);
+			}
+		}
+
+		for (auto it = shard.buckets_.begin(); it != shard.buckets_.end(); )
+		{
+			Bucket &b = it->second;
+			refillL(b, now);
+			if (b.dropped_ != 0)
+			{
+				Report r;
+				r.err_ = LogErrorSource.mkMui(EPEM_LOG_RATE_LIMITED, b.dropped_);
+				r.sev_ = b.sev_;
+				r.entity_ = b.entity_;
+				reports.push_back(r);
+				b.dropped_ = 0;
+			}
+			// A full bucket is the same as a new one.
+			if (all || b.tokens_ >= opts_.burst_)
+				it = shard.buckets_.erase(it);
+			else
+				++it;
+		}
+	}
+
+	for (size_t i = 0; i < reports.size(); ++i)
+		report(reports[i].err_, reports[i].sev_, reports[i].entity_);
+}
+
+void RateLimitLogger::poll()
+{
+	// The windows end no more often than this, so there is no point
+	// in going through the shards more often.
+	ULONGLONG period = opts_.windowMs_ != 0 ? opts_.windowMs_ : (ULONGLONG)DEFAULT_WINDOW_MS;
+	ULONGLONG now = GetTickCount64();
+	ULONGLONG last = lastSweep_.load(std::memory_order_relaxed);
+	if (now - last >= period
+	&& lastSweep_.compare_exchange_strong(last, now, std::memory_order_relaxed))
+		sweep(false);
+
+	sink_->poll();
+}
+
+void RateLimitLogger::getStats(__out Stats &st)
+{
+	st.passed_ = passed_.load(std::memory_order_relaxed);
+	st.repeated_ = repeated_.load(std::memory_order_relaxed);
+	st.dropped_ = dropped_.load(std::memory_order_relaxed);
+	st.reports_ = reports_.load(std::memory_order_relaxed);
+}
+
+Erref RateLimitLogger::captureState()
+{
+	Stats st;
+	getStats(st);
+	return LogErrorSource.mkMui(EPEM_LOG_LIMITER_STATE,
+		st.passed_, st.repeated_, st.dropped_, st.reports_);
+}
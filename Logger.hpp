@@ -1,281 +1,2009 @@
-/*++
-
-Copyright (c) 2016 Microsoft Corporation
-
-https://blogs.msdn.microsoft.com/sergey_babkins_blog/2016/12/30/error-handling-part-6-etw-logging-example/
-
---*/
-
-
-class LogEntity
-{
-	// Normally stored in a shared_ptr.
-	// The address of this object is used as a token used to group
-	// the messages from this entity inside the loggers.
-public:
-	LogEntity(const std::wstring &name) :
-		name_(name)
-	{
-	}
-
-	std::wstring name_; // name of the entity
-};
-
-class Logger
-{
-public:
-	enum Severity {
-		SV_DEBUG,
-		SV_VERBOSE, // the detailed information
-		SV_INFO,
-		SV_WARNING,
-		SV_ERROR,
-		SV_NEVER, // pseudo-severity, used to indicate that the logger logs nothing
-		SV_DEFAULT_MIN = SV_INFO // the default lowest severity to be logged
-	};
-
-	// Specify the minimum severity to not throw away.
-	Logger(Severity minSeverity) :
-		minSeverity_(minSeverity)
-	{
-	}
-
-	// A Logger would normally be reference-counted by shared_ptr.
-	virtual ~Logger();
-
-	// Log a message. Works even on a NULL pointer to a logger
-	// (i.e. if the logger is not available, throws away the messages).
-	//
-	// err - the error object
-	// sev - the severity (the logger might decide to throw away the
-	//      messages below some level)
-	// entity - description of the entity that reported the error;
-	//      may be NULL
-	void log(
-		__in Erref err,
-		__in Severity sev,
-		__in_opt std::shared_ptr<LogEntity> entity
-	)
-	{
-		if (this != NULL && err) // ignore the no-errors
-			logBody(err, sev, entity);
-	}
-
-	// May be called periodically in case if the logger
-	// needs to do some periodic processing, such as flushing
-	// the buffers. The EtwLogger uses this method to send
-	// the collected backlog after the provider gets enabled
-	// even if there are no more log messages written.
-	// The default implementation does nothing.
-	virtual void poll();
-
-	// A special-case hack for the small tools:
-	// If this error reference is not empty, log it and exit(1).
-	// As another special case, if this logger object is NULL,
-	// the error gets printed directly on stdout.
-	// The severity here is always SV_ERROR.
-	void logAndExitOnError(
-		__in Erref err,
-		__in_opt std::shared_ptr<LogEntity> entity
-	);
-
-	// The internal implementation of log()
-	// This function must be internally synchronized, since it will
-	// be called from multiple threads. Implemented in subclasses.
-	virtual void logBody(
-		__in Erref err,
-		__in Severity sev,
-		__in_opt std::shared_ptr<LogEntity> entity
-	) = 0;
-
-	// The smarter check that works even on a NULL pointer.
-	Severity getMinSeverity() const
-	{
-		if (this == NULL)
-			return SV_NEVER;
-		else
-			return minSeverity_;
-	}
-
-	// Check that the logger will accept messages of a given severity.
-	// Can be used to avoid printing message sthat will be thrown away.
-	bool allowsSeverity(Severity sv) const
-	{
-		if (this == NULL)
-			return false;
-		else
-			return (sv >= minSeverity_);
-	}
-
-	virtual void setMinSeverity(Severity sv);
-
-	// Translate the severity into an one-letter indication.
-	// Returns '?' for an invalid value.
-	static WCHAR oneLetterSeverity(Severity sv);
-
-	// Translate the severity into a full name.
-	// Returns NULL for an invalid value.
-	static const WCHAR *strSeverity(Severity sv);
-
-	// Translate the human-readable name of severity to
-	// enum value.
-	// Returns SV_NEVER if it cannot find a name.
-	static Severity severityFromName(const std::wstring &svname);
-
-	// Returns the list of all supported severity levels.
-	static std::wstring listAllSeverities();
-
-public:
-	volatile Severity minSeverity_; // the lowest severity that passes through the logger;
-		// normally set once and then read-only, the callers may use it to
-		// optimize and skip the messages that will be thrown away
-};
-
-// A shortcut if the message is intended only for logging:
-// skips the message creation if the logger won't record it anyway.
-#define LOG_SHORTCUT(logger, severity, entity, err) do { \
-    if (logger->allowsSeverity(severity)) { \
-        logger->log(err, severity, entity); \
-    } } while(0)
-
-
-class EtwLogger : public Logger
-{
-public:
-	// The approximate limit on the message string length
-	// in one ETW message, in characters. The message chains longer
-	// than that will be split up. The individual messages in the
-	// chain will not be split, so if a real long message happens,
-	// it will hit the ETW limit and be thrown away.
-	//
-	// Since the strings are in Unicode, that the character number
-	// must be multiplied by 2 to get the byte size.
-	// Keep in mind that the ETW message size limit is 64KB, including
-	// all the headers.
-	enum { STRING_LIMIT = 5 * 1000 };
-	// The maximum expected number of fields in the message,
-	// which drives the limit on the number of the error codes per message
-	// (i.e. the nesting depth of the Erref).
-	enum { MSG_FIELD_LIMIT = 100 };
-
-	// guid - GUID of the ETW provider (must match the .man file)
-	// minSeverity - the minimum severity to not throw away.
-	//
-	// The errors are kept, and can be extracted with error().
-	// A EtwLogger with errors cannot be used.
-	EtwLogger(
-		LPCGUID guid,
-		_In_ Severity minSeverity = SV_DEFAULT_MIN
-	);
-
-	// Closes the file.
-	~EtwLogger();
-
-	// Close the logger at any time (no logging is possible after that).
-	// The errors get recorded and can be extracted with error().
-	void close();
-
-	// from Logger
-	void logBody(
-		__in Erref err,
-		__in Severity sev,
-		__in_opt std::shared_ptr<LogEntity> entity
-	);
-	void poll();
-
-	// Get the logger's fatal error. Obviously, it would have to be reported
-	// in some other way.
-	Erref error()
-	{
-		return err_;
-	}
-
-protected:
-	// Callback from ETW to enable and disable logging.
-	static void NTAPI callback(
-		_In_ LPCGUID sourceId,
-		_In_ ULONG isEnabled,
-		_In_ UCHAR level,
-		_In_ ULONGLONG matchAnyKeyword,
-		_In_ ULONGLONG matchAllKeywords,
-		_In_opt_ PEVENT_FILTER_DESCRIPTOR filterData,
-		_In_opt_ PVOID context
-	);
-
-	// The actual logging. The caller must check that
-	// the logging is already enabled and that the severity
-	// level is allowed.
-	// The caller must also hold cr_.
-	void logBodyInternalL(
-		__in Erref err,
-		__in Severity sev,
-		__in_opt std::shared_ptr<LogEntity> entity
-	);
-
-	// Check if anything is in the backlog, and forward it.
-	// The caller must also hold cr_.
-	void processBacklogL();
-
-	enum {
-		// Up to how many entries to keep on the backlog.
-		BACKLOG_LIMIT = 4096,
-	};
-	struct BacklogEntry {
-	public:
-		Erref err_;
-		Severity sev_;
-		std::shared_ptr<LogEntity> entity_;
-
-	public:
-		BacklogEntry(
-			__in Erref err,
-			__in Severity sev,
-			__in_opt std::shared_ptr<LogEntity> entity
-		) :
-			err_(err),
-			sev_(sev),
-			entity_(entity)
-		{
-        }
-	};
-
-protected:
-	Critical cr_;			// synchronizes the object
-	std::wstring guidName_; // for error reports, GUID in string format
-	REGHANDLE h_;			// handle for logging
-	Erref err_;				// the recorded fatal error
-	Severity origMinSeverity_; // the minimal severity as was set on creation
-	std::deque<BacklogEntry> backlog_; // backlog of messages to send when the provider becomes enabled
-	bool enabled_; // whether anyone is listening in ETW
-};
-
-class StdoutLogger : public Logger
-{
-public:
-    StdoutLogger(
-        _In_ Severity minSeverity = SV_DEFAULT_MIN
-    );
-    ~StdoutLogger();
-
-    // The internal implementation of log()
-    // This function must be internally synchronized, since it will
-    // be called from multiple threads. Implemented in subclasses.
-    void logBody(
-        __in Erref err,
-        __in Severity sev,
-        __in_opt std::shared_ptr<LogEntity> entity
-    );
-
-};
-
-#define NTSTATUS ULONG
-
-#define EVENT_CONTROL_CODE_DISABLE_PROVIDER 0
-#define EVENT_CONTROL_CODE_ENABLE_PROVIDER 1
-#define EVENT_CONTROL_CODE_CAPTURE_STATE 2
-
-#define TRACE_LEVEL_CRITICAL 1
-#define TRACE_LEVEL_ERROR 2
-#define TRACE_LEVEL_WARNING 3
-#define TRACE_LEVEL_INFORMATION 4
-#define TRACE_LEVEL_VERBOSE 5
+/*++
+
+Copyright (c) 2016 Microsoft Corporation
+
+https://blogs.msdn.microsoft.com/sergey_babkins_blog/2016/12/30/error-handling-part-6-etw-logging-example/
+
+--*/
+
+// The build-time minimum severity: the call sites of LOG_SHORTCUT(),
+// LOG_DEBUG() etc. and Logger::logLazy() with a constant severity below
+// it compile to nothing. Can be overridden from the compiler options.
+#ifndef LOG_MIN_SEVERITY
+# ifdef _DEBUG
+#  define LOG_MIN_SEVERITY Logger::SV_DEBUG
+# else
+#  define LOG_MIN_SEVERITY Logger::SV_INFO
+# endif
+#endif
+
+// The entities that report the messages. An entity gets registered
+// once by name, and the log calls pass around only its small integer ID,
+// without touching any shared state. The loggers use the ID as a token
+// to group the messages from this entity, and look up the name to print it.
+// The entities are never unregistered.
+//
+// An entity may also have the ETW keyword bits, that let a tracing
+// session enable only the messages of the chosen subsystems
+// (see KeywordFilter).
+class LogEntity
+{
+public:
+	typedef uint32_t Id;
+
+	enum {
+		NONE = 0, // the ID for the messages not tied to any entity
+		LIMIT = 64 * 1024, // the maximal number of the registered entities
+	};
+
+	// Register an entity, or find the already registered one
+	// with the same name (then its original keywords stay).
+	// keywords - the ETW keyword bits of the entity; the high 16 bits
+	//     are reserved by ETW and must not be used; 0 means that the
+	//     entity's messages pass any keyword filter
+	// Returns NONE if too many entities are registered already.
+	static Id intern(
+		__in const std::wstring &name,
+		__in ULONGLONG keywords = 0);
+
+	// Get the name of an entity. The name stays valid until the
+	// program exits. Doesn't take any locks.
+	// Returns NULL for NONE or an unknown ID.
+	static const std::wstring *name(
+		__in Id id);
+
+	// Get the keywords of an entity. Doesn't take any locks.
+	// Returns 0 for NONE or an unknown ID.
+	static ULONGLONG keywords(
+		__in Id id);
+};
+
+// The ETW-style keyword filter: a message passes if its keywords are 0,
+// or if matchAny is 0, or if its keywords contain any of the matchAny
+// bits and all of the matchAll bits. The reads take no locks: the pair
+// of masks is guarded by a sequence number, and a reader that races
+// with an update retries.
+class KeywordFilter
+{
+public:
+	KeywordFilter() :
+		seq_(0), matchAny_(0), matchAll_(0)
+	{
+	}
+
+	// Set the masks. The caller must serialize the calls.
+	void set(
+		__in ULONGLONG matchAny,
+		__in ULONGLONG matchAll)
+	{
+		uint32_t seq = seq_.load(std::memory_order_relaxed);
+		seq_.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		matchAny_.store(matchAny, std::memory_order_relaxed);
+		matchAll_.store(matchAll, std::memory_order_relaxed);
+		seq_.store(seq + 2, std::memory_order_release);
+	}
+
+	// A quick check whether the filter lets everything through.
+	// It may be stale if set() runs concurrently.
+	bool passesAll() const
+	{
+		return matchAny_.load(std::memory_order_relaxed) == 0;
+	}
+
+	// Check whether the message with the given keywords passes.
+	bool matches(
+		__in ULONGLONG keywords) const
+	{
+		if (keywords == 0)
+			return true;
+		for (;;) {
+			uint32_t seq = seq_.load(std::memory_order_acquire);
+			ULONGLONG any = matchAny_.load(std::memory_order_relaxed);
+			ULONGLONG all = matchAll_.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if ((seq & 1) == 0 && seq_.load(std::memory_order_relaxed) == seq)
+				return any == 0
+					|| ((keywords & any) != 0 && (keywords & all) == all);
+		}
+	}
+
+protected:
+	std::atomic<uint32_t> seq_; // odd while an update is in progress
+	std::atomic<ULONGLONG> matchAny_;
+	std::atomic<ULONGLONG> matchAll_;
+};
+
+class Logger
+{
+public:
+	enum Severity {
+		SV_DEBUG,
+		SV_VERBOSE, // the detailed information
+		SV_INFO,
+		SV_WARNING,
+		SV_ERROR,
+		SV_NEVER, // pseudo-severity, used to indicate that the logger logs nothing
+		SV_DEFAULT_MIN = SV_INFO // the default lowest severity to be logged
+	};
+
+	// Specify the minimum severity to not throw away.
+	Logger(Severity minSeverity) :
+		minSeverity_(minSeverity), entityFilter_(&keywords_)
+	{
+	}
+
+	// A Logger would normally be reference-counted by shared_ptr.
+	virtual ~Logger();
+
+	// Log a message.
+	//
+	// err - the error object
+	// sev - the severity (the logger might decide to throw away the
+	//      messages below some level)
+	// entity - ID of the entity that reported the error (see LogEntity);
+	//      may be LogEntity::NONE
+	void log(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	)
+	{
+		if (err) // ignore the no-errors
+			logBody(err, sev, entity);
+	}
+
+	// May be called periodically in case if the logger
+	// needs to do some periodic processing, such as flushing
+	// the buffers. The EtwLogger uses this method to send
+	// the collected backlog after the provider gets enabled
+	// even if there are no more log messages written.
+	// The default implementation does nothing.
+	virtual void poll();
+
+	// A special-case hack for the small tools:
+	// If this error reference is not empty, log it and exit(1).
+	// The severity here is always SV_ERROR.
+	void logAndExitOnError(
+		__in Erref err,
+		__in LogEntity::Id entity
+	);
+
+	// The internal implementation of log()
+	// This function must be internally synchronized, since it will
+	// be called from multiple threads. Implemented in subclasses.
+	virtual void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	) = 0;
+
+	Severity getMinSeverity() const
+	{
+		return minSeverity_.load(std::memory_order_relaxed);
+	}
+
+	// Check that the logger will accept messages of a given severity.
+	// Can be used to avoid printing message sthat will be thrown away.
+	bool allowsSeverity(Severity sv) const
+	{
+		return (sv >= minSeverity_.load(std::memory_order_relaxed));
+	}
+
+	// Check that the logger will accept the messages from a given entity,
+	// by the keyword filter.
+	bool allowsEntity(LogEntity::Id entity) const
+	{
+		if (entity == LogEntity::NONE || entityFilter_->passesAll())
+			return true;
+		return entityFilter_->matches(LogEntity::keywords(entity));
+	}
+
+	// Check that the logger will accept the messages of a given severity
+	// from a given entity.
+	bool allows(Severity sv, LogEntity::Id entity) const
+	{
+		return allowsSeverity(sv) && allowsEntity(entity);
+	}
+
+	// Check whether the messages of a given severity are compiled in
+	// at all, see LOG_MIN_SEVERITY. With a constant argument, it's
+	// a compile-time constant.
+	static constexpr bool compiledIn(Severity sv)
+	{
+		return sv >= LOG_MIN_SEVERITY;
+	}
+
+	// Log a message built only if it will be recorded:
+	//   logger->logLazy<Logger::SV_DEBUG>(entity, [&] {
+	//       return Source.mkString(...);
+	//   });
+	// Below LOG_MIN_SEVERITY the call compiles to nothing, otherwise
+	// it costs one check of the minimal severity (and of the keyword
+	// filter, if any is set).
+	//
+	// entity - ID of the entity that reported the error (see LogEntity);
+	//      may be LogEntity::NONE
+	// make - a callable returning the error object
+	template <Severity SV, typename Make>
+	void logLazy(
+		__in LogEntity::Id entity,
+		__in Make make
+	)
+	{
+		if (compiledIn(SV) && allows(SV, entity))
+			log(make(), SV, entity);
+	}
+
+	virtual void setMinSeverity(Severity sv);
+
+	// Translate the severity into an one-letter indication.
+	// Returns '?' for an invalid value.
+	static WCHAR oneLetterSeverity(Severity sv);
+
+	// Translate the severity into a full name.
+	// Returns NULL for an invalid value.
+	static const WCHAR *strSeverity(Severity sv);
+
+	// Translate the human-readable name of severity to
+	// enum value.
+	// Returns SV_NEVER if it cannot find a name.
+	static Severity severityFromName(const std::wstring &svname);
+
+	// Returns the list of all supported severity levels.
+	static std::wstring listAllSeverities();
+
+	// Format a record the way the text loggers write it, in UTF-8:
+	// the local time, the one-letter severity, the entity name (if any)
+	// and the error chain, one message per line.
+	// dest - the string to append the record to
+	static void formatRecord(
+		__inout std::string &dest,
+		__in const Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Get the current time in the form kept in the binary records:
+	// the 100-ns intervals since 1601-01-01 UTC, as in FILETIME.
+	static uint64_t recordTime();
+
+	// Format a record like formatRecord() does, from the parts
+	// read from a binary log (see BinaryLogReader).
+	// entname - name of the entity, or NULL
+	// time - the time of the record, as returned by recordTime()
+	static void formatRecordAt(
+		__inout std::string &dest,
+		__in const Erref &err,
+		__in Severity sev,
+		__in_opt const std::wstring *entname,
+		__in uint64_t time
+	);
+
+public:
+	// The lowest severity that passes through the logger; normally set
+	// once and then read-only, the callers may use it to optimize and
+	// skip the messages that will be thrown away. Nothing is ordered by it,
+	// so it's accessed with the relaxed loads and stores.
+	std::atomic<Severity> minSeverity_;
+	// The filter by the entities' keywords. Passes everything
+	// unless set by the logger (as EtwLogger does from the ETW session).
+	KeywordFilter keywords_;
+	// The filter that allowsEntity() checks: keywords_, or the filter
+	// of the sink for the loggers that pass the records on to a sink,
+	// so that the shortcuts skip the messages that the sink would drop.
+	const KeywordFilter *entityFilter_;
+
+protected:
+	// Check the entities by the sink's filter, see entityFilter_.
+	// The sink must outlive this logger.
+	void filterEntitiesBy(__in const Logger &sink)
+	{
+		entityFilter_ = sink.entityFilter_;
+	}
+};
+
+// A shortcut if the message is intended only for logging:
+// skips the message creation if the logger won't record it anyway,
+// or if the logger pointer is NULL (i.e. the logger is not available).
+// With a constant severity below LOG_MIN_SEVERITY compiles to nothing.
+#define LOG_SHORTCUT(logger, severity, entity, err) do { \
+    if (Logger::compiledIn(severity) && (logger) && (logger)->allows(severity, entity)) { \
+        (logger)->log(err, severity, entity); \
+    } } while(0)
+
+// The shortcuts for the fixed severities.
+#define LOG_DEBUG(logger, entity, err) LOG_SHORTCUT(logger, Logger::SV_DEBUG, entity, err)
+#define LOG_VERBOSE(logger, entity, err) LOG_SHORTCUT(logger, Logger::SV_VERBOSE, entity, err)
+#define LOG_INFO(logger, entity, err) LOG_SHORTCUT(logger, Logger::SV_INFO, entity, err)
+#define LOG_WARNING(logger, entity, err) LOG_SHORTCUT(logger, Logger::SV_WARNING, entity, err)
+#define LOG_ERROR(logger, entity, err) LOG_SHORTCUT(logger, Logger::SV_ERROR, entity, err)
+
+// A component that can describe its current state on demand. Instead of
+// logging its state continuously at the verbose level, the component
+// registers itself in StateSources, and its state gets logged only when
+// a snapshot is requested (such as by an ETW capture-state request to
+// EtwLogger).
+class StateSource
+{
+public:
+	virtual ~StateSource();
+
+	// Describe the current state, as a chain of messages.
+	// Called on the thread that requests the snapshot, without holding
+	// the registry's lock, so it must be internally synchronized. May
+	// log and register the sources, but must not unregister any.
+	// Returns NULL if there is nothing to report.
+	virtual Erref captureState() = 0;
+};
+
+// The registry of the state sources.
+class StateSources
+{
+public:
+	// Register a source. The source must unregister itself before
+	// it gets destroyed.
+	static void add(
+		__in StateSource *source);
+
+	// Unregister a source. If a snapshot in progress has the source,
+	// waits for it to complete, so it must not be called from
+	// captureState(). Does nothing if the source is not registered.
+	static void remove(
+		__in StateSource *source);
+
+	// Collect the states of all the registered sources, in the order
+	// of their registration.
+	static void capture(
+		__out std::vector<Erref> &states);
+
+	// Collect the states and log them at SV_INFO. Can be used to take
+	// a snapshot into any logger. Does nothing if the logger is NULL.
+	static void capture(
+		__in Logger *logger);
+};
+
+// The payload of a batched ETW event: several log records packed into
+// a single binary field. All the values are in little-endian:
+//   uint32 MAGIC
+//   uint32 number of records
+//   records, each:
+//     uint8 severity (Logger::Severity)
+//     uint8 reserved, 0
+//     uint16 number of the error codes
+//     uint32 length of the text, in UTF-16 units
+//     uint32 error codes
+//     text in UTF-16, not NUL-terminated
+// The values are not aligned.
+class EtwBatch
+{
+public:
+	enum { MAGIC = 0x31424C45 }; // "ELB1"
+	enum { HEADER_SIZE = 8 };
+	enum { RECORD_HEADER_SIZE = 8 };
+
+	// A decoded record.
+	struct Record {
+	public:
+		Logger::Severity sev_;
+		std::vector<uint32_t> codes_;
+		std::wstring text_;
+	};
+
+	EtwBatch();
+
+	// Drop all the records.
+	void clear();
+
+	// Append a record, unless that would make the batch longer than limit
+	// bytes. A record gets always appended to an empty batch.
+	// Returns true if the record was appended.
+	bool append(
+		__in Logger::Severity sev,
+		_In_reads_(ncodes) const uint32_t *codes,
+		__in size_t ncodes,
+		__in const std::wstring &text,
+		__in size_t limit);
+
+	// Decode the payload of an event.
+	// Returns false if the data is not a valid batch, and then the
+	// records may be decoded only partially.
+	static bool decode(
+		_In_reads_bytes_(size) const void *data,
+		__in size_t size,
+		__out std::vector<Record> &records);
+
+	bool empty() const
+	{
+		return count_ == 0;
+	}
+
+	// The encoded payload.
+	const std::string &data() const
+	{
+		return data_;
+	}
+
+	// The highest severity of the records in the batch.
+	Logger::Severity maxSeverity() const
+	{
+		return maxSev_;
+	}
+
+protected:
+	std::string data_; // the encoded payload
+	uint32_t count_; // number of records
+	Logger::Severity maxSev_; // the highest severity of the records
+};
+
+class EtwLogger : public Logger
+{
+public:
+	// The approximate limit on the message string length
+	// in one ETW message, in characters. The message chains longer
+	// than that will be split up. The individual messages in the
+	// chain will not be split, so if a real long message happens,
+	// it will hit the ETW limit and be thrown away.
+	//
+	// Since the strings are in Unicode, that the character number
+	// must be multiplied by 2 to get the byte size.
+	// Keep in mind that the ETW message size limit is 64KB, including
+	// all the headers.
+	enum { STRING_LIMIT = 5 * 1000 };
+	// The limit on the number of the error codes per message
+	// (i.e. the nesting depth of the Erref). The codes are sent
+	// as a single array field.
+	enum { MSG_FIELD_LIMIT = 100 };
+	// The limit on the payload of a batched event, in bytes,
+	// leaving the space for the ETW headers.
+	enum { BATCH_LIMIT = 60 * 1000 };
+	// The ID of the batched event. This event is not described in the
+	// .man file, its payload is decoded with EtwBatch::decode().
+	enum { BATCH_EVENT_ID = 1000 };
+
+	// guid - GUID of the ETW provider (must match the .man file)
+	// minSeverity - the minimum severity to not throw away.
+	// batch - collect the records and send them in batched events,
+	//     up to BATCH_LIMIT bytes per event; an error record or
+	//     poll() sends the collected batch right away, so poll() must
+	//     be called periodically (as AsyncLogger does)
+	//
+	// The errors are kept, and can be extracted with error().
+	// A EtwLogger with errors cannot be used.
+	EtwLogger(
+		LPCGUID guid,
+		_In_ Severity minSeverity = SV_DEFAULT_MIN,
+		__in bool batch = false
+	);
+
+	// Closes the logger and waits for the backlog replay to stop.
+	~EtwLogger();
+
+	// Close the logger at any time (no logging is possible after that).
+	// The errors get recorded and can be extracted with error().
+	void close();
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Replays the backlog, if the provider is enabled. This is normally
+	// done on a thread pool thread right after the provider gets enabled,
+	// but calling poll() also works. Then sends the collected batch.
+	void poll();
+
+	// Get the logger's fatal error. Obviously, it would have to be reported
+	// in some other way.
+	Erref error()
+	{
+		return err_;
+	}
+
+protected:
+	// The thread pool callback that replays the backlog.
+	// context - the EtwLogger object
+	static VOID CALLBACK replayCallback(
+		_Inout_ PTP_CALLBACK_INSTANCE instance,
+		_Inout_opt_ PVOID context,
+		_Inout_ PTP_WORK work
+	);
+
+	// Callback from ETW to enable and disable logging.
+	static void NTAPI callback(
+		_In_ LPCGUID sourceId,
+		_In_ ULONG isEnabled,
+		_In_ UCHAR level,
+		_In_ ULONGLONG matchAnyKeyword,
+		_In_ ULONGLONG matchAllKeywords,
+		_In_opt_ PEVENT_FILTER_DESCRIPTOR filterData,
+		_In_opt_ PVOID context
+	);
+
+	// The actual logging. The caller must check that
+	// the logging is already enabled and that the severity
+	// level is allowed.
+	// The caller must also hold cr_.
+	void logBodyInternalL(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Send the collected batch, if any.
+	// The caller must also hold cr_.
+	// Returns false if the logger got closed on an error.
+	bool writeBatchL();
+
+	// Write the snapshot of all the state sources, on the
+	// capture-state request.
+	void writeStates();
+
+	// Check the result of EventWrite(), on a fatal error record it
+	// and close the logger.
+	// The caller must also hold cr_.
+	// Returns false if the logger got closed.
+	bool checkWriteL(__in ULONG status);
+
+	// Check whether there is anything to replay: the entries or
+	// the summary of the dropped ones.
+	// The caller must also hold cr_.
+	bool hasBacklogL() const
+	{
+		return backlogCount_ != 0 || backlogDropped_ != 0;
+	}
+
+	// Forward the entries from the backlog, starting with the summary
+	// of the dropped entries, if any.
+	// The caller must also hold cr_.
+	// limit - the maximal number of entries to forward
+	// Returns true if anything is left in the backlog.
+	bool processBacklogL(__in size_t limit);
+
+	enum {
+		// Up to how many entries to keep on the backlog, a power of 2.
+		// When the backlog is full, the oldest entries get overwritten.
+		BACKLOG_LIMIT = 4096,
+		// How many entries to replay at a time, before letting the
+		// logging threads through.
+		REPLAY_BATCH = 64,
+	};
+	struct BacklogEntry {
+	public:
+		BacklogEntry() :
+			sev_(SV_NEVER), entity_(LogEntity::NONE)
+		{
+		}
+
+		Erref err_;
+		Severity sev_;
+		LogEntity::Id entity_;
+	};
+
+protected:
+	Critical cr_;			// synchronizes the object
+	std::wstring guidName_; // for error reports, GUID in string format
+	REGHANDLE h_;			// handle for logging
+	Erref err_;				// the recorded fatal error
+	Severity origMinSeverity_; // the minimal severity as was set on creation
+	// The backlog of messages to send when the provider becomes enabled,
+	// a ring of BACKLOG_LIMIT entries allocated up front.
+	BacklogEntry *backlog_;
+	size_t backlogHead_; // index of the oldest entry
+	size_t backlogCount_; // number of entries in the backlog, under cr_
+	uint64_t backlogDropped_; // number of the overwritten entries,
+		// to be reported before replaying the rest, under cr_
+	PTP_WORK replayWork_; // replays the backlog on a thread pool thread;
+		// NULL if it could not be created, then the backlog gets
+		// replayed by the next logBody() or poll()
+	bool enabled_; // whether anyone is listening in ETW
+	bool batching_; // whether the records get batched
+	EtwBatch batch_; // the collected batch
+	ULONGLONG batchKeywords_; // keywords of the entities in the batch
+	std::wstring text_; // the text of the message being sent, kept
+		// to reuse the memory
+};
+
+#ifndef _WIN32
+// A stand-in for the ETW on the platforms that don't have it.
+// Logger.cpp defines EventRegister(), EventUnregister() and EventWrite()
+// that deliver the events here, so that the encoding of the events
+// can be tested.
+class EtwStandIn
+{
+public:
+	// A written event.
+	struct Event {
+	public:
+		EVENT_DESCRIPTOR desc_;
+		std::string data_; // the data of all the descriptors, concatenated
+	};
+
+	EtwStandIn();
+
+	// Enable all the registered providers at the level and keywords,
+	// or disable them. Calls their callbacks, so the caller must not
+	// hold any of the loggers' locks. The written events above the
+	// level get dropped, as in a real session.
+	void enable(
+		__in UCHAR level,
+		__in ULONGLONG matchAny = 0,
+		__in ULONGLONG matchAll = 0);
+	void disable();
+
+	// Send the capture-state request to all the registered providers.
+	void captureState();
+
+	// Whether to keep the written events. If not, they only get counted.
+	void keepEvents(__in bool keep);
+
+	// Take the kept events out of the stand-in.
+	void takeEvents(__out std::vector<Event> &events);
+
+	// The number of events written.
+	uint64_t count();
+
+	// The implementation of the ETW calls.
+	ULONG registerProvider(
+		_In_ LPCGUID guid,
+		_In_opt_ PENABLECALLBACK callback,
+		_In_opt_ PVOID context,
+		__out REGHANDLE *h);
+	ULONG unregisterProvider(
+		__in REGHANDLE h);
+	ULONG write(
+		__in REGHANDLE h,
+		_In_ PCEVENT_DESCRIPTOR desc,
+		__in ULONG count,
+		_In_reads_opt_(count) PEVENT_DATA_DESCRIPTOR data);
+
+protected:
+	struct Provider {
+	public:
+		REGHANDLE h_;
+		GUID guid_;
+		PENABLECALLBACK callback_;
+		PVOID context_;
+	};
+
+	// Call the callbacks of all the registered providers.
+	void notify(
+		__in ULONG code,
+		__in UCHAR level,
+		__in ULONGLONG matchAny,
+		__in ULONGLONG matchAll);
+
+	Critical cr_; // synchronizes the object
+	std::vector<Provider> providers_;
+	std::vector<Event> events_; // the kept events
+	REGHANDLE lastHandle_; // the last allocated handle
+	uint64_t count_; // number of events written
+	UCHAR level_; // the level of the session, 0 if disabled
+	bool keep_; // whether to keep the events
+};
+
+extern EtwStandIn etwStandIn;
+#endif // _WIN32
+
+// A logger that writes the text records to stdout.
+// On a terminal every record gets written right away, otherwise the
+// records get collected into large blocks. The lock protects only the
+// buffer: one of the logging threads at a time becomes the writer and
+// writes out the collected records without holding the lock, while
+// the other threads keep appending and return without waiting.
+class StdoutLogger : public Logger
+{
+public:
+	// When stdout is not a terminal, write in the blocks of this size, in bytes.
+	enum { BLOCK_SIZE = 64 * 1024 };
+	// If this much is waiting to be written, the new records get dropped.
+	enum { PENDING_LIMIT = 16 * 1024 * 1024 };
+
+	StdoutLogger(
+		_In_ Severity minSeverity = SV_DEFAULT_MIN
+	);
+	// Writes out the collected records.
+	~StdoutLogger();
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+	// Writes out the collected records.
+	void poll();
+
+	// Write out the collected records and wait until they're written.
+	void flush();
+
+	// Get the number of records dropped because stdout was not keeping up.
+	uint64_t dropped();
+
+protected:
+	// Become the writer and write out the collected records.
+	// wait - if another thread is the writer, wait for it to finish
+	//      and then write whatever is left; otherwise return right away,
+	//      since that writer will pick up the new records
+	void writeOut(__in bool wait);
+
+	// Write the data to stdout. Called only by the writer.
+	void writeStdout(__in const std::string &data);
+
+protected:
+	Critical cr_; // synchronizes buf_, writing_ and dropped_
+	std::string buf_; // the collected records, in UTF-8
+	std::string out_; // the records being written, owned by the writer
+	bool writing_; // some thread is the writer
+	bool terminal_; // stdout is a terminal, write every record right away
+	uint64_t dropped_; // the records dropped because of PENDING_LIMIT
+#ifdef _WIN32
+	HANDLE h_; // the stdout handle
+	std::wstring wout_; // the conversion buffer for the console
+#endif
+
+private:
+	StdoutLogger(const StdoutLogger &);
+	void operator=(const StdoutLogger &);
+};
+
+// Compresses the rotated log files on a background thread with the
+// low CPU and I/O priority, so the writers never wait for it: add()
+// only places the name into a queue. On Windows the files get the NTFS
+// compression, so they stay readable by the usual tools. Elsewhere
+// each file gets replaced by its gzip copy, <fname>.gz.
+// The files still waiting get left uncompressed on destruction.
+class LogCompressor
+{
+public:
+	// The statistics, for monitoring.
+	struct Stats {
+	public:
+		uint64_t files_; // the number of files compressed
+		uint64_t bytes_; // the total size of these files before compression
+		uint64_t ns_; // the time spent compressing them
+		uint64_t failures_; // the number of files that failed to compress
+		uint64_t pending_; // the number of files waiting in the queue
+	};
+
+	// The errors are kept, and can be extracted with error().
+	LogCompressor();
+	// Stops the thread, leaving the waiting files uncompressed.
+	~LogCompressor();
+
+	// Queue a file for compression.
+	void add(__in const std::wstring &fname);
+
+	// Get the current statistics.
+	void getStats(__out Stats &st);
+
+	// Get the first error of starting the thread or of compressing a file.
+	Erref error()
+	{
+		ScopeCritical sc(cr_);
+		return err_;
+	}
+
+protected:
+	// The background thread.
+	static DWORD WINAPI compressorThread(LPVOID arg);
+
+	// Compress one file.
+	// bytes - returns the size of the file
+	Erref compressFile(
+		__in const std::wstring &fname,
+		__out uint64_t &bytes);
+
+protected:
+	Critical cr_; // synchronizes everything below
+	std::deque<std::wstring> queue_; // the files waiting for compression
+	bool stopping_;
+	HANDLE wakeup_; // signaled on adding a file or stopping
+	HANDLE thread_;
+	Erref err_;
+	LONGLONG ticksPerSec_; // frequency of QueryPerformanceCounter()
+	uint64_t files_;
+	uint64_t bytes_;
+	uint64_t ns_;
+	uint64_t failures_;
+
+private:
+	LogCompressor(const LogCompressor &);
+	void operator=(const LogCompressor &);
+};
+
+// A logger that writes the text records into a file.
+// The records get collected in a large buffer and written with
+// one write per many records. There are two buffers: while one
+// is being written, the other one collects the new records, so
+// the callers don't wait for the disk unless they fill the buffer.
+//
+// The file can be rotated by size and by time: before writing a
+// buffer, the writer renames the full file to <fname>.<local time>
+// and starts a new one. The rotated files can be compressed by
+// a LogCompressor in background.
+class FileLogger : public Logger
+{
+public:
+	// The default buffer size, in bytes.
+	enum { DEFAULT_BUFFER_SIZE = 1024 * 1024 };
+	// The default period for FF_PERIODIC, in milliseconds.
+	enum { DEFAULT_FLUSH_PERIOD_MS = 1000 };
+	// The sync period value that disables the syncing.
+	enum { NO_SYNC = 0xFFFFFFFF };
+	// How many names to try for the rotated files within the same second.
+	enum { ROTATE_ATTEMPTS = 100 };
+
+	// The flush policies, can be combined. The buffer always
+	// gets written when it fills up, and on close().
+	enum FlushFlags {
+		FF_ON_ERROR = 0x01, // after every record of SV_ERROR and higher
+		FF_PERIODIC = 0x02, // from poll() and from logging a record,
+			// if the flush period has passed since the last write
+		FF_DEFAULT = FF_ON_ERROR | FF_PERIODIC,
+	};
+
+	struct Options {
+	public:
+		Options() :
+			bufferSize_(DEFAULT_BUFFER_SIZE),
+			flushFlags_(FF_DEFAULT),
+			flushPeriodMs_(DEFAULT_FLUSH_PERIOD_MS),
+			syncPeriodMs_(NO_SYNC),
+			rotateSize_(0),
+			rotatePeriodMs_(0),
+			compress_(false)
+		{ }
+
+		size_t bufferSize_; // the size of each of the two buffers, in bytes
+		uint32_t flushFlags_; // a combination of FlushFlags
+		DWORD flushPeriodMs_; // the period for FF_PERIODIC
+		DWORD syncPeriodMs_; // how often to force the written data to
+			// the disk (FlushFileBuffers() or fsync()), checked after
+			// the writes and in poll(); 0 means after every write,
+			// NO_SYNC means never
+		uint64_t rotateSize_; // rotate the file when a write would
+			// make it longer than this, in bytes; 0 means never
+		DWORD rotatePeriodMs_; // rotate the file on the first write after
+			// it has been open this long; 0 means never
+		bool compress_; // compress the rotated files in background
+	};
+
+	// The statistics of the logger, for monitoring.
+	struct Stats {
+	public:
+		uint64_t records_; // the number of records accepted
+		uint64_t bytes_; // the number of bytes written to the file
+		uint64_t writes_; // the number of the write calls
+		uint64_t syncs_; // the number of the syncs to the disk
+		uint64_t rotations_; // the number of the rotations
+		uint64_t rotateNsTotal_; // the time the writers spent rotating
+		uint64_t rotateNsMax_; // the longest rotation
+		LogCompressor::Stats compressor_; // all zeroes if not compressing
+	};
+
+	// fname - name of the file, it gets appended to if it already exists
+	// minSeverity - the minimum severity to not throw away
+	// opts - the buffering and flushing options
+	//
+	// The errors are kept, and can be extracted with error().
+	// A FileLogger with errors in opening the file cannot be used.
+	FileLogger(
+		_In_z_ const WCHAR *fname,
+		_In_ Severity minSeverity = SV_DEFAULT_MIN,
+		__in const Options &opts = Options()
+	);
+
+	// Flushes and closes the file.
+	~FileLogger();
+
+	// Write out the buffered records and close the file
+	// (no logging is possible after that).
+	// The errors get recorded and can be extracted with error().
+	void close();
+
+	// Write out all the buffered records right now.
+	void flush();
+
+	// Append the raw data (such as the captured output of a process)
+	// to the file, with the same buffering and rotation as the records.
+	void writeRaw(
+		_In_reads_(len) const char *data,
+		__in size_t len);
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+	void poll();
+
+	// Get the current statistics.
+	void getStats(__out Stats &st);
+
+	// Get the logger's fatal error. Obviously, it would have to be reported
+	// in some other way.
+	Erref error()
+	{
+		ScopeCritical sc(cr_);
+		return err_;
+	}
+
+protected:
+	// Write out the buffer if the flush policy asks for it,
+	// after a record has been appended.
+	// sev - severity of the record
+	// full - the buffer has filled up
+	void checkFlush(
+		__in Severity sev,
+		__in bool full);
+
+	// Swap the buffers and write out the collected data.
+	// force - write even if the buffer is not full yet
+	void writeBuffer(__in bool force);
+
+	// Write the data to the file, handling the partial writes.
+	// The caller must hold writeCr_.
+	// Returns false on error, with the error recorded.
+	bool writeFileW(
+		_In_reads_(len) const char *data,
+		__in size_t len
+	);
+
+	// Open the file for appending and find its size.
+	// The caller must hold writeCr_ (or be the constructor).
+	// Returns false on error, with the error recorded.
+	bool openW();
+
+	// Rotate the file if writing len more bytes calls for it.
+	// The caller must hold writeCr_.
+	void checkRotateW(__in size_t len);
+
+	// Rename the file to the next segment name and start a new one.
+	// The caller must hold writeCr_.
+	void rotateW();
+
+	// Get the data that must start every new file after a rotation,
+	// such as a format header. Called with writeCr_ held, may take cr_.
+	// The default implementation leaves it empty.
+	virtual void segmentHeaderW(__inout std::string &dest);
+
+	// Force the written data to the disk if the sync period has passed.
+	// The caller must hold writeCr_.
+	void syncW(__in bool force);
+
+	// Record an error of a file operation, taking the code from
+	// GetLastError() or errno. Only the first error gets kept, to
+	// avoid growing the chain on a failing disk.
+	void recordError(__in DWORD msgCode);
+
+	// Check whether the file is open.
+	bool isOpen() const
+	{
+#ifdef _WIN32
+		return (fh_ != INVALID_HANDLE_VALUE);
+#else
+		return (fd_ >= 0);
+#endif
+	}
+
+protected:
+	std::wstring fname_; // name of the file, for the error messages
+	Options opts_;
+
+	Critical cr_; // synchronizes buf_, closed_, err_ and records_
+	std::string buf_; // collects the new records
+	bool closed_; // no more records are accepted
+	Erref err_; // the recorded fatal error
+
+	Critical writeCr_; // serializes the writes; always taken before cr_
+	std::string spare_; // the buffer being written out
+	std::atomic<ULONGLONG> lastWrite_; // time of the last write, for FF_PERIODIC;
+		// updated under writeCr_ but read without it
+	ULONGLONG lastSync_; // time of the last sync
+	bool unsynced_; // something was written since the last sync
+#ifdef _WIN32
+	HANDLE fh_; // the file
+#else
+	int fd_; // the file
+#endif
+	uint64_t fileSize_; // the current size of the file, under writeCr_
+	ULONGLONG fileStart_; // time when the file was opened, under writeCr_
+	LONGLONG ticksPerSec_; // frequency of QueryPerformanceCounter()
+	std::unique_ptr<LogCompressor> compressor_; // NULL if not compressing
+
+	uint64_t records_;
+	// updated under writeCr_ but read without it
+	std::atomic<uint64_t> bytes_;
+	std::atomic<uint64_t> writes_;
+	std::atomic<uint64_t> syncs_;
+	std::atomic<uint64_t> rotations_;
+	std::atomic<uint64_t> rotateNsTotal_;
+	std::atomic<uint64_t> rotateNsMax_;
+
+private:
+	FileLogger();
+	FileLogger(const FileLogger &);
+	void operator=(const FileLogger &);
+};
+
+// Copies the output of a process from a pipe into a FileLogger,
+// on a background thread. Unlike a file handle given directly to
+// the process, this allows to rotate the file.
+class OutputPump
+{
+public:
+	enum { BUFFER_SIZE = 64 * 1024 };
+
+#ifdef _WIN32
+	typedef HANDLE Pipe;
+#else
+	typedef int Pipe; // a file descriptor
+#endif
+
+	// pipe - the read end of the pipe, will be owned by this object
+	// file - the log file to write the data to
+	OutputPump(
+		__in Pipe pipe,
+		__in std::shared_ptr<FileLogger> file
+	);
+	// Waits for the thread and closes the pipe.
+	~OutputPump();
+
+	// Start the thread that copies the data.
+	Erref start();
+
+	// Wait until the write end of the pipe gets closed by everyone,
+	// and all the data gets written.
+	void wait();
+
+protected:
+	// The background thread that copies the data.
+	// arg - the OutputPump object
+	static DWORD WINAPI pumpThread(LPVOID arg);
+
+	Pipe pipe_;
+	std::shared_ptr<FileLogger> file_;
+	HANDLE thread_;
+
+private:
+	OutputPump(const OutputPump &);
+	void operator=(const OutputPump &);
+};
+
+// A logger that writes the records into a file in a compact binary form,
+// leaving the formatting of the messages to the reader (see BinaryLogReader
+// and the LogDecode tool). The formats, MUI templates and system texts get
+// written once per file, and the records refer to them by IDs, carrying
+// only the packed arguments. The buffering, flushing and statistics
+// are the same as in FileLogger.
+//
+// A message that has been already formatted (such as by another logger)
+// has no arguments left, so its text gets written instead.
+//
+// After a rotation, the new file starts with a session block followed
+// by all the definitions made so far, so every file decodes on its own.
+//
+// The file consists of the blocks, each block being a type byte, a varint
+// of the payload length and the payload. In the payloads, the integers
+// are varints, and the texts are in UTF-8. A text at the end of a block
+// takes the rest of it, otherwise it's preceded by a varint of its
+// length in bytes.
+//   BT_SESSION: the magic "EBL1" - written first by every logger object,
+//     the following blocks refer only to the definitions made after it
+//   BT_STRING: ID, text - a printf format, a MUI template or a system text
+//   BT_SOURCE: ID, name - an error source; the ID 0 means the NT errors
+//   BT_ENTITY: ID, name - a log entity
+//   BT_RECORD: time (see Logger::recordTime()), severity, entity ID, the
+//     count of the messages in the chain, then for every message: source ID,
+//     code, the RecordForm and its contents:
+//       RF_TEXT: text
+//       RF_STRING: string ID of the text
+//       RF_PRINTF: string ID of the format, the packed arguments
+//         (see FormatArgs::pack())
+//       RF_MUI: string ID of the template, the packed arguments
+class BinaryLogger : public FileLogger
+{
+public:
+	enum { MAGIC = 0x314C4245 }; // "EBL1"
+	enum BlockType {
+		BT_SESSION = 1,
+		BT_STRING,
+		BT_SOURCE,
+		BT_ENTITY,
+		BT_RECORD,
+	};
+	enum RecordForm {
+		RF_TEXT,
+		RF_STRING,
+		RF_PRINTF,
+		RF_MUI,
+	};
+
+	// fname - name of the file, it gets appended to if it already exists
+	// minSeverity - the minimum severity to not throw away
+	// opts - the buffering and flushing options
+	//
+	// The errors are kept, and can be extracted with error().
+	BinaryLogger(
+		_In_z_ const WCHAR *fname,
+		_In_ Severity minSeverity = SV_DEFAULT_MIN,
+		__in const Options &opts = Options()
+	);
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+protected:
+	// A message of the chain, prepared before taking the lock.
+	struct Part {
+	public:
+		ErrorMsg *msg_;
+		ErrorMsg::MsgKind kind_;
+		RecordForm form_;
+		const void *key_; // the format or template, for RF_PRINTF and RF_MUI
+		size_t offset_; // the packed arguments or the text in the per-thread buffer
+		size_t len_;
+		uint32_t sourceId_; // filled under the lock
+		uint32_t stringId_; // filled under the lock, except for RF_TEXT
+	};
+
+	// from FileLogger: the session block and all the definitions
+	void segmentHeaderW(__inout std::string &dest);
+
+	// Append a block to buf_. The caller must hold cr_.
+	void appendBlockL(
+		__in BlockType type,
+		__in const std::string &payload);
+
+	// Append a definition block to buf_, and keep it in defs_ for
+	// the new files after rotation. The caller must hold cr_.
+	void defineL(
+		__in BlockType type,
+		__in const std::string &payload);
+
+	// Get the ID of a string, writing out its definition on the first use.
+	// The caller must hold cr_.
+	// key - identity of the string (such as the address of a format)
+	uint32_t stringIdL(
+		__in const void *key,
+		_In_reads_(len) const WCHAR *text,
+		__in size_t len);
+
+	// Get the ID of a system or errno text, writing out its definition
+	// on the first use. The caller must hold cr_.
+	uint32_t systemIdL(
+		__in ErrorMsg *msg,
+		__in ErrorMsg::MsgKind kind);
+
+	// Get the ID of a source, writing out its definition on the first use.
+	// The caller must hold cr_.
+	uint32_t sourceIdL(
+		__in_opt const ErrorMsg::Source *source);
+
+	// Write out the definition of an entity on the first use.
+	// The caller must hold cr_.
+	void entityL(
+		__in LogEntity::Id entity);
+
+protected:
+	// All the following are synchronized by cr_.
+	std::unordered_map<const void *, uint32_t> strings_; // by the address of the format or template
+	std::unordered_map<uint64_t, uint32_t> systemTexts_; // by the kind and code
+	std::unordered_map<const void *, uint32_t> sources_;
+	std::vector<bool> entities_; // whether the entity name has been written
+	uint32_t lastId_; // the last ID assigned to a string or source
+	std::string block_; // the payload of the block being built
+	std::string defs_; // all the definition blocks written so far
+
+private:
+	BinaryLogger();
+	BinaryLogger(const BinaryLogger &);
+	void operator=(const BinaryLogger &);
+};
+
+// Reads the files written by BinaryLogger and turns the records back
+// into the error chains. The messages get rebuilt with the deferred
+// formatting, so toString() produces the same text as it would have
+// in the writing process, and formatRecord() the same text as
+// FileLogger would have written.
+class BinaryLogReader
+{
+public:
+	// The size of the reads from the file, in bytes.
+	enum { READ_SIZE = 1024 * 1024 };
+	// The blocks larger than this are treated as corrupted.
+	enum { BLOCK_LIMIT = 64 * 1024 * 1024 };
+
+	// A record read from the file. The error chain refers to the sources
+	// and formats kept in the reader, so it may be used only as long as
+	// the reader is alive.
+	struct Record {
+	public:
+		uint64_t time_; // see Logger::recordTime()
+		Logger::Severity sev_;
+		LogEntity::Id entity_; // the ID in the writing process
+		const std::wstring *entityName_; // NULL if the record has no entity
+		Erref err_;
+	};
+
+	// The errors are kept, and can be extracted with error().
+	BinaryLogReader(
+		_In_z_ const WCHAR *fname);
+	~BinaryLogReader();
+
+	// Read the next record.
+	// Returns false at the end of the file or on an error,
+	// which can be then extracted with error().
+	bool next(__out Record &rec);
+
+	// Append the record as text, the same way as FileLogger would.
+	static void formatRecord(
+		__inout std::string &dest,
+		__in const Record &rec);
+
+	// Get the error of reading or decoding the file. The records read
+	// before it are good.
+	Erref error()
+	{
+		return err_;
+	}
+
+protected:
+	// A source as defined in the file.
+	struct SourceDef {
+	public:
+		std::wstring name_;
+		std::shared_ptr<ErrorMsg::Source> source_; // refers to name_ and catalog_
+		MuiCatalog catalog_; // the templates of the MUI messages
+	};
+
+	// Make sure that at least need bytes are available after pos_.
+	// Returns false if the file ends before that or on an error.
+	bool fill(__in size_t need);
+
+	// Decode a block.
+	// rec - filled in if the block is a record
+	// Returns BT_RECORD for a record, the block type for the other
+	// blocks, or 0 if the block is corrupted.
+	int parseBlock(
+		__in int type,
+		__in const uint8_t *p,
+		__in const uint8_t *end,
+		__out Record &rec);
+
+	// Decode the messages of a record.
+	// Returns false if they're corrupted.
+	bool parseMessages(
+		__inout const uint8_t *&p,
+		__in const uint8_t *end,
+		__out Erref &err);
+
+	// Read a text.
+	// Returns false if it runs past the end.
+	static bool readText(
+		__inout const uint8_t *&p,
+		__in const uint8_t *end,
+		__out std::wstring &text);
+
+	// Record the error of the file being corrupted at offset_.
+	void corrupted();
+
+protected:
+	std::wstring fname_; // name of the file, for the error messages
+	Erref err_;
+#ifdef _WIN32
+	HANDLE fh_;
+#else
+	int fd_;
+#endif
+	std::string buf_; // the data read from the file
+	size_t pos_; // the start of the unparsed data in buf_
+	uint64_t offset_; // the offset of the unparsed data in the file
+	bool eof_; // the whole file has been read into buf_
+
+	bool session_; // a session block has been seen
+	std::deque<std::wstring> texts_; // all the strings and entity names, kept
+		// for the lifetime of the reader, since the records refer to them
+	std::deque<SourceDef> sourceDefs_; // all the sources, kept the same way
+	// The definitions of the current session, by their IDs.
+	std::unordered_map<uint64_t, const std::wstring *> strings_;
+	std::unordered_map<uint64_t, SourceDef *> sources_;
+	std::unordered_map<uint64_t, const std::wstring *> entities_;
+
+private:
+	BinaryLogReader();
+	BinaryLogReader(const BinaryLogReader &);
+	void operator=(const BinaryLogReader &);
+};
+
+// A logger that takes the formatting and writing off the callers' threads.
+// logBody() only places the record into a bounded lock-free queue,
+// and a dedicated flusher thread takes the records from the queue
+// and passes them to the sink logger. When the queue is full,
+// the new records are dropped and counted. The entities get checked
+// by the sink's keyword filter, before placing them into the queue.
+// The statistics get reported in the state snapshots (see StateSources).
+class AsyncLogger : public Logger, public StateSource
+{
+public:
+	// The default queue size, in records. Must be a power of 2.
+	enum { DEFAULT_QUEUE_SIZE = 8192 };
+	// How often the flusher thread calls the sink's poll(), in milliseconds.
+	enum { POLL_PERIOD_MS = 1000 };
+	// The number of buckets in the enqueue latency histogram.
+	// Bucket i counts the latencies in the range [2^(i-1), 2^i) nanoseconds.
+	enum { LATENCY_BUCKETS = 32 };
+
+	// The statistics of the logger, for monitoring.
+	struct Stats {
+	public:
+		size_t queueDepth_; // the number of records currently in the queue
+		size_t queueSize_; // the capacity of the queue
+		uint64_t enqueued_; // the number of records placed into the queue
+		uint64_t dropped_; // the number of records dropped because the queue was full
+		uint64_t written_; // the number of records passed to the sink
+		uint64_t p99EnqueueNs_; // the 99th percentile of the enqueue latency
+			// (the upper bound of the histogram bucket), in nanoseconds
+	};
+
+	// sink - the logger that will do the actual writing; its logBody()
+	//      will be called only from one thread at a time: the flusher,
+	//      or after close() the logging threads, one by one
+	// minSeverity - the minimum severity to not throw away
+	// queueSize - capacity of the queue, in records; rounded up to a power of 2
+	//
+	// The errors are kept, and can be extracted with error().
+	AsyncLogger(
+		__in std::shared_ptr<Logger> sink,
+		_In_ Severity minSeverity = SV_DEFAULT_MIN,
+		__in size_t queueSize = DEFAULT_QUEUE_SIZE
+	);
+
+	// Flushes the queue and stops the flusher thread.
+	~AsyncLogger();
+
+	// Write out everything that is already in the queue and stop the
+	// flusher thread. The records logged after that get written
+	// synchronously, directly to the sink, one at a time; the ones
+	// logged while close() runs wait for it to finish.
+	void close();
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Get the current statistics.
+	void getStats(__out Stats &st);
+
+	// from StateSource
+	Erref captureState();
+
+	// Get the logger's fatal error.
+	Erref error()
+	{
+		return err_;
+	}
+
+protected:
+	// One element of the queue. The sequence number tells whether
+	// the slot is free to be written by a producer (seq_ == position)
+	// or is filled and ready for the consumer (seq_ == position + 1).
+	struct Slot {
+	public:
+		std::atomic<size_t> seq_;
+		Erref err_;
+		Severity sev_;
+		LogEntity::Id entity_;
+	};
+
+	// The body of the flusher thread.
+	// arg - the AsyncLogger object
+	static DWORD WINAPI flusherThread(LPVOID arg);
+
+	// The results of enqueue().
+	enum EnqueueResult {
+		EQ_OK,
+		EQ_FULL, // the queue is full, the record is dropped
+		EQ_CLOSED, // close() has sealed the queue, write the record directly
+	};
+
+	// The bit of enqueuePos_ set by close(), so that a producer can't
+	// claim a slot after the final drain.
+	static const size_t POS_CLOSED = (size_t)1 << (sizeof(size_t) * 8 - 1);
+
+	// Write a record to the sink after close(), or if the flusher
+	// could not be started. Serialized with close() and the other
+	// direct writes by cr_.
+	void writeDirect(
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Try to place a record into the queue.
+	EnqueueResult enqueue(
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Pass all the records currently in the queue to the sink.
+	// Called only from the flusher thread, or from drainClosed()
+	// after the flusher thread has exited.
+	// Returns true if anything was written.
+	bool drain();
+
+	// After the flusher thread has exited, pass to the sink the records
+	// that the producers have placed after its last drain, up to the
+	// position at which the queue got sealed.
+	// endPos - enqueuePos_ at the time of sealing, without POS_CLOSED
+	void drainClosed(
+		__in size_t endPos
+	);
+
+	// Check whether the next slot for the consumer is filled.
+	bool hasRecords();
+
+	// Record one enqueue latency in the histogram.
+	void recordLatency(LONGLONG ticks);
+
+protected:
+	std::shared_ptr<Logger> sink_; // where the records get written
+	Slot *queue_; // the ring buffer of records
+	size_t mask_; // the queue size - 1, for wrapping the positions
+	// The positions are kept on separate cache lines, since the producers
+	// contend on one and the consumer owns the other.
+	alignas(64) std::atomic<size_t> enqueuePos_; // next position to write,
+		// with POS_CLOSED after close()
+	alignas(64) std::atomic<size_t> dequeuePos_; // next position to read
+	alignas(64) std::atomic<bool> sleeping_; // the flusher waits for the wakeup event
+	std::atomic<bool> stopping_; // the flusher must drain the queue and exit;
+		// also set if the flusher could not be started, then the records
+		// get written synchronously
+	HANDLE wakeup_; // auto-reset event to wake up the flusher
+	HANDLE thread_; // the flusher thread
+
+	std::atomic<uint64_t> enqueued_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> written_;
+	std::atomic<uint64_t> latency_[LATENCY_BUCKETS]; // enqueue latency histogram
+	LONGLONG ticksPerSec_; // frequency of QueryPerformanceCounter()
+
+	Critical cr_; // synchronizes close() and the direct writes to the sink
+	Erref err_; // the recorded fatal error
+
+private:
+	AsyncLogger();
+	AsyncLogger(const AsyncLogger &);
+	void operator=(const AsyncLogger &);
+};
+
+// A logger that keeps the records below the sink's minimal severity
+// in memory instead of throwing them away, so that when an error
+// happens, the context leading to it is available.
+//
+// Each thread has its own fixed-size ring of the recent records, so
+// recording takes no locks and shares nothing with the other threads.
+// The records are kept as they are, their formatting is deferred until
+// they get written. The ring of a thread is dumped into the sink
+// (as a single record that precedes the error) when an error gets
+// logged on that thread, or on an explicit request by flushThread().
+// The rings of all the threads get dumped by flushAllThreads(),
+// and when the process crashes (see installCrashHandler()).
+// The records that the sink accepts pass through to it directly.
+//
+// The recorder only gets the records that are compiled in: with the
+// default LOG_MIN_SEVERITY of the release builds, LOG_DEBUG and
+// LOG_VERBOSE (and LOG_SHORTCUT or logLazy() below SV_INFO) never reach
+// it. To keep them in the rings, build with LOG_MIN_SEVERITY defined
+// as Logger::SV_DEBUG.
+//
+// The rings belong to the recorder. When a thread exits, its ring
+// gets cleared and is reused by the next thread that starts logging.
+class FlightRecorder : public Logger
+{
+public:
+	// The default ring size per thread, in records. Must be a power of 2.
+	enum { DEFAULT_RING_SIZE = 256 };
+	// How many times flushAllThreads() yields the CPU, waiting for
+	// the thread of a ring to finish its write.
+	enum { FREEZE_SPINS = 1000 };
+
+	// sink - the logger that will do the actual writing
+	// minSeverity - the minimum severity to record
+	// ringSize - capacity of the ring of each thread, in records;
+	//      rounded up to a power of 2
+	FlightRecorder(
+		__in std::shared_ptr<Logger> sink,
+		_In_ Severity minSeverity = SV_DEBUG,
+		__in size_t ringSize = DEFAULT_RING_SIZE
+	);
+	// Removes the crash handler, if it was installed by this object,
+	// and frees the rings.
+	~FlightRecorder();
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+	// Calls the sink's poll().
+	void poll();
+
+	// Write the records kept for the current thread into the sink,
+	// at the sink's minimal severity (but at least SV_INFO).
+	void flushThread();
+
+	// Write the records kept for all the threads into the sink,
+	// at the same severity as flushThread(). Each ring is written
+	// as a header record with the thread ID, followed by its records
+	// one by one. The rings are left as they are, so the same records
+	// may get written again later.
+	//
+	// This is the dump done on a crash, so it allocates no memory
+	// itself (the sink still might). Each ring gets frozen while it's
+	// being written: its thread leaves it alone, and the records that
+	// the thread logs below the sink's severity meanwhile are lost.
+	// A ring whose thread doesn't finish its current write within
+	// FREEZE_SPINS attempts (such as a thread that crashed in the middle
+	// of it) is skipped.
+	void flushAllThreads();
+
+#ifdef _WIN32
+	// Install an unhandled exception filter that writes the records
+	// kept for all the threads into the sink (like flushAllThreads()
+	// but at SV_ERROR) and polls the sink, before passing the exception
+	// on. Only one recorder at a time can have the crash handler.
+	void installCrashHandler();
+#endif
+
+protected:
+	struct Entry {
+	public:
+		Entry() :
+			sev_(SV_NEVER), entity_(LogEntity::NONE)
+		{
+		}
+
+		Erref err_;
+		Severity sev_;
+		LogEntity::Id entity_;
+	};
+
+	// The ring of one thread. Written only by its thread, the others
+	// only read it in flushAllThreads(), after freezing it.
+	//
+	// The owner thread and the readers agree through two flags, in
+	// the sequentially consistent order: the owner sets writing_ and
+	// then checks frozen_, a reader increments frozen_ and then checks
+	// writing_. So either the owner sees the ring frozen and leaves it
+	// alone, or the reader sees the write in progress and waits for it.
+	struct Ring {
+	public:
+		Ring(__in size_t size) :
+			entries_(new Entry[size]), mask_(size - 1), count_(0),
+			inUse_(true), writing_(false), frozen_(0), next_(NULL)
+		{
+		}
+		~Ring()
+		{
+			delete[] entries_;
+		}
+
+		// Called by the owner thread before changing the ring.
+		// Returns false if the ring is frozen, then it must be left
+		// alone; otherwise endWrite() must follow.
+		bool beginWrite()
+		{
+			writing_.store(true);
+			if (frozen_.load() == 0)
+				return true;
+			writing_.store(false, std::memory_order_release);
+			return false;
+		}
+		// Like beginWrite() but waits for the ring to thaw, for
+		// the changes that can't be dropped.
+		void waitWrite()
+		{
+			while (!beginWrite())
+				SwitchToThread();
+		}
+		void endWrite()
+		{
+			writing_.store(false, std::memory_order_release);
+		}
+
+		// Called by a reader before reading the ring. Returns false
+		// if the owner doesn't finish its write in time, then the ring
+		// must be left alone; otherwise thaw() must follow.
+		bool freeze();
+		void thaw()
+		{
+			frozen_.fetch_sub(1, std::memory_order_release);
+		}
+
+		// Called by the thread that exits, so that the ring can be
+		// reused by another thread.
+		void release();
+
+		Entry *entries_;
+		size_t mask_;
+		std::atomic<uint64_t> count_; // number of records written since the last dump
+		std::atomic<bool> inUse_; // a thread owns this ring
+		std::atomic<bool> writing_; // the owner is changing the ring
+		std::atomic<int> frozen_; // number of the readers of the ring
+		Erref header_; // the header for flushAllThreads(), made in advance by the owner thread
+		Ring *next_; // the next ring of the recorder, set before the ring gets listed
+
+	private:
+		Ring(const Ring &);
+		void operator=(const Ring &);
+	};
+
+	// A reference from a thread to its ring in a recorder.
+	struct ThreadRing {
+	public:
+		uint64_t serial_; // serial number of the recorder
+		Ring *ring_; // belongs to the recorder
+	};
+
+	// The references of a thread to its rings. When the thread exits,
+	// releases the rings of the recorders that still exist.
+	class ThreadRingList {
+	public:
+		~ThreadRingList();
+
+		// Remove the references to the recorders that don't exist
+		// any more.
+		void prune();
+
+		std::vector<ThreadRing> rings_;
+	};
+
+	// Find the current thread's ring.
+	// create - create the ring if it doesn't exist yet
+	// Returns NULL if the ring doesn't exist and create is false.
+	Ring *threadRing(__in bool create);
+
+	// Get a ring for the current thread: reuse a released one
+	// or add a new one to the list.
+	Ring *claimRing();
+
+	// Write the records kept for the current thread into the sink,
+	// as a single record, and clear the ring.
+	// sev - the severity to write the records at
+	void dump(__in Severity sev);
+
+	// Write the records kept in all the rings into the sink,
+	// without allocating the memory; see flushAllThreads().
+	// sev - the severity to write the records at
+	void dumpAll(__in Severity sev);
+
+#ifdef _WIN32
+	static LONG WINAPI crashFilter(__in PEXCEPTION_POINTERS ep);
+
+	static std::atomic<FlightRecorder *> crashRecorder_; // the recorder with the crash handler
+	static LPTOP_LEVEL_EXCEPTION_FILTER prevFilter_; // the filter that was there before
+#endif
+
+	static std::atomic<uint64_t> nextSerial_; // for the serial numbers of the recorders
+	static thread_local ThreadRingList threadRings_; // rings of the current thread
+
+	std::shared_ptr<Logger> sink_; // the logger that does the actual writing
+	size_t ringSize_; // the size of each ring, in records
+	uint64_t serial_; // identifies this recorder in threadRings_, never reused
+	std::atomic<Ring *> rings_; // all the rings of this recorder, a lock-free list
+
+private:
+	FlightRecorder();
+	FlightRecorder(const FlightRecorder &);
+	void operator=(const FlightRecorder &);
+};
+
+// A logger that protects the sink from the floods of the same records,
+// such as an error repeated by a retry loop thousands of times a second.
+//
+// The identical records within a window get collapsed: the first one
+// passes through, the following ones are only counted, and when the
+// window ends, a single record with the repeat count and the last
+// repeated error gets written. The records are identical if they have
+// the same severity, entity, and the chain of sources and codes; the
+// message texts and arguments are not compared.
+// The records that pass are then limited by a token bucket per entity
+// and source (of the first error in the chain). The records exceeding
+// the rate get dropped, and their count gets reported with the next
+// record that passes through the same bucket, or from poll().
+//
+// All this is decided before any formatting of the messages. The state
+// is spread over the shards by the hash of the record's key, each shard
+// with its own lock, so that the threads logging the different errors
+// rarely contend. A repeat within its window takes no lock at all:
+// it finds its entry in the shard's fixed table and increments the
+// atomic count, so the threads repeating the same error in an incident
+// share only that count. Each shard keeps at most REPEAT_SLOTS kinds
+// of records at a time, the records that don't fit pass through
+// without collapsing. The statistics get reported in the state
+// snapshots (see StateSources).
+class RateLimitLogger : public Logger, public StateSource
+{
+public:
+	// The number of shards, must be a power of 2.
+	enum { SHARDS = 16 };
+	// The size of the table of the repeats in each shard, must be
+	// a power of 2, and how many entries a record may probe in it.
+	enum { REPEAT_SLOTS = 32, REPEAT_PROBES = 8 };
+	// The longest chain that a repeat gets recognized by without
+	// the shard's lock.
+	enum { CHAIN_LIMIT = 4 };
+	// The defaults for the Options.
+	enum { DEFAULT_RATE = 100 };
+	enum { DEFAULT_BURST = 200 };
+	enum { DEFAULT_WINDOW_MS = 1000 };
+
+	struct Options {
+	public:
+		Options() :
+			ratePerSec_(DEFAULT_RATE),
+			burst_(DEFAULT_BURST),
+			windowMs_(DEFAULT_WINDOW_MS)
+		{ }
+
+		uint32_t ratePerSec_; // the records per second allowed for each
+			// entity and source; 0 means no limit
+		uint32_t burst_; // the size of the token buckets, in records
+		DWORD windowMs_; // the window for collapsing the repeated
+			// records, in milliseconds; 0 means no collapsing
+	};
+
+	// The statistics of the logger, for monitoring.
+	struct Stats {
+	public:
+		uint64_t passed_; // the number of records passed to the sink
+		uint64_t repeated_; // the number of records collapsed as repeats
+		uint64_t dropped_; // the number of records dropped by the rate limit
+		uint64_t reports_; // the number of records that reported the
+			// repeats and drops
+	};
+
+	// sink - the logger that will do the actual writing
+	// minSeverity - the minimum severity to not throw away
+	// opts - the limits
+	RateLimitLogger(
+		__in std::shared_ptr<Logger> sink,
+		_In_ Severity minSeverity = SV_DEFAULT_MIN,
+		__in const Options &opts = Options()
+	);
+	// Reports the outstanding repeats and drops.
+	~RateLimitLogger();
+
+	// from Logger
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+	// Reports the repeats of the ended windows and the drops,
+	// then calls the sink's poll().
+	void poll();
+
+	// Get the current statistics.
+	void getStats(__out Stats &st);
+
+	// from StateSource
+	Erref captureState();
+
+protected:
+	// The bits of Repeat::state_: the count of the repeats in the low
+	// bits, the generation of the entry above them, and the top bit
+	// for a closed entry.
+	enum : uint64_t {
+		RS_COUNT_BITS = 40,
+		RS_COUNT_MASK = (1ull << RS_COUNT_BITS) - 1,
+		RS_CLOSED = 1ull << 63,
+	};
+
+	// The repeats of one kind of record, an entry in a shard's table.
+	// The entries get opened, closed and reused under the shard's lock.
+	// While an entry is open, the repeats of its record get counted
+	// without the lock: a repeat checks the identity of the record
+	// against the entry and increments the count with a CAS of the same
+	// state_ that it has checked against, so that the entry can't get
+	// closed and reused in between. The identity fields are atomics,
+	// since the lock-free readers may race with the reuse.
+	struct alignas(64) Repeat {
+	public:
+		Repeat() :
+			state_(RS_CLOSED), key_(0), start_(0), sev_(SV_NEVER),
+			entity_(LogEntity::NONE), chainLen_(0),
+			lastBusy_(false), lastGen_(0)
+		{
+			for (int i = 0; i < CHAIN_LIMIT; ++i)
+			{
+				sources_[i].store(NULL, std::memory_order_relaxed);
+				codes_[i].store(0, std::memory_order_relaxed);
+			}
+		}
+
+		// Check whether the record has this entry's severity, entity
+		// and chain of sources and codes. Returns false if the entry's
+		// chain is longer than CHAIN_LIMIT, then it has to be compared
+		// against first_ under the lock.
+		bool matches(
+			__in const Erref &err,
+			__in Severity sev,
+			__in LogEntity::Id entity
+		) const;
+
+		std::atomic<uint64_t> state_; // RS_* bits
+		std::atomic<uint64_t> key_; // the hash of the record
+		std::atomic<ULONGLONG> start_; // the start of the window, by GetTickCount64()
+		std::atomic<int> sev_; // Severity of the record
+		std::atomic<LogEntity::Id> entity_;
+		std::atomic<uint32_t> chainLen_; // the length of the record's chain
+		std::atomic<const ErrorMsg::Source *> sources_[CHAIN_LIMIT]; // the start of the chain
+		std::atomic<DWORD> codes_[CHAIN_LIMIT];
+		Erref first_; // the record that opened the entry, under the shard's lock
+		std::atomic<bool> lastBusy_; // some thread is changing last_ and lastGen_
+		Erref last_; // the last repeated record
+		uint64_t lastGen_; // the generation of the entry when last_ was set
+	};
+
+	// The token bucket of one entity and source.
+	struct Bucket {
+	public:
+		double tokens_; // the records that can pass right now
+		ULONGLONG last_; // when the tokens were last added, by GetTickCount64()
+		uint64_t dropped_; // the records dropped since the last report
+		Severity sev_; // the highest severity of the dropped records
+		LogEntity::Id entity_;
+	};
+
+	// The keys are the hashes, and the collisions get detected
+	// only for the repeats, where they matter.
+	struct alignas(64) Shard {
+	public:
+		Critical cr_;
+		Repeat repeats_[REPEAT_SLOTS]; // open-addressed by the key
+		std::unordered_map<uint64_t, Bucket> buckets_;
+	};
+
+	// Compute the key of a record for collapsing the repeats.
+	// Virtual, so that the tests can make the keys collide.
+	virtual uint64_t repeatKey(
+		__in const Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Count a repeat in an open entry of its record, without the lock.
+	// Returns false if the record has no such entry, or its window
+	// has ended, then it goes through collapseL().
+	// now - the current time, by GetTickCount64()
+	bool countRepeat(
+		__in Shard &shard,
+		__in uint64_t key,
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity,
+		__in ULONGLONG now
+	);
+
+	// Find or open the entry of a record, under the shard's lock.
+	// Returns true if the record got counted as a repeat, otherwise
+	// it has to be written. The report of the ended window is placed
+	// into repeats.
+	bool collapseL(
+		__in Shard &shard,
+		__in uint64_t key,
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity,
+		__in ULONGLONG now,
+		__out Erref &repeats
+	);
+
+	// Increment the count of an open entry of the given state.
+	// Returns false if the entry got closed or reused meanwhile.
+	bool addRepeat(
+		__inout Repeat &rep,
+		__in uint64_t state,
+		__in Erref &err
+	);
+
+	// Close an open entry, under the shard's lock.
+	// Returns the report of its repeats, or NULL if there were none.
+	// now - the current time, by GetTickCount64()
+	Erref closeL(
+		__inout Repeat &rep,
+		__in ULONGLONG now
+	);
+
+	// Open a closed entry for a record, under the shard's lock.
+	void openL(
+		__inout Repeat &rep,
+		__in uint64_t key,
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity,
+		__in ULONGLONG now
+	);
+
+	// Compute the key of a record's token bucket.
+	static uint64_t bucketKey(
+		__in const Erref &err,
+		__in LogEntity::Id entity
+	);
+
+	// Check that two chains have the same sources and codes.
+	static bool sameChain(
+		__in const ErrorMsg *a,
+		__in const ErrorMsg *b
+	);
+
+	// Add the tokens for the time passed since the last addition.
+	// Called under the shard's lock.
+	void refillL(
+		__inout Bucket &b,
+		__in ULONGLONG now
+	);
+
+	// Pass a record through its token bucket to the sink.
+	// now - the current time, by GetTickCount64()
+	void passLimited(
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity,
+		__in ULONGLONG now
+	);
+
+	// Write a report of the repeats or drops to the sink.
+	void report(
+		__in Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity
+	);
+
+	// Report the ended windows and the drops, and forget the idle state.
+	// all - report and forget everything, the windows that didn't end yet too
+	void sweep(__in bool all);
+
+protected:
+	std::shared_ptr<Logger> sink_; // the logger that does the actual writing
+	Options opts_;
+	Shard shards_[SHARDS];
+	std::atomic<ULONGLONG> lastSweep_; // when poll() last went through the shards
+
+	std::atomic<uint64_t> passed_;
+	std::atomic<uint64_t> repeated_;
+	std::atomic<uint64_t> dropped_;
+	std::atomic<uint64_t> reports_;
+
+private:
+	RateLimitLogger();
+	RateLimitLogger(const RateLimitLogger &);
+	void operator=(const RateLimitLogger &);
+};
+
+#define NTSTATUS ULONG
+
+#define EVENT_CONTROL_CODE_DISABLE_PROVIDER 0
+#define EVENT_CONTROL_CODE_ENABLE_PROVIDER 1
+#define EVENT_CONTROL_CODE_CAPTURE_STATE 2
+
+#define TRACE_LEVEL_CRITICAL 1
+#define TRACE_LEVEL_ERROR 2
+#define TRACE_LEVEL_WARNING 3
+#define TRACE_LEVEL_INFORMATION 4
+#define TRACE_LEVEL_VERBOSE 5
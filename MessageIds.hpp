@@ -0,0 +1,55 @@
+#pragma once
+
+// The message codes of the MUI sources and the descriptors of the ETW
+// events, for the builds without the message compiler. On Windows they
+// come from the headers that mc.exe generates from the message file
+// and the ETW manifest. The codes only need to be unique here: the
+// texts come from a catalog file (see MuiCatalog), if there is one.
+
+#ifdef _WIN32
+#error "MessageIds.hpp is only for the non-Windows builds"
+#endif
+
+enum {
+	// Logger
+	EPEM_LOG_EVENT_REGISTER_FAIL = 0x1001,
+	EPEM_LOG_EVENT_UNREGISTER_FAIL,
+	EPEM_LOG_EVENT_WRITE_FAIL,
+	EPEM_LOG_ASYNC_START_FAIL,
+	EPEM_LOG_ASYNC_STOP_FAIL,
+	EPEM_LOG_ASYNC_STATE,
+	EPEM_LOG_FILE_OPEN_FAIL,
+	EPEM_LOG_FILE_WRITE_FAIL,
+	EPEM_LOG_FILE_SYNC_FAIL,
+	EPEM_LOG_FILE_CLOSE_FAIL,
+	EPEM_LOG_FILE_ROTATE_FAIL,
+	EPEM_LOG_COMPRESS_START_FAIL,
+	EPEM_LOG_COMPRESS_FAIL,
+	EPEM_LOG_BACKLOG_DROPPED,
+	EPEM_LOG_FLIGHT_RECORDER,
+	EPEM_LOG_BINARY_READ_FAIL,
+	EPEM_LOG_BINARY_CORRUPTED,
+	EPEM_LOG_REPEATED,
+	EPEM_LOG_RATE_LIMITED,
+	EPEM_LOG_LIMITER_STATE,
+	EPEM_LOG_FLIGHT_THREAD,
+	EPEM_LOG_PUMP_START_FAIL,
+
+	// Service
+	EPEM_SERVICE_DISPATCHER_FAIL = 0x2001,
+	EPEM_SERVICE_HANDLER_REGISTER_FAIL,
+	EPEM_SERVICE_STATE,
+	EPEM_SERVICE_NOTIFY_OPEN_FAIL,
+	EPEM_SERVICE_NOTIFY_SEND_FAIL,
+	EPEM_SERVICE_NOTIFY_RECEIVE_FAIL,
+	EPEM_SERVICE_HEARTBEAT_START_FAIL,
+	EPEM_SERVICE_PUBLISHER_START_FAIL,
+	EPEM_SERVICE_PUBLISH_STATE,
+	EPEM_SERVICE_UNKNOWN,
+	EPEM_SERVICE_HOST_EMPTY,
+};
+
+// The events of EtwLogger, one per level allowed by the manifest.
+static const EVENT_DESCRIPTOR ETWMSG_LOG_INST_ERROR2 = { 1, 0, 0x10, 2, 0, 0, 0 };
+static const EVENT_DESCRIPTOR ETWMSG_LOG_INST_WARNING2 = { 2, 0, 0x10, 3, 0, 0, 0 };
+static const EVENT_DESCRIPTOR ETWMSG_LOG_INST_INFO2 = { 3, 0, 0x10, 4, 0, 0, 0 };
@@ -1,190 +1,1141 @@
-#include "pch.h"
-
-static ErrorMsg::MuiSource ServiceErrorSource(L"Service", NULL);
-
-// -------------------- Service---------------------------------
-
-Service *Service::instance_;
-
-Service::Service(const wstring &name,
-	bool canStop,
-	bool canShutdown,
-	bool canPauseContinue
-) :
-	name_(name), statusHandle_(NULL)
-{
-
-	// The service runs in its own process.
-	status_.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
-
-	// The service is starting.
-	status_.dwCurrentState = SERVICE_START_PENDING;
-
-	// The accepted commands of the service.
-	status_.dwControlsAccepted = 0;
-	if (canStop)
-		status_.dwControlsAccepted |= SERVICE_ACCEPT_STOP;
-	if (canShutdown)
-		status_.dwControlsAccepted |= SERVICE_ACCEPT_SHUTDOWN;
-	if (canPauseContinue)
-		status_.dwControlsAccepted |= SERVICE_ACCEPT_PAUSE_CONTINUE;
-
-	status_.dwWin32ExitCode = NO_ERROR;
-	status_.dwServiceSpecificExitCode = 0;
-	status_.dwCheckPoint = 0;
-	status_.dwWaitHint = 0;
-}
-
-Service::~Service()
-{ 
-}
-
-void Service::run(Erref &err)
-{
-	err_.reset();
-	instance_ = this;
-
-	SERVICE_TABLE_ENTRY serviceTable[] =
-	{
-		{ (LPWSTR)name_.c_str(), serviceMain },
-		{ NULL, NULL }
-	};
-
-	if (!StartServiceCtrlDispatcher(serviceTable)) {
-		err_ = ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_DISPATCHER_FAIL, name_.c_str());
-	}
-
-	err = err_.copy();
-}
-
-void WINAPI Service::serviceMain(
-	__in DWORD argc,
-	__in_ecount(argc) LPWSTR *argv)
-{
-	//assert(instance_ != NULL);
-
-	// Register the handler function for the service
-	instance_->statusHandle_ = RegisterServiceCtrlHandler(
-		instance_->name_.c_str(), serviceCtrlHandler);
-	if (instance_->statusHandle_ == NULL)
-	{
-		instance_->err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(),
-			EPEM_SERVICE_HANDLER_REGISTER_FAIL, instance_->name_.c_str()));
-		instance_->setStateStoppedSpecific(EPEM_SERVICE_HANDLER_REGISTER_FAIL);
-		return;
-	}
-
-	// Start the service.
-	instance_->setState(SERVICE_START_PENDING);
-	instance_->onStart(argc, argv);
-}
-
-void WINAPI Service::serviceCtrlHandler(DWORD ctrl)
-{
-	switch (ctrl)
-	{
-	case SERVICE_CONTROL_STOP:
-		if (instance_->status_.dwControlsAccepted & SERVICE_ACCEPT_STOP) {
-			instance_->setState(SERVICE_STOP_PENDING);
-			instance_->onStop();
-		}
-		break;
-	case SERVICE_CONTROL_PAUSE:
-		if (instance_->status_.dwControlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE) {
-			instance_->setState(SERVICE_PAUSE_PENDING);
-			instance_->onPause();
-		}
-		break;
-	case SERVICE_CONTROL_CONTINUE:
-		if (instance_->status_.dwControlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE) {
-			instance_->setState(SERVICE_CONTINUE_PENDING);
-			instance_->onContinue();
-		}
-		break;
-	case SERVICE_CONTROL_SHUTDOWN:
-		if (instance_->status_.dwControlsAccepted & SERVICE_ACCEPT_SHUTDOWN) {
-			instance_->setState(SERVICE_STOP_PENDING);
-			instance_->onShutdown();
-		}
-		break;
-	case SERVICE_CONTROL_INTERROGATE:
-		SetServiceStatus(instance_->statusHandle_, &instance_->status_);
-		break;
-	default:
-		break;
-	}
-}
-
-void Service::setState(DWORD state)
-{
-	ScopeCritical sc(statusCr_);
-
-	setStateL(state);
-}
-
-void Service::setStateL(DWORD state)
-{
-	status_.dwCurrentState = state;
-	status_.dwCheckPoint = 0;
-	status_.dwWaitHint = 0;
-	SetServiceStatus(statusHandle_, &status_);
-}
-
-void Service::setStateStopped(DWORD exitCode)
-{
-	ScopeCritical sc(statusCr_);
-
-	status_.dwWin32ExitCode = exitCode;
-	setStateL(SERVICE_STOPPED);
-}
-
-void Service::setStateStoppedSpecific(DWORD exitCode)
-{
-	ScopeCritical sc(statusCr_);
-
-	status_.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
-	status_.dwServiceSpecificExitCode = exitCode;
-	setStateL(SERVICE_STOPPED);
-}
-
-void Service::bump()
-{
-	ScopeCritical sc(statusCr_);
-
-	++status_.dwCheckPoint;
-	::SetServiceStatus(statusHandle_, &status_);
-}
-
-void Service::hintTime(DWORD msec)
-{
-	ScopeCritical sc(statusCr_);
-
-	++status_.dwCheckPoint;
-	status_.dwWaitHint = msec;
-	::SetServiceStatus(statusHandle_, &status_);
-	status_.dwWaitHint = 0; // won't apply after the next update
-}
-
-void Service::onStart(
-	__in DWORD argc,
-	__in_ecount(argc) LPWSTR *argv)
-{
-	setState(SERVICE_RUNNING);
-}
-void Service::onStop()
-{
-	setStateStopped(NO_ERROR);
-}
-void Service::onPause()
-{
-	setState(SERVICE_PAUSED);
-}
-void Service::onContinue()
-{
-	setState(SERVICE_RUNNING);
-}
-void Service::onShutdown()
-{
-	onStop();
-}
-
+#include "pch.h"
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+static ErrorMsg::MuiSource ServiceErrorSource(L"Service", NULL);
+
+#ifndef _WIN32
+// -------------------- SdNotify ---------------------------------
+
+SdNotify::SdNotify() :
+	fd_(-1)
+{
+}
+
+SdNotify::~SdNotify()
+{
+	close();
+}
+
+Erref SdNotify::open()
+{
+	close();
+	err_.reset();
+
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (path == NULL || path[0] == 0)
+		return Erref(); // not run by the service manager
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t len = strlen(path);
+	// '@' stands for the abstract namespace
+	if ((path[0] != '/' && path[0] != '@') || len >= sizeof(addr.sun_path))
+		return ServiceErrorSource.mkMuiSystem(EINVAL, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+	memcpy(addr.sun_path, path, len);
+	if (path[0] == '@')
+		addr.sun_path[0] = 0;
+
+	fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+	if (connect(fd_, (struct sockaddr *)&addr, (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len)) != 0) {
+		Erref err = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+		close();
+		return err;
+	}
+	return Erref();
+}
+
+void SdNotify::close()
+{
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+}
+
+bool SdNotify::send(
+	__in const std::string &msg)
+{
+	if (fd_ < 0)
+		return true;
+
+	for (;;) {
+		if (::send(fd_, msg.data(), msg.size(), MSG_NOSIGNAL) >= 0)
+			return true;
+		if (errno != EINTR)
+			break;
+	}
+	if (!err_)
+		err_ = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_SEND_FAIL, msg.c_str());
+	return false;
+}
+
+// -------------------- SdNotifyStandIn ---------------------------------
+
+SdNotifyStandIn::SdNotifyStandIn() :
+	fd_(-1), start_(0), ticksPerSec_(1)
+{
+	LARGE_INTEGER freq;
+	if (QueryPerformanceFrequency(&freq) && freq.QuadPart > 0)
+		ticksPerSec_ = freq.QuadPart;
+	markStart();
+}
+
+SdNotifyStandIn::~SdNotifyStandIn()
+{
+	close();
+}
+
+Erref SdNotifyStandIn::open(
+	__in const char *path)
+{
+	close();
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t len = strlen(path);
+	if (len == 0 || len >= sizeof(addr.sun_path))
+		return ServiceErrorSource.mkMuiSystem(EINVAL, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+	memcpy(addr.sun_path, path, len);
+
+	unlink(path); // ignore the errors
+	fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		return ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+	if (bind(fd_, (struct sockaddr *)&addr, (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len)) != 0) {
+		Erref err = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_OPEN_FAIL, path);
+		close();
+		return err;
+	}
+	path_ = path;
+	setenv("NOTIFY_SOCKET", path, 1);
+	return Erref();
+}
+
+void SdNotifyStandIn::close()
+{
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+		unlink(path_.c_str());
+		path_.clear();
+	}
+}
+
+void SdNotifyStandIn::markStart()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	start_ = now.QuadPart;
+}
+
+bool SdNotifyStandIn::receive(
+	__out Message &msg,
+	__in DWORD timeoutMs)
+{
+	struct pollfd pfd;
+	pfd.fd = fd_;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	int n = poll(&pfd, 1, (int)timeoutMs);
+	if (n <= 0) {
+		if (n < 0)
+			err_ = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_RECEIVE_FAIL);
+		return false;
+	}
+
+	char buf[4096]; // the notifications are short
+	ssize_t len = recv(fd_, buf, sizeof(buf), 0);
+	if (len < 0) {
+		err_ = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_NOTIFY_RECEIVE_FAIL);
+		return false;
+	}
+
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	msg.text_.assign(buf, (size_t)len);
+	msg.ns_ = (uint64_t)((double)(now.QuadPart - start_) * 1e9 / (double)ticksPerSec_);
+	return true;
+}
+
+bool SdNotifyStandIn::waitFor(
+	__in const char *assignment,
+	__out Message &msg,
+	__in DWORD timeoutMs)
+{
+	size_t len = strlen(assignment);
+	while (receive(msg, timeoutMs)) {
+		// the assignments are separated by newlines
+		for (size_t pos = 0; pos < msg.text_.size(); ) {
+			size_t end = msg.text_.find('\n', pos);
+			if (end == std::string::npos)
+				end = msg.text_.size();
+			if (end - pos == len && msg.text_.compare(pos, len, assignment) == 0)
+				return true;
+			pos = end + 1;
+		}
+	}
+	return false;
+}
+#endif // _WIN32
+
+// -------------------- Service---------------------------------
+
+Service::Service(const wstring &name,
+	bool canStop,
+	bool canShutdown,
+	bool canPauseContinue,
+	bool canParamChange
+) :
+	name_(name), host_(NULL), statusHandle_(NULL), pendingSince_(0),
+	heartbeat_(false), nextHeartbeat_(0),
+	checkPoint_(0), waitHint_(0),
+	publishIntervalMs_(DEFAULT_PUBLISH_INTERVAL_MS),
+	publishing_(false), dirty_(false),
+	published_(0), suppressed_(0),
+	statusSeq_(0), snapEpoch_(0), snapState_(SERVICE_START_PENDING),
+	snapExitCode_(NO_ERROR), snapSpecificExitCode_(0),
+	publishedCheckPoint_(0), publishedWaitHint_(0),
+	stateSince_(0), lastPublish_(0)
+#ifndef _WIN32
+	, ready_(false)
+#endif
+{
+	for (int i = 0; i < TR_COUNT; ++i)
+		history_[i] = TransitionHistory();
+
+	// Until the host tells otherwise, the service runs in its own process.
+	status_.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+
+	// The service is starting.
+	status_.dwCurrentState = SERVICE_START_PENDING;
+
+	// The accepted commands of the service.
+	status_.dwControlsAccepted = 0;
+	if (canStop)
+		status_.dwControlsAccepted |= SERVICE_ACCEPT_STOP;
+	if (canShutdown)
+		status_.dwControlsAccepted |= SERVICE_ACCEPT_SHUTDOWN;
+	if (canPauseContinue)
+		status_.dwControlsAccepted |= SERVICE_ACCEPT_PAUSE_CONTINUE;
+	if (canParamChange)
+		status_.dwControlsAccepted |= SERVICE_ACCEPT_PARAMCHANGE;
+
+	status_.dwWin32ExitCode = NO_ERROR;
+	status_.dwServiceSpecificExitCode = 0;
+	status_.dwCheckPoint = 0;
+	status_.dwWaitHint = 0;
+}
+
+Service::~Service()
+{ 
+	StateSources::remove(this);
+}
+
+void Service::run(Erref &err)
+{
+	ServiceHost host;
+	host.add(this);
+	host.run(err);
+}
+
+void Service::beginRun(
+	__in ServiceHost *host,
+	__in DWORD serviceType)
+{
+	err_.reset();
+	host_ = host;
+	status_.dwServiceType = serviceType;
+#ifndef _WIN32
+	ready_ = false;
+#endif
+	StateSources::add(this);
+
+	// the service starts in SERVICE_START_PENDING
+	pendingSince_ = GetTickCount64();
+	stateSince_ = pendingSince_;
+	nextHeartbeat_ = pendingSince_;
+}
+
+Erref Service::endRun()
+{
+	StateSources::remove(this);
+	{
+		ScopeCritical sc(statusCr_);
+		host_ = NULL;
+	}
+	ScopeCritical sc(errCr_);
+	return err_.copy();
+}
+
+DWORD Service::control(DWORD ctrl)
+{
+	switch (ctrl)
+	{
+	case SERVICE_CONTROL_STOP:
+		if (status_.dwControlsAccepted & SERVICE_ACCEPT_STOP) {
+			setState(SERVICE_STOP_PENDING);
+			onStop();
+		}
+		break;
+	case SERVICE_CONTROL_PAUSE:
+		if (status_.dwControlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE) {
+			setState(SERVICE_PAUSE_PENDING);
+			onPause();
+		}
+		break;
+	case SERVICE_CONTROL_CONTINUE:
+		if (status_.dwControlsAccepted & SERVICE_ACCEPT_PAUSE_CONTINUE) {
+			setState(SERVICE_CONTINUE_PENDING);
+			onContinue();
+		}
+		break;
+	case SERVICE_CONTROL_SHUTDOWN:
+		if (status_.dwControlsAccepted & SERVICE_ACCEPT_SHUTDOWN) {
+			setState(SERVICE_STOP_PENDING);
+			onShutdown();
+		}
+		break;
+	case SERVICE_CONTROL_PARAMCHANGE:
+		if (status_.dwControlsAccepted & SERVICE_ACCEPT_PARAMCHANGE) {
+			onParamChange();
+		}
+		break;
+	case SERVICE_CONTROL_INTERROGATE:
+		{
+			// The controller already knows the published status, only the
+			// checkpoints waiting for the publisher are worth sending early.
+			// The control handler must not wait for the bumping threads.
+			StatusSnapshot snap = statusSnapshot();
+			if (snap.state_ != SERVICE_STOPPED && snap.checkPoint_ != snap.publishedCheckPoint_)
+				requestPublish();
+		}
+		break;
+	default:
+		return ERROR_CALL_NOT_IMPLEMENTED;
+	}
+	return NO_ERROR;
+}
+
+void Service::setState(DWORD state)
+{
+	ScopeCritical sc(statusCr_);
+
+	setStateL(state);
+}
+
+void Service::setStateL(DWORD state)
+{
+	ULONGLONG now = GetTickCount64();
+	bool changed = (state != status_.dwCurrentState);
+
+	if (changed) {
+		Transition prev = transitionOf(status_.dwCurrentState);
+		Transition next = transitionOf(state);
+		if (prev != TR_COUNT || next != TR_COUNT) {
+			if (prev != TR_COUNT) {
+				TransitionHistory &hist = history_[prev];
+				ULONGLONG dur = now - pendingSince_;
+				DWORD ms = dur > 0xFFFFFFFF ? 0xFFFFFFFF : (DWORD)dur;
+				// the smoothing gives 1/4 of the weight to the latest duration
+				if (hist.count_ == 0)
+					hist.avgMs_ = ms;
+				else
+					hist.avgMs_ = hist.avgMs_ - hist.avgMs_ / 4 + ms / 4;
+				if (ms > hist.maxMs_)
+					hist.maxMs_ = ms;
+				if (hist.count_ != 0xFFFFFFFF)
+					++hist.count_;
+			}
+			if (next != TR_COUNT) {
+				pendingSince_ = now;
+				if (heartbeat_ && host_ != NULL) {
+					nextHeartbeat_ = now;
+					host_->wakeHeartbeat();
+				}
+			}
+		}
+	}
+
+	// The state changes get published right away, the pending
+	// bumps of the previous state get folded into them.
+	status_.dwCurrentState = state;
+	DWORD epoch = (DWORD)(checkPoint_.load(std::memory_order_relaxed) >> 32) + 1;
+	beginStatusWriteL();
+	snapEpoch_.store(epoch, std::memory_order_relaxed);
+	snapState_.store(state, std::memory_order_relaxed);
+	snapExitCode_.store(status_.dwWin32ExitCode, std::memory_order_relaxed);
+	snapSpecificExitCode_.store(status_.dwServiceSpecificExitCode, std::memory_order_relaxed);
+	if (changed)
+		stateSince_.store(now, std::memory_order_relaxed);
+	checkPoint_.store((uint64_t)epoch << 32, std::memory_order_relaxed);
+	waitHint_.store(0, std::memory_order_relaxed);
+	endStatusWriteL();
+	publishL(true);
+#ifndef _WIN32
+	if (state == SERVICE_STOPPED)
+		ServiceHost::wakeRun();
+#endif
+}
+
+void Service::setStateStopped(DWORD exitCode)
+{
+	ScopeCritical sc(statusCr_);
+
+	status_.dwWin32ExitCode = exitCode;
+	setStateL(SERVICE_STOPPED);
+}
+
+void Service::setStateStoppedSpecific(DWORD exitCode)
+{
+	ScopeCritical sc(statusCr_);
+
+	status_.dwWin32ExitCode = ERROR_SERVICE_SPECIFIC_ERROR;
+	status_.dwServiceSpecificExitCode = exitCode;
+	setStateL(SERVICE_STOPPED);
+}
+
+void Service::bump()
+{
+	bumpCheckPoint();
+	requestPublish();
+}
+
+void Service::hintTime(DWORD msec)
+{
+	waitHint_.store(msec, std::memory_order_relaxed);
+	bumpCheckPoint();
+	requestPublish();
+}
+
+void Service::hintTimeL(DWORD msec)
+{
+	waitHint_.store(msec, std::memory_order_relaxed);
+	bumpCheckPoint();
+	if (!publishing_.load())
+		publishL(false);
+	else
+		wakePublisher();
+}
+
+void Service::bumpCheckPoint()
+{
+	// A plain increment would carry into the epoch after 2^32 bumps.
+	uint64_t cp = checkPoint_.load(std::memory_order_relaxed);
+	while (!checkPoint_.compare_exchange_weak(cp,
+			(cp & 0xFFFFFFFF00000000ull) | (DWORD)(cp + 1),
+			std::memory_order_relaxed)) {
+	}
+}
+
+void Service::setPublishInterval(DWORD msec)
+{
+	publishIntervalMs_ = msec;
+}
+
+void Service::getPublishStats(__out PublishStats &st)
+{
+	st.published_ = published_.load(std::memory_order_relaxed);
+	st.suppressed_ = suppressed_.load(std::memory_order_relaxed);
+}
+
+void Service::requestPublish()
+{
+	if (!publishing_.load()) {
+		ScopeCritical sc(statusCr_);
+		publishL(false);
+		return;
+	}
+	wakePublisher();
+}
+
+void Service::wakePublisher()
+{
+	if (dirty_.exchange(true)) {
+		// will be published together with the previous update
+		suppressed_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	SetEvent(host_->publisherWakeup_);
+}
+
+void Service::publishL(bool stateChange)
+{
+	if (!stateChange && status_.dwCurrentState == SERVICE_STOPPED)
+		return; // nothing may be reported after the stop
+
+	status_.dwCheckPoint = (DWORD)checkPoint_.load(std::memory_order_relaxed);
+	// the hint applies only to one update
+	status_.dwWaitHint = waitHint_.exchange(0, std::memory_order_relaxed);
+#ifdef _WIN32
+	SetServiceStatus(statusHandle_, &status_);
+#else
+	if (host_ != NULL) {
+		if (stateChange)
+			host_->notifyStateL(this);
+		else
+			host_->notifyCheckPoint(status_.dwWaitHint);
+	}
+#endif
+
+	beginStatusWriteL();
+	publishedCheckPoint_.store(status_.dwCheckPoint, std::memory_order_relaxed);
+	publishedWaitHint_.store(status_.dwWaitHint, std::memory_order_relaxed);
+	lastPublish_.store(GetTickCount64(), std::memory_order_relaxed);
+	endStatusWriteL();
+
+	status_.dwWaitHint = 0; // won't apply after this update
+	published_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Service::beginStatusWriteL()
+{
+	statusSeq_.store(statusSeq_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+void Service::endStatusWriteL()
+{
+	statusSeq_.store(statusSeq_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+Service::StatusSnapshot Service::statusSnapshot() const
+{
+	StatusSnapshot snap;
+	for (;;) {
+		uint32_t seq = statusSeq_.load(std::memory_order_acquire);
+		snap.epoch_ = snapEpoch_.load(std::memory_order_relaxed);
+		snap.state_ = snapState_.load(std::memory_order_relaxed);
+		uint64_t cp = checkPoint_.load(std::memory_order_relaxed);
+		snap.checkPoint_ = (DWORD)cp;
+		snap.waitHint_ = publishedWaitHint_.load(std::memory_order_relaxed);
+		snap.win32ExitCode_ = snapExitCode_.load(std::memory_order_relaxed);
+		snap.serviceSpecificExitCode_ = snapSpecificExitCode_.load(std::memory_order_relaxed);
+		snap.publishedCheckPoint_ = publishedCheckPoint_.load(std::memory_order_relaxed);
+		snap.stateSince_ = stateSince_.load(std::memory_order_relaxed);
+		snap.lastPublish_ = lastPublish_.load(std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if ((seq & 1) == 0 && statusSeq_.load(std::memory_order_relaxed) == seq
+				&& (DWORD)(cp >> 32) == snap.epoch_)
+			return snap;
+	}
+}
+
+void Service::enableHeartbeat()
+{
+	heartbeat_ = true;
+}
+
+void Service::getTransitionHistory(
+	__in Transition tr,
+	__out TransitionHistory &hist)
+{
+	ScopeCritical sc(statusCr_);
+
+	hist = history_[tr];
+}
+
+void Service::setTransitionHistory(
+	__in Transition tr,
+	__in const TransitionHistory &hist)
+{
+	ScopeCritical sc(statusCr_);
+
+	history_[tr] = hist;
+}
+
+Service::Transition Service::transitionOf(DWORD state)
+{
+	switch (state) {
+	case SERVICE_START_PENDING:
+		return TR_START;
+	case SERVICE_STOP_PENDING:
+		return TR_STOP;
+	case SERVICE_PAUSE_PENDING:
+		return TR_PAUSE;
+	case SERVICE_CONTINUE_PENDING:
+		return TR_CONTINUE;
+	default:
+		return TR_COUNT;
+	}
+}
+
+void Service::heartbeatTimesL(
+	__in ULONGLONG now,
+	__out DWORD &hint,
+	__out DWORD &interval)
+{
+	const TransitionHistory &hist = history_[transitionOf(status_.dwCurrentState)];
+	ULONGLONG elapsed = now - pendingSince_;
+
+	ULONGLONG remaining;
+	if (hist.count_ == 0) {
+		remaining = HEARTBEAT_DEFAULT_HINT_MS;
+	} else {
+		// leave a margin over the average, and within the longest seen
+		ULONGLONG expected = (ULONGLONG)hist.avgMs_ + hist.avgMs_ / 4;
+		if (expected < hist.maxMs_)
+			expected = (expected + hist.maxMs_) / 2;
+		if (elapsed < expected)
+			remaining = expected - elapsed;
+		else
+			remaining = elapsed / 2; // overdue, expect it to keep going for a while
+	}
+
+	if (remaining < HEARTBEAT_MIN_HINT_MS)
+		remaining = HEARTBEAT_MIN_HINT_MS;
+	if (remaining > HEARTBEAT_MAX_HINT_MS)
+		remaining = HEARTBEAT_MAX_HINT_MS;
+	hint = (DWORD)remaining;
+
+	// a few checkpoints within each hint, in case some get delayed
+	interval = hint / 3;
+	if (interval < HEARTBEAT_MIN_INTERVAL_MS)
+		interval = HEARTBEAT_MIN_INTERVAL_MS;
+}
+
+void Service::onStart(
+	__in DWORD argc,
+	__in_ecount(argc) LPWSTR *argv)
+{
+	setState(SERVICE_RUNNING);
+}
+void Service::onStop()
+{
+	setStateStopped(NO_ERROR);
+}
+void Service::onPause()
+{
+	setState(SERVICE_PAUSED);
+}
+void Service::onContinue()
+{
+	setState(SERVICE_RUNNING);
+}
+void Service::onShutdown()
+{
+	onStop();
+}
+void Service::onParamChange()
+{
+}
+
+Erref Service::captureState()
+{
+	StatusSnapshot snap = statusSnapshot();
+
+	Erref state = ServiceErrorSource.mkMui(EPEM_SERVICE_STATE, name_.c_str(),
+		snap.state_, snap.checkPoint_, snap.waitHint_,
+		snap.win32ExitCode_, snap.serviceSpecificExitCode_);
+	state.append(ServiceErrorSource.mkMui(EPEM_SERVICE_PUBLISH_STATE,
+		published_.load(std::memory_order_relaxed), suppressed_.load(std::memory_order_relaxed)));
+	return state;
+}
+
+
+// -------------------- ServiceHost -----------------------------
+
+#ifdef _WIN32
+ServiceHost *ServiceHost::running_;
+#else
+int ServiceHost::signalPipe_[2] = { -1, -1 };
+#endif
+
+ServiceHost::ServiceHost() :
+#ifndef _WIN32
+	readyCount_(0),
+#endif
+	threadsStop_(false),
+	publisherWakeup_(NULL), publisherThread_(NULL),
+	heartbeatWakeup_(NULL), heartbeatThread_(NULL)
+{
+}
+
+ServiceHost::~ServiceHost()
+{
+	// the events stay until here, since the services that have
+	// just stopped may still be using them
+	if (publisherWakeup_ != NULL)
+		CloseHandle(publisherWakeup_);
+	if (heartbeatWakeup_ != NULL)
+		CloseHandle(heartbeatWakeup_);
+}
+
+void ServiceHost::add(
+	__in Service *svc)
+{
+	services_.push_back(svc);
+	if (!names_.empty())
+		names_ += L", ";
+	names_ += svc->name_;
+}
+
+void ServiceHost::run(
+	__out Erref &err)
+{
+	err_.reset();
+	if (services_.empty()) {
+		err = ServiceErrorSource.mkMui(EPEM_SERVICE_HOST_EMPTY);
+		return;
+	}
+
+#ifndef _WIN32
+	// ready before the services start publishing
+	readyCount_ = 0;
+	err_ = notify_.open();
+	if (!err_ && pipe(signalPipe_) != 0)
+		err_ = ServiceErrorSource.mkMuiSystem((DWORD)errno, EPEM_SERVICE_DISPATCHER_FAIL, names_.c_str());
+#endif
+
+	DWORD serviceType = (services_.size() > 1 ?
+		SERVICE_WIN32_SHARE_PROCESS : SERVICE_WIN32_OWN_PROCESS);
+	for (size_t i = 0; i < services_.size(); ++i)
+		services_[i]->beginRun(this, serviceType);
+	startThreads();
+
+#ifdef _WIN32
+	std::vector<SERVICE_TABLE_ENTRY> serviceTable;
+	for (size_t i = 0; i < services_.size(); ++i) {
+		SERVICE_TABLE_ENTRY entry = { (LPWSTR)services_[i]->name_.c_str(), serviceMain };
+		serviceTable.push_back(entry);
+	}
+	SERVICE_TABLE_ENTRY end = { NULL, NULL };
+	serviceTable.push_back(end);
+
+	running_ = this;
+	if (!StartServiceCtrlDispatcher(&serviceTable[0])) {
+		ScopeCritical sc(errCr_);
+		err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_DISPATCHER_FAIL, names_.c_str()));
+	}
+	running_ = NULL;
+#else
+	static const int signals[] = { SIGTERM, SIGINT, SIGHUP };
+	enum { SIGNAL_COUNT = sizeof(signals) / sizeof(signals[0]) };
+	struct sigaction prevActions[SIGNAL_COUNT];
+
+	if (!err_) {
+		for (int i = 0; i < 2; ++i)
+			fcntl(signalPipe_[i], F_SETFD, FD_CLOEXEC);
+		fcntl(signalPipe_[1], F_SETFL, O_NONBLOCK);
+
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = signalHandler;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		for (int i = 0; i < SIGNAL_COUNT; ++i)
+			sigaction(signals[i], &action, &prevActions[i]);
+
+		// what serviceMain() does, minus the handler registration
+		for (size_t i = 0; i < services_.size(); ++i) {
+			Service *svc = services_[i];
+			svc->setState(SERVICE_START_PENDING);
+			LPWSTR argv[] = { (LPWSTR)svc->name_.c_str(), NULL };
+			svc->onStart(1, argv);
+		}
+
+		for (;;) {
+			size_t stopped = 0;
+			for (size_t i = 0; i < services_.size(); ++i) {
+				if (services_[i]->statusSnapshot().state_ == SERVICE_STOPPED)
+					++stopped;
+			}
+			if (stopped == services_.size())
+				break;
+
+			unsigned char sig;
+			ssize_t len = read(signalPipe_[0], &sig, 1);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0) {
+				ScopeCritical sc(errCr_);
+				err_.append(ServiceErrorSource.mkMuiSystem(len < 0 ? (DWORD)errno : EPIPE,
+					EPEM_SERVICE_DISPATCHER_FAIL, names_.c_str()));
+				break;
+			}
+
+			// the signals are for the whole process, so for all the services
+			for (size_t i = 0; i < services_.size(); ++i) {
+				Service *svc = services_[i];
+				if (svc->statusSnapshot().state_ == SERVICE_STOPPED)
+					continue;
+
+				switch (sig) {
+				case SIGTERM:
+				case SIGINT:
+					if (svc->status_.dwControlsAccepted & SERVICE_ACCEPT_STOP)
+						svc->control(SERVICE_CONTROL_STOP);
+					else
+						svc->control(SERVICE_CONTROL_SHUTDOWN);
+					break;
+				case SIGHUP:
+					svc->control(SERVICE_CONTROL_PARAMCHANGE);
+					break;
+				default:
+					break;
+				}
+			}
+		}
+
+		for (int i = 0; i < SIGNAL_COUNT; ++i)
+			sigaction(signals[i], &prevActions[i], NULL);
+	}
+#endif
+
+	stopThreads();
+	Erref result = err_.copy();
+	for (size_t i = 0; i < services_.size(); ++i)
+		result.append(services_[i]->endRun());
+
+#ifndef _WIN32
+	for (int i = 0; i < 2; ++i) {
+		if (signalPipe_[i] >= 0) {
+			::close(signalPipe_[i]);
+			signalPipe_[i] = -1;
+		}
+	}
+	if (notify_.error())
+		result.append(notify_.error());
+	notify_.close();
+#endif
+
+	err = result;
+}
+
+void ServiceHost::startThreads()
+{
+	bool publish = false;
+	bool heartbeat = false;
+	for (size_t i = 0; i < services_.size(); ++i) {
+		if (services_[i]->publishIntervalMs_ != 0)
+			publish = true;
+		if (services_[i]->heartbeat_)
+			heartbeat = true;
+	}
+	threadsStop_ = false;
+
+	// The publisher failure is not fatal, the updates just get
+	// published synchronously.
+	if (publish) {
+		if (publisherWakeup_ == NULL)
+			publisherWakeup_ = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (publisherWakeup_ == NULL) {
+			err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_PUBLISHER_START_FAIL, names_.c_str()));
+		} else {
+			publisherThread_ = CreateThread(NULL, 0, &publisherThread, (LPVOID)this, 0, NULL);
+			if (publisherThread_ == NULL) {
+				err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_PUBLISHER_START_FAIL, names_.c_str()));
+			} else {
+				for (size_t i = 0; i < services_.size(); ++i) {
+					if (services_[i]->publishIntervalMs_ != 0)
+						services_[i]->publishing_ = true;
+				}
+			}
+		}
+	}
+
+	// The heartbeat failure is not fatal, the services just run without it.
+	if (heartbeat) {
+		if (heartbeatWakeup_ == NULL)
+			heartbeatWakeup_ = CreateEventW(NULL, FALSE, FALSE, NULL);
+		if (heartbeatWakeup_ == NULL) {
+			err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_HEARTBEAT_START_FAIL, names_.c_str()));
+		} else {
+			heartbeatThread_ = CreateThread(NULL, 0, &heartbeatThread, (LPVOID)this, 0, NULL);
+			if (heartbeatThread_ == NULL) {
+				err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(), EPEM_SERVICE_HEARTBEAT_START_FAIL, names_.c_str()));
+			}
+		}
+	}
+}
+
+void ServiceHost::stopThreads()
+{
+	// The services have stopped, and the updates that are still
+	// pending make no sense any more.
+	for (size_t i = 0; i < services_.size(); ++i)
+		services_[i]->publishing_ = false;
+	threadsStop_ = true;
+
+	if (heartbeatThread_ != NULL) {
+		SetEvent(heartbeatWakeup_);
+		WaitForSingleObject(heartbeatThread_, INFINITE); // ignore any errors...
+		CloseHandle(heartbeatThread_);
+		heartbeatThread_ = NULL;
+	}
+	if (publisherThread_ != NULL) {
+		SetEvent(publisherWakeup_);
+		WaitForSingleObject(publisherThread_, INFINITE); // ignore any errors...
+		CloseHandle(publisherThread_);
+		publisherThread_ = NULL;
+	}
+}
+
+void ServiceHost::wakeHeartbeat()
+{
+	if (heartbeatWakeup_ != NULL)
+		SetEvent(heartbeatWakeup_);
+}
+
+DWORD WINAPI ServiceHost::publisherThread(LPVOID arg)
+{
+	ServiceHost *host = (ServiceHost *)arg;
+	DWORD wait = INFINITE;
+
+	for (;;) {
+		WaitForSingleObject(host->publisherWakeup_, wait); // ignore any errors...
+		if (host->threadsStop_.load())
+			break;
+
+		// At most one update per interval for each service, the requests
+		// that come in the meantime get folded into it.
+		wait = INFINITE;
+		ULONGLONG now = GetTickCount64();
+		for (size_t i = 0; i < host->services_.size(); ++i) {
+			Service *svc = host->services_[i];
+			if (!svc->dirty_.load())
+				continue;
+
+			ULONGLONG since = now - svc->lastPublish_.load(std::memory_order_relaxed);
+			if (since < svc->publishIntervalMs_) {
+				DWORD left = (DWORD)(svc->publishIntervalMs_ - since);
+				if (left < wait)
+					wait = left;
+				continue;
+			}
+
+			// cleared before publishing, so that the requests made
+			// while publishing get their own update
+			svc->dirty_ = false;
+			ScopeCritical sc(svc->statusCr_);
+			svc->publishL(false);
+		}
+	}
+	return 0;
+}
+
+DWORD WINAPI ServiceHost::heartbeatThread(LPVOID arg)
+{
+	ServiceHost *host = (ServiceHost *)arg;
+	DWORD wait = 0; // the services start in a pending state
+
+	for (;;) {
+		WaitForSingleObject(host->heartbeatWakeup_, wait); // ignore any errors...
+		if (host->threadsStop_.load())
+			break;
+
+		// sleep until the earliest heartbeat due, or the next pending state
+		wait = INFINITE;
+		ULONGLONG now = GetTickCount64();
+		for (size_t i = 0; i < host->services_.size(); ++i) {
+			Service *svc = host->services_[i];
+			if (!svc->heartbeat_)
+				continue;
+
+			DWORD hint;
+			DWORD interval;
+			// The hint gets sent under the same lock as the check of
+			// the state, or the service might have left the pending
+			// state by then.
+			ScopeCritical sc(svc->statusCr_);
+			if (Service::transitionOf(svc->status_.dwCurrentState) == Service::TR_COUNT)
+				continue;
+			if (svc->nextHeartbeat_ > now) {
+				interval = (DWORD)(svc->nextHeartbeat_ - now);
+				if (interval < wait)
+					wait = interval;
+				continue;
+			}
+			svc->heartbeatTimesL(now, hint, interval);
+			svc->nextHeartbeat_ = now + interval;
+			if (interval < wait)
+				wait = interval;
+			svc->hintTimeL(hint);
+		}
+	}
+	return 0;
+}
+
+#ifdef _WIN32
+Service *ServiceHost::find(
+	__in const WCHAR *name)
+{
+	if (services_.size() == 1)
+		return services_[0];
+	for (size_t i = 0; i < services_.size(); ++i) {
+		// the controller treats the service names as case-insensitive
+		if (_wcsicmp(services_[i]->name_.c_str(), name) == 0)
+			return services_[i];
+	}
+	return NULL;
+}
+
+void WINAPI ServiceHost::serviceMain(
+	__in DWORD argc,
+	__in_ecount(argc) LPWSTR *argv)
+{
+	//assert(running_ != NULL);
+	const WCHAR *name = (argc > 0 ? argv[0] : L"");
+	Service *svc = running_->find(name);
+	if (svc == NULL) {
+		ScopeCritical sc(running_->errCr_);
+		running_->err_.append(ServiceErrorSource.mkMui(EPEM_SERVICE_UNKNOWN, name));
+		return;
+	}
+
+	// Register the handler function for the service, with the service
+	// as the context to route the requests by.
+	svc->statusHandle_ = RegisterServiceCtrlHandlerEx(
+		svc->name_.c_str(), serviceCtrlHandler, (LPVOID)svc);
+	if (svc->statusHandle_ == NULL)
+	{
+		{
+			ScopeCritical sc(svc->errCr_);
+			svc->err_.append(ServiceErrorSource.mkMuiSystem(GetLastError(),
+				EPEM_SERVICE_HANDLER_REGISTER_FAIL, svc->name_.c_str()));
+		}
+		svc->setStateStoppedSpecific(EPEM_SERVICE_HANDLER_REGISTER_FAIL);
+		return;
+	}
+
+	// Start the service.
+	svc->setState(SERVICE_START_PENDING);
+	svc->onStart(argc, argv);
+}
+
+DWORD WINAPI ServiceHost::serviceCtrlHandler(
+	__in DWORD ctrl,
+	__in DWORD eventType,
+	__in LPVOID eventData,
+	__in LPVOID context)
+{
+	return ((Service *)context)->control(ctrl);
+}
+#else
+void ServiceHost::signalHandler(int sig)
+{
+	int savedErrno = errno;
+	unsigned char c = (unsigned char)sig;
+	ssize_t written = write(signalPipe_[1], &c, 1);
+	(void)written; // nothing can be done about it in a signal handler
+	errno = savedErrno;
+}
+
+void ServiceHost::wakeRun()
+{
+	if (signalPipe_[1] >= 0) {
+		unsigned char zero = 0;
+		ssize_t written = write(signalPipe_[1], &zero, 1);
+		(void)written; // if the pipe is full, run() will wake up anyway
+	}
+}
+
+void ServiceHost::notifyStateL(
+	__in Service *svc)
+{
+	const char *status;
+	bool ready = false;
+	bool stopping = false;
+	switch (svc->status_.dwCurrentState) {
+	case SERVICE_START_PENDING:
+		status = "Starting";
+		break;
+	case SERVICE_RUNNING:
+		status = "Running";
+		ready = true;
+		break;
+	case SERVICE_PAUSE_PENDING:
+		status = "Pausing";
+		break;
+	case SERVICE_PAUSED:
+		status = "Paused";
+		ready = true;
+		break;
+	case SERVICE_CONTINUE_PENDING:
+		status = "Continuing";
+		break;
+	case SERVICE_STOP_PENDING:
+		status = "Stopping";
+		stopping = true;
+		break;
+	case SERVICE_STOPPED:
+		status = "Stopped";
+		stopping = true;
+		break;
+	default:
+		return;
+	}
+
+	// Serialized, so that the last service to change its state
+	// sees the states of all the others.
+	ScopeCritical sc(notifyCr_);
+
+	std::string msg;
+	if (ready) {
+		if (!svc->ready_) {
+			svc->ready_ = true;
+			++readyCount_;
+		}
+		// the process is ready when all its services are
+		if (readyCount_ == services_.size())
+			msg = "READY=1\n";
+	}
+
+	size_t down = 0; // stopping or stopped
+	size_t stopped = 0;
+	DWORD exitCode = NO_ERROR;
+	if (stopping) {
+		for (size_t i = 0; i < services_.size(); ++i) {
+			Service::StatusSnapshot snap = services_[i]->statusSnapshot();
+			if (snap.state_ == SERVICE_STOPPED) {
+				++down;
+				++stopped;
+				// the first failure is the exit status of the process
+				if (exitCode == NO_ERROR)
+					exitCode = (snap.win32ExitCode_ == ERROR_SERVICE_SPECIFIC_ERROR ?
+						snap.serviceSpecificExitCode_ : snap.win32ExitCode_);
+			} else if (snap.state_ == SERVICE_STOP_PENDING) {
+				++down;
+			}
+		}
+		if (down == services_.size())
+			msg = "STOPPING=1\n";
+	}
+
+	msg += "STATUS=";
+	if (services_.size() > 1) {
+		appendUtf8(msg, svc->name_.c_str(), svc->name_.size());
+		msg += ": ";
+	}
+	msg += status;
+	if (stopped == services_.size()) {
+		msg += "\nEXIT_STATUS=";
+		msg += std::to_string(exitCode);
+	}
+	notify_.send(msg);
+}
+
+void ServiceHost::notifyCheckPoint(
+	__in DWORD waitHint)
+{
+	ScopeCritical sc(notifyCr_);
+
+	if (waitHint != 0)
+		notify_.send("EXTEND_TIMEOUT_USEC=" + std::to_string((uint64_t)waitHint * 1000) + "\nWATCHDOG=1");
+	else
+		notify_.send("WATCHDOG=1");
+}
+#endif // _WIN32
@@ -1,100 +1,508 @@
-#pragma once
-
-//#define DLLEXPORT __declspec( dllexport )
-#define DLLEXPORT
-
-
-class DLLEXPORT Service
-{
-public:
-	// The way the services work, there can be only one Service object
-	// in the process. 
-	Service(const std::wstring &name,
-		bool canStop,
-		bool canShutdown,
-		bool canPauseContinue);
-
-	virtual ~Service();
-
-	// Run the service. Returns after the service gets stopped.
-	// When the Service object gets started,
-	// it will remember the instance pointer in the instance_ static
-	// member, and use it in the callbacks.
-	// The errors are reported back in err.
-	void run(Erref &err);
-
-	// Change the service state. Don't use it for SERVICE_STOPPED,
-	// do that through the special versions.
-	// Can be called only while run() is running.
-	void setState(DWORD state);
-	// The convenience versions.
-	void setStateRunning()
-	{
-		setState(SERVICE_RUNNING);
-	}
-	void setStatePaused()
-	{
-		setState(SERVICE_PAUSED);
-	}
-	// The stopping is more compilcated: it also sets the exit code.
-	// Which can be either general or a service-specific error code.
-	// The success indication is the general code NO_ERROR.
-	// Can be called only while run() is running.
-	void setStateStopped(DWORD exitCode);
-	void setStateStoppedSpecific(DWORD exitCode);
-
-	// On the lengthy operations, periodically call this to tell the
-	// controller that the service is not dead.
-	// Can be called only while run() is running.
-	void bump();
-
-	// Can be used to set the expected length of long operations.
-	// Also does the bump.
-	// Can be called only while run() is running.
-	void hintTime(DWORD msec);
-
-	// Methods for the subclasses to override.
-	// The base class defaults set the completion state, so the subclasses must
-	// either call them at the end of processing (maybe after some wait, maybe
-	// from another thread) or do it themselves.
-	// The pending states (where applicable) will be set before these methods
-	// are called.
-	// onStart() is responsible for actually starting the application
-	virtual void onStart(
-		__in DWORD argc,
-		__in_ecount(argc) LPWSTR *argv);
-	virtual void onStop(); // sets the success exit code
-	virtual void onPause();
-	virtual void onContinue();
-	virtual void onShutdown(); // calls onStop()
-
-protected:
-	// The callback for the service start.
-	static void WINAPI serviceMain(
-		__in DWORD argc,
-		__in_ecount(argc) LPWSTR *argv);
-	// The callback for the requests.
-	static void WINAPI serviceCtrlHandler(DWORD ctrl);
-
-	// the internal version that expects the caller to already hold statusCr_
-	void setStateL(DWORD state);
-
-protected:
-	/** this is a singleton! */
-	static Service *instance_;
-
-	std::wstring name_; // service name
-
-	Critical statusCr_; // protects the status setting
-	SERVICE_STATUS_HANDLE statusHandle_; // handle used to report the status
-	SERVICE_STATUS status_; // the current status
-
-	Critical errCr_; // protects the error handling
-	Erref err_; // the collected errors
-
-private:
-	Service();
-	Service(const Service &);
-	void operator=(const Service &);
-};
-
+#pragma once
+
+//#define DLLEXPORT __declspec( dllexport )
+#define DLLEXPORT
+
+
+#ifndef _WIN32
+// The client side of the systemd notification protocol (sd_notify):
+// sends the state changes as datagrams to the unix socket named
+// by $NOTIFY_SOCKET.
+class SdNotify
+{
+public:
+	SdNotify();
+	~SdNotify();
+
+	// Connect to the socket from $NOTIFY_SOCKET. If the variable is not
+	// set, the process is not run by the service manager, and the
+	// notifications get silently thrown away.
+	// Returns the error if the socket can't be connected.
+	Erref open();
+	void close();
+
+	// Send a notification, such as "READY=1". Several assignments
+	// can be sent at once, separated by "\n".
+	// The first failure gets kept, and can be extracted with error().
+	// Returns false on failure.
+	bool send(
+		__in const std::string &msg);
+
+	Erref error()
+	{
+		return err_;
+	}
+
+protected:
+	int fd_; // the connected socket, or -1
+	Erref err_; // the first send failure
+
+private:
+	SdNotify(const SdNotify &);
+	void operator=(const SdNotify &);
+};
+
+// A stand-in for the service manager's side of the notification protocol,
+// for testing the services: binds a unix datagram socket, and receives
+// the notifications sent to it, timing them.
+class SdNotifyStandIn
+{
+public:
+	// A received notification.
+	struct Message {
+	public:
+		std::string text_;
+		uint64_t ns_; // the time since markStart(), in nanoseconds
+	};
+
+	SdNotifyStandIn();
+	~SdNotifyStandIn();
+
+	// Bind the socket and point $NOTIFY_SOCKET to it, so that the
+	// services started after this in this process or in its child
+	// processes notify it.
+	// path - the socket path, gets replaced if it exists
+	Erref open(
+		__in const char *path);
+	void close();
+
+	// Remember the current time as the start of the service.
+	void markStart();
+
+	// Receive the next notification.
+	// timeoutMs - how long to wait for it
+	// Returns false on timeout or on an error (see error()).
+	bool receive(
+		__out Message &msg,
+		__in DWORD timeoutMs);
+
+	// Receive the notifications until one contains the given assignment,
+	// such as "READY=1". The timing of that notification is the
+	// latency from markStart() to that state.
+	// timeoutMs - how long to wait for each notification
+	// Returns false on timeout or on an error.
+	bool waitFor(
+		__in const char *assignment,
+		__out Message &msg,
+		__in DWORD timeoutMs);
+
+	Erref error()
+	{
+		return err_;
+	}
+
+protected:
+	int fd_; // the bound socket, or -1
+	std::string path_; // path of the socket
+	LONGLONG start_; // the start time, by QueryPerformanceCounter()
+	LONGLONG ticksPerSec_; // frequency of QueryPerformanceCounter()
+	Erref err_; // the last receive error
+
+private:
+	SdNotifyStandIn(const SdNotifyStandIn &);
+	void operator=(const SdNotifyStandIn &);
+};
+#endif // _WIN32
+
+class ServiceHost;
+
+// A service, run by a ServiceHost, either alone in its process
+// (see run()) or together with the other services.
+//
+// On the platforms without the Windows service controller, the service
+// runs under a service manager such as systemd: the state changes get
+// sent as notifications through SdNotify, and the signals get translated
+// to the controls: SIGTERM and SIGINT to the stop (or shutdown, if the
+// stop is not accepted), SIGHUP to the parameter change.
+//
+// The service reports its status in the state snapshots
+// (see StateSources) while it's running.
+class DLLEXPORT Service : public StateSource
+{
+	friend class ServiceHost;
+
+public:
+	// The limits of the wait hints sent by the heartbeat, in milliseconds.
+	enum {
+		HEARTBEAT_MIN_HINT_MS = 1000,
+		HEARTBEAT_DEFAULT_HINT_MS = 5000, // when there is no history
+		HEARTBEAT_MAX_HINT_MS = 60000,
+		HEARTBEAT_MIN_INTERVAL_MS = 100, // the shortest interval between the checkpoints
+	};
+
+	// The default for setPublishInterval().
+	enum { DEFAULT_PUBLISH_INTERVAL_MS = 100 };
+
+	// The statistics of publishing the status updates.
+	struct PublishStats {
+	public:
+		uint64_t published_; // the number of updates sent to the controller
+		uint64_t suppressed_; // the number of bumps and hints folded into
+			// the other updates
+	};
+
+	// A consistent copy of the service status, see statusSnapshot().
+	struct StatusSnapshot {
+	public:
+		DWORD state_; // SERVICE_*
+		DWORD epoch_; // the number of the state updates so far
+		DWORD checkPoint_; // the latest checkpoint within the state update
+			// of epoch_, maybe not published yet
+		DWORD waitHint_; // the wait hint of the last published update
+		DWORD win32ExitCode_;
+		DWORD serviceSpecificExitCode_;
+		DWORD publishedCheckPoint_; // the checkpoint last sent to the controller
+		ULONGLONG stateSince_; // when the state was entered, by GetTickCount64()
+		ULONGLONG lastPublish_; // when the status was last sent to the
+			// controller, by GetTickCount64(); 0 if never
+	};
+
+	// The transitions through the pending states.
+	enum Transition {
+		TR_START,
+		TR_STOP,
+		TR_PAUSE,
+		TR_CONTINUE,
+		TR_COUNT, // the number of transitions, also means "not pending"
+	};
+
+	// The history of the durations of a transition, from which the
+	// heartbeat derives the wait hints.
+	struct TransitionHistory {
+	public:
+		DWORD avgMs_; // the smoothed average duration
+		DWORD maxMs_; // the longest duration
+		DWORD count_; // the number of the transitions seen
+	};
+
+	// name - the name the service is registered with
+	Service(const std::wstring &name,
+		bool canStop,
+		bool canShutdown,
+		bool canPauseContinue,
+		bool canParamChange = false);
+
+	virtual ~Service();
+
+	// Run the service as the only one in its process, with its own
+	// ServiceHost. Returns after the service gets stopped.
+	// The errors are reported back in err.
+	void run(Erref &err);
+
+	// The host that runs the service, or NULL if it's not running.
+	ServiceHost *host() const
+	{
+		return host_;
+	}
+
+	const std::wstring &name() const
+	{
+		return name_;
+	}
+
+	// Change the service state. Don't use it for SERVICE_STOPPED,
+	// do that through the special versions.
+	// Can be called only while run() is running.
+	void setState(DWORD state);
+	// The convenience versions.
+	void setStateRunning()
+	{
+		setState(SERVICE_RUNNING);
+	}
+	void setStatePaused()
+	{
+		setState(SERVICE_PAUSED);
+	}
+	// The stopping is more compilcated: it also sets the exit code.
+	// Which can be either general or a service-specific error code.
+	// The success indication is the general code NO_ERROR.
+	// Can be called only while run() is running.
+	void setStateStopped(DWORD exitCode);
+	void setStateStoppedSpecific(DWORD exitCode);
+
+	// On the lengthy operations, periodically call this to tell the
+	// controller that the service is not dead.
+	// Takes no locks: the update gets published to the controller in
+	// background, and the bumps that come faster than the publish
+	// interval get folded together (see setPublishInterval()).
+	// Can be called only while run() is running.
+	void bump();
+
+	// Can be used to set the expected length of long operations.
+	// Also does the bump.
+	// Can be called only while run() is running.
+	void hintTime(DWORD msec);
+
+	// Set the minimal interval between the updates for bump() and
+	// hintTime(). The state changes get published right away in any case.
+	// 0 means publishing every update synchronously.
+	// Must be called before run().
+	void setPublishInterval(DWORD msec);
+
+	// Get the statistics of publishing the updates.
+	void getPublishStats(__out PublishStats &st);
+
+	// Get a consistent copy of the status. Takes no locks: the reader
+	// retries if it races with an update, and never delays the writers.
+	// Can be called from any thread, any time.
+	StatusSnapshot statusSnapshot() const;
+
+	// Opt in to the automatic heartbeats: while the service is in any
+	// of the pending states, the host's heartbeat thread reports the checkpoints,
+	// with the wait hints derived from the history of the same transition.
+	// The longer the transition is expected to take, the rarer are the
+	// checkpoints. Must be called before run().
+	void enableHeartbeat();
+
+	// Get or set the history of a transition. The history is collected
+	// in any case, and a subclass may save it and restore it before the
+	// next run(), to get the good wait hints for the start and stop.
+	// WrapService keeps it in the registry, under its Parameters key.
+	void getTransitionHistory(
+		__in Transition tr,
+		__out TransitionHistory &hist);
+	void setTransitionHistory(
+		__in Transition tr,
+		__in const TransitionHistory &hist);
+
+	// Methods for the subclasses to override.
+	// The base class defaults set the completion state, so the subclasses must
+	// either call them at the end of processing (maybe after some wait, maybe
+	// from another thread) or do it themselves.
+	// The pending states (where applicable) will be set before these methods
+	// are called.
+	// onStart() is responsible for actually starting the application
+	virtual void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv);
+	virtual void onStop(); // sets the success exit code
+	virtual void onPause();
+	virtual void onContinue();
+	virtual void onShutdown(); // calls onStop()
+	virtual void onParamChange(); // does nothing
+
+	// from StateSource
+	// The subclasses may extend it with their own state.
+	virtual Erref captureState();
+
+protected:
+	// Get ready to be run by a host.
+	// serviceType - SERVICE_WIN32_OWN_PROCESS or SERVICE_WIN32_SHARE_PROCESS
+	void beginRun(
+		__in ServiceHost *host,
+		__in DWORD serviceType);
+	// Detach from the host after the service has stopped.
+	// Returns the collected errors.
+	Erref endRun();
+
+	// Handle a control request, as routed by the host.
+	// Returns NO_ERROR, or ERROR_CALL_NOT_IMPLEMENTED for the
+	// unsupported controls.
+	DWORD control(DWORD ctrl);
+
+	// the internal version that expects the caller to already hold statusCr_
+	void setStateL(DWORD state);
+
+	// Publish an update from bump() or hintTime(): in background
+	// if the host's publisher is running, otherwise right away.
+	void requestPublish();
+	// Wake up the host's publisher for an update.
+	void wakePublisher();
+
+	// hintTime() for the heartbeat, called under statusCr_ together with
+	// the check of the state, so that the hint can't land after the
+	// service has left the pending state.
+	void hintTimeL(DWORD msec);
+
+	// Send the current status to the controller. Called under statusCr_.
+	// stateChange - the state has changed, otherwise it's only a checkpoint
+	void publishL(bool stateChange);
+
+	// Increment the checkpoint, keeping it within the current epoch.
+	void bumpCheckPoint();
+
+	// Bracket an update of the fields read by statusSnapshot().
+	// Called under statusCr_, which serializes the writers.
+	void beginStatusWriteL();
+	void endStatusWriteL();
+
+	// Find the transition of a pending state.
+	// Returns TR_COUNT if the state is not pending.
+	static Transition transitionOf(DWORD state);
+
+	// Compute the wait hint and the interval till the next checkpoint
+	// for the current pending state. Called under statusCr_.
+	// now - the current time, by GetTickCount64()
+	void heartbeatTimesL(
+		__in ULONGLONG now,
+		__out DWORD &hint,
+		__out DWORD &interval);
+
+protected:
+	std::wstring name_; // service name
+	ServiceHost *host_; // the host running the service, or NULL
+
+	Critical statusCr_; // protects the status setting
+	SERVICE_STATUS_HANDLE statusHandle_; // handle used to report the status
+	SERVICE_STATUS status_; // the current status
+	ULONGLONG pendingSince_; // when the current pending state was entered,
+		// by GetTickCount64()
+	TransitionHistory history_[TR_COUNT]; // the durations of the transitions
+
+	bool heartbeat_; // the heartbeat is enabled
+	ULONGLONG nextHeartbeat_; // when the next heartbeat is due, by GetTickCount64()
+
+	// The checkpoint and wait hint get updated without the lock, and
+	// copied to status_ when publishing. The checkpoint is in the low
+	// half of checkPoint_, the epoch of the state update it counts in
+	// is in the high half, so that a reset for the next state and the
+	// bumps can't get mixed up.
+	std::atomic<uint64_t> checkPoint_;
+	std::atomic<DWORD> waitHint_; // reset to 0 after it gets published
+	DWORD publishIntervalMs_; // the minimal interval between the updates
+	std::atomic<bool> publishing_; // the host's publisher thread is running
+	std::atomic<bool> dirty_; // an update is waiting for the publisher
+	std::atomic<uint64_t> published_;
+	std::atomic<uint64_t> suppressed_;
+
+	// The fields read by statusSnapshot(). They get written under
+	// statusCr_, with the sequence number odd while an update is in
+	// progress. checkPoint_ gets incremented by bump() outside of the
+	// sequence, the reader takes it only if its epoch matches snapEpoch_.
+	std::atomic<uint32_t> statusSeq_;
+	std::atomic<DWORD> snapEpoch_;
+	std::atomic<DWORD> snapState_;
+	std::atomic<DWORD> snapExitCode_;
+	std::atomic<DWORD> snapSpecificExitCode_;
+	std::atomic<DWORD> publishedCheckPoint_;
+	std::atomic<DWORD> publishedWaitHint_;
+	std::atomic<ULONGLONG> stateSince_;
+	std::atomic<ULONGLONG> lastPublish_;
+#ifndef _WIN32
+	bool ready_; // the service has reported READY to the host
+#endif
+
+	Critical errCr_; // protects the error handling
+	Erref err_; // the collected errors
+
+private:
+	Service();
+	Service(const Service &);
+	void operator=(const Service &);
+};
+
+
+// Runs one or more services in one process, sharing the process-wide
+// infrastructure (such as the loggers and the MUI sources) and the
+// host's background threads: one publishes the status updates
+// of all the services, and one sends their heartbeats.
+//
+// On Windows all the services get registered in one dispatcher table.
+// With more than one service they are SERVICE_WIN32_SHARE_PROCESS,
+// and must be installed that way. The controls get routed to each
+// service by the context of its handler.
+//
+// On the other platforms the process is one unit of the service manager:
+// the notifications get combined, with READY sent after all the services
+// have started, and STOPPING after all of them are stopping. The signals
+// go to all the services.
+class DLLEXPORT ServiceHost
+{
+	friend class Service;
+public:
+	ServiceHost();
+	// Must not be destroyed while run() is running.
+	~ServiceHost();
+
+	// Add a service to run. Must be called before run().
+	// The service must stay alive until run() returns.
+	void add(
+		__in Service *svc);
+
+	// Run all the added services. Returns after all of them get stopped.
+	// The errors of the host and of the services are reported back in err.
+	void run(
+		__out Erref &err);
+
+protected:
+	// Start the background threads, if any of the services needs them.
+	// The failures are not fatal, the services run without them.
+	void startThreads();
+	// Stop the background threads.
+	void stopThreads();
+
+	// Wake up the heartbeat thread, on entering a pending state.
+	void wakeHeartbeat();
+
+	// The body of the publisher thread.
+	// arg - the ServiceHost object
+	static DWORD WINAPI publisherThread(LPVOID arg);
+
+	// The body of the heartbeat thread.
+	// arg - the ServiceHost object
+	static DWORD WINAPI heartbeatThread(LPVOID arg);
+
+#ifdef _WIN32
+	// Find a service by name. With only one service, returns it for
+	// any name, as the single-service processes always did.
+	// Returns NULL if not found.
+	Service *find(
+		__in const WCHAR *name);
+
+	// The callback for the start of any service, finds it by argv[0].
+	static void WINAPI serviceMain(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv);
+
+	// The callback for the requests.
+	// context - the Service object
+	static DWORD WINAPI serviceCtrlHandler(
+		__in DWORD ctrl,
+		__in DWORD eventType,
+		__in LPVOID eventData,
+		__in LPVOID context);
+
+	// The host that runs the dispatcher, there can be only one per process.
+	static ServiceHost *running_;
+#else
+	// The signal handler: passes the signal to run() through the pipe.
+	static void signalHandler(int sig);
+
+	// Wake up run() to check whether all the services have stopped.
+	static void wakeRun();
+
+	// Send the notification of a service's current state, combined
+	// with the states of the other services. Called under the
+	// service's statusCr_.
+	void notifyStateL(
+		__in Service *svc);
+
+	// Send a notification about a checkpoint.
+	void notifyCheckPoint(
+		__in DWORD waitHint);
+
+	Critical notifyCr_; // serializes the notifications
+	SdNotify notify_; // reports the status to the service manager
+	size_t readyCount_; // the services that have reported READY, under notifyCr_
+
+	// The signals for run(), by number, and 0 to check whether the
+	// services have stopped. The write end is non-blocking.
+	static int signalPipe_[2];
+#endif
+
+protected:
+	std::vector<Service *> services_;
+	std::wstring names_; // the names of all the services, for the messages
+	Critical errCr_; // protects err_
+	Erref err_; // the host's own errors
+
+	std::atomic<bool> threadsStop_; // the background threads must exit
+	HANDLE publisherWakeup_; // auto-reset event to wake up the publisher
+	HANDLE publisherThread_; // the publisher thread, runs during run()
+	HANDLE heartbeatWakeup_; // auto-reset event to wake up the heartbeat thread
+	HANDLE heartbeatThread_; // the heartbeat thread, runs during run()
+
+private:
+	ServiceHost(const ServiceHost &);
+	void operator=(const ServiceHost &);
+};
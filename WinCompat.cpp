@@ -0,0 +1,454 @@
+#include "pch.h"
+#include <dlfcn.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/**
+ *  WinCompat: the subset of the Windows API on top of POSIX,
+ *  for the non-Windows builds.
+ */
+
+static thread_local DWORD lastError_;
+
+DWORD GetLastError()
+{
+	return lastError_;
+}
+
+void SetLastError(
+	__in DWORD err)
+{
+	lastError_ = err;
+}
+
+/////////////////////////// synchronization /////////////////////////////
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&cs->mutex_, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+// The object behind an event or thread handle. A thread keeps
+// a reference to its own handle until it exits, so the handle can
+// be closed while the thread is still running.
+class CompatHandle
+{
+public:
+	CompatHandle(bool manualReset, bool signaled) :
+		refs_(1), manualReset_(manualReset), signaled_(signaled)
+	{
+	}
+
+	void addRef()
+	{
+		refs_.fetch_add(1);
+	}
+	void release()
+	{
+		if (refs_.fetch_sub(1) == 1)
+			delete this;
+	}
+
+	void set()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		signaled_ = true;
+		if (manualReset_)
+			cond_.notify_all();
+		else
+			cond_.notify_one();
+	}
+
+	void reset()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		signaled_ = false;
+	}
+
+	// Returns WAIT_OBJECT_0 or WAIT_TIMEOUT.
+	DWORD wait(DWORD timeoutMs)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (timeoutMs == INFINITE) {
+			while (!signaled_)
+				cond_.wait(lock);
+		} else {
+			std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now()
+				+ std::chrono::milliseconds(timeoutMs);
+			while (!signaled_) {
+				if (cond_.wait_until(lock, deadline) == std::cv_status::timeout && !signaled_)
+					return WAIT_TIMEOUT;
+			}
+		}
+		if (!manualReset_)
+			signaled_ = false;
+		return WAIT_OBJECT_0;
+	}
+
+	// For the thread handles.
+	LPTHREAD_START_ROUTINE func_;
+	LPVOID arg_;
+
+protected:
+	std::atomic<int> refs_;
+	bool manualReset_;
+	bool signaled_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+
+private:
+	CompatHandle(const CompatHandle &);
+	void operator=(const CompatHandle &);
+};
+
+HANDLE CreateEventW(
+	__in_opt LPSECURITY_ATTRIBUTES attr,
+	__in BOOL manualReset,
+	__in BOOL initialState,
+	__in_opt LPCWSTR name)
+{
+	(void)attr; // the security doesn't apply to a process-local event
+	(void)name; // the named events are not supported
+	return new CompatHandle(manualReset != FALSE, initialState != FALSE);
+}
+
+BOOL SetEvent(
+	__in HANDLE h)
+{
+	((CompatHandle *)h)->set();
+	return TRUE;
+}
+
+BOOL ResetEvent(
+	__in HANDLE h)
+{
+	((CompatHandle *)h)->reset();
+	return TRUE;
+}
+
+static void *threadMain(void *arg)
+{
+	CompatHandle *h = (CompatHandle *)arg;
+	h->func_(h->arg_);
+	h->set();
+	h->release();
+	return NULL;
+}
+
+HANDLE CreateThread(
+	__in_opt LPSECURITY_ATTRIBUTES attr,
+	__in SIZE_T stackSize,
+	__in LPTHREAD_START_ROUTINE func,
+	__in_opt LPVOID arg,
+	__in DWORD flags,
+	__out_opt DWORD *threadId)
+{
+	(void)attr;
+	(void)flags; // the threads can't be created suspended
+	CompatHandle *h = new CompatHandle(true, false);
+	h->func_ = func;
+	h->arg_ = arg;
+	h->addRef(); // for the thread
+
+	pthread_attr_t pattr;
+	pthread_attr_init(&pattr);
+	pthread_attr_setdetachstate(&pattr, PTHREAD_CREATE_DETACHED);
+	if (stackSize != 0)
+		pthread_attr_setstacksize(&pattr, stackSize);
+	pthread_t thread;
+	int err = pthread_create(&thread, &pattr, threadMain, h);
+	pthread_attr_destroy(&pattr);
+	if (err != 0) {
+		delete h;
+		SetLastError((DWORD)err);
+		return NULL;
+	}
+	if (threadId != NULL)
+		*threadId = 0; // known only inside the thread
+	return h;
+}
+
+DWORD WaitForSingleObject(
+	__in HANDLE h,
+	__in DWORD timeoutMs)
+{
+	if (h == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return WAIT_FAILED;
+	}
+	return ((CompatHandle *)h)->wait(timeoutMs);
+}
+
+BOOL CloseHandle(
+	__in HANDLE h)
+{
+	if (h == NULL) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+	((CompatHandle *)h)->release();
+	return TRUE;
+}
+
+HANDLE GetCurrentThread()
+{
+	return (HANDLE)(intptr_t)-2; // a pseudo-handle, like on Windows
+}
+
+DWORD GetCurrentThreadId()
+{
+	return (DWORD)syscall(SYS_gettid);
+}
+
+BOOL SetThreadPriority(
+	__in HANDLE thread,
+	__in int priority)
+{
+	(void)thread; // always the current thread, as used here
+	int nice;
+	if (priority == THREAD_MODE_BACKGROUND_BEGIN)
+		nice = 19;
+	else if (priority < 0)
+		nice = -5 * priority;
+	else
+		return TRUE; // raising needs the privileges
+	// On Linux the nice value is per thread.
+	if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice) != 0) {
+		SetLastError((DWORD)errno);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+void Sleep(
+	__in DWORD ms)
+{
+	std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+BOOL SwitchToThread()
+{
+	sched_yield();
+	return TRUE;
+}
+
+struct _TP_WORK
+{
+	PTP_WORK_CALLBACK func_;
+	PVOID context_;
+	std::mutex mutex_;
+	std::vector<std::thread> threads_;
+};
+
+PTP_WORK CreateThreadpoolWork(
+	__in PTP_WORK_CALLBACK func,
+	__in_opt PVOID context,
+	__in_opt PTP_CALLBACK_ENVIRON env)
+{
+	(void)env; // there is only the default pool
+	PTP_WORK work = new TP_WORK;
+	work->func_ = func;
+	work->context_ = context;
+	return work;
+}
+
+void SubmitThreadpoolWork(
+	__in PTP_WORK work)
+{
+	std::lock_guard<std::mutex> lock(work->mutex_);
+	work->threads_.push_back(std::thread([work] {
+		work->func_(NULL, work->context_, work);
+	}));
+}
+
+void WaitForThreadpoolWorkCallbacks(
+	__in PTP_WORK work,
+	__in BOOL cancelPending)
+{
+	(void)cancelPending; // the work starts right away, nothing is pending
+	std::vector<std::thread> threads;
+	{
+		std::lock_guard<std::mutex> lock(work->mutex_);
+		threads.swap(work->threads_);
+	}
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+}
+
+void CloseThreadpoolWork(
+	__in PTP_WORK work)
+{
+	WaitForThreadpoolWorkCallbacks(work, FALSE);
+	delete work;
+}
+
+/////////////////////////// time /////////////////////////////
+
+// The difference between the FILETIME epoch (1601) and the Unix
+// epoch, in 100ns units.
+static const ULONGLONG FILETIME_UNIX_EPOCH = 116444736000000000ULL;
+
+ULONGLONG GetTickCount64()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ULONGLONG)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+BOOL QueryPerformanceCounter(
+	__out LARGE_INTEGER *count)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	count->QuadPart = (LONGLONG)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(
+	__out LARGE_INTEGER *freq)
+{
+	freq->QuadPart = 1000000000;
+	return TRUE;
+}
+
+void GetSystemTimeAsFileTime(
+	__out FILETIME *ft)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ULONGLONG t = FILETIME_UNIX_EPOCH + (ULONGLONG)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+	ft->dwLowDateTime = (DWORD)t;
+	ft->dwHighDateTime = (DWORD)(t >> 32);
+}
+
+static ULONGLONG fileTimeValue(const FILETIME *ft)
+{
+	return ((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+BOOL FileTimeToSystemTime(
+	__in const FILETIME *ft,
+	__out SYSTEMTIME *st)
+{
+	ULONGLONG t = fileTimeValue(ft);
+	if (t < FILETIME_UNIX_EPOCH) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	t -= FILETIME_UNIX_EPOCH;
+	time_t sec = (time_t)(t / 10000000);
+	struct tm tm;
+	gmtime_r(&sec, &tm);
+	st->wYear = (WORD)(tm.tm_year + 1900);
+	st->wMonth = (WORD)(tm.tm_mon + 1);
+	st->wDayOfWeek = (WORD)tm.tm_wday;
+	st->wDay = (WORD)tm.tm_mday;
+	st->wHour = (WORD)tm.tm_hour;
+	st->wMinute = (WORD)tm.tm_min;
+	st->wSecond = (WORD)tm.tm_sec;
+	st->wMilliseconds = (WORD)(t % 10000000 / 10000);
+	return TRUE;
+}
+
+BOOL FileTimeToLocalFileTime(
+	__in const FILETIME *ft,
+	__out FILETIME *local)
+{
+	ULONGLONG t = fileTimeValue(ft);
+	time_t sec = (time_t)((t - FILETIME_UNIX_EPOCH) / 10000000);
+	struct tm tm;
+	localtime_r(&sec, &tm);
+	t += (LONGLONG)tm.tm_gmtoff * 10000000;
+	local->dwLowDateTime = (DWORD)t;
+	local->dwHighDateTime = (DWORD)(t >> 32);
+	return TRUE;
+}
+
+void GetLocalTime(
+	__out SYSTEMTIME *st)
+{
+	FILETIME ft, local;
+	GetSystemTimeAsFileTime(&ft);
+	FileTimeToLocalFileTime(&ft, &local);
+	FileTimeToSystemTime(&local, st);
+}
+
+/////////////////////////// messages /////////////////////////////
+
+BOOL GetModuleHandleExW(
+	__in DWORD flags,
+	__in_opt LPCWSTR address,
+	__out HMODULE *module)
+{
+	Dl_info info;
+	*module = NULL;
+	if (!(flags & GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS)
+		|| address == NULL
+		|| dladdr((const void *)address, &info) == 0
+		|| info.dli_fbase == NULL) {
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return FALSE;
+	}
+	*module = (HMODULE)info.dli_fbase;
+	return TRUE;
+}
+
+DWORD FormatMessageW(
+	__in DWORD flags,
+	__in_opt const void *source,
+	__in DWORD messageId,
+	__in DWORD languageId,
+	__out LPWSTR buffer,
+	__in DWORD size,
+	__in_opt va_list *args)
+{
+	// nothing ever gets formatted, so the arguments are not used
+	(void)messageId;
+	(void)languageId;
+	(void)args;
+
+	if (flags & FORMAT_MESSAGE_ALLOCATE_BUFFER)
+	{
+		if (buffer == NULL)
+		{
+			SetLastError(ERROR_INVALID_PARAMETER);
+			return 0;
+		}
+		*(LPWSTR *)buffer = NULL;
+	}
+	else if (buffer == NULL || size == 0)
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+
+	if ((flags & ~(FORMAT_MESSAGE_ALLOCATE_BUFFER
+		| FORMAT_MESSAGE_FROM_HMODULE
+		| FORMAT_MESSAGE_ARGUMENT_ARRAY)) != 0)
+	{
+		// the other sources of the messages are not implemented
+		SetLastError(ERROR_NOT_SUPPORTED);
+		return 0;
+	}
+	if (!(flags & FORMAT_MESSAGE_FROM_HMODULE))
+	{
+		SetLastError(ERROR_INVALID_PARAMETER);
+		return 0;
+	}
+
+	// Neither the module in the source nor the executable (for NULL)
+	// has a message table.
+	(void)source;
+	SetLastError(ERROR_RESOURCE_TYPE_NOT_FOUND);
+	return 0;
+}
@@ -0,0 +1,406 @@
+#pragma once
+
+// The subset of the Windows API that the code uses, for building on
+// the POSIX platforms. The types keep their Windows sizes (DWORD and
+// LONG are 32 bits), the synchronization and threads are implemented
+// on top of pthreads in WinCompat.cpp. Only the calls that are reached
+// outside of the #ifdef _WIN32 parts are here: the file, console,
+// process and service controller calls have their own POSIX backends
+// in the code that uses them.
+
+#ifdef _WIN32
+#error "WinCompat.hpp is only for the non-Windows builds"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+// The SAL annotations below are macros with the names like __in, that
+// the C++ library headers use as identifiers. So all the library headers
+// that the code uses get included first, before the macros are defined.
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ---------------- annotations and calling conventions ----------------
+
+#define __cdecl
+#define WINAPI
+#define NTAPI
+#define CALLBACK
+
+#define __in
+#define __out
+#define __inout
+#define __in_opt
+#define __out_opt
+#define __in_ecount(n)
+#define __out_ecount(n)
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _In_opt_z_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(n)
+#define _In_reads_opt_(n)
+#define _In_reads_bytes_(n)
+#define _Printf_format_string_
+
+// ---------------- types ----------------
+
+typedef int BOOL;
+typedef uint8_t BYTE, UCHAR;
+typedef uint16_t WORD, USHORT;
+typedef uint32_t DWORD, ULONG, UINT;
+typedef int32_t LONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, DWORD64, REGHANDLE;
+typedef uintptr_t ULONG_PTR, DWORD_PTR;
+typedef size_t SIZE_T;
+typedef void VOID;
+typedef void *PVOID, *LPVOID, *HANDLE, *HMODULE;
+typedef wchar_t WCHAR;
+typedef WCHAR *LPWSTR, *PWSTR;
+typedef const WCHAR *LPCWSTR, *PCWSTR;
+
+#define TRUE 1
+#define FALSE 0
+
+typedef union _LARGE_INTEGER {
+	struct {
+		DWORD LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+typedef struct _FILETIME {
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+typedef struct _SYSTEMTIME {
+	WORD wYear;
+	WORD wMonth;
+	WORD wDayOfWeek;
+	WORD wDay;
+	WORD wHour;
+	WORD wMinute;
+	WORD wSecond;
+	WORD wMilliseconds;
+} SYSTEMTIME;
+
+typedef struct _GUID {
+	DWORD Data1;
+	WORD Data2;
+	WORD Data3;
+	BYTE Data4[8];
+} GUID;
+typedef const GUID *LPCGUID;
+
+typedef struct _SECURITY_ATTRIBUTES SECURITY_ATTRIBUTES, *LPSECURITY_ATTRIBUTES;
+
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+#define _TRUNCATE ((size_t)-1)
+
+// ---------------- error codes ----------------
+
+#define NO_ERROR 0
+#define ERROR_SUCCESS 0
+#define ERROR_ACCESS_DENIED 5
+#define ERROR_INVALID_HANDLE 6
+#define ERROR_NOT_ENOUGH_MEMORY 8
+#define ERROR_INVALID_DATA 13
+#define ERROR_HANDLE_EOF 38
+#define ERROR_NOT_SUPPORTED 50
+#define ERROR_INVALID_PARAMETER 87
+#define ERROR_CALL_NOT_IMPLEMENTED 120
+#define ERROR_MORE_DATA 234
+#define ERROR_ARITHMETIC_OVERFLOW 534
+#define ERROR_SERVICE_SPECIFIC_ERROR 1066
+#define ERROR_RESOURCE_TYPE_NOT_FOUND 1813
+#define ERROR_TIMEOUT 1460
+
+#define STATUS_SUCCESS 0
+#define STATUS_LOG_FILE_FULL 0xC0000188
+
+// The last error of the compat calls, per thread. The calls that fail
+// from POSIX set it to the errno value.
+DWORD GetLastError();
+void SetLastError(
+	__in DWORD err);
+
+// ---------------- synchronization ----------------
+
+// Like on Windows, the critical sections are recursive.
+typedef struct _CRITICAL_SECTION {
+	pthread_mutex_t mutex_;
+} CRITICAL_SECTION;
+
+void InitializeCriticalSection(CRITICAL_SECTION *cs);
+inline void DeleteCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutex_destroy(&cs->mutex_);
+}
+inline void EnterCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutex_lock(&cs->mutex_);
+}
+inline void LeaveCriticalSection(CRITICAL_SECTION *cs)
+{
+	pthread_mutex_unlock(&cs->mutex_);
+}
+
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+#define WAIT_FAILED 0xFFFFFFFF
+
+// The events and threads are the waitable handles.
+// The thread handle gets signaled when the thread exits.
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID arg);
+
+HANDLE CreateEventW(
+	__in_opt LPSECURITY_ATTRIBUTES attr,
+	__in BOOL manualReset,
+	__in BOOL initialState,
+	__in_opt LPCWSTR name);
+BOOL SetEvent(
+	__in HANDLE h);
+BOOL ResetEvent(
+	__in HANDLE h);
+HANDLE CreateThread(
+	__in_opt LPSECURITY_ATTRIBUTES attr,
+	__in SIZE_T stackSize,
+	__in LPTHREAD_START_ROUTINE func,
+	__in_opt LPVOID arg,
+	__in DWORD flags,
+	__out_opt DWORD *threadId);
+DWORD WaitForSingleObject(
+	__in HANDLE h,
+	__in DWORD timeoutMs);
+BOOL CloseHandle(
+	__in HANDLE h);
+
+#define THREAD_MODE_BACKGROUND_BEGIN 0x00010000
+#define THREAD_PRIORITY_LOWEST (-2)
+
+HANDLE GetCurrentThread();
+DWORD GetCurrentThreadId();
+// Only THREAD_MODE_BACKGROUND_BEGIN and the lowered priorities have
+// any effect, through the nice value of the thread.
+BOOL SetThreadPriority(
+	__in HANDLE thread,
+	__in int priority);
+void Sleep(
+	__in DWORD ms);
+BOOL SwitchToThread();
+
+// The thread pool work items run each on its own thread.
+typedef struct _TP_WORK TP_WORK, *PTP_WORK;
+typedef struct _TP_CALLBACK_INSTANCE TP_CALLBACK_INSTANCE, *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_CALLBACK_ENVIRON TP_CALLBACK_ENVIRON, *PTP_CALLBACK_ENVIRON;
+typedef VOID (CALLBACK *PTP_WORK_CALLBACK)(PTP_CALLBACK_INSTANCE instance, PVOID context, PTP_WORK work);
+
+PTP_WORK CreateThreadpoolWork(
+	__in PTP_WORK_CALLBACK func,
+	__in_opt PVOID context,
+	__in_opt PTP_CALLBACK_ENVIRON env);
+void SubmitThreadpoolWork(
+	__in PTP_WORK work);
+void WaitForThreadpoolWorkCallbacks(
+	__in PTP_WORK work,
+	__in BOOL cancelPending);
+void CloseThreadpoolWork(
+	__in PTP_WORK work);
+
+// ---------------- time ----------------
+
+ULONGLONG GetTickCount64();
+BOOL QueryPerformanceCounter(
+	__out LARGE_INTEGER *count);
+BOOL QueryPerformanceFrequency(
+	__out LARGE_INTEGER *freq);
+void GetSystemTimeAsFileTime(
+	__out FILETIME *ft);
+BOOL FileTimeToSystemTime(
+	__in const FILETIME *ft,
+	__out SYSTEMTIME *st);
+BOOL FileTimeToLocalFileTime(
+	__in const FILETIME *ft,
+	__out FILETIME *local);
+void GetLocalTime(
+	__out SYSTEMTIME *st);
+
+// ---------------- strings and messages ----------------
+
+inline int _wcsicmp(const WCHAR *a, const WCHAR *b)
+{
+	return wcscasecmp(a, b);
+}
+
+inline int _get_errno(int *value)
+{
+	*value = errno;
+	return 0;
+}
+
+#define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT 0x00000002
+#define GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS 0x00000004
+
+// Finds the loaded executable or shared library that contains the address.
+// Only GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS is supported.
+BOOL GetModuleHandleExW(
+	__in DWORD flags,
+	__in_opt LPCWSTR address,
+	__out HMODULE *module);
+
+#define FORMAT_MESSAGE_ALLOCATE_BUFFER 0x00000100
+#define FORMAT_MESSAGE_FROM_HMODULE 0x00000800
+#define FORMAT_MESSAGE_ARGUMENT_ARRAY 0x00002000
+#define LANG_NEUTRAL 0x00
+#define SUBLANG_DEFAULT 0x01
+#define MAKELANGID(p, s) ((((WORD)(s)) << 10) | (WORD)(p))
+
+// The POSIX executables have no message tables, so this always fails:
+// with ERROR_RESOURCE_TYPE_NOT_FOUND for the messages from a module,
+// with ERROR_NOT_SUPPORTED for any other source of the messages or
+// any other flags than FORMAT_MESSAGE_ALLOCATE_BUFFER and
+// FORMAT_MESSAGE_ARGUMENT_ARRAY, and with ERROR_INVALID_PARAMETER
+// for the missing buffer or source flag. The MUI messages come from the
+// catalog files instead (see MuiCatalog), and the system error texts
+// from strerror_r().
+DWORD FormatMessageW(
+	__in DWORD flags,
+	__in_opt const void *source,
+	__in DWORD messageId,
+	__in DWORD languageId,
+	__out LPWSTR buffer,
+	__in DWORD size,
+	__in_opt va_list *args);
+inline void *LocalFree(void *mem)
+{
+	free(mem);
+	return NULL;
+}
+
+// ---------------- ETW ----------------
+
+typedef struct _EVENT_DESCRIPTOR {
+	USHORT Id;
+	UCHAR Version;
+	UCHAR Channel;
+	UCHAR Level;
+	UCHAR Opcode;
+	USHORT Task;
+	ULONGLONG Keyword;
+} EVENT_DESCRIPTOR, *PEVENT_DESCRIPTOR;
+typedef const EVENT_DESCRIPTOR *PCEVENT_DESCRIPTOR;
+
+typedef struct _EVENT_DATA_DESCRIPTOR {
+	ULONGLONG Ptr;
+	ULONG Size;
+	ULONG Reserved;
+} EVENT_DATA_DESCRIPTOR, *PEVENT_DATA_DESCRIPTOR;
+
+typedef struct _EVENT_FILTER_DESCRIPTOR {
+	ULONGLONG Ptr;
+	ULONG Size;
+	ULONG Type;
+} EVENT_FILTER_DESCRIPTOR, *PEVENT_FILTER_DESCRIPTOR;
+
+typedef VOID (NTAPI *PENABLECALLBACK)(LPCGUID sourceId, ULONG isEnabled,
+	UCHAR level, ULONGLONG matchAnyKeyword, ULONGLONG matchAllKeyword,
+	PEVENT_FILTER_DESCRIPTOR filterData, PVOID context);
+
+#define EVENT_CONTROL_CODE_DISABLE_PROVIDER 0
+#define EVENT_CONTROL_CODE_ENABLE_PROVIDER 1
+#define EVENT_CONTROL_CODE_CAPTURE_STATE 2
+
+inline void EventDataDescCreate(
+	__out PEVENT_DATA_DESCRIPTOR desc,
+	__in const void *ptr,
+	__in ULONG size)
+{
+	desc->Ptr = (ULONGLONG)(ULONG_PTR)ptr;
+	desc->Size = size;
+	desc->Reserved = 0;
+}
+
+// EventRegister(), EventUnregister() and EventWrite() are implemented
+// in Logger.cpp on top of EtwStandIn.
+ULONG EventRegister(
+	__in LPCGUID providerId,
+	__in_opt PENABLECALLBACK callback,
+	__in_opt PVOID context,
+	__out REGHANDLE *handle);
+ULONG EventUnregister(
+	__in REGHANDLE handle);
+ULONG EventWrite(
+	__in REGHANDLE handle,
+	__in PCEVENT_DESCRIPTOR desc,
+	__in ULONG count,
+	__in_opt PEVENT_DATA_DESCRIPTOR data);
+
+// ---------------- service controller ----------------
+
+#define SERVICE_WIN32_OWN_PROCESS 0x00000010
+#define SERVICE_WIN32_SHARE_PROCESS 0x00000020
+
+#define SERVICE_STOPPED 0x00000001
+#define SERVICE_START_PENDING 0x00000002
+#define SERVICE_STOP_PENDING 0x00000003
+#define SERVICE_RUNNING 0x00000004
+#define SERVICE_CONTINUE_PENDING 0x00000005
+#define SERVICE_PAUSE_PENDING 0x00000006
+#define SERVICE_PAUSED 0x00000007
+
+#define SERVICE_ACCEPT_STOP 0x00000001
+#define SERVICE_ACCEPT_PAUSE_CONTINUE 0x00000002
+#define SERVICE_ACCEPT_SHUTDOWN 0x00000004
+#define SERVICE_ACCEPT_PARAMCHANGE 0x00000008
+
+#define SERVICE_CONTROL_STOP 0x00000001
+#define SERVICE_CONTROL_PAUSE 0x00000002
+#define SERVICE_CONTROL_CONTINUE 0x00000003
+#define SERVICE_CONTROL_INTERROGATE 0x00000004
+#define SERVICE_CONTROL_SHUTDOWN 0x00000005
+#define SERVICE_CONTROL_PARAMCHANGE 0x00000006
+
+typedef HANDLE SERVICE_STATUS_HANDLE;
+
+typedef struct _SERVICE_STATUS {
+	DWORD dwServiceType;
+	DWORD dwCurrentState;
+	DWORD dwControlsAccepted;
+	DWORD dwWin32ExitCode;
+	DWORD dwServiceSpecificExitCode;
+	DWORD dwCheckPoint;
+	DWORD dwWaitHint;
+} SERVICE_STATUS, *LPSERVICE_STATUS;
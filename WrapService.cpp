@@ -1,329 +1,474 @@
-#include "pch.h"
-
-/*++
-Copyright (c) 2016 Microsoft Corporation
-
-https://blogs.msdn.microsoft.com/sergey_babkins_blog/2016/12/30/how-to-run-arbitrary-commands-as-a-service/
-
---*/
-
-// put the includes here
-
-ErrorMsg::Source WaSvcErrorSource(L"WrapSvc", NULL);
-
-class WrapService : public Service
-{
-protected:
-	// The thread that will be waiting for the background process to complete.
-	// This handle is owned by this class.
-	HANDLE waitThread_;
-
-public:
-	shared_ptr<Logger> logger_; // the logger
-	shared_ptr<LogEntity> entity_; // mostly a placeholder for now
-
-	// NONE OF THE HANDLES BELOW ARE OWNED HERE.
-	// Whoever created them should close them after disposing of this object.
-
-	// Information about the running background process.
-	// The code that starts it is responsible for filling this
-	// field directly.
-	PROCESS_INFORMATION pi_;
-	// The event used to signal the stop request to the process,
-	HANDLE stopEvent_;
-
-	// Don't forget to fill in pi_ with the information from the started
-	// background process after constructing this object!
-	//
-	// name - service name
-	// logger - objviously, used for logging the messages
-	// stopEvent - event object used to signal the stop request
-	WrapService(
-		__in const std::wstring &name,
-		__in shared_ptr<Logger> logger,
-		__in HANDLE stopEvent
-	)
-		: Service(name, true, true, false),
-		waitThread_(INVALID_HANDLE_VALUE),
-		logger_(logger),
-		stopEvent_(stopEvent)
-	{
-		ZeroMemory(&pi_, sizeof(pi_));
-	}
-
-	~WrapService()
-	{
-		if (waitThread_ != INVALID_HANDLE_VALUE) {
-			CloseHandle(waitThread_);
-		}
-	}
-
-	void log(
-		__in Erref err,
-		__in Logger::Severity sev)
-	{
-		logger_->log(err, sev, entity_);
-	}
-
-	virtual void onStart(
-		__in DWORD argc,
-		__in_ecount(argc) LPWSTR *argv)
-	{
-		setStateRunning();
-
-		// start the thread that will wait for the background process
-		waitThread_ = CreateThread(NULL,
-			0, // do we need to change the stack size?
-			&waitForProcess,
-			(LPVOID)this,
-			0, NULL);
-
-		if (waitThread_ == INVALID_HANDLE_VALUE) {
-			log(WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to create the thread that will wait for the background process:"),
-				Logger::SV_ERROR);
-
-			if (!SetEvent(stopEvent_)) {
-				log(WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to set the event to stop the service:"),
-					Logger::SV_ERROR);
-			}
-			WaitForSingleObject(pi_.hProcess, INFINITE); // ignore any errors...
-
-			setStateStopped(1);
-			return;
-		}
-	}
-
-	// The background thread that waits for the child process to complete.
-	// arg - the WrapService object where the status gets reported
-	DWORD static waitForProcess(LPVOID arg)
-	{
-		WrapService *svc = (WrapService *)arg;
-
-		DWORD status = WaitForSingleObject(svc->pi_.hProcess, INFINITE);
-		if (status == WAIT_FAILED) {
-			svc->log(
-				WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to wait for the process completion:"),
-				Logger::SV_ERROR);
-		}
-
-		DWORD exitCode = 1;
-		if (!GetExitCodeProcess(svc->pi_.hProcess, &exitCode)) {
-			svc->log(
-				WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to get the process exit code:"),
-				Logger::SV_ERROR);
-		}
-
-		svc->log(
-			WaSvcErrorSource.mkString(0, L"The process exit code is: %d.", exitCode),
-			Logger::SV_INFO);
-
-		svc->setStateStopped(exitCode);
-		return exitCode;
-	}
-
-	virtual void onStop()
-	{
-		if (!SetEvent(stopEvent_)) {
-			log(WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to set the event to stop the service:"),
-				Logger::SV_ERROR);
-			// not much else to be done?
-			return;
-		}
-
-		DWORD status = WaitForSingleObject(waitThread_, INFINITE);
-		if (status == WAIT_FAILED) {
-			log(WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to wait for thread that waits for the process completion:"),
-				Logger::SV_ERROR);
-			// not much else to be done?
-			return;
-		}
-
-		// the thread had already set the exit code, so nothing more to do
-	}
-};
-
-int
-__cdecl
-wmain(
-	__in long argc,
-	__in_ecount(argc) PWSTR argv[]
-)
-/*++
-
-Routine Description:
-
-	This is the Win32 entry point for the application.
-
-Arguments:
-
-	argc - The number of command line arguments.
-
-	argv - The command line arguments.
-
-Return Value:
-
-	Zero on success, non-zero otherwise.
-
---*/
-{
-	Erref err;
-	wstring result;
-	HRESULT hr;
-	DWORD status;
-
-#define DEFAULT_GLOBAL_EVENT_PREFIX L"Global\\Service"
-
-	shared_ptr<Logger> logger = make_shared<StdoutLogger>(Logger::SV_DEBUG); // will write to stdout
-	std::shared_ptr<LogEntity> logEntity = NULL;
-
-	Switches switches(WaSvcErrorSource.mkString(0,
-		L"Wrapper to run any program as a service.\n"
-		L"  WrapSvc [switches] -- wrapped command\n"
-		L"The rest of the arguments constitute the command that will start the actual service process.\n"
-		L"The arguments will be passed directly to CreateProcess(), so the name of the executable\n"
-		L"must constitute the full path and full name with the extension.\n"
-		L"The switches are:\n"));
-	auto swName = switches.addMandatoryArg(
-		L"name", WaSvcErrorSource.mkString(0, L"Name of the service being started."));
-	auto swEvent = switches.addArg(
-		L"event", WaSvcErrorSource.mkString(0, L"Name of the event that will be used to request the service stop. If not specified, will default to " DEFAULT_GLOBAL_EVENT_PREFIX "<ServiceName>, where <ServiceName> is taken from the switch -name."));
-	auto swOwnLog = switches.addArg(
-		L"ownLog", WaSvcErrorSource.mkString(0, L"Name of the log file where the log of the wrapper's own will be switched."));
-	auto swSvcLog = switches.addArg(
-		L"svcLog", WaSvcErrorSource.mkString(0, L"Name of the log file where the stdout and stderr of the service process will be switched."));
-	auto swAppend = switches.addBool(
-		L"append", WaSvcErrorSource.mkString(0, L"Use the append mode for the logs, instead of overwriting."));
-
-	switches.parse(argc, argv);
-	// try to honor the log switch if it's parseable even if the rest aren't
-	if (swOwnLog->on_) {
-		// reopen the logger
-		if (!swAppend->on_)
-			DeleteFileW(swOwnLog->value_); // ignore the errors
-		auto newlogger = make_shared<FileLogger>(swOwnLog->value_, Logger::SV_DEBUG);
-		logger->logAndExitOnError(newlogger->error(), NULL); // fall through if no error
-		logger = newlogger;
-	}
-
-	logger->logAndExitOnError(switches.err_, NULL);
-
-	// Since the underlying arguments aren't actually parsed on Windows but are
-	// passed as a single string, find this string directly from Windows, for passing
-	// through.
-	LPWSTR cmdline = GetCommandLineW();
-	PWSTR passline = wcsstr(cmdline, L" --");
-	if (passline == NULL) {
-		err = WaSvcErrorSource.mkString(1, L"Cannot find a '--' in the command line '%ls'.", cmdline);
-		logger->logAndExitOnError(err, NULL);
-	}
-	passline += 3;
-	while (*passline != 0 && iswspace(*passline))
-		++passline;
-
-	if (*passline == 0) {
-		err = WaSvcErrorSource.mkString(1, L"The part after a '--' is empty in the command line '%ls'.", cmdline);
-		logger->logAndExitOnError(err, NULL);
-	}
-
-	logger->log(
-		WaSvcErrorSource.mkString(0, L"--- WaSvc started."),
-		Logger::SV_INFO, NULL);
-
-	// Create the service stop request event
-
-	wstring evname;
-	if (swEvent->on_) {
-		evname = swEvent->value_;
-	}
-	else {
-		evname = DEFAULT_GLOBAL_EVENT_PREFIX;
-		evname.append(swName->value_);
-	}
-	logger->log(
-		WaSvcErrorSource.mkString(0, L"The stop event name is '%ls'", evname.c_str()),
-		Logger::SV_INFO, NULL);
-
-	HANDLE stopEvent = CreateEventW(NULL, TRUE, FALSE, evname.c_str());
-	if (stopEvent == INVALID_HANDLE_VALUE) {
-		err = WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to create the event '%ls':", evname.c_str());
-		logger->logAndExitOnError(err, NULL);
-	}
-	if (!ResetEvent(stopEvent)) {
-		err = WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to reset the event '%ls' before starting the service:", evname.c_str());
-		logger->logAndExitOnError(err, NULL);
-	}
-
-	auto svc = make_shared<WrapService>(swName->value_, logger, stopEvent);
-
-	logger->log(
-		WaSvcErrorSource.mkString(0, L"The internal process command line is '%ls'", passline),
-		Logger::SV_INFO, NULL);
-
-	STARTUPINFO si;
-	ZeroMemory(&si, sizeof(si));
-	si.cb = sizeof(si);
-	HANDLE newlog = INVALID_HANDLE_VALUE;
-	if (swSvcLog->on_) {
-		if (swOwnLog->on_ && !_wcsicmp(swOwnLog->value_, swSvcLog->value_)) {
-			err = WaSvcErrorSource.mkString(1, L"The wrapper's own log and the service's log must not be both redirected to the same file '%ls'.", swSvcLog->value_);
-			logger->logAndExitOnError(err, NULL);
-		}
-
-		if (!swAppend->on_)
-			DeleteFileW(swSvcLog->value_); // ignore the errors
-
-		SECURITY_ATTRIBUTES inheritable = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
-
-		newlog = CreateFileW(swSvcLog->value_, swAppend->on_ ? (FILE_GENERIC_WRITE | FILE_APPEND_DATA) : GENERIC_WRITE,
-			FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
-			&inheritable, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-		if (newlog == INVALID_HANDLE_VALUE) {
-			err = WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Open of the service log file '%ls' failed:", swSvcLog->value_);
-			logger->logAndExitOnError(err, NULL);
-		}
-		if (swAppend->on_)
-			SetFilePointer(newlog, 0, NULL, FILE_END);
-
-		si.dwFlags |= STARTF_USESTDHANDLES;
-		si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
-		si.hStdOutput = newlog;
-		si.hStdError = newlog;
-	}
-
-	if (!CreateProcess(NULL, passline, NULL, NULL, TRUE, 0, NULL, NULL, &si, &svc->pi_)) {
-		err = WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to create the child process.");
-		logger->logAndExitOnError(err, NULL);
-	}
-
-	if (newlog != INVALID_HANDLE_VALUE) {
-		if (!CloseHandle(newlog)) {
-			logger->log(
-				WaSvcErrorSource.mkSystem(GetLastError(), 2, L"Failed to close the old handle for stderr."),
-				Logger::SV_ERROR, NULL); // don't exit
-		}
-	}
-
-	logger->log(
-		WaSvcErrorSource.mkString(0, L"Started the process."),
-		Logger::SV_INFO, NULL);
-
-	svc->run(err);
-	if (err) {
-		logger->log(err, Logger::SV_ERROR, NULL);
-		if (!SetEvent(stopEvent)) {
-			logger->log(WaSvcErrorSource.mkSystem(GetLastError(), 1, L"Failed to set the event to stop the service:"),
-				Logger::SV_ERROR, NULL);
-		}
-		WaitForSingleObject(svc->pi_.hProcess, INFINITE); // ignore any errors...
-		exit(1);
-	}
-
-	CloseHandle(svc->pi_.hProcess);
-	CloseHandle(svc->pi_.hThread);
-	CloseHandle(stopEvent);
-
-	logger->log(
-		WaSvcErrorSource.mkString(0, L"--- WaSvc stopped."),
-		Logger::SV_INFO, NULL);
-	return 0;
-}
+#include "pch.h"
+
+/*++
+Copyright (c) 2016 Microsoft Corporation
+
+https://blogs.msdn.microsoft.com/sergey_babkins_blog/2016/12/30/how-to-run-arbitrary-commands-as-a-service/
+
+--*/
+
+// put the includes here
+
+ErrorMsg::Source WaSvcErrorSource(L"WrapSvc", NULL);
+
+class WrapService : public Service
+{
+protected:
+	// The thread that will be waiting for the background process to complete.
+	// This handle is owned by this class.
+	HANDLE waitThread_;
+
+public:
+	shared_ptr<Logger> logger_; // the logger
+	LogEntity::Id entity_; // mostly a placeholder for now
+
+	// NONE OF THE HANDLES BELOW ARE OWNED HERE.
+	// Whoever created them should close them after disposing of this object.
+
+	// Information about the running background process.
+	// The code that starts it is responsible for filling this
+	// field directly.
+	PROCESS_INFORMATION pi_;
+	// The event used to signal the stop request to the process,
+	HANDLE stopEvent_;
+
+	// Don't forget to fill in pi_ with the information from the started
+	// background process after constructing this object!
+	//
+	// name - service name
+	// logger - objviously, used for logging the messages
+	// stopEvent - event object used to signal the stop request
+	WrapService(
+		__in const std::wstring &name,
+		__in shared_ptr<Logger> logger,
+		__in HANDLE stopEvent
+	)
+		: Service(name, true, true, false),
+		waitThread_(INVALID_HANDLE_VALUE),
+		logger_(logger),
+		entity_(LogEntity::NONE),
+		stopEvent_(stopEvent)
+	{
+		ZeroMemory(&pi_, sizeof(pi_));
+		// the wrapped process may take a while to exit on stop
+		enableHeartbeat();
+	}
+
+	~WrapService()
+	{
+		if (waitThread_ != INVALID_HANDLE_VALUE) {
+			CloseHandle(waitThread_);
+		}
+	}
+
+	void log(
+		__in Erref err,
+		__in Logger::Severity sev)
+	{
+		logger_->log(err, sev, entity_);
+	}
+
+	// The registry key where the service keeps its parameters,
+	// relative to HKEY_LOCAL_MACHINE.
+	std::wstring paramsKey()
+	{
+		return L"SYSTEM\\CurrentControlSet\\Services\\" + name() + L"\\Parameters";
+	}
+
+	// Restore the history of the transitions saved by the previous run,
+	// so that the heartbeat has the good wait hints for the start too.
+	// Must be called before run(). The errors get logged as warnings:
+	// without the history the default hints get used.
+	void loadHistory()
+	{
+		TransitionHistory hist[TR_COUNT];
+		DWORD size = sizeof(hist);
+		std::wstring key = paramsKey();
+		LSTATUS status = RegGetValueW(HKEY_LOCAL_MACHINE, key.c_str(), HISTORY_VALUE,
+			RRF_RT_REG_BINARY, NULL, hist, &size);
+		if (status == ERROR_FILE_NOT_FOUND)
+			return; // not saved yet
+		if (status != ERROR_SUCCESS) {
+			log(ERRMSG_SYSTEM(WaSvcErrorSource, status, 1, L"Failed to read the value '%ls' of the registry key '%ls':",
+				HISTORY_VALUE, key.c_str()), Logger::SV_WARNING);
+			return;
+		}
+		if (size != sizeof(hist)) {
+			log(ERRMSG_STRING(WaSvcErrorSource, 1, L"Ignored the value '%ls' of the registry key '%ls': its size is %lu bytes instead of %lu.",
+				HISTORY_VALUE, key.c_str(), size, (DWORD)sizeof(hist)), Logger::SV_WARNING);
+			return;
+		}
+		for (int tr = 0; tr < TR_COUNT; ++tr)
+			setTransitionHistory((Transition)tr, hist[tr]);
+	}
+
+	// Save the history of the transitions for the next run,
+	// after run() returns.
+	void saveHistory()
+	{
+		TransitionHistory hist[TR_COUNT];
+		for (int tr = 0; tr < TR_COUNT; ++tr)
+			getTransitionHistory((Transition)tr, hist[tr]);
+		std::wstring key = paramsKey();
+		LSTATUS status = RegSetKeyValueW(HKEY_LOCAL_MACHINE, key.c_str(), HISTORY_VALUE,
+			REG_BINARY, hist, sizeof(hist));
+		if (status != ERROR_SUCCESS) {
+			log(ERRMSG_SYSTEM(WaSvcErrorSource, status, 1, L"Failed to save the value '%ls' of the registry key '%ls':",
+				HISTORY_VALUE, key.c_str()), Logger::SV_WARNING);
+		}
+	}
+
+	// The registry value with the history of the transitions.
+	static const WCHAR *HISTORY_VALUE;
+
+	virtual void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv)
+	{
+		setStateRunning();
+
+		// start the thread that will wait for the background process
+		waitThread_ = CreateThread(NULL,
+			0, // do we need to change the stack size?
+			&waitForProcess,
+			(LPVOID)this,
+			0, NULL);
+
+		if (waitThread_ == INVALID_HANDLE_VALUE) {
+			log(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to create the thread that will wait for the background process:"),
+				Logger::SV_ERROR);
+
+			if (!SetEvent(stopEvent_)) {
+				log(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to set the event to stop the service:"),
+					Logger::SV_ERROR);
+			}
+			WaitForSingleObject(pi_.hProcess, INFINITE); // ignore any errors...
+
+			setStateStopped(1);
+			return;
+		}
+	}
+
+	// The background thread that waits for the child process to complete.
+	// arg - the WrapService object where the status gets reported
+	DWORD static waitForProcess(LPVOID arg)
+	{
+		WrapService *svc = (WrapService *)arg;
+
+		DWORD status = WaitForSingleObject(svc->pi_.hProcess, INFINITE);
+		if (status == WAIT_FAILED) {
+			svc->log(
+				ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to wait for the process completion:"),
+				Logger::SV_ERROR);
+		}
+
+		DWORD exitCode = 1;
+		if (!GetExitCodeProcess(svc->pi_.hProcess, &exitCode)) {
+			svc->log(
+				ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to get the process exit code:"),
+				Logger::SV_ERROR);
+		}
+
+		svc->log(
+			ERRMSG_STRING(WaSvcErrorSource, 0, L"The process exit code is: %d.", exitCode),
+			Logger::SV_INFO);
+
+		svc->setStateStopped(exitCode);
+		return exitCode;
+	}
+
+	virtual void onStop()
+	{
+		if (!SetEvent(stopEvent_)) {
+			log(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to set the event to stop the service:"),
+				Logger::SV_ERROR);
+			// not much else to be done?
+			return;
+		}
+
+		DWORD status = WaitForSingleObject(waitThread_, INFINITE);
+		if (status == WAIT_FAILED) {
+			log(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to wait for thread that waits for the process completion:"),
+				Logger::SV_ERROR);
+			// not much else to be done?
+			return;
+		}
+
+		// the thread had already set the exit code, so nothing more to do
+	}
+
+	// from Service
+	virtual Erref captureState()
+	{
+		Erref err = Service::captureState();
+
+		DWORD exitCode;
+		if (pi_.hProcess == NULL) {
+			err.append(ERRMSG_STRING(WaSvcErrorSource, 0, L"The wrapped process is not started."));
+		} else if (!GetExitCodeProcess(pi_.hProcess, &exitCode)) {
+			err.append(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to get the state of the wrapped process %lu:",
+				pi_.dwProcessId));
+		} else if (exitCode == STILL_ACTIVE) {
+			err.append(ERRMSG_STRING(WaSvcErrorSource, 0, L"The wrapped process %lu is running.", pi_.dwProcessId));
+		} else {
+			err.append(ERRMSG_STRING(WaSvcErrorSource, 0, L"The wrapped process %lu has exited with the code %lu.",
+				pi_.dwProcessId, exitCode));
+		}
+		return err;
+	}
+};
+
+const WCHAR *WrapService::HISTORY_VALUE = L"TransitionHistory";
+
+// Parse a positive decimal number from a switch.
+// Returns false if the value is not a positive number.
+static bool parsePositive(
+	__in const WCHAR *value,
+	__out uint64_t &result)
+{
+	WCHAR *end = NULL;
+	result = wcstoull(value, &end, 10);
+	return (end != value && *end == 0 && result != 0);
+}
+
+int
+__cdecl
+wmain(
+	__in long argc,
+	__in_ecount(argc) PWSTR argv[]
+)
+/*++
+
+Routine Description:
+
+	This is the Win32 entry point for the application.
+
+Arguments:
+
+	argc - The number of command line arguments.
+
+	argv - The command line arguments.
+
+Return Value:
+
+	Zero on success, non-zero otherwise.
+
+--*/
+{
+	Erref err;
+	wstring result;
+	HRESULT hr;
+	DWORD status;
+
+#define DEFAULT_GLOBAL_EVENT_PREFIX L"Global\\Service"
+
+	shared_ptr<Logger> logger = make_shared<StdoutLogger>(Logger::SV_DEBUG); // will write to stdout
+	LogEntity::Id logEntity = LogEntity::NONE;
+
+	Switches switches(ERRMSG_STRING(WaSvcErrorSource, 0,
+		L"Wrapper to run any program as a service.\n"
+		L"  WrapSvc [switches] -- wrapped command\n"
+		L"The rest of the arguments constitute the command that will start the actual service process.\n"
+		L"The arguments will be passed directly to CreateProcess(), so the name of the executable\n"
+		L"must constitute the full path and full name with the extension.\n"
+		L"The switches are:\n"));
+	auto swName = switches.addMandatoryArg(
+		L"name", ERRMSG_STRING(WaSvcErrorSource, 0, L"Name of the service being started."));
+	auto swEvent = switches.addArg(
+		L"event", ERRMSG_STRING(WaSvcErrorSource, 0, L"Name of the event that will be used to request the service stop. If not specified, will default to " DEFAULT_GLOBAL_EVENT_PREFIX "<ServiceName>, where <ServiceName> is taken from the switch -name."));
+	auto swOwnLog = switches.addArg(
+		L"ownLog", ERRMSG_STRING(WaSvcErrorSource, 0, L"Name of the log file where the log of the wrapper's own will be switched."));
+	auto swSvcLog = switches.addArg(
+		L"svcLog", ERRMSG_STRING(WaSvcErrorSource, 0, L"Name of the log file where the stdout and stderr of the service process will be switched."));
+	auto swAppend = switches.addBool(
+		L"append", ERRMSG_STRING(WaSvcErrorSource, 0, L"Use the append mode for the logs, instead of overwriting."));
+	auto swRotateSize = switches.addArg(
+		L"rotateSize", ERRMSG_STRING(WaSvcErrorSource, 0, L"Rotate the logs when they grow larger than this many megabytes. The rotated log gets renamed to <name>.<YYYYMMDD-hhmmss>."));
+	auto swRotatePeriod = switches.addArg(
+		L"rotatePeriod", ERRMSG_STRING(WaSvcErrorSource, 0, L"Rotate the logs after they have been written for this many minutes."));
+	auto swCompress = switches.addBool(
+		L"compress", ERRMSG_STRING(WaSvcErrorSource, 0, L"Compress the rotated logs in background, with the NTFS compression."));
+
+	switches.parse(argc, argv);
+
+	// the rotation applies to both logs
+	FileLogger::Options logOpts;
+	uint64_t value;
+	if (swRotateSize->on_) {
+		if (!parsePositive(swRotateSize->value_, value)) {
+			err = ERRMSG_STRING(WaSvcErrorSource, 1, L"The value '%ls' of the switch -rotateSize is not a positive number.", swRotateSize->value_);
+			logger->logAndExitOnError(err, LogEntity::NONE);
+		}
+		logOpts.rotateSize_ = value * 1024 * 1024;
+	}
+	if (swRotatePeriod->on_) {
+		if (!parsePositive(swRotatePeriod->value_, value) || value > 0xFFFFFFFF / 60000) {
+			err = ERRMSG_STRING(WaSvcErrorSource, 1, L"The value '%ls' of the switch -rotatePeriod is not a valid number of minutes.", swRotatePeriod->value_);
+			logger->logAndExitOnError(err, LogEntity::NONE);
+		}
+		logOpts.rotatePeriodMs_ = (DWORD)(value * 60000);
+	}
+	logOpts.compress_ = swCompress->on_;
+	bool rotating = (swRotateSize->on_ || swRotatePeriod->on_);
+
+	// try to honor the log switch if it's parseable even if the rest aren't
+	if (swOwnLog->on_) {
+		// reopen the logger
+		if (!swAppend->on_)
+			DeleteFileW(swOwnLog->value_); // ignore the errors
+		auto newlogger = make_shared<FileLogger>(swOwnLog->value_, Logger::SV_DEBUG, logOpts);
+		logger->logAndExitOnError(newlogger->error(), LogEntity::NONE); // fall through if no error
+		logger = newlogger;
+	}
+
+	logger->logAndExitOnError(switches.err_, LogEntity::NONE);
+
+	// Since the underlying arguments aren't actually parsed on Windows but are
+	// passed as a single string, find this string directly from Windows, for passing
+	// through.
+	LPWSTR cmdline = GetCommandLineW();
+	PWSTR passline = wcsstr(cmdline, L" --");
+	if (passline == NULL) {
+		err = ERRMSG_STRING(WaSvcErrorSource, 1, L"Cannot find a '--' in the command line '%ls'.", cmdline);
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+	passline += 3;
+	while (*passline != 0 && iswspace(*passline))
+		++passline;
+
+	if (*passline == 0) {
+		err = ERRMSG_STRING(WaSvcErrorSource, 1, L"The part after a '--' is empty in the command line '%ls'.", cmdline);
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+
+	logger->log(
+		ERRMSG_STRING(WaSvcErrorSource, 0, L"--- WaSvc started."),
+		Logger::SV_INFO, LogEntity::NONE);
+
+	// Create the service stop request event
+
+	wstring evname;
+	if (swEvent->on_) {
+		evname = swEvent->value_;
+	}
+	else {
+		evname = DEFAULT_GLOBAL_EVENT_PREFIX;
+		evname.append(swName->value_);
+	}
+	logger->log(
+		ERRMSG_STRING(WaSvcErrorSource, 0, L"The stop event name is '%ls'", evname.c_str()),
+		Logger::SV_INFO, LogEntity::NONE);
+
+	HANDLE stopEvent = CreateEventW(NULL, TRUE, FALSE, evname.c_str());
+	if (stopEvent == INVALID_HANDLE_VALUE) {
+		err = ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to create the event '%ls':", evname.c_str());
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+	if (!ResetEvent(stopEvent)) {
+		err = ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to reset the event '%ls' before starting the service:", evname.c_str());
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+
+	auto svc = make_shared<WrapService>(swName->value_, logger, stopEvent);
+
+	logger->log(
+		ERRMSG_STRING(WaSvcErrorSource, 0, L"The internal process command line is '%ls'", passline),
+		Logger::SV_INFO, LogEntity::NONE);
+
+	STARTUPINFO si;
+	ZeroMemory(&si, sizeof(si));
+	si.cb = sizeof(si);
+	HANDLE newlog = INVALID_HANDLE_VALUE;
+	unique_ptr<OutputPump> pump; // copies the output when the service log is rotated
+	if (swSvcLog->on_) {
+		if (swOwnLog->on_ && !_wcsicmp(swOwnLog->value_, swSvcLog->value_)) {
+			err = ERRMSG_STRING(WaSvcErrorSource, 1, L"The wrapper's own log and the service's log must not be both redirected to the same file '%ls'.", swSvcLog->value_);
+			logger->logAndExitOnError(err, LogEntity::NONE);
+		}
+
+		if (!swAppend->on_)
+			DeleteFileW(swSvcLog->value_); // ignore the errors
+
+		SECURITY_ATTRIBUTES inheritable = { sizeof(SECURITY_ATTRIBUTES), NULL, TRUE };
+
+		if (rotating) {
+			// The process writes into a pipe, and the wrapper copies
+			// the data into the log file that it can rotate.
+			auto svcLogFile = make_shared<FileLogger>(swSvcLog->value_, Logger::SV_DEBUG, logOpts);
+			logger->logAndExitOnError(svcLogFile->error(), LogEntity::NONE);
+
+			HANDLE pipeRead;
+			if (!CreatePipe(&pipeRead, &newlog, &inheritable, 0)) {
+				err = ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to create the pipe for the service output:");
+				logger->logAndExitOnError(err, LogEntity::NONE);
+			}
+			// only the write end goes to the process
+			SetHandleInformation(pipeRead, HANDLE_FLAG_INHERIT, 0);
+			pump.reset(new OutputPump(pipeRead, svcLogFile));
+		} else {
+			newlog = CreateFileW(swSvcLog->value_, swAppend->on_ ? (FILE_GENERIC_WRITE | FILE_APPEND_DATA) : GENERIC_WRITE,
+				FILE_SHARE_DELETE | FILE_SHARE_READ | FILE_SHARE_WRITE,
+				&inheritable, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (newlog == INVALID_HANDLE_VALUE) {
+				err = ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Open of the service log file '%ls' failed:", swSvcLog->value_);
+				logger->logAndExitOnError(err, LogEntity::NONE);
+			}
+			if (swAppend->on_)
+				SetFilePointer(newlog, 0, NULL, FILE_END);
+		}
+
+		si.dwFlags |= STARTF_USESTDHANDLES;
+		si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+		si.hStdOutput = newlog;
+		si.hStdError = newlog;
+	}
+
+	if (!CreateProcess(NULL, passline, NULL, NULL, TRUE, 0, NULL, NULL, &si, &svc->pi_)) {
+		err = ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to create the child process.");
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+
+	if (newlog != INVALID_HANDLE_VALUE) {
+		if (!CloseHandle(newlog)) {
+			logger->log(
+				ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 2, L"Failed to close the old handle for stderr."),
+				Logger::SV_ERROR, LogEntity::NONE); // don't exit
+		}
+	}
+
+	if (pump) {
+		// the process has its own copy of the write end by now
+		err = pump->start();
+		logger->logAndExitOnError(err, LogEntity::NONE);
+	}
+
+	logger->log(
+		ERRMSG_STRING(WaSvcErrorSource, 0, L"Started the process."),
+		Logger::SV_INFO, LogEntity::NONE);
+
+	svc->loadHistory();
+	svc->run(err);
+	if (err) {
+		logger->log(err, Logger::SV_ERROR, LogEntity::NONE);
+		if (!SetEvent(stopEvent)) {
+			logger->log(ERRMSG_SYSTEM(WaSvcErrorSource, GetLastError(), 1, L"Failed to set the event to stop the service:"),
+				Logger::SV_ERROR, LogEntity::NONE);
+		}
+		WaitForSingleObject(svc->pi_.hProcess, INFINITE); // ignore any errors...
+		if (pump)
+			pump->wait();
+		exit(1);
+	}
+
+	svc->saveHistory();
+	if (pump)
+		pump->wait();
+	CloseHandle(svc->pi_.hProcess);
+	CloseHandle(svc->pi_.hThread);
+	CloseHandle(stopEvent);
+
+	logger->log(
+		ERRMSG_STRING(WaSvcErrorSource, 0, L"--- WaSvc stopped."),
+		Logger::SV_INFO, LogEntity::NONE);
+	return 0;
+}
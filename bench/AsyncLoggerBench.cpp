@@ -0,0 +1,55 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  AsyncLoggerBench: the time that the logging threads spend in log(),
+ *  writing synchronously to a StdoutLogger versus through an AsyncLogger
+ *  in front of it. stdout goes to /dev/null.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { RECORDS = 400000 };
+
+static void run(
+	__in int nthreads,
+	__in bool async)
+{
+	std::shared_ptr<StdoutLogger> sink = std::make_shared<StdoutLogger>(Logger::SV_DEBUG);
+	std::shared_ptr<AsyncLogger> alog;
+	Logger *logger = sink.get();
+	if (async) {
+		alog = std::make_shared<AsyncLogger>(sink, Logger::SV_DEBUG, 65536);
+		logger = alog.get();
+	}
+
+	int perThread = RECORDS / nthreads;
+	double callers = benchThreads(nthreads, [&](int t) {
+		for (int i = 0; i < perThread; ++i)
+			logger->log(BenchSource.mkString(t, L"record %d of thread %d", i, t),
+				Logger::SV_INFO, LogEntity::NONE);
+	});
+	uint64_t dropped = 0;
+	if (alog) {
+		alog->close();
+		AsyncLogger::Stats st;
+		alog->getStats(st);
+		dropped = st.dropped_;
+	}
+	sink->flush();
+
+	fprintf(stderr, "%-5s %d threads: %7.0f ns per record in the callers, %llu dropped\n",
+		async ? "async" : "sync", nthreads,
+		callers * 1e9 * nthreads / (perThread * nthreads), (unsigned long long)dropped);
+}
+
+int main()
+{
+	benchDiscardStdout();
+	const int threads[] = { 1, 2, 4 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		run(threads[i], false);
+		run(threads[i], true);
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+// The common parts of the benchmark programs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+// Run fn(thread index) on the given number of threads at once.
+// Returns the elapsed time in seconds.
+template <typename Fn>
+double benchThreads(int nthreads, Fn fn)
+{
+	std::vector<std::thread> threads;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int t = 0; t < nthreads; ++t)
+		threads.push_back(std::thread(fn, t));
+	for (size_t t = 0; t < threads.size(); ++t)
+		threads[t].join();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Run fn() the given number of times on the current thread.
+// Returns the average time of one call in nanoseconds.
+template <typename Fn>
+double benchLoop(long count, Fn fn)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (long i = 0; i < count; ++i)
+		fn();
+	return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count()
+		/ count;
+}
+
+// The benchmarks write their logs into stdout: send it to /dev/null,
+// and the results to stderr.
+inline void benchDiscardStdout()
+{
+	if (freopen("/dev/null", "w", stdout) == NULL) {
+		perror("/dev/null");
+		exit(1);
+	}
+}
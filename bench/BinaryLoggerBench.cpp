@@ -0,0 +1,95 @@
+#include "pch.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include "BenchUtil.hpp"
+
+/**
+ *  BinaryLoggerBench: the write rate and the on-disk size of
+ *  BinaryLogger against the text of FileLogger, for the same records,
+ *  and the rate of decoding the binary log back into the text.
+ *  The logs go into the directory from the argument (by default /tmp)
+ *  and get deleted after each run.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { RECORDS = 1000000 };
+
+static off_t fileSize(
+	__in const std::string &path)
+{
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+// Returns the size of the log in bytes.
+static off_t run(
+	__in const std::string &path,
+	__in bool binary)
+{
+	std::wstring wpath(path.begin(), path.end());
+	unlink(path.c_str());
+
+	LogEntity::Id entity = LogEntity::intern(L"client.example.com");
+	std::shared_ptr<FileLogger> logger;
+	if (binary)
+		logger = std::make_shared<BinaryLogger>(wpath.c_str(), Logger::SV_DEBUG);
+	else
+		logger = std::make_shared<FileLogger>(wpath.c_str(), Logger::SV_DEBUG);
+	if (logger->error()) {
+		fprintf(stderr, "%ls", logger->error()->toString().c_str());
+		exit(1);
+	}
+
+	int i = 0;
+	double ns = benchLoop(RECORDS, [&] {
+		logger->log(BenchSource.mkString(100 + (i & 7), L"request %d from '%ls' took %d ms",
+			i, L"client.example.com", i % 1000), Logger::SV_INFO, entity);
+		++i;
+	});
+	logger->close();
+
+	off_t size = fileSize(path);
+	fprintf(stderr, "%s: %5.0f ns/record, %6.1f bytes/record, %6.1f MB/s on disk\n",
+		binary ? "binary" : "text  ", ns, (double)size / RECORDS, size / (ns * RECORDS) * 1e3);
+	return size;
+}
+
+static void decode(
+	__in const std::string &path)
+{
+	std::wstring wpath(path.begin(), path.end());
+	BinaryLogReader reader(wpath.c_str());
+	BinaryLogReader::Record rec;
+	std::string text;
+	size_t bytes = 0;
+	long n = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while (reader.next(rec)) {
+		text.clear();
+		BinaryLogReader::formatRecord(text, rec);
+		bytes += text.size();
+		++n;
+	}
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (reader.error())
+		fprintf(stderr, "%ls", reader.error()->toString().c_str());
+	fprintf(stderr, "decode: %5.0f ns/record, %6.1f MB/s of text\n", sec * 1e9 / n, bytes / sec / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = (argc > 1) ? argv[1] : "/tmp";
+	std::string base = dir + "/BinaryLoggerBench." + std::to_string(getpid());
+
+	off_t text = run(base + ".log", false);
+	off_t binary = run(base + ".bin", true);
+	fprintf(stderr, "binary/text size: %.2f\n", (double)binary / text);
+	decode(base + ".bin");
+
+	unlink((base + ".log").c_str());
+	unlink((base + ".bin").c_str());
+	return 0;
+}
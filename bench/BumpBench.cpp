@@ -0,0 +1,78 @@
+#include "pch.h"
+#include <unistd.h>
+#include "BenchUtil.hpp"
+
+/**
+ *  BumpBench: the cost of bump() from 1 and 4 threads during a long
+ *  start, with the synchronous publishing (interval 0) and with the
+ *  updates coalesced by the publisher thread (the default 100 ms),
+ *  against the sd_notify stand-in, and how many updates get sent.
+ */
+
+enum { BUMPS = 200000 };
+
+class BumpService : public Service
+{
+public:
+	BumpService(int nthreads) :
+		Service(L"BumpService", true, true, false),
+		nthreads_(nthreads), sec_(0)
+	{
+	}
+
+	void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv)
+	{
+		sec_ = benchThreads(nthreads_, [this](int t) {
+			for (int i = 0; i < BUMPS; ++i)
+				bump();
+		});
+		setStateStopped(NO_ERROR);
+	}
+
+	int nthreads_;
+	double sec_; // the time of all the bumps
+};
+
+int main()
+{
+	std::string path = "/tmp/BumpBench." + std::to_string(getpid()) + ".sock";
+	SdNotifyStandIn mgr;
+	Erref err = mgr.open(path.c_str());
+	if (err) {
+		fprintf(stderr, "%ls", err->toString().c_str());
+		return 1;
+	}
+	// the messages only need to be taken out of the socket
+	std::thread drain([&] {
+		SdNotifyStandIn::Message msg;
+		while (mgr.receive(msg, 2000))
+			;
+	});
+
+	const DWORD intervals[] = { 0, Service::DEFAULT_PUBLISH_INTERVAL_MS };
+	const int threads[] = { 1, 4 };
+	for (size_t i = 0; i < _countof(intervals); ++i) {
+		for (size_t j = 0; j < _countof(threads); ++j) {
+			BumpService svc(threads[j]);
+			svc.setPublishInterval(intervals[i]);
+			svc.run(err);
+			if (err) {
+				fprintf(stderr, "%ls", err->toString().c_str());
+				return 1;
+			}
+
+			Service::PublishStats st;
+			svc.getPublishStats(st);
+			fprintf(stderr, "interval %3u ms, %d threads: %7.1f ns/bump, %8.0f bumps/s, %llu published, %llu suppressed\n",
+				(unsigned)intervals[i], threads[j],
+				svc.sec_ * 1e9 / BUMPS / threads[j], BUMPS * threads[j] / svc.sec_,
+				(unsigned long long)st.published_, (unsigned long long)st.suppressed_);
+		}
+	}
+
+	drain.join();
+	mgr.close();
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include "pch.h"
+#include <atomic>
+#include <new>
+#include "BenchUtil.hpp"
+
+/**
+ *  ErrorChainBench: building and discarding the 3-deep error chains,
+ *  an application error wrapped around a mkSystem() pair, from 1 and
+ *  4 threads, in ns and heap allocations per chain. Built twice: as
+ *  ErrorChainBench with the ErrorMsg pool, and as ErrorChainBenchNoPool
+ *  with make_shared() (ERRORMSG_NO_POOL). The texts never get
+ *  formatted, as with the errors that get filtered out by the loggers.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { CHAINS = 2000000 };
+
+// The heap allocations, counted per thread and summed up at the end
+// of each thread.
+static thread_local uint64_t threadAllocs;
+static std::atomic<uint64_t> totalAllocs;
+
+void *operator new(size_t size)
+{
+	++threadAllocs;
+	void *p = malloc(size == 0 ? 1 : size);
+	if (p == NULL)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+static void run(
+	__in int nthreads)
+{
+	int perThread = CHAINS / nthreads;
+	totalAllocs = 0;
+	double sec = benchThreads(nthreads, [&](int t) {
+		threadAllocs = 0;
+		for (int i = 0; i < perThread; ++i) {
+			Erref err = BenchSource.mkSystem(ENOENT, 2, L"cannot open '%ls'", L"/etc/app.conf");
+			err.wrap(BenchSource.mkString(1, L"cannot load the configuration"));
+		}
+		totalAllocs += threadAllocs;
+	});
+
+	fprintf(stderr, "%s, %d threads: %6.1f ns of wall time per chain, %5.2f allocations per chain\n",
+#ifdef ERRORMSG_NO_POOL
+		"heap",
+#else
+		"pool",
+#endif
+		nthreads, sec * 1e9 / (perThread * nthreads),
+		(double)totalAllocs.load() / (perThread * nthreads));
+}
+
+int main()
+{
+	// the first round warms up the pool
+	run(1);
+	run(1);
+	run(4);
+	return 0;
+}
@@ -0,0 +1,47 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  EtwLoggerBench: the records per second and the number of events
+ *  for EtwLogger, one event per record versus the batched events,
+ *  with the short and the long records. The events go into EtwStandIn,
+ *  which only counts them.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+static void run(
+	__in bool batch,
+	__in int count,
+	__in int textLen)
+{
+	GUID guid = {};
+	std::wstring pad(textLen, L'x');
+	uint64_t events = etwStandIn.count();
+
+	double sec;
+	{
+		EtwLogger logger(&guid, Logger::SV_DEBUG, batch);
+		etwStandIn.enable(TRACE_LEVEL_INFORMATION);
+		sec = benchLoop(count, [&] {
+			logger.log(BenchSource.mkString(1, L"record %ls", pad.c_str()),
+				Logger::SV_INFO, LogEntity::NONE);
+		}) * count / 1e9;
+		// the closing sends the last batch
+		sec += benchLoop(1, [&] { logger.close(); }) / 1e9;
+	}
+
+	fprintf(stderr, "%-7s %5d chars: %8.0f records/s, %llu events\n",
+		batch ? "batched" : "single", textLen, count / sec,
+		(unsigned long long)(etwStandIn.count() - events));
+}
+
+int main()
+{
+	etwStandIn.keepEvents(false);
+	run(false, 200000, 20);
+	run(true, 200000, 20);
+	run(false, 50000, 2000);
+	run(true, 50000, 2000);
+	return 0;
+}
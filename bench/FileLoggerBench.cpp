@@ -0,0 +1,60 @@
+#include "pch.h"
+#include <unistd.h>
+#include "BenchUtil.hpp"
+
+/**
+ *  FileLoggerBench: the records per second that FileLogger takes
+ *  from 1 to 8 threads, with no syncing and with the syncs every 100 ms.
+ *  The log goes into the directory from the argument (by default /tmp)
+ *  and gets deleted after each run.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { RECORDS = 400000 };
+
+static void run(
+	__in const std::string &path,
+	__in int nthreads,
+	__in DWORD syncPeriodMs)
+{
+	std::wstring wpath(path.begin(), path.end());
+	unlink(path.c_str());
+
+	FileLogger::Options opts;
+	opts.syncPeriodMs_ = syncPeriodMs;
+	std::shared_ptr<FileLogger> logger = std::make_shared<FileLogger>(wpath.c_str(), Logger::SV_DEBUG, opts);
+	if (logger->error()) {
+		fprintf(stderr, "%ls", logger->error()->toString().c_str());
+		exit(1);
+	}
+
+	int perThread = RECORDS / nthreads;
+	double sec = benchThreads(nthreads, [&](int t) {
+		for (int i = 0; i < perThread; ++i)
+			logger->log(BenchSource.mkString(t, L"record %d of thread %d", i, t),
+				Logger::SV_INFO, LogEntity::NONE);
+	});
+	logger->close();
+
+	FileLogger::Stats st;
+	logger->getStats(st);
+	fprintf(stderr, "%d threads, sync %s: %8.0f records/s, %6.1f MB/s, %llu writes, %llu syncs\n",
+		nthreads, syncPeriodMs == FileLogger::NO_SYNC ? "never " : "100 ms",
+		st.records_ / sec, st.bytes_ / sec / 1e6,
+		(unsigned long long)st.writes_, (unsigned long long)st.syncs_);
+	unlink(path.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	std::string dir = (argc > 1) ? argv[1] : "/tmp";
+	std::string path = dir + "/FileLoggerBench." + std::to_string(getpid()) + ".log";
+
+	const int threads[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		run(path, threads[i], FileLogger::NO_SYNC);
+		run(path, threads[i], 100);
+	}
+	return 0;
+}
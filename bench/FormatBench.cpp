@@ -0,0 +1,257 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  FormatBench: the formatting before and after the one-pass
+ *  vwstrAppendF() and the printf-free headers of the error chains:
+ *  vwstrAppendF() on the results of the different lengths and on
+ *  a format error, wstrprintf(), and toString() and toLimitedString()
+ *  of an error chain. The previous way of the non-Windows builds
+ *  looked for the length in the separate buffers of up to 64M
+ *  characters, and printed the header of every chain element
+ *  through a wstrprintf() temporary.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+// The previous implementation, for comparison.
+static void __cdecl oldVAppendF(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *fmt,
+	__in va_list args)
+{
+	WCHAR buf[512];
+	va_list cpargs;
+	va_copy(cpargs, args);
+	int len = vswprintf(buf, _countof(buf), fmt, cpargs);
+	va_end(cpargs);
+	if (len >= 0) {
+		dest.append(buf, len);
+		return;
+	}
+
+	int reqlen = -1;
+	for (size_t size = 4 * _countof(buf); size <= (1 << 26); size *= 4) {
+		std::unique_ptr<WCHAR[]> big(new WCHAR[size]);
+		va_copy(cpargs, args);
+		reqlen = vswprintf(big.get(), size, fmt, cpargs);
+		va_end(cpargs);
+		if (reqlen >= 0)
+			break;
+	}
+	if (reqlen < 0) {
+		dest.append(L"[error]");
+		return;
+	}
+
+	size_t oldsz = dest.size();
+	dest.resize(oldsz + reqlen + 1);
+	va_copy(cpargs, args);
+	len = vswprintf(&dest[oldsz], reqlen + 1, fmt, cpargs);
+	va_end(cpargs);
+	dest.resize(oldsz + (len < 0 ? 0 : len));
+}
+
+static void __cdecl oldAppendF(
+	__inout std::wstring &dest,
+	_In_z_ const WCHAR *fmt,
+	...)
+{
+	va_list args;
+	va_start(args, fmt);
+	oldVAppendF(dest, fmt, args);
+	va_end(args);
+}
+
+static std::wstring __cdecl oldWstrprintf(
+	_In_z_ const WCHAR *fmt,
+	...)
+{
+	std::wstring res;
+	va_list args;
+	va_start(args, fmt);
+	oldVAppendF(res, fmt, args);
+	va_end(args);
+	return res;
+}
+
+// The previous header of a chain element.
+static void oldAppendHeader(
+	__inout std::wstring &res,
+	__in const ErrorMsg *err)
+{
+	res.append(err->source_ == NULL ? L"NT" : err->source_->name_);
+	res.append(oldWstrprintf(L":%d:0x%x: ", (err->code_ & 0x3FFFFFFF), err->code_));
+}
+
+// The previous toString().
+static std::wstring oldToString(
+	__in ErrorMsg *chain)
+{
+	std::wstring res;
+	size_t estimate = 0;
+	for (ErrorMsg *err = chain; err != NULL; err = err->chain_.get())
+		estimate += 40 + err->getMsg().size();
+	res.reserve(estimate);
+
+	for (ErrorMsg *err = chain; err != NULL; err = err->chain_.get()) {
+		if (err != chain)
+			res.append(L"  ");
+		oldAppendHeader(res, err);
+		res.append(err->getMsg());
+		if (res[res.size() - 1] != L'\n')
+			res.append(L"\n");
+	}
+	return res;
+}
+
+// The previous toLimitedString().
+static std::wstring oldToLimitedString(
+	__in ErrorMsg *chain,
+	__in size_t limit,
+	__out Erref &next)
+{
+	std::wstring res;
+	size_t estimate = 0;
+	for (ErrorMsg *err = chain; err != NULL; err = err->chain_.get()) {
+		estimate += 40 + err->getMsg().size();
+		if (estimate > limit)
+			break;
+	}
+	res.reserve(estimate);
+
+	ErrorMsg *lasterr = NULL;
+	for (ErrorMsg *err = chain; err != NULL; lasterr = err, err = err->chain_.get()) {
+		size_t prevsz = res.size();
+		if (err != chain)
+			res.append(L"  ");
+		oldAppendHeader(res, err);
+		if (res.size() + err->getMsg().size() >= limit && lasterr) {
+			res.resize(prevsz);
+			next = lasterr->chain_;
+			return res;
+		}
+		res.append(err->getMsg());
+		if (res[res.size() - 1] != L'\n')
+			res.append(L"\n");
+	}
+	next.reset();
+	return res;
+}
+
+static void report(
+	__in const char *name,
+	__in double oldNs,
+	__in double newNs,
+	__in size_t oldLen,
+	__in size_t newLen)
+{
+	fprintf(stderr, "%-16s before %10.0f ns, after %10.0f ns (%zu -> %zu chars)\n",
+		name, oldNs, newNs, oldLen, newLen);
+}
+
+static void runAppend(
+	__in const char *name,
+	__in long count,
+	_In_z_ const WCHAR *fmt,
+	__in const void *arg)
+{
+	std::wstring dest;
+	double oldNs = benchLoop(count, [&] {
+		dest.clear();
+		oldAppendF(dest, fmt, arg);
+	});
+	size_t oldLen = dest.size();
+	double newNs = benchLoop(count, [&] {
+		dest.clear();
+		wstrAppendF(dest, fmt, arg);
+	});
+	report(name, oldNs, newNs, oldLen, dest.size());
+}
+
+static void runPrintf()
+{
+	std::wstring res;
+	double oldNs = benchLoop(1000000, [&] {
+		res = oldWstrprintf(L"service '%ls' exited with %d", L"MyService", 3);
+	});
+	size_t oldLen = res.size();
+	double newNs = benchLoop(1000000, [&] {
+		res = wstrprintf(L"service '%ls' exited with %d", L"MyService", 3);
+	});
+	report("wstrprintf", oldNs, newNs, oldLen, res.size());
+}
+
+// A chain of the given depth, with the texts already rendered.
+static Erref mkChain(
+	__in int depth)
+{
+	Erref err = BenchSource.mkSystem(ENOENT, 10, L"cannot open '%ls'", L"/etc/app.conf");
+	for (int i = 1; i < depth - 1; ++i)
+		err.wrap(BenchSource.mkString(10 + i, L"cannot load the configuration, step %d", i));
+	err->toString();
+	return err;
+}
+
+static void runToString(
+	__in const char *name,
+	__in int depth)
+{
+	Erref err = mkChain(depth);
+	std::wstring res;
+	double oldNs = benchLoop(200000, [&] {
+		res = oldToString(err.get());
+	});
+	size_t oldLen = res.size();
+	double newNs = benchLoop(200000, [&] {
+		res = err->toString();
+	});
+	report(name, oldNs, newNs, oldLen, res.size());
+}
+
+// Print the whole chain in chunks.
+static void runToLimitedString(
+	__in const char *name,
+	__in int depth,
+	__in size_t limit)
+{
+	Erref err = mkChain(depth);
+	size_t oldLen = 0, newLen = 0;
+	double oldNs = benchLoop(100000, [&] {
+		oldLen = 0;
+		for (Erref cur = err; cur; ) {
+			Erref next;
+			oldLen += oldToLimitedString(cur.get(), limit, next).size();
+			cur = next;
+		}
+	});
+	double newNs = benchLoop(100000, [&] {
+		newLen = 0;
+		for (Erref cur = err; cur; ) {
+			Erref next;
+			newLen += cur->toLimitedString(limit, next).size();
+			cur = next;
+		}
+	});
+	report(name, oldNs, newNs, oldLen, newLen);
+}
+
+int main()
+{
+	std::wstring mid(2000, L'm');
+	std::wstring big(100000, L'b');
+	std::wstring huge(2000000, L'h');
+
+	runAppend("short", 1000000, L"value %ls", L"short");
+	runAppend("2K", 100000, L"value %ls", mid.c_str());
+	runAppend("100K", 1000, L"value %ls", big.c_str());
+	runAppend("2M", 10, L"value %ls", huge.c_str());
+	// not convertible from multibyte in the C locale
+	runAppend("invalid", 5, L"value %hs", "\xff\xfe");
+
+	runPrintf();
+	runToString("toString 3", 3);
+	runToString("toString 10", 10);
+	runToLimitedString("toLimited 10/200", 10, 200);
+	return 0;
+}
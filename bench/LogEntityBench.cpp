@@ -0,0 +1,123 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  LogEntityBench: Logger::log() from several threads that all log
+ *  for the same entity, before and after the interned entity IDs.
+ *  Before, the entity went as a shared_ptr<LogEntity> by value through
+ *  log() and logBody(), so every call incremented and decremented
+ *  the one shared reference count; OldLogger reproduces that. After,
+ *  it's a LogEntity::Id, and the sink looks up the name without locks.
+ *  Each thread logs its own error, built in advance, and both sinks
+ *  only look at the entity's name, to leave the cost of passing it.
+ */
+
+enum { CALLS = 4000000 };
+
+// The sum of the entity name lengths seen by the sinks on this thread.
+static thread_local size_t threadChars;
+
+// The previous LogEntity and Logger interface.
+class OldLogEntity
+{
+public:
+	OldLogEntity(const std::wstring &name) :
+		name_(name)
+	{
+	}
+
+	std::wstring name_;
+};
+
+class OldLogger
+{
+public:
+	virtual ~OldLogger()
+	{
+	}
+
+	void log(
+		__in Erref err,
+		__in Logger::Severity sev,
+		__in_opt std::shared_ptr<OldLogEntity> entity)
+	{
+		if (err)
+			logBody(err, sev, entity);
+	}
+
+	virtual void logBody(
+		__in Erref err,
+		__in Logger::Severity sev,
+		__in_opt std::shared_ptr<OldLogEntity> entity) = 0;
+};
+
+class OldCountingLogger : public OldLogger
+{
+public:
+	void logBody(
+		__in Erref err,
+		__in Logger::Severity sev,
+		__in_opt std::shared_ptr<OldLogEntity> entity)
+	{
+		if (entity)
+			threadChars += entity->name_.size();
+	}
+};
+
+class CountingLogger : public Logger
+{
+public:
+	CountingLogger() :
+		Logger(SV_DEBUG)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		const std::wstring *name = LogEntity::name(entity);
+		if (name != NULL)
+			threadChars += name->size();
+	}
+};
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+int main()
+{
+	std::shared_ptr<OldLogEntity> oldEntity = std::make_shared<OldLogEntity>(L"bench entity");
+	LogEntity::Id entity = LogEntity::intern(L"bench entity");
+	OldCountingLogger oldCounting;
+	CountingLogger counting;
+	OldLogger *oldLogger = &oldCounting;
+	Logger *logger = &counting;
+
+	const int threads[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		int nthreads = threads[i];
+		int perThread = CALLS / nthreads;
+		std::vector<Erref> errs;
+		for (int t = 0; t < nthreads; ++t)
+			errs.push_back(BenchSource.mkString(1, L"record of thread %d", t));
+		std::atomic<size_t> chars(0);
+
+		double oldSec = benchThreads(nthreads, [&](int t) {
+			threadChars = 0;
+			for (int j = 0; j < perThread; ++j)
+				oldLogger->log(errs[t], Logger::SV_INFO, oldEntity);
+			chars += threadChars;
+		});
+		double newSec = benchThreads(nthreads, [&](int t) {
+			threadChars = 0;
+			for (int j = 0; j < perThread; ++j)
+				logger->log(errs[t], Logger::SV_INFO, entity);
+			chars += threadChars;
+		});
+
+		fprintf(stderr, "%d threads: before %5.2f ns, after %5.2f ns of wall time per call\n",
+			nthreads, oldSec * 1e9 / (perThread * nthreads), newSec * 1e9 / (perThread * nthreads));
+	}
+	return 0;
+}
@@ -0,0 +1,63 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  LogLazyBench: the cost of a log call whose message gets thrown away,
+ *  when the message is built and then dropped by the logger, when
+ *  the runtime severity check skips building it (LOG_INFO(), logLazy()),
+ *  and when the call is below LOG_MIN_SEVERITY and compiles to nothing.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { CALLS = 2000000 };
+
+static void report(
+	__in const char *what,
+	__in double ns)
+{
+	fprintf(stderr, "%-36s %6.2f ns\n", what, ns);
+}
+
+int main()
+{
+	benchDiscardStdout();
+	std::shared_ptr<Logger> logger = std::make_shared<StdoutLogger>(Logger::SV_WARNING);
+	Logger *lg = logger.get();
+
+	fprintf(stderr, "LOG_MIN_SEVERITY is %ls, the logger's minimum is %ls\n",
+		Logger::strSeverity(LOG_MIN_SEVERITY), Logger::strSeverity(lg->getMinSeverity()));
+
+	int i = 0;
+	double ns = benchLoop(CALLS, [&] {
+		lg->log(BenchSource.mkString(1, L"value %d", ++i), Logger::SV_INFO, LogEntity::NONE);
+	});
+	report("built and dropped:", ns);
+
+	ns = benchLoop(CALLS, [&] {
+		LOG_INFO(lg, LogEntity::NONE, BenchSource.mkString(1, L"value %d", ++i));
+	});
+	report("LOG_INFO(), runtime check:", ns);
+
+	ns = benchLoop(CALLS, [&] {
+		lg->logLazy<Logger::SV_INFO>(LogEntity::NONE, [&] {
+			return BenchSource.mkString(1, L"value %d", ++i);
+		});
+	});
+	report("logLazy<SV_INFO>(), runtime check:", ns);
+
+	ns = benchLoop(CALLS, [&] {
+		LOG_DEBUG(lg, LogEntity::NONE, BenchSource.mkString(1, L"value %d", ++i));
+	});
+	report(Logger::compiledIn(Logger::SV_DEBUG)
+		? "LOG_DEBUG(), runtime check:" : "LOG_DEBUG(), compiled out:", ns);
+
+	ns = benchLoop(CALLS, [&] {
+		lg->logLazy<Logger::SV_DEBUG>(LogEntity::NONE, [&] {
+			return BenchSource.mkString(1, L"value %d", ++i);
+		});
+	});
+	report(Logger::compiledIn(Logger::SV_DEBUG)
+		? "logLazy<SV_DEBUG>(), runtime check:" : "logLazy<SV_DEBUG>(), compiled out:", ns);
+	return 0;
+}
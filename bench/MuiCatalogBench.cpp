@@ -0,0 +1,81 @@
+#include "pch.h"
+#include <unistd.h>
+#include <unordered_map>
+#include "BenchUtil.hpp"
+
+/**
+ *  MuiCatalogBench: rendering a MUI message from the pre-parsed
+ *  MuiCatalog against the way of FormatMessageW(), that finds the
+ *  text of the message in the message table and parses it on every
+ *  call. The POSIX builds have no message tables, so the lookup and
+ *  the parsing of the raw text get done here, with the same parser.
+ *  Also the whole mkMui() and getMsg() through a MuiSource that reads
+ *  the catalog file.
+ */
+
+enum {
+	MESSAGES = 300, // about the size of a real message table
+	RENDERS = 1000000,
+	CODE_BASE = 0x1000,
+};
+
+// The message texts, of the typical kind.
+static std::wstring messageText(
+	__in int i)
+{
+	return wstrprintf(L"The service %%1 failed the step %d of the start after %%2!d! ms,"
+		L" with the error code 0x%%3!x!. Check the configuration in '%%4'.%%n", i);
+}
+
+int main()
+{
+	MuiCatalog catalog;
+	std::unordered_map<DWORD, std::wstring> table; // the raw texts, as in a message table
+	for (int i = 0; i < MESSAGES; ++i) {
+		std::wstring text = messageText(i);
+		catalog.add(CODE_BASE + i, text.c_str(), text.size());
+		table[CODE_BASE + i] = text;
+	}
+
+	FormatArgs args;
+	args.addAll(L"MyService", 1500, 0x80070005u, L"/etc/myservice.conf");
+
+	std::wstring msg;
+	int i = 0;
+	double rawNs = benchLoop(RENDERS, [&] {
+		DWORD code = CODE_BASE + (i++ % MESSAGES);
+		const std::wstring &text = table.find(code)->second;
+		MuiCatalog::Template tpl;
+		tpl.parse(text.c_str(), text.size());
+		msg.clear();
+		tpl.render(msg, args);
+	});
+	size_t rawLen = msg.size();
+
+	double cachedNs = benchLoop(RENDERS, [&] {
+		DWORD code = CODE_BASE + (i++ % MESSAGES);
+		msg.clear();
+		catalog.find(code)->render(msg, args);
+	});
+
+	fprintf(stderr, "lookup and parse every time: %7.1f ns per message (%zu chars)\n", rawNs, rawLen);
+	fprintf(stderr, "from the catalog:            %7.1f ns per message (%zu chars)\n", cachedNs, msg.size());
+
+	// The same through a MuiSource, from the catalog file.
+	std::string path = "/tmp/MuiCatalogBench." + std::to_string(getpid()) + ".cat";
+	std::wstring wpath(path.begin(), path.end());
+	Erref err = catalog.saveFile(wpath.c_str());
+	if (err) {
+		fprintf(stderr, "%ls", err->toString().c_str());
+		return 1;
+	}
+	ErrorMsg::MuiSource source(L"Bench", NULL, wpath);
+	unlink(path.c_str());
+
+	double mkNs = benchLoop(RENDERS, [&] {
+		Erref e = source.mkMui(CODE_BASE + (i++ % MESSAGES), L"MyService", 1500, 0x80070005u, L"/etc/myservice.conf");
+		msg = e->getMsg();
+	});
+	fprintf(stderr, "mkMui() and getMsg():        %7.1f ns per message (%zu chars)\n", mkNs, msg.size());
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "pch.h"
+#include <atomic>
+#include "BenchUtil.hpp"
+
+/**
+ *  RateLimitBench: the time of RateLimitLogger::log() when all the
+ *  threads keep repeating the same error, as in an incident, and when
+ *  each thread repeats its own. The errors are built in advance, to
+ *  leave only the limiter's own time. The sink counts the records.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { RECORDS = 2000000 };
+
+class CountingLogger : public Logger
+{
+public:
+	CountingLogger() :
+		Logger(SV_DEBUG), count_(0)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		count_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::atomic<uint64_t> count_;
+};
+
+static void run(
+	__in int nthreads,
+	__in bool same)
+{
+	std::shared_ptr<CountingLogger> sink = std::make_shared<CountingLogger>();
+	RateLimitLogger::Options opts;
+	opts.windowMs_ = 600 * 1000;
+	RateLimitLogger limiter(sink, Logger::SV_DEBUG, opts);
+
+	std::vector<Erref> errs;
+	for (int t = 0; t < nthreads; ++t) {
+		Erref err = BenchSource.mkString(same ? 1 : t, L"connection failed");
+		err.append(BenchSource.mkString(2, L"timed out"));
+		errs.push_back(err);
+	}
+
+	int perThread = RECORDS / nthreads;
+	double elapsed = benchThreads(nthreads, [&](int t) {
+		for (int i = 0; i < perThread; ++i)
+			limiter.log(errs[t], Logger::SV_ERROR, LogEntity::NONE);
+	});
+
+	RateLimitLogger::Stats st;
+	limiter.getStats(st);
+	fprintf(stderr, "%-4s error, %d threads: %6.1f ns per record, %llu repeats\n",
+		same ? "same" : "own", nthreads,
+		elapsed * 1e9 * nthreads / (perThread * nthreads),
+		(unsigned long long)st.repeated_);
+}
+
+int main()
+{
+	const int threads[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		run(threads[i], true);
+		run(threads[i], false);
+	}
+	return 0;
+}
@@ -0,0 +1,35 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  StdoutLoggerBench: the records per second that StdoutLogger takes
+ *  from 1 to 8 threads, with stdout going to /dev/null.
+ */
+
+static ErrorMsg::Source BenchSource(L"Bench", NULL);
+
+enum { RECORDS = 400000 };
+
+int main()
+{
+	benchDiscardStdout();
+
+	const int threads[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		int nthreads = threads[i];
+		int perThread = RECORDS / nthreads;
+
+		std::shared_ptr<StdoutLogger> logger = std::make_shared<StdoutLogger>(Logger::SV_DEBUG);
+		double sec = benchThreads(nthreads, [&](int t) {
+			for (int j = 0; j < perThread; ++j)
+				logger->log(BenchSource.mkString(t, L"record %d of thread %d", j, t),
+					Logger::SV_INFO, LogEntity::NONE);
+		});
+		// the records still in the buffer count too
+		sec += benchLoop(1, [&] { logger->flush(); }) / 1e9;
+
+		fprintf(stderr, "%d threads: %8.0f records/s, %llu dropped\n",
+			nthreads, perThread * nthreads / sec, (unsigned long long)logger->dropped());
+	}
+	return 0;
+}
@@ -0,0 +1,34 @@
+#include "pch.h"
+#include "BenchUtil.hpp"
+
+/**
+ *  SystemTextCacheBench: the lookups of the cached errno texts from
+ *  the several threads at once, that all hit the cache.
+ */
+
+enum { LOOKUPS = 2000000 };
+
+int main()
+{
+	const int threads[] = { 1, 2, 4, 8 };
+	for (size_t i = 0; i < _countof(threads); ++i) {
+		int nthreads = threads[i];
+		int perThread = LOOKUPS / nthreads;
+
+		SystemTextCache::Stats before;
+		systemTextCache.getStats(before);
+		double sec = benchThreads(nthreads, [&](int t) {
+			std::wstring text;
+			for (int j = 0; j < perThread; ++j)
+				systemTextCache.get(SystemTextCache::SK_ERRNO, ENOENT + (j & 3), text);
+		});
+		SystemTextCache::Stats after;
+		systemTextCache.getStats(after);
+
+		fprintf(stderr, "%d threads: %6.1f ns of wall time per lookup, %llu hits, %llu misses\n",
+			nthreads, sec * 1e9 / (perThread * nthreads),
+			(unsigned long long)(after.hits_ - before.hits_),
+			(unsigned long long)(after.misses_ - before.misses_));
+	}
+	return 0;
+}
@@ -1,23 +1,32 @@
-#pragma once
-
-// TODO: add headers that you want to pre-compile here
-#define WIN32_NO_STATUS
-#include <windows.h>
-#undef WIN32_NO_STATUS
-#include <ntstatus.h>
-#include <winnt.h>
-
-#include <evntprov.h>
-#include <synchapi.h>
-#include <muiload.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string>
-#include <memory>
-#include <deque>
-
-#include "Critical.hpp"
-#include "ErrorHelpers.hpp"
-#include "Logger.hpp"
-// TODO: reference additional headers your program requires here
-#include "Service.hpp"
+#pragma once
+
+// TODO: add headers that you want to pre-compile here
+#ifdef _WIN32
+#define WIN32_NO_STATUS
+#include <windows.h>
+#undef WIN32_NO_STATUS
+#include <ntstatus.h>
+#include <winnt.h>
+
+#include <evntprov.h>
+#include <synchapi.h>
+#include <muiload.h>
+#else
+#include "WinCompat.hpp"
+#include "MessageIds.hpp"
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <atomic>
+
+#include "Critical.hpp"
+#include "ErrorHelpers.hpp"
+#include "Logger.hpp"
+// TODO: reference additional headers your program requires here
+#include "Service.hpp"
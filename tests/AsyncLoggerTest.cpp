@@ -0,0 +1,79 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  AsyncLoggerTest: close() while the producers keep logging must
+ *  not lose any records: each one is either written by the flusher,
+ *  or drained by close(), or written directly, or counted as dropped.
+ *  The sink never gets called from two threads at once.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+// Counts the records, and the calls that overlap.
+class CountingLogger : public Logger
+{
+public:
+	CountingLogger() :
+		Logger(SV_DEBUG), count_(0), inside_(0), overlaps_(0)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		if (inside_.fetch_add(1) != 0)
+			overlaps_.fetch_add(1);
+		count_.fetch_add(1);
+		// widen the window for an overlap
+		if ((count_.load(std::memory_order_relaxed) & 15) == 0)
+			SwitchToThread();
+		inside_.fetch_sub(1);
+	}
+
+	std::atomic<uint64_t> count_;
+	std::atomic<int> inside_; // the calls in progress
+	std::atomic<uint64_t> overlaps_;
+};
+
+enum { THREADS = 4, ROUNDS = 50 };
+
+int main()
+{
+	for (int round = 0; round < ROUNDS; ++round) {
+		std::shared_ptr<CountingLogger> sink = std::make_shared<CountingLogger>();
+		// a small queue, to get both the drops and the records in flight
+		AsyncLogger logger(sink, Logger::SV_DEBUG, 64);
+
+		std::atomic<uint64_t> logged(0);
+		std::atomic<bool> closed(false);
+		std::vector<std::thread> threads;
+		for (int t = 0; t < THREADS; ++t) {
+			threads.push_back(std::thread([&, t] {
+				// keep logging for a while after close()
+				int after = 0;
+				while (after < 100) {
+					if (closed.load())
+						++after;
+					logger.log(TestSource.mkString(t, L"record"), Logger::SV_INFO, LogEntity::NONE);
+					logged.fetch_add(1);
+				}
+			}));
+		}
+		Sleep(round % 3);
+		logger.close();
+		closed = true;
+		for (size_t t = 0; t < threads.size(); ++t)
+			threads[t].join();
+
+		AsyncLogger::Stats st;
+		logger.getStats(st);
+		TEST_CHECK(sink->count_.load() + st.dropped_ == logged.load());
+		TEST_CHECK(sink->overlaps_.load() == 0);
+		TEST_CHECK(st.written_ == st.enqueued_);
+		TEST_CHECK(st.queueDepth_ == 0);
+	}
+	return TEST_RESULT();
+}
@@ -0,0 +1,178 @@
+#include "pch.h"
+#include <unistd.h>
+#include "TestCheck.hpp"
+
+/**
+ *  BinaryLogTest: the same records written by BinaryLogger and by
+ *  FileLogger, and the binary log decoded back by BinaryLogReader
+ *  (and by the LogDecode program, if its path is in the argument),
+ *  must give the same text, except for the timestamps.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+enum { MUI_CODE = 5 };
+
+// The length of the timestamp that starts each record.
+static const size_t TIME_LEN = sizeof("2026-01-01 00:00:00.000 ") - 1;
+
+// Remove the timestamps, the lines of the chained messages start
+// with the spaces and have none.
+static std::string stripTimes(
+	__in const std::string &text)
+{
+	std::string result;
+	size_t pos = 0;
+	while (pos < text.size()) {
+		size_t end = text.find('\n', pos);
+		end = (end == std::string::npos) ? text.size() : end + 1;
+		if (text[pos] != ' ' && end - pos > TIME_LEN)
+			pos += TIME_LEN;
+		result.append(text, pos, end - pos);
+		pos = end;
+	}
+	return result;
+}
+
+static std::string readFile(
+	__in const std::string &path)
+{
+	std::string text;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == NULL)
+		return text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text.append(buf, n);
+	fclose(f);
+	return text;
+}
+
+static std::string readCommand(
+	__in const std::string &cmd)
+{
+	std::string text;
+	FILE *f = popen(cmd.c_str(), "r");
+	if (f == NULL)
+		return text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text.append(buf, n);
+	TEST_CHECK(pclose(f) == 0);
+	return text;
+}
+
+// Log the same records into both loggers.
+static void logBoth(
+	__in Logger &binary,
+	__in Logger &text,
+	__in std::vector<Erref> &errs,
+	__in LogEntity::Id entity)
+{
+	for (size_t i = 0; i < errs.size(); ++i) {
+		// The binary logger goes first, so it sees the deferred messages.
+		Erref err = errs[i].copy();
+		Logger::Severity sev = (Logger::Severity)(i % Logger::SV_NEVER);
+		LogEntity::Id ent = (i & 1) ? entity : (LogEntity::Id)LogEntity::NONE;
+		binary.log(err, sev, ent);
+		text.log(err, sev, ent);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string base = "/tmp/BinaryLogTest." + std::to_string(getpid());
+	std::string binPath = base + ".bin";
+	std::string textPath = base + ".log";
+	std::string catPath = base + ".cat";
+	std::wstring wbinPath(binPath.begin(), binPath.end());
+	std::wstring wtextPath(textPath.begin(), textPath.end());
+	std::wstring wcatPath(catPath.begin(), catPath.end());
+
+	{
+		MuiCatalog catalog;
+		const WCHAR *tmpl = L"Mui message %1 and %2!d! end%n";
+		catalog.add(MUI_CODE, tmpl, wcslen(tmpl));
+		TEST_CHECK(!catalog.saveFile(wcatPath.c_str()));
+	}
+	ErrorMsg::MuiSource muiSource(L"MuiTest", NULL, wcatPath);
+	LogEntity::Id entity = LogEntity::intern(L"Entity é");
+
+	std::vector<Erref> errs;
+	errs.push_back(TestSource.mkString(1, L"ints %d %u %lld %x %5.2f", -5, 7u, -1234567890123LL, 255u, 3.25));
+	errs.push_back(TestSource.mkString(2, L"strs '%ls' '%hs' '%ls'", L"wide \U0001F600 ü", "narrow", (const WCHAR *)NULL));
+	errs.push_back(TestSource.mkSystem(5, 3, L"with system %d", 42));
+	{
+		Erref err = TestSource.mkString(4, L"errno chain");
+		err.append(ErrorMsg::mkErrno(ENOENT));
+		errs.push_back(err);
+	}
+	errs.push_back(muiSource.mkMui(MUI_CODE, L"arg1", 17));
+	{
+		Erref err = TestSource.mkString(6, L"prerendered %d", 9);
+		err->toString();
+		errs.push_back(err);
+	}
+	errs.push_back(TestSource.mkString(7, L"plain no args"));
+
+	unlink(binPath.c_str());
+	unlink(textPath.c_str());
+	{
+		BinaryLogger binary(wbinPath.c_str(), Logger::SV_DEBUG);
+		FileLogger text(wtextPath.c_str(), Logger::SV_DEBUG);
+		TEST_CHECK(!binary.error() && !text.error());
+		logBoth(binary, text, errs, entity);
+		logBoth(binary, text, errs, entity);
+	}
+	{
+		// the second session gets appended
+		BinaryLogger binary(wbinPath.c_str(), Logger::SV_DEBUG);
+		FileLogger text(wtextPath.c_str(), Logger::SV_DEBUG);
+		logBoth(binary, text, errs, entity);
+	}
+
+	std::string expected = stripTimes(readFile(textPath));
+	TEST_CHECK(!expected.empty());
+
+	std::string decoded;
+	int records = 0;
+	{
+		BinaryLogReader reader(wbinPath.c_str());
+		BinaryLogReader::Record rec;
+		while (reader.next(rec)) {
+			BinaryLogReader::formatRecord(decoded, rec);
+			++records;
+		}
+		TEST_CHECK(!reader.error());
+	}
+	TEST_CHECK(records == (int)(3 * errs.size()));
+	TEST_CHECK(stripTimes(decoded) == expected);
+
+	if (argc > 1) {
+		std::string output = readCommand(std::string(argv[1]) + " " + binPath);
+		TEST_CHECK(stripTimes(output) == expected);
+	}
+
+	// A truncated file gives the records before the damage, and an error.
+	{
+		std::string data = readFile(binPath);
+		FILE *f = fopen(binPath.c_str(), "wb");
+		fwrite(data.data(), 1, data.size() - 3, f);
+		fclose(f);
+
+		BinaryLogReader reader(wbinPath.c_str());
+		BinaryLogReader::Record rec;
+		int n = 0;
+		while (reader.next(rec))
+			++n;
+		TEST_CHECK(n == records - 1);
+		TEST_CHECK(reader.error());
+	}
+
+	unlink(binPath.c_str());
+	unlink(textPath.c_str());
+	unlink(catPath.c_str());
+	return TEST_RESULT();
+}
@@ -0,0 +1,106 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  ErrefTest: the appends to a long chain take constant time, and the
+ *  tail hint doesn't outlive the chain it points into.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+enum { APPENDS = 100000 };
+
+// Count the elements of the chain.
+static size_t chainLength(Erref err)
+{
+	size_t len = 0;
+	for (; err; err = err.getChain())
+		++len;
+	return len;
+}
+
+// A chain of the given length, with the codes 1 to len.
+static Erref mkChain(int len)
+{
+	Erref err;
+	for (int i = 1; i <= len; ++i)
+		err.append(TestSource.mkString(i, L"error %d", i));
+	return err;
+}
+
+static void testStress()
+{
+	Erref err;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int i = 0; i < APPENDS; ++i)
+		err.append(TestSource.mkString(i, L"error %d", i));
+	double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	printf("%d appends: %.1f ns each\n", (int)APPENDS, sec * 1e9 / APPENDS);
+
+	TEST_CHECK(chainLength(err) == APPENDS);
+	// walking the chain on each append would take minutes
+	TEST_CHECK(sec < 5.);
+
+	// the last one must be at the end
+	Erref last = err;
+	while (last.getChain())
+		last = last.getChain();
+	TEST_CHECK(last.getCode() == APPENDS - 1);
+
+	// a copy shares the chain and the hint stays valid for it
+	Erref dup = err;
+	dup.append(TestSource.mkString(APPENDS, L"one more"));
+	TEST_CHECK(chainLength(err) == APPENDS + 1);
+
+	// the long chain must be destroyed without running out of stack
+	err.reset();
+	dup.reset();
+	last.reset();
+}
+
+static void testMovedFrom()
+{
+	Erref a = mkChain(3);
+	Erref b = std::move(a);
+	TEST_CHECK(!a);
+	TEST_CHECK(chainLength(b) == 3);
+
+	// the moved-from reference starts a new chain and doesn't touch the old one
+	a.append(TestSource.mkString(10, L"new"));
+	TEST_CHECK(chainLength(a) == 1);
+	TEST_CHECK(a.getCode() == 10);
+	TEST_CHECK(chainLength(b) == 3);
+	a.append(TestSource.mkString(11, L"new"));
+	TEST_CHECK(chainLength(a) == 2);
+	TEST_CHECK(chainLength(b) == 3);
+
+	// same after the move assignment
+	Erref c = mkChain(2);
+	b = std::move(c);
+	TEST_CHECK(!c);
+	TEST_CHECK(chainLength(b) == 2);
+	c.append(TestSource.mkString(20, L"new"));
+	c.splice(TestSource.mkString(21, L"new"));
+	TEST_CHECK(chainLength(c) == 2);
+	TEST_CHECK(chainLength(b) == 2);
+
+	// the swap takes the hints along
+	Erref d = mkChain(4);
+	Erref e = mkChain(1);
+	d.swap(e);
+	d.append(TestSource.mkString(30, L"new"));
+	e.append(TestSource.mkString(31, L"new"));
+	TEST_CHECK(chainLength(d) == 2);
+	TEST_CHECK(chainLength(e) == 5);
+	std::swap(d, e);
+	d.append(TestSource.mkString(32, L"new"));
+	TEST_CHECK(chainLength(d) == 6);
+	TEST_CHECK(chainLength(e) == 2);
+}
+
+int main()
+{
+	testStress();
+	testMovedFrom();
+	return TEST_RESULT();
+}
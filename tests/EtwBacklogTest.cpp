@@ -0,0 +1,142 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  EtwBacklogTest: the records logged before an ETW session starts
+ *  go into the EtwLogger's backlog ring, the oldest get overwritten
+ *  when it's full, and the thread pool replays the rest when the
+ *  session starts, after an EPEM_LOG_BACKLOG_DROPPED summary.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+// Exposes the size of the backlog.
+class BacklogLogger : public EtwLogger
+{
+public:
+	enum { LIMIT = BACKLOG_LIMIT };
+
+	BacklogLogger(
+		__in LPCGUID guid) :
+		EtwLogger(guid, SV_DEBUG)
+	{
+	}
+};
+
+enum { EXTRA = 100 };
+
+// The code of the outer message of a single event: the payload is
+// the text, the code, the number of codes and the codes.
+static DWORD eventCode(
+	__in const EtwStandIn::Event &ev)
+{
+	const std::string &data = ev.data_;
+	size_t pos = 0;
+	for (; pos + sizeof(WCHAR) <= data.size(); pos += sizeof(WCHAR)) {
+		WCHAR c;
+		memcpy(&c, data.data() + pos, sizeof(c));
+		if (c == 0)
+			break;
+	}
+	pos += sizeof(WCHAR);
+	uint32_t code = 0;
+	if (pos + sizeof(code) <= data.size())
+		memcpy(&code, data.data() + pos, sizeof(code));
+	return code;
+}
+
+// Wait until the stand-in has seen the given number of events.
+static bool waitEvents(
+	__in uint64_t count)
+{
+	for (int i = 0; i < 5000; ++i) {
+		if (etwStandIn.count() >= count)
+			return true;
+		Sleep(1);
+	}
+	return false;
+}
+
+static void testReplay()
+{
+	GUID guid = {};
+	BacklogLogger logger(&guid);
+	etwStandIn.keepEvents(true);
+	std::vector<EtwStandIn::Event> events;
+	etwStandIn.takeEvents(events);
+
+	// Overfill the ring. The debug records get dropped on replay
+	// by the session's level.
+	for (int i = 0; i < BacklogLogger::LIMIT + EXTRA; ++i) {
+		Logger::Severity sev = (i % 10 == 0) ? Logger::SV_DEBUG : Logger::SV_INFO;
+		logger.log(TestSource.mkString(i + 1, L"record %d", i), sev, LogEntity::NONE);
+	}
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+
+	// The replay runs on the thread pool, nobody calls poll().
+	uint64_t start = etwStandIn.count();
+	int expected = 1; // the summary
+	for (int i = EXTRA; i < BacklogLogger::LIMIT + EXTRA; ++i)
+		expected += (i % 10 != 0);
+	etwStandIn.enable(TRACE_LEVEL_INFORMATION);
+	TEST_CHECK(waitEvents(start + expected));
+	// a new record goes after the replayed ones
+	logger.log(TestSource.mkString(999999, L"after"), Logger::SV_INFO, LogEntity::NONE);
+
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.size() == (size_t)expected + 1);
+	if (events.size() != (size_t)expected + 1)
+		return;
+
+	TEST_CHECK(eventCode(events[0]) == (EPEM_LOG_BACKLOG_DROPPED & 0x3FFFFFFF));
+	TEST_CHECK(events[0].desc_.Level == TRACE_LEVEL_WARNING);
+
+	// The oldest EXTRA are gone, the rest come in order.
+	size_t idx = 1;
+	for (int i = EXTRA; i < BacklogLogger::LIMIT + EXTRA; ++i) {
+		if (i % 10 == 0)
+			continue;
+		TEST_CHECK(eventCode(events[idx]) == (DWORD)(i + 1));
+		++idx;
+	}
+	TEST_CHECK(eventCode(events[idx]) == 999999);
+
+	// Nothing is left to replay after the session restarts.
+	etwStandIn.disable();
+	etwStandIn.enable(TRACE_LEVEL_INFORMATION);
+	logger.poll();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+
+	etwStandIn.disable();
+}
+
+// A backlog that is not full has no summary.
+static void testNoDrops()
+{
+	GUID guid = {};
+	BacklogLogger logger(&guid);
+	etwStandIn.keepEvents(true);
+	std::vector<EtwStandIn::Event> events;
+
+	for (int i = 0; i < 10; ++i)
+		logger.log(TestSource.mkString(i + 1, L"record %d", i), Logger::SV_WARNING, LogEntity::NONE);
+	uint64_t start = etwStandIn.count();
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE);
+	TEST_CHECK(waitEvents(start + 10));
+
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.size() == 10);
+	for (size_t i = 0; i < events.size(); ++i)
+		TEST_CHECK(eventCode(events[i]) == (DWORD)(i + 1));
+
+	etwStandIn.disable();
+}
+
+int main()
+{
+	testReplay();
+	testNoDrops();
+	return TEST_RESULT();
+}
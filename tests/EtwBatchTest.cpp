@@ -0,0 +1,61 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  EtwBatchTest: the batched EtwLogger records written through
+ *  EtwStandIn decode back with EtwBatch::decode().
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+static void testBatched()
+{
+	GUID guid = {};
+	EtwLogger logger(&guid, Logger::SV_DEBUG, true);
+	etwStandIn.keepEvents(true);
+	etwStandIn.enable(TRACE_LEVEL_INFORMATION);
+
+	Erref err = TestSource.mkString(1, L"inner \U0001F600");
+	err.wrap(TestSource.mkString(2, L"outer"));
+	logger.log(err, Logger::SV_WARNING, LogEntity::NONE);
+	logger.log(TestSource.mkString(3, L"info"), Logger::SV_INFO, LogEntity::NONE);
+
+	// collected until poll()
+	std::vector<EtwStandIn::Event> events;
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+
+	logger.poll();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.size() == 1);
+	if (events.size() != 1)
+		return;
+	TEST_CHECK(events[0].desc_.Id == EtwLogger::BATCH_EVENT_ID);
+	TEST_CHECK(events[0].desc_.Level == TRACE_LEVEL_WARNING);
+
+	std::vector<EtwBatch::Record> recs;
+	TEST_CHECK(EtwBatch::decode(events[0].data_.data(), events[0].data_.size(), recs));
+	TEST_CHECK(recs.size() == 2);
+	if (recs.size() == 2) {
+		TEST_CHECK(recs[0].sev_ == Logger::SV_WARNING);
+		TEST_CHECK(recs[0].codes_.size() == 2 && recs[0].codes_[0] == 2 && recs[0].codes_[1] == 1);
+		TEST_CHECK(recs[0].text_.find(L"inner \U0001F600") != std::wstring::npos);
+		TEST_CHECK(recs[0].text_.find(L"outer") != std::wstring::npos);
+		TEST_CHECK(recs[1].sev_ == Logger::SV_INFO);
+		TEST_CHECK(recs[1].codes_.size() == 1 && recs[1].codes_[0] == 3);
+	}
+
+	// a truncated payload is detected
+	TEST_CHECK(!EtwBatch::decode(events[0].data_.data(), events[0].data_.size() - 1, recs));
+
+	// an error gets sent right away
+	logger.log(TestSource.mkString(4, L"error"), Logger::SV_ERROR, LogEntity::NONE);
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.size() == 1 && events[0].desc_.Level == TRACE_LEVEL_ERROR);
+}
+
+int main()
+{
+	testBatched();
+	return TEST_RESULT();
+}
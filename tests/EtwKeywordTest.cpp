@@ -0,0 +1,207 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  EtwKeywordTest: the keyword masks of the ETW session, set through
+ *  EtwStandIn::enable(), filter the records of the entities in
+ *  EtwLogger, in LOG_SHORTCUT and logLazy() (which then don't even
+ *  build the messages), in the replay of the backlog, and in front
+ *  of an AsyncLogger.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+enum {
+	KW_A = 0x1,
+	KW_B = 0x2,
+};
+
+// The record codes tell the entities apart.
+enum {
+	CODE_A = 1,
+	CODE_B,
+	CODE_AB,
+	CODE_FREE,
+	CODE_NONE,
+};
+
+static LogEntity::Id entA, entB, entAB, entFree;
+
+// How many messages have been built.
+static int built;
+
+static Erref make(
+	__in DWORD code)
+{
+	++built;
+	return TestSource.mkString(code, L"record");
+}
+
+// Log a record from each entity, with the code of the entity.
+static void logAll(
+	__in Logger *logger)
+{
+	logger->log(make(CODE_A), Logger::SV_INFO, entA);
+	logger->log(make(CODE_B), Logger::SV_INFO, entB);
+	logger->log(make(CODE_AB), Logger::SV_INFO, entAB);
+	logger->log(make(CODE_FREE), Logger::SV_INFO, entFree);
+	logger->log(make(CODE_NONE), Logger::SV_INFO, LogEntity::NONE);
+}
+
+// Take the written events and return the codes of their records,
+// in the order of writing. The single event's payload starts with
+// the text, followed by the code.
+static std::vector<DWORD> takeCodes()
+{
+	std::vector<EtwStandIn::Event> events;
+	etwStandIn.takeEvents(events);
+	std::vector<DWORD> codes;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const std::string &data = events[i].data_;
+		size_t pos = 0;
+		for (; pos + sizeof(WCHAR) <= data.size(); pos += sizeof(WCHAR)) {
+			WCHAR c;
+			memcpy(&c, data.data() + pos, sizeof(c));
+			if (c == 0)
+				break;
+		}
+		pos += sizeof(WCHAR);
+		uint32_t code = 0;
+		if (pos + sizeof(code) <= data.size())
+			memcpy(&code, data.data() + pos, sizeof(code));
+		codes.push_back(code);
+	}
+	return codes;
+}
+
+static std::vector<DWORD> codes(
+	__in std::initializer_list<DWORD> list)
+{
+	return std::vector<DWORD>(list);
+}
+
+static void testBacklog()
+{
+	GUID guid = {};
+	EtwLogger logger(&guid, Logger::SV_DEBUG);
+	etwStandIn.keepEvents(true);
+
+	// Before the session starts, everything goes into the backlog.
+	built = 0;
+	logAll(&logger);
+	TEST_CHECK(built == 5);
+	TEST_CHECK(takeCodes().empty());
+
+	// The replay drops the entities that the session doesn't want.
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE, KW_A, 0);
+	logger.poll(); // the backlog is empty after it returns
+	TEST_CHECK(takeCodes() == codes({ CODE_A, CODE_AB, CODE_FREE, CODE_NONE }));
+
+	etwStandIn.disable();
+}
+
+static void testShortcuts()
+{
+	GUID guid = {};
+	EtwLogger logger(&guid, Logger::SV_DEBUG);
+	EtwLogger *lg = &logger;
+	etwStandIn.keepEvents(true);
+
+	// Any of KW_A.
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE, KW_A, 0);
+	built = 0;
+	logAll(lg);
+	TEST_CHECK(built == 5);
+	TEST_CHECK(takeCodes() == codes({ CODE_A, CODE_AB, CODE_FREE, CODE_NONE }));
+
+	// The filtered messages don't get built.
+	built = 0;
+	LOG_INFO(lg, entA, make(CODE_A));
+	LOG_INFO(lg, entB, make(CODE_B));
+	LOG_SHORTCUT(lg, Logger::SV_INFO, entFree, make(CODE_FREE));
+	TEST_CHECK(built == 2);
+	TEST_CHECK(takeCodes() == codes({ CODE_A, CODE_FREE }));
+
+	built = 0;
+	lg->logLazy<Logger::SV_INFO>(entB, [] { return make(CODE_B); });
+	lg->logLazy<Logger::SV_INFO>(entAB, [] { return make(CODE_AB); });
+	lg->logLazy<Logger::SV_INFO>(LogEntity::NONE, [] { return make(CODE_NONE); });
+	TEST_CHECK(built == 2);
+	TEST_CHECK(takeCodes() == codes({ CODE_AB, CODE_NONE }));
+
+	// Any of KW_A and KW_B, with all of KW_B.
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE, KW_A | KW_B, KW_B);
+	built = 0;
+	LOG_INFO(lg, entA, make(CODE_A));
+	LOG_INFO(lg, entB, make(CODE_B));
+	lg->logLazy<Logger::SV_INFO>(entAB, [] { return make(CODE_AB); });
+	lg->logLazy<Logger::SV_INFO>(entFree, [] { return make(CODE_FREE); });
+	TEST_CHECK(built == 3);
+	TEST_CHECK(takeCodes() == codes({ CODE_B, CODE_AB, CODE_FREE }));
+
+	// No keywords pass everything.
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE, 0, 0);
+	built = 0;
+	LOG_INFO(lg, entA, make(CODE_A));
+	LOG_INFO(lg, entB, make(CODE_B));
+	TEST_CHECK(built == 2);
+	TEST_CHECK(takeCodes() == codes({ CODE_A, CODE_B }));
+
+	// The level still applies.
+	etwStandIn.enable(TRACE_LEVEL_WARNING, KW_A, 0);
+	built = 0;
+	LOG_INFO(lg, entA, make(CODE_A));
+	LOG_WARNING(lg, entA, make(CODE_A));
+	LOG_WARNING(lg, entB, make(CODE_B));
+	TEST_CHECK(built == 1);
+	TEST_CHECK(takeCodes() == codes({ CODE_A }));
+
+	// A missing logger takes nothing.
+	EtwLogger *none = NULL;
+	built = 0;
+	LOG_ERROR(none, entA, make(CODE_A));
+	TEST_CHECK(built == 0);
+
+	etwStandIn.disable();
+}
+
+static void testAsync()
+{
+	GUID guid = {};
+	std::shared_ptr<EtwLogger> etw = std::make_shared<EtwLogger>(&guid, Logger::SV_DEBUG);
+	etwStandIn.keepEvents(true);
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE, KW_B, 0);
+
+	AsyncLogger async(etw, Logger::SV_DEBUG);
+	AsyncLogger *lg = &async;
+	built = 0;
+	logAll(lg);
+	TEST_CHECK(built == 5);
+	// the shortcuts see the filter of the EtwLogger behind
+	LOG_INFO(lg, entA, make(CODE_A));
+	lg->logLazy<Logger::SV_INFO>(entB, [] { return make(CODE_B); });
+	TEST_CHECK(built == 6);
+	async.close();
+
+	// The filtered records don't even take the space in the queue.
+	AsyncLogger::Stats st;
+	async.getStats(st);
+	TEST_CHECK(st.enqueued_ == 5);
+	TEST_CHECK(st.written_ == 5);
+	TEST_CHECK(takeCodes() == codes({ CODE_B, CODE_AB, CODE_FREE, CODE_NONE, CODE_B }));
+
+	etwStandIn.disable();
+}
+
+int main()
+{
+	entA = LogEntity::intern(L"EntityA", KW_A);
+	entB = LogEntity::intern(L"EntityB", KW_B);
+	entAB = LogEntity::intern(L"EntityAB", KW_A | KW_B);
+	entFree = LogEntity::intern(L"EntityFree", 0);
+
+	testBacklog();
+	testShortcuts();
+	testAsync();
+	return TEST_RESULT();
+}
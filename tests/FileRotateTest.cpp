@@ -0,0 +1,363 @@
+#include "pch.h"
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "TestCheck.hpp"
+
+/**
+ *  FileRotateTest: FileLogger rotates its file by size and by time,
+ *  without replacing the existing segments, and compresses the
+ *  rotated segments into gzip files. Every BinaryLogger segment
+ *  decodes on its own. OutputPump copies the data from a pipe through
+ *  the rotations without losing or reordering any of it.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+static std::string dir;
+
+static std::string readFile(
+	__in const std::string &path)
+{
+	std::string text;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == NULL)
+		return text;
+	char buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		text.append(buf, n);
+	fclose(f);
+	return text;
+}
+
+static std::string readGzip(
+	__in const std::string &path)
+{
+	std::string text;
+	gzFile gz = gzopen(path.c_str(), "rb");
+	if (gz == NULL)
+		return text;
+	char buf[4096];
+	int n;
+	while ((n = gzread(gz, buf, sizeof(buf))) > 0)
+		text.append(buf, (size_t)n);
+	TEST_CHECK(n == 0);
+	gzclose(gz);
+	return text;
+}
+
+// The order of a segment name: by the time, then by the counter
+// within the same second. The current file goes last.
+static std::pair<std::string, int> segmentOrder(
+	__in const std::string &name,
+	__in const std::string &base)
+{
+	if (name == base)
+		return std::make_pair(std::string("~"), 0);
+	std::string rest = name.substr(base.size() + 1); // after the dot
+	size_t dash = rest.find('-', sizeof("YYYYmmdd-HHMMSS") - 1);
+	if (dash == std::string::npos)
+		return std::make_pair(rest, 0);
+	return std::make_pair(rest.substr(0, dash), atoi(rest.c_str() + dash + 1));
+}
+
+// List the files of the log, in the order of writing.
+static std::vector<std::string> listSegments(
+	__in const std::string &base)
+{
+	std::vector<std::string> names;
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL)
+		return names;
+	while (struct dirent *e = readdir(d)) {
+		std::string name = e->d_name;
+		if (name.compare(0, base.size(), base) == 0)
+			names.push_back(name);
+	}
+	closedir(d);
+	std::sort(names.begin(), names.end(), [&](const std::string &a, const std::string &b) {
+		return segmentOrder(a, base) < segmentOrder(b, base);
+	});
+	return names;
+}
+
+static void removeSegments(
+	__in const std::string &base)
+{
+	std::vector<std::string> names = listSegments(base);
+	for (size_t i = 0; i < names.size(); ++i)
+		unlink((dir + "/" + names[i]).c_str());
+}
+
+static std::wstring widen(
+	__in const std::string &s)
+{
+	return std::wstring(s.begin(), s.end());
+}
+
+static size_t countLines(
+	__in const std::string &text)
+{
+	return (size_t)std::count(text.begin(), text.end(), '\n');
+}
+
+// The segment name that a rotation at this time would take first.
+static std::string segmentName(
+	__in const std::string &base,
+	__in time_t when)
+{
+	struct tm tm;
+	localtime_r(&when, &tm);
+	char buf[64];
+	snprintf(buf, sizeof(buf), ".%04d%02d%02d-%02d%02d%02d",
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+	return base + buf;
+}
+
+static void testSizeRotation()
+{
+	enum { RECORDS = 300, ROTATE_SIZE = 4096 };
+	const std::string base = "size.log";
+	const std::string path = dir + "/" + base;
+
+	// The segments that the rotations would take first already exist,
+	// and must stay untouched.
+	time_t now = time(NULL);
+	const char *occupied = "occupied\n";
+	for (int i = 0; i < 3; ++i) {
+		FILE *f = fopen((dir + "/" + segmentName(base, now + i)).c_str(), "wb");
+		fputs(occupied, f);
+		fclose(f);
+	}
+
+	FileLogger::Options opts;
+	opts.bufferSize_ = 512;
+	opts.flushFlags_ = 0;
+	opts.rotateSize_ = ROTATE_SIZE;
+	FileLogger::Stats st;
+	{
+		FileLogger logger(widen(path).c_str(), Logger::SV_DEBUG, opts);
+		TEST_CHECK(!logger.error());
+		for (int i = 0; i < RECORDS; ++i)
+			logger.log(TestSource.mkString(1, L"record %d", i), Logger::SV_INFO, LogEntity::NONE);
+		logger.close();
+		logger.getStats(st);
+		TEST_CHECK(!logger.error());
+	}
+	TEST_CHECK(st.rotations_ >= 2);
+	TEST_CHECK(st.compressor_.files_ == 0);
+
+	std::vector<std::string> names = listSegments(base);
+	TEST_CHECK(names.size() == st.rotations_ + 1 + 3);
+	size_t lines = 0;
+	int found = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		std::string text = readFile(dir + "/" + names[i]);
+		if (text == occupied) {
+			++found;
+			continue;
+		}
+		TEST_CHECK(text.size() <= ROTATE_SIZE);
+		// a record never gets split between the segments
+		TEST_CHECK(!text.empty() && text[text.size() - 1] == '\n');
+		lines += countLines(text);
+	}
+	TEST_CHECK(found == 3);
+	TEST_CHECK(lines == RECORDS);
+	removeSegments(base);
+}
+
+static void testTimeRotation()
+{
+	enum { PERIOD_MS = 200 };
+	const std::string base = "time.log";
+	const std::string path = dir + "/" + base;
+
+	FileLogger::Options opts;
+	opts.rotatePeriodMs_ = PERIOD_MS;
+	FileLogger::Stats st;
+	{
+		FileLogger logger(widen(path).c_str(), Logger::SV_DEBUG, opts);
+		logger.log(TestSource.mkString(1, L"first"), Logger::SV_INFO, LogEntity::NONE);
+		logger.flush();
+		logger.log(TestSource.mkString(1, L"still first"), Logger::SV_INFO, LogEntity::NONE);
+		logger.flush();
+		logger.getStats(st);
+		TEST_CHECK(st.rotations_ == 0);
+
+		Sleep(PERIOD_MS + 50);
+		logger.log(TestSource.mkString(1, L"second"), Logger::SV_INFO, LogEntity::NONE);
+		logger.flush();
+		logger.getStats(st);
+		TEST_CHECK(st.rotations_ == 1);
+	}
+
+	std::vector<std::string> names = listSegments(base);
+	TEST_CHECK(names.size() == 2);
+	if (names.size() == 2) {
+		TEST_CHECK(countLines(readFile(dir + "/" + names[0])) == 2);
+		TEST_CHECK(countLines(readFile(dir + "/" + names[1])) == 1);
+	}
+	removeSegments(base);
+}
+
+static void testCompression()
+{
+	enum { RECORDS = 300 };
+	const std::string base = "gz.log";
+	const std::string path = dir + "/" + base;
+
+	FileLogger::Options opts;
+	opts.bufferSize_ = 512;
+	opts.flushFlags_ = 0;
+	opts.rotateSize_ = 4096;
+	opts.compress_ = true;
+	FileLogger::Stats st;
+	{
+		FileLogger logger(widen(path).c_str(), Logger::SV_DEBUG, opts);
+		for (int i = 0; i < RECORDS; ++i)
+			logger.log(TestSource.mkString(1, L"record %d", i), Logger::SV_INFO, LogEntity::NONE);
+		logger.flush();
+
+		// the files left in the queue on destruction stay uncompressed
+		for (int i = 0; i < 1000; ++i) {
+			logger.getStats(st);
+			if (st.compressor_.files_ + st.compressor_.failures_ >= st.rotations_)
+				break;
+			Sleep(10);
+		}
+	}
+	TEST_CHECK(st.rotations_ >= 2);
+	TEST_CHECK(st.compressor_.files_ == st.rotations_);
+	TEST_CHECK(st.compressor_.failures_ == 0);
+	TEST_CHECK(st.compressor_.pending_ == 0);
+	TEST_CHECK(st.compressor_.bytes_ > 0);
+
+	std::vector<std::string> names = listSegments(base);
+	TEST_CHECK(names.size() == st.rotations_ + 1);
+	size_t lines = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		const std::string &name = names[i];
+		if (name == base) {
+			lines += countLines(readFile(dir + "/" + name));
+			continue;
+		}
+		TEST_CHECK(name.size() > 3 && name.compare(name.size() - 3, 3, ".gz") == 0);
+		std::string text = readGzip(dir + "/" + name);
+		TEST_CHECK(!text.empty() && text[text.size() - 1] == '\n');
+		lines += countLines(text);
+	}
+	TEST_CHECK(lines == RECORDS);
+	removeSegments(base);
+}
+
+static void testBinarySegments()
+{
+	enum { RECORDS = 300 };
+	const std::string base = "bin.log";
+	const std::string path = dir + "/" + base;
+	LogEntity::Id entity = LogEntity::intern(L"RotatedEntity");
+
+	FileLogger::Options opts;
+	opts.bufferSize_ = 512;
+	opts.flushFlags_ = 0;
+	opts.rotateSize_ = 2048;
+	FileLogger::Stats st;
+	{
+		BinaryLogger logger(widen(path).c_str(), Logger::SV_DEBUG, opts);
+		for (int i = 0; i < RECORDS; ++i) {
+			// the formats and the entity get defined only in the first segment
+			Erref err = TestSource.mkString(1, L"record %d", i);
+			err.append(TestSource.mkString(2, L"chained %ls", L"text"));
+			logger.log(err, Logger::SV_WARNING, (i & 1) ? entity : (LogEntity::Id)LogEntity::NONE);
+		}
+		logger.close();
+		logger.getStats(st);
+	}
+	TEST_CHECK(st.rotations_ >= 2);
+
+	std::vector<std::string> names = listSegments(base);
+	TEST_CHECK(names.size() == st.rotations_ + 1);
+	int next = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		BinaryLogReader reader(widen(dir + "/" + names[i]).c_str());
+		BinaryLogReader::Record rec;
+		int n = 0;
+		while (reader.next(rec)) {
+			std::wstring expected;
+			wstrAppendF(expected, L"record %d", next);
+			TEST_CHECK(rec.err_->getMsg() == expected);
+			TEST_CHECK(rec.err_->chain_ && rec.err_->chain_->getMsg() == L"chained text");
+			TEST_CHECK((rec.entityName_ != NULL) == ((next & 1) != 0));
+			if (rec.entityName_ != NULL)
+				TEST_CHECK(*rec.entityName_ == L"RotatedEntity");
+			++next;
+			++n;
+		}
+		TEST_CHECK(!reader.error());
+		TEST_CHECK(n > 0);
+	}
+	TEST_CHECK(next == RECORDS);
+	removeSegments(base);
+}
+
+static void testOutputPump()
+{
+	enum { CHUNKS = 2000 }; // several times the size of the pipe buffer
+	const std::string base = "pump.log";
+	const std::string path = dir + "/" + base;
+
+	FileLogger::Options opts;
+	opts.bufferSize_ = 1024;
+	opts.rotateSize_ = 8192;
+	std::shared_ptr<FileLogger> logger = std::make_shared<FileLogger>(widen(path).c_str(), Logger::SV_DEBUG, opts);
+
+	int fds[2];
+	TEST_CHECK(pipe(fds) == 0);
+	std::string written;
+	{
+		OutputPump pump(fds[0], logger);
+		TEST_CHECK(!pump.start());
+		for (int i = 0; i < CHUNKS; ++i) {
+			// the lines get split between the writes, like from a process
+			std::string chunk = "output " + std::to_string(i) + " ";
+			chunk.append((size_t)(i * 7 % 300), 'x');
+			if (i % 3 == 0)
+				chunk.push_back('\n');
+			TEST_CHECK(write(fds[1], chunk.data(), chunk.size()) == (ssize_t)chunk.size());
+			written.append(chunk);
+		}
+		close(fds[1]);
+		pump.wait();
+	}
+	logger->close();
+	FileLogger::Stats st;
+	logger->getStats(st);
+	TEST_CHECK(st.rotations_ >= 2);
+	TEST_CHECK(st.bytes_ == written.size());
+
+	std::vector<std::string> names = listSegments(base);
+	TEST_CHECK(names.size() == st.rotations_ + 1);
+	std::string copied;
+	for (size_t i = 0; i < names.size(); ++i)
+		copied.append(readFile(dir + "/" + names[i]));
+	TEST_CHECK(copied == written);
+	removeSegments(base);
+}
+
+int main()
+{
+	dir = "/tmp/FileRotateTest." + std::to_string(getpid());
+	TEST_CHECK(mkdir(dir.c_str(), 0755) == 0);
+
+	testSizeRotation();
+	testTimeRotation();
+	testCompression();
+	testBinarySegments();
+	testOutputPump();
+
+	rmdir(dir.c_str());
+	return TEST_RESULT();
+}
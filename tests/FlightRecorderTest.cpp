@@ -0,0 +1,215 @@
+#include "pch.h"
+#include <mutex>
+#include <set>
+#include <thread>
+#include "TestCheck.hpp"
+
+/**
+ *  FlightRecorderTest: flushAllThreads() writes the rings of all the
+ *  live threads, the rings of the exited threads get reused, and the
+ *  references to the destroyed recorders get pruned. Then the threads
+ *  keep logging while flushAllThreads() runs over and over, and every
+ *  record it writes must be intact.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+// Collects the codes of the records that it gets.
+class CollectingLogger : public Logger
+{
+public:
+	CollectingLogger() :
+		Logger(SV_INFO)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		codes_.push_back(err.getCode());
+	}
+
+	std::mutex mutex_;
+	std::vector<DWORD> codes_;
+};
+
+// Exposes the internals.
+class TestRecorder : public FlightRecorder
+{
+public:
+	TestRecorder(
+		__in std::shared_ptr<Logger> sink,
+		__in size_t ringSize) :
+		FlightRecorder(sink, SV_DEBUG, ringSize)
+	{
+	}
+
+	size_t ringCount()
+	{
+		size_t n = 0;
+		for (Ring *ring = rings_.load(); ring != NULL; ring = ring->next_)
+			++n;
+		return n;
+	}
+
+	static size_t threadRingCount()
+	{
+		return threadRings_.rings_.size();
+	}
+};
+
+enum { THREADS = 4, RECORDS = 10, RING_SIZE = 8 };
+
+// Start the threads that log RECORDS debug records each (with the
+// codes 1000*t + i), then wait for go before exiting.
+static void startThreads(
+	__in TestRecorder &recorder,
+	__out std::vector<std::thread> &threads,
+	__in HANDLE logged,
+	__in HANDLE go,
+	__in std::atomic<int> &done)
+{
+	for (int t = 0; t < THREADS; ++t) {
+		threads.push_back(std::thread([&, t] {
+			for (int i = 0; i < RECORDS; ++i)
+				recorder.log(TestSource.mkString(1000 * t + i, L"record"), Logger::SV_DEBUG, LogEntity::NONE);
+			if (done.fetch_add(1) + 1 == THREADS)
+				SetEvent(logged);
+			WaitForSingleObject(go, INFINITE);
+		}));
+	}
+}
+
+// Checks the text of every record that it gets, against the format
+// of the records logged by testConcurrentDump().
+class CheckingLogger : public Logger
+{
+public:
+	CheckingLogger() :
+		Logger(SV_INFO), records_(0), bad_(0)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		++records_;
+		if (err.getCode() == EPEM_LOG_FLIGHT_THREAD)
+			return;
+		// The argument is a heap string, so the reads of the freed
+		// records would show up here (or under a sanitizer).
+		std::wstring text = err->getMsg();
+		DWORD code = err.getCode();
+		if (text != L"record " + std::wstring(STRESS_ARG_LEN, (WCHAR)(L'a' + code % 26)))
+			++bad_;
+	}
+
+	enum { STRESS_ARG_LEN = 200 };
+
+	std::atomic<long> records_;
+	std::atomic<long> bad_;
+};
+
+static void testConcurrentDump()
+{
+	std::shared_ptr<CheckingLogger> sink = std::make_shared<CheckingLogger>();
+	TestRecorder recorder(sink, RING_SIZE);
+	std::atomic<bool> stop(false);
+	std::atomic<long> logged(0);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; ++t) {
+		threads.push_back(std::thread([&, t] {
+			std::wstring arg;
+			for (DWORD i = 0; !stop.load(); ++i) {
+				DWORD code = 1000 * t + i % 1000;
+				arg.assign(CheckingLogger::STRESS_ARG_LEN, (WCHAR)(L'a' + code % 26));
+				recorder.log(TestSource.mkString(code, L"record %ls", arg.c_str()),
+					Logger::SV_DEBUG, LogEntity::NONE);
+				++logged;
+			}
+		}));
+	}
+
+	while (logged.load() < THREADS * RING_SIZE)
+		Sleep(1);
+	for (int i = 0; i < 2000; ++i)
+		recorder.flushAllThreads();
+	stop = true;
+	for (size_t t = 0; t < threads.size(); ++t)
+		threads[t].join();
+
+	printf("concurrent dump: %ld logged, %ld written\n", logged.load(), sink->records_.load());
+	TEST_CHECK(sink->records_ > 0);
+	TEST_CHECK(sink->bad_ == 0);
+}
+
+int main()
+{
+	std::shared_ptr<CollectingLogger> sink = std::make_shared<CollectingLogger>();
+	{
+		TestRecorder recorder(sink, RING_SIZE);
+
+		for (int round = 0; round < 2; ++round) {
+			HANDLE logged = CreateEventW(NULL, TRUE, FALSE, NULL);
+			HANDLE go = CreateEventW(NULL, TRUE, FALSE, NULL);
+			std::atomic<int> done(0);
+			std::vector<std::thread> threads;
+			startThreads(recorder, threads, logged, go, done);
+			TEST_CHECK(WaitForSingleObject(logged, 5000) == WAIT_OBJECT_0);
+
+			sink->codes_.clear();
+			recorder.flushAllThreads();
+
+			// A header and the last RING_SIZE records per thread.
+			std::multiset<DWORD> codes(sink->codes_.begin(), sink->codes_.end());
+			TEST_CHECK(sink->codes_.size() == THREADS * (RING_SIZE + 1));
+			TEST_CHECK(codes.count(EPEM_LOG_FLIGHT_THREAD) == THREADS);
+			for (int t = 0; t < THREADS; ++t) {
+				for (int i = 0; i < RECORDS; ++i)
+					TEST_CHECK(codes.count(1000 * t + i) == (i >= RECORDS - RING_SIZE ? 1 : 0));
+			}
+
+			SetEvent(go);
+			for (size_t t = 0; t < threads.size(); ++t)
+				threads[t].join();
+			CloseHandle(logged);
+			CloseHandle(go);
+
+			// The second round reuses the rings of the first one.
+			TEST_CHECK(recorder.ringCount() == THREADS);
+		}
+
+		// The released rings are cleared.
+		sink->codes_.clear();
+		recorder.flushAllThreads();
+		TEST_CHECK(sink->codes_.empty());
+
+		recorder.log(TestSource.mkString(1, L"record"), Logger::SV_DEBUG, LogEntity::NONE);
+		TEST_CHECK(TestRecorder::threadRingCount() == 1);
+		TEST_CHECK(recorder.ringCount() == THREADS);
+	}
+
+	// The reference to the destroyed recorder goes away when
+	// the thread starts logging into a new one.
+	TEST_CHECK(TestRecorder::threadRingCount() == 1);
+	{
+		TestRecorder recorder(sink, RING_SIZE);
+		recorder.log(TestSource.mkString(1, L"record"), Logger::SV_DEBUG, LogEntity::NONE);
+		TEST_CHECK(TestRecorder::threadRingCount() == 1);
+
+		// An error dumps the ring of its thread, as one record.
+		sink->codes_.clear();
+		recorder.log(TestSource.mkString(2, L"error"), Logger::SV_ERROR, LogEntity::NONE);
+		TEST_CHECK(sink->codes_.size() == 2);
+		TEST_CHECK(sink->codes_.size() == 2 && sink->codes_[0] == EPEM_LOG_FLIGHT_RECORDER);
+	}
+
+	testConcurrentDump();
+	return TEST_RESULT();
+}
@@ -0,0 +1,118 @@
+#include "pch.h"
+#include "TestCheck.hpp"
+
+/**
+ *  FormatTest: the typed ErrorMsg factories, the formats
+ *  checked at compile time, and wstrAppendF() with the results
+ *  of any length.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+static void testChecked()
+{
+	DWORD code = 5;
+	const WCHAR *name = L"svc";
+
+	Erref err = ERRMSG_STRING(TestSource, 1, L"process %lu of '%ls' %hs", code, name, "x");
+	TEST_CHECK(err->getMsg() == L"process 5 of 'svc' x");
+
+	// without the arguments
+	err = ERRMSG_STRING(TestSource, 2, L"no arguments");
+	TEST_CHECK(err->getMsg() == L"no arguments");
+	TEST_CHECK(err.getCode() == 2);
+
+	err = ERRMSG_SYSTEM(TestSource, ERROR_ACCESS_DENIED, 3, L"open '%ls' failed:", name);
+	TEST_CHECK(err->getMsg() == L"open 'svc' failed:");
+	TEST_CHECK(err.getChainCode() == ERROR_ACCESS_DENIED);
+
+	static_assert(FormatCheck::matchesCall(L"%d %ls",
+		(FormatCheck::TypeList<const WCHAR[7], int, const WCHAR *> *)nullptr), "");
+	static_assert(!FormatCheck::matchesCall(L"%d %ls",
+		(FormatCheck::TypeList<const WCHAR[7], int, int> *)nullptr), "");
+	static_assert(!FormatCheck::matchesCall(L"%d",
+		(FormatCheck::TypeList<const WCHAR[3]> *)nullptr), "");
+}
+
+// Without the macros, the typed factories check the format at run time.
+static void testRuntimeCheck()
+{
+	const WCHAR *fmt = L"%d of '%ls'";
+
+	Erref err = TestSource.mkString(1, fmt, 5, L"svc");
+	TEST_CHECK(err->getMsg() == L"5 of 'svc'");
+	TEST_CHECK(!err->chain_);
+
+	err = TestSource.mkString(1, fmt, L"svc", 5);
+	TEST_CHECK(err.getCode() == 1);
+	TEST_CHECK(err.getChainCode() == ErrorMsg::InternalErrorSource::BAD_FORMAT_ARGS);
+
+	// the system error stays in the chain
+	err = TestSource.mkSystem(ERROR_ACCESS_DENIED, 2, fmt, 5);
+	TEST_CHECK(err.getChainCode() == ErrorMsg::InternalErrorSource::BAD_FORMAT_ARGS);
+	TEST_CHECK(err->chain_->chain_ && err->chain_->chain_->code_ == ERROR_ACCESS_DENIED);
+}
+
+static void testNullptr()
+{
+	Erref err = ERRMSG_STRING(TestSource, 1, L"[%ls] [%hs]", nullptr, nullptr);
+	std::wstring expect;
+	wstrAppendF(expect, L"[%ls] [%hs]", (const WCHAR *)NULL, (const char *)NULL);
+	TEST_CHECK(err->getMsg() == expect);
+
+	err = TestSource.mkString(1, L"[%p]", nullptr);
+	expect.clear();
+	wstrAppendF(expect, L"[%p]", (const void *)NULL);
+	TEST_CHECK(err->getMsg() == expect);
+}
+
+// The insertions in a MUI message must stay within MuiCatalog::MAX_ARGS,
+// including the arguments for the '*' in the width and precision.
+static void testMuiBounds()
+{
+	MuiCatalog cat;
+	const WCHAR *over = L"a %99!*.*d! b";
+	TEST_CHECK(!cat.add(1, over, wcslen(over)));
+	const MuiCatalog::Template *t = cat.find(1);
+	TEST_CHECK(t != NULL);
+	TEST_CHECK(t->nargs_ == 0);
+	// kept as the literal text
+	TEST_CHECK(t->pieces_.size() == 1 && t->pieces_[0].literal_ == over);
+
+	const WCHAR *fits = L"a %97!*.*d! b";
+	TEST_CHECK(cat.add(2, fits, wcslen(fits)));
+	t = cat.find(2);
+	TEST_CHECK(t != NULL);
+	TEST_CHECK(t->nargs_ == MuiCatalog::MAX_ARGS);
+
+	const WCHAR *star = L"%99!*d!";
+	TEST_CHECK(!cat.add(3, star, wcslen(star)));
+	TEST_CHECK(cat.find(3)->nargs_ == 0);
+}
+
+// The results longer than the stack buffer take the second pass,
+// and there is no limit on their length.
+static void testLong()
+{
+	const size_t lengths[] = { 511, 512, 513, 100000, 3000000 };
+	for (size_t i = 0; i < _countof(lengths); ++i) {
+		std::wstring arg(lengths[i], L'x');
+		std::wstring dest(L"prefix ");
+		wstrAppendF(dest, L"%ls %d", arg.c_str(), 7);
+		TEST_CHECK(dest == L"prefix " + arg + L" 7");
+	}
+
+	std::wstring arg(2000000, L'y');
+	Erref err = ERRMSG_STRING(TestSource, 1, L"[%ls]", arg.c_str());
+	TEST_CHECK(err->getMsg() == L"[" + arg + L"]");
+}
+
+int main()
+{
+	testChecked();
+	testRuntimeCheck();
+	testNullptr();
+	testMuiBounds();
+	testLong();
+	return TEST_RESULT();
+}
@@ -0,0 +1,154 @@
+#include "pch.h"
+#include <signal.h>
+#include <unistd.h>
+#include "TestCheck.hpp"
+
+/**
+ *  HeartbeatTest: runs a Service with the heartbeat under
+ *  SdNotifyStandIn, twice. No hints come between the end of the
+ *  start and the stop. The first run has no history and gets
+ *  the default wait hint for the start. The second run gets the
+ *  history saved from the first one, as an app would restore it
+ *  with setTransitionHistory(), and the hints shrink towards the
+ *  expected end of the start.
+ */
+
+enum { START_MS = 1200, STOP_MS = 300 };
+
+class TestService : public Service
+{
+public:
+	TestService() :
+		Service(L"TestService", true, true, false)
+	{
+		enableHeartbeat();
+	}
+
+	void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv)
+	{
+		Sleep(START_MS);
+		setStateRunning();
+	}
+
+	void onStop()
+	{
+		Sleep(STOP_MS);
+		setStateStopped(NO_ERROR);
+	}
+};
+
+struct RunArgs
+{
+	TestService *svc_;
+	Erref err_;
+};
+
+static DWORD WINAPI runThread(LPVOID arg)
+{
+	RunArgs *ra = (RunArgs *)arg;
+	ra->svc_->run(ra->err_);
+	return 0;
+}
+
+// Run the service through the start and stop, and collect the
+// wait hints sent during the start, in milliseconds.
+static void runService(
+	__in SdNotifyStandIn &mgr,
+	__in TestService &svc,
+	__out std::vector<DWORD> &startHints)
+{
+	static const std::string HINT = "EXTEND_TIMEOUT_USEC=";
+
+	RunArgs ra;
+	ra.svc_ = &svc;
+	mgr.markStart();
+	HANDLE thread = CreateThread(NULL, 0, &runThread, &ra, 0, NULL);
+	TEST_CHECK(thread != NULL);
+
+	bool running = false;
+	bool stopping = false;
+	bool stopped = false;
+	SdNotifyStandIn::Message msg;
+	while (mgr.receive(msg, 5000)) {
+		size_t pos = msg.text_.find(HINT);
+		if (pos != std::string::npos && !running)
+			startHints.push_back((DWORD)(std::stoull(msg.text_.substr(pos + HINT.size())) / 1000));
+		// no hints while running, between the start and the stop
+		TEST_CHECK(pos == std::string::npos || !running || stopping);
+		if (msg.text_.find("STOPPING=1") != std::string::npos)
+			stopping = true;
+		if (msg.text_.find("READY=1") != std::string::npos) {
+			running = true;
+			kill(getpid(), SIGTERM);
+		}
+		if (msg.text_.find("EXIT_STATUS=0") != std::string::npos) {
+			stopped = true;
+			break;
+		}
+	}
+	TEST_CHECK(running);
+	TEST_CHECK(stopped);
+
+	TEST_CHECK(WaitForSingleObject(thread, 5000) == WAIT_OBJECT_0);
+	CloseHandle(thread);
+	TEST_CHECK(!ra.err_);
+}
+
+int main()
+{
+	std::string path = "/tmp/HeartbeatTest." + std::to_string(getpid()) + ".sock";
+	SdNotifyStandIn mgr;
+	Erref err = mgr.open(path.c_str());
+	TEST_CHECK(!err);
+	if (err) {
+		fprintf(stderr, "%ls\n", err->toString().c_str());
+		return TEST_RESULT();
+	}
+
+	Service::TransitionHistory saved[Service::TR_COUNT];
+	{
+		TestService svc;
+		std::vector<DWORD> hints;
+		runService(mgr, svc, hints);
+
+		// Without the history, the start gets the default hint.
+		TEST_CHECK(!hints.empty());
+		TEST_CHECK(!hints.empty() && hints[0] == Service::HEARTBEAT_DEFAULT_HINT_MS);
+
+		for (int tr = 0; tr < Service::TR_COUNT; ++tr)
+			svc.getTransitionHistory((Service::Transition)tr, saved[tr]);
+		TEST_CHECK(saved[Service::TR_START].count_ == 1);
+		TEST_CHECK(saved[Service::TR_START].avgMs_ >= START_MS);
+		TEST_CHECK(saved[Service::TR_START].avgMs_ < START_MS + 500);
+		TEST_CHECK(saved[Service::TR_STOP].count_ == 1);
+		TEST_CHECK(saved[Service::TR_STOP].avgMs_ >= STOP_MS);
+		TEST_CHECK(saved[Service::TR_PAUSE].count_ == 0);
+	}
+	{
+		TestService svc;
+		for (int tr = 0; tr < Service::TR_COUNT; ++tr)
+			svc.setTransitionHistory((Service::Transition)tr, saved[tr]);
+		std::vector<DWORD> hints;
+		runService(mgr, svc, hints);
+
+		// The hints come from the history: shorter than the default,
+		// more frequent, and shrinking as the start goes on.
+		TEST_CHECK(hints.size() >= 2);
+		for (size_t i = 0; i < hints.size(); ++i) {
+			printf("start hint %u ms\n", (unsigned)hints[i]);
+			TEST_CHECK(hints[i] >= Service::HEARTBEAT_MIN_HINT_MS);
+			TEST_CHECK(hints[i] < Service::HEARTBEAT_DEFAULT_HINT_MS);
+			if (i > 0)
+				TEST_CHECK(hints[i] <= hints[i - 1]);
+		}
+
+		Service::TransitionHistory hist;
+		svc.getTransitionHistory(Service::TR_START, hist);
+		TEST_CHECK(hist.count_ == 2);
+	}
+
+	mgr.close();
+	return TEST_RESULT();
+}
@@ -0,0 +1,227 @@
+#include "pch.h"
+#include <mutex>
+#include <thread>
+#include "TestCheck.hpp"
+
+/**
+ *  RateLimitTest: RateLimitLogger collapses the repeats, counting them
+ *  exactly from several threads at once, reports them on poll() with
+ *  the last repeated error, drops the records above the rate and
+ *  reports the drops, and lets the records with colliding keys
+ *  through.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+static ErrorMsg::Source OtherSource(L"Other", NULL);
+
+// Collects the codes of the records, with the code of the first
+// chained error.
+class CollectingLogger : public Logger
+{
+public:
+	struct Record {
+	public:
+		DWORD code_;
+		DWORD chained_; // 0 if nothing is chained
+	};
+
+	CollectingLogger() :
+		Logger(SV_DEBUG)
+	{
+	}
+
+	void logBody(
+		__in Erref err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		Record r;
+		r.code_ = err.getCode();
+		r.chained_ = err->chain_ ? err->chain_->code_ : 0;
+		std::lock_guard<std::mutex> lock(mutex_);
+		records_.push_back(r);
+	}
+
+	// Count the records with the code.
+	size_t count(__in DWORD code)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		size_t n = 0;
+		for (size_t i = 0; i < records_.size(); ++i)
+			n += (records_[i].code_ == code);
+		return n;
+	}
+
+	std::mutex mutex_;
+	std::vector<Record> records_;
+};
+
+// All the records get the same key.
+class CollidingLimiter : public RateLimitLogger
+{
+public:
+	CollidingLimiter(
+		__in std::shared_ptr<Logger> sink,
+		__in const Options &opts) :
+		RateLimitLogger(sink, SV_DEBUG, opts)
+	{
+	}
+
+protected:
+	uint64_t repeatKey(
+		__in const Erref &err,
+		__in Severity sev,
+		__in LogEntity::Id entity)
+	{
+		return 0x12345;
+	}
+};
+
+enum { THREADS = 4, REPEATS = 20000 };
+
+static RateLimitLogger::Options collapseOptions(__in DWORD windowMs)
+{
+	RateLimitLogger::Options opts;
+	opts.ratePerSec_ = 0;
+	opts.windowMs_ = windowMs;
+	return opts;
+}
+
+static void testCollapse()
+{
+	std::shared_ptr<CollectingLogger> sink = std::make_shared<CollectingLogger>();
+	{
+		// The window is long enough to not end while the threads run.
+		RateLimitLogger limiter(sink, Logger::SV_DEBUG, collapseOptions(600 * 1000));
+
+		// The threads repeat the same error, and each also has its own.
+		std::vector<std::thread> threads;
+		for (int t = 0; t < THREADS; ++t) {
+			threads.push_back(std::thread([&, t] {
+				for (int i = 0; i < REPEATS; ++i) {
+					limiter.log(TestSource.mkString(1, L"same %d", i), Logger::SV_ERROR, LogEntity::NONE);
+					Erref err = TestSource.mkString(100 + t, L"own");
+					err.append(OtherSource.mkString(7, L"chained"));
+					limiter.log(err, Logger::SV_ERROR, LogEntity::NONE);
+				}
+			}));
+		}
+		for (size_t t = 0; t < threads.size(); ++t)
+			threads[t].join();
+
+		RateLimitLogger::Stats st;
+		limiter.getStats(st);
+		TEST_CHECK(sink->records_.size() == 1 + THREADS);
+		TEST_CHECK(st.passed_ == 1 + THREADS);
+		TEST_CHECK(st.repeated_ == 2ull * THREADS * REPEATS - 1 - THREADS);
+		TEST_CHECK(st.reports_ == 0);
+
+		// A different severity is a different record.
+		limiter.log(TestSource.mkString(1, L"same"), Logger::SV_WARNING, LogEntity::NONE);
+		TEST_CHECK(sink->records_.size() == 2 + THREADS);
+	}
+
+	// The destructor reports the open windows, with the last repeat chained.
+	TEST_CHECK(sink->count(EPEM_LOG_REPEATED) == 1 + THREADS);
+	for (size_t i = 2 + THREADS; i < sink->records_.size(); ++i) {
+		DWORD chained = sink->records_[i].chained_;
+		TEST_CHECK(chained == 1 || (chained >= 100 && chained < 100 + THREADS));
+	}
+}
+
+static void testPollReport()
+{
+	enum { WINDOW_MS = 200 };
+	std::shared_ptr<CollectingLogger> sink = std::make_shared<CollectingLogger>();
+	RateLimitLogger limiter(sink, Logger::SV_DEBUG, collapseOptions(WINDOW_MS));
+
+	for (int i = 0; i < 3; ++i)
+		limiter.log(TestSource.mkString(1, L"same"), Logger::SV_ERROR, LogEntity::NONE);
+	TEST_CHECK(sink->records_.size() == 1);
+
+	// Nothing gets reported while the window lasts.
+	limiter.poll();
+	TEST_CHECK(sink->records_.size() == 1);
+
+	Sleep(WINDOW_MS + 50);
+	limiter.poll();
+	RateLimitLogger::Stats st;
+	limiter.getStats(st);
+	TEST_CHECK(st.repeated_ == 2);
+	TEST_CHECK(st.reports_ == 1);
+	TEST_CHECK(sink->records_.size() == 2);
+	TEST_CHECK(sink->records_.size() == 2
+		&& sink->records_[1].code_ == EPEM_LOG_REPEATED
+		&& sink->records_[1].chained_ == 1);
+
+	// The next record starts a new window and passes.
+	limiter.log(TestSource.mkString(1, L"same"), Logger::SV_ERROR, LogEntity::NONE);
+	limiter.log(TestSource.mkString(1, L"same"), Logger::SV_ERROR, LogEntity::NONE);
+	TEST_CHECK(sink->records_.size() == 3);
+}
+
+static void testCollision()
+{
+	std::shared_ptr<CollectingLogger> sink = std::make_shared<CollectingLogger>();
+	CollidingLimiter limiter(sink, collapseOptions(600 * 1000));
+
+	for (int i = 0; i < 3; ++i) {
+		limiter.log(TestSource.mkString(1, L"first"), Logger::SV_ERROR, LogEntity::NONE);
+		limiter.log(TestSource.mkString(2, L"second"), Logger::SV_ERROR, LogEntity::NONE);
+	}
+
+	// The first record takes the key, the other one passes every time.
+	RateLimitLogger::Stats st;
+	limiter.getStats(st);
+	TEST_CHECK(sink->count(1) == 1);
+	TEST_CHECK(sink->count(2) == 3);
+	TEST_CHECK(st.repeated_ == 2);
+}
+
+static void testDrops()
+{
+	enum { BURST = 5, EXTRA = 15 };
+	std::shared_ptr<CollectingLogger> sink = std::make_shared<CollectingLogger>();
+	RateLimitLogger::Options opts;
+	opts.ratePerSec_ = 2;
+	opts.burst_ = BURST;
+	opts.windowMs_ = 0;
+	RateLimitLogger limiter(sink, Logger::SV_DEBUG, opts);
+
+	for (int i = 0; i < BURST + EXTRA; ++i)
+		limiter.log(TestSource.mkString(i, L"burst"), Logger::SV_WARNING, LogEntity::NONE);
+	// another source has its own bucket
+	limiter.log(OtherSource.mkString(1, L"other"), Logger::SV_WARNING, LogEntity::NONE);
+
+	RateLimitLogger::Stats st;
+	limiter.getStats(st);
+	TEST_CHECK(st.passed_ == BURST + 1);
+	TEST_CHECK(st.dropped_ == EXTRA);
+	TEST_CHECK(sink->records_.size() == BURST + 1);
+
+	// The next record that passes the bucket reports the drops first.
+	Sleep(600);
+	limiter.log(TestSource.mkString(99, L"after"), Logger::SV_WARNING, LogEntity::NONE);
+	TEST_CHECK(sink->records_.size() == BURST + 3);
+	TEST_CHECK(sink->count(EPEM_LOG_RATE_LIMITED) == 1);
+	TEST_CHECK(sink->records_.size() == BURST + 3 && sink->records_[BURST + 1].code_ == EPEM_LOG_RATE_LIMITED);
+
+	// Without any more records, poll() reports the drops.
+	for (int i = 0; i < EXTRA; ++i)
+		limiter.log(TestSource.mkString(i, L"burst"), Logger::SV_WARNING, LogEntity::NONE);
+	Sleep(RateLimitLogger::DEFAULT_WINDOW_MS + 50);
+	limiter.poll();
+	TEST_CHECK(sink->count(EPEM_LOG_RATE_LIMITED) == 2);
+	limiter.getStats(st);
+	TEST_CHECK(st.dropped_ == 2 * EXTRA);
+	TEST_CHECK(st.reports_ == 2);
+}
+
+int main()
+{
+	testCollapse();
+	testPollReport();
+	testCollision();
+	testDrops();
+	return TEST_RESULT();
+}
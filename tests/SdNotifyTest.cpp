@@ -0,0 +1,101 @@
+#include "pch.h"
+#include <signal.h>
+#include <unistd.h>
+#include "TestCheck.hpp"
+
+/**
+ *  SdNotifyTest: runs a Service under SdNotifyStandIn, as systemd
+ *  would, and measures the latency from the start to READY=1.
+ */
+
+class TestService : public Service
+{
+public:
+	TestService() :
+		Service(L"TestService", true, true, false, true),
+		paramChanges_(0)
+	{
+	}
+
+	void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv)
+	{
+		hintTime(5000);
+		bump();
+		setStateRunning();
+	}
+
+	void onParamChange()
+	{
+		++paramChanges_;
+	}
+
+	std::atomic<int> paramChanges_;
+};
+
+struct RunArgs
+{
+	TestService *svc_;
+	Erref err_;
+};
+
+static DWORD WINAPI runThread(LPVOID arg)
+{
+	RunArgs *ra = (RunArgs *)arg;
+	ra->svc_->run(ra->err_);
+	return 0;
+}
+
+int main()
+{
+	std::string path = "/tmp/SdNotifyTest." + std::to_string(getpid()) + ".sock";
+	SdNotifyStandIn mgr;
+	Erref err = mgr.open(path.c_str());
+	TEST_CHECK(!err);
+	if (err) {
+		fprintf(stderr, "%ls\n", err->toString().c_str());
+		return TEST_RESULT();
+	}
+
+	for (int round = 0; round < 3; ++round) {
+		TestService svc;
+		RunArgs ra;
+		ra.svc_ = &svc;
+
+		mgr.markStart();
+		HANDLE thread = CreateThread(NULL, 0, &runThread, &ra, 0, NULL);
+		TEST_CHECK(thread != NULL);
+
+		SdNotifyStandIn::Message msg;
+		bool ready = mgr.waitFor("READY=1", msg, 2000);
+		TEST_CHECK(ready);
+		if (ready)
+			printf("READY=1 after %.1f us\n", msg.ns_ / 1000.);
+
+		kill(getpid(), SIGHUP);
+		kill(getpid(), SIGTERM);
+
+		bool stopping = false;
+		bool stopped = false;
+		while (mgr.receive(msg, 1000)) {
+			if (msg.text_.find("STOPPING=1") != std::string::npos)
+				stopping = true;
+			if (msg.text_.find("EXIT_STATUS=0") != std::string::npos) {
+				stopped = true;
+				break;
+			}
+		}
+		TEST_CHECK(stopping);
+		TEST_CHECK(stopped);
+
+		TEST_CHECK(WaitForSingleObject(thread, 5000) == WAIT_OBJECT_0);
+		CloseHandle(thread);
+		TEST_CHECK(!ra.err_);
+		TEST_CHECK(svc.paramChanges_ == 1);
+		TEST_CHECK(svc.statusSnapshot().state_ == SERVICE_STOPPED);
+	}
+
+	mgr.close();
+	return TEST_RESULT();
+}
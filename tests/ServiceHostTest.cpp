@@ -0,0 +1,249 @@
+#include "pch.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include "TestCheck.hpp"
+
+/**
+ *  ServiceHostTest: several services in one ServiceHost, as one
+ *  systemd unit under SdNotifyStandIn. READY=1 comes only after all
+ *  of them are running, SIGTERM stops all of them, and the exit status
+ *  is the failure of one of them. Then the memory per service, with
+ *  SERVICES services in one host.
+ */
+
+enum { SERVICES = 1000 };
+// The upper limit of the memory per service, in kilobytes.
+// A separate process per service would take megabytes.
+static const double SERVICE_KB_LIMIT = 16.;
+
+// Starts and stops in the background, after a delay. The background
+// threads get joined before the object goes away.
+class TestService : public Service
+{
+public:
+	TestService(
+		__in const std::wstring &name,
+		__in DWORD delayMs,
+		__in DWORD exitCode) :
+		Service(name, true, true, false),
+		delayMs_(delayMs), exitCode_(exitCode)
+	{
+		enableHeartbeat();
+	}
+
+	~TestService()
+	{
+		join(startThread_);
+		join(stopThread_);
+	}
+
+	void onStart(
+		__in DWORD argc,
+		__in_ecount(argc) LPWSTR *argv)
+	{
+		// the thread may set the state before the assignment completes
+		ScopeCritical sc(threadsCr_);
+		startThread_ = std::thread([this] {
+			Sleep(delayMs_);
+			setStateRunning();
+		});
+	}
+
+	void onStop()
+	{
+		join(startThread_);
+		ScopeCritical sc(threadsCr_);
+		stopThread_ = std::thread([this] {
+			Sleep(delayMs_);
+			setStateStopped(exitCode_);
+		});
+	}
+
+	// Wait for a background thread to exit, if it was started.
+	void join(
+		__inout std::thread &th)
+	{
+		std::thread t;
+		{
+			ScopeCritical sc(threadsCr_);
+			t.swap(th);
+		}
+		if (t.joinable())
+			t.join();
+	}
+
+	DWORD delayMs_;
+	DWORD exitCode_;
+	Critical threadsCr_; // protects the thread objects
+	std::thread startThread_;
+	std::thread stopThread_;
+};
+
+struct RunArgs
+{
+	ServiceHost *host_;
+	Erref err_;
+};
+
+static DWORD WINAPI runThread(LPVOID arg)
+{
+	RunArgs *ra = (RunArgs *)arg;
+	ra->host_->run(ra->err_);
+	return 0;
+}
+
+// The resident memory of the process, in kilobytes.
+static long rssKb()
+{
+	long kb = 0;
+	FILE *f = fopen("/proc/self/status", "r");
+	if (f == NULL)
+		return 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %ld", &kb) == 1)
+			break;
+	}
+	fclose(f);
+	return kb;
+}
+
+static bool allInState(
+	__in std::vector<TestService *> &svcs,
+	__in DWORD state)
+{
+	for (size_t i = 0; i < svcs.size(); ++i) {
+		if (svcs[i]->statusSnapshot().state_ != state)
+			return false;
+	}
+	return true;
+}
+
+static void testThreeServices()
+{
+	std::string path = "/tmp/ServiceHostTest." + std::to_string(getpid()) + ".sock";
+	SdNotifyStandIn mgr;
+	Erref err = mgr.open(path.c_str());
+	TEST_CHECK(!err);
+	if (err) {
+		fprintf(stderr, "%ls\n", err->toString().c_str());
+		return;
+	}
+
+	TestService alpha(L"Alpha", 50, NO_ERROR);
+	TestService beta(L"Beta", 200, 3);
+	TestService gamma(L"Gamma", 100, NO_ERROR);
+	std::vector<TestService *> svcs;
+	svcs.push_back(&alpha);
+	svcs.push_back(&beta);
+	svcs.push_back(&gamma);
+
+	ServiceHost host;
+	for (size_t i = 0; i < svcs.size(); ++i)
+		host.add(svcs[i]);
+
+	RunArgs ra;
+	ra.host_ = &host;
+	mgr.markStart();
+	HANDLE thread = CreateThread(NULL, 0, &runThread, &ra, 0, NULL);
+	TEST_CHECK(thread != NULL);
+
+	bool ready = false;
+	bool stopping = false;
+	bool stopped = false;
+	std::string exitStatus;
+	std::set<std::string> named; // the services seen in STATUS=
+	SdNotifyStandIn::Message msg;
+	while (mgr.receive(msg, 5000)) {
+		for (size_t i = 0; i < svcs.size(); ++i) {
+			std::string name(svcs[i]->name().begin(), svcs[i]->name().end());
+			if (msg.text_.find("STATUS=" + name + ":") != std::string::npos)
+				named.insert(name);
+		}
+		if (msg.text_.find("READY=1") != std::string::npos) {
+			TEST_CHECK(!ready);
+			ready = true;
+			// the slowest service starts in 200 ms
+			TEST_CHECK(msg.ns_ >= 200ull * 1000 * 1000);
+			TEST_CHECK(allInState(svcs, SERVICE_RUNNING));
+			kill(getpid(), SIGTERM);
+		}
+		if (msg.text_.find("STOPPING=1") != std::string::npos) {
+			TEST_CHECK(ready);
+			stopping = true;
+		}
+		size_t pos = msg.text_.find("EXIT_STATUS=");
+		if (pos != std::string::npos) {
+			exitStatus = msg.text_.substr(pos + strlen("EXIT_STATUS="));
+			stopped = true;
+			break;
+		}
+	}
+	TEST_CHECK(ready);
+	TEST_CHECK(stopping);
+	TEST_CHECK(stopped);
+	// Beta is the one that failed.
+	TEST_CHECK(exitStatus.substr(0, exitStatus.find('\n')) == "3");
+	TEST_CHECK(named.size() == svcs.size());
+
+	TEST_CHECK(WaitForSingleObject(thread, 5000) == WAIT_OBJECT_0);
+	CloseHandle(thread);
+	TEST_CHECK(!ra.err_);
+	TEST_CHECK(allInState(svcs, SERVICE_STOPPED));
+	for (size_t i = 0; i < svcs.size(); ++i)
+		TEST_CHECK(svcs[i]->host() == NULL);
+
+	mgr.close();
+}
+
+static void testMemory()
+{
+	// Nobody listens to the notifications.
+	unsetenv("NOTIFY_SOCKET");
+
+	long before = rssKb();
+	std::vector<std::unique_ptr<TestService> > owned;
+	std::vector<TestService *> svcs;
+	ServiceHost host;
+	for (int i = 0; i < SERVICES; ++i) {
+		owned.push_back(std::unique_ptr<TestService>(new TestService(L"Svc" + std::to_wstring(i), 1, NO_ERROR)));
+		svcs.push_back(owned.back().get());
+		host.add(svcs.back());
+	}
+
+	RunArgs ra;
+	ra.host_ = &host;
+	HANDLE thread = CreateThread(NULL, 0, &runThread, &ra, 0, NULL);
+	TEST_CHECK(thread != NULL);
+
+	for (int i = 0; i < 500 && !allInState(svcs, SERVICE_RUNNING); ++i)
+		Sleep(10);
+	TEST_CHECK(allInState(svcs, SERVICE_RUNNING));
+	for (size_t i = 0; i < svcs.size(); ++i)
+		svcs[i]->join(svcs[i]->startThread_);
+	long after = rssKb();
+	double perService = (double)(after - before) / SERVICES;
+	printf("%d services: RSS %ld -> %ld kB, %.1f kB per service, sizeof(Service) %zu\n",
+		SERVICES, before, after, perService, sizeof(Service));
+	TEST_CHECK(before > 0);
+#if !defined(__SANITIZE_THREAD__) && !defined(__SANITIZE_ADDRESS__)
+	// the sanitizers keep much memory of their own per thread
+	TEST_CHECK(perService < SERVICE_KB_LIMIT);
+#endif
+
+	kill(getpid(), SIGTERM);
+	TEST_CHECK(WaitForSingleObject(thread, 10000) == WAIT_OBJECT_0);
+	CloseHandle(thread);
+	TEST_CHECK(!ra.err_);
+	TEST_CHECK(allInState(svcs, SERVICE_STOPPED));
+}
+
+int main()
+{
+	testThreeServices();
+	testMemory();
+	return TEST_RESULT();
+}
@@ -0,0 +1,177 @@
+#include "pch.h"
+#include <thread>
+#include "TestCheck.hpp"
+
+/**
+ *  StateCaptureTest: the ETW capture-state request, sent through
+ *  EtwStandIn::captureState(), makes EtwLogger write the states of
+ *  all the sources, at a level that the session accepts, in both the
+ *  single and batched events. The sources get called without the
+ *  registry's lock, so they may log and register the sources while
+ *  the other threads register and unregister theirs.
+ */
+
+static ErrorMsg::Source TestSource(L"Test", NULL);
+
+enum { STATE_CODE = 7, OTHER_CODE = 8 };
+
+class CountingSource : public StateSource
+{
+public:
+	CountingSource(
+		__in DWORD code) :
+		code_(code), calls_(0)
+	{
+		StateSources::add(this);
+	}
+
+	~CountingSource()
+	{
+		StateSources::remove(this);
+	}
+
+	Erref captureState()
+	{
+		int n = ++calls_;
+		return TestSource.mkString(code_, L"state %d", n);
+	}
+
+	DWORD code_;
+	std::atomic<int> calls_;
+};
+
+// Registers and unregisters another source, on another thread, from
+// inside the snapshot. Used to deadlock on the registry's lock.
+class RegisteringSource : public StateSource
+{
+public:
+	RegisteringSource()
+	{
+		StateSources::add(this);
+	}
+
+	~RegisteringSource()
+	{
+		StateSources::remove(this);
+	}
+
+	Erref captureState()
+	{
+		std::thread t([] {
+			CountingSource other(OTHER_CODE);
+		});
+		t.join();
+		return Erref();
+	}
+};
+
+// Check whether the events carry a record with the code, and that all
+// the events are at the level of the session or below.
+static bool hasCode(
+	__in const std::vector<EtwStandIn::Event> &events,
+	__in UCHAR level,
+	__in DWORD code)
+{
+	bool found = false;
+	for (size_t i = 0; i < events.size(); ++i) {
+		const EtwStandIn::Event &ev = events[i];
+		TEST_CHECK(ev.desc_.Level != 0 && ev.desc_.Level <= level);
+		if (ev.desc_.Id == EtwLogger::BATCH_EVENT_ID) {
+			std::vector<EtwBatch::Record> recs;
+			TEST_CHECK(EtwBatch::decode(ev.data_.data(), ev.data_.size(), recs));
+			for (size_t j = 0; j < recs.size(); ++j) {
+				for (size_t k = 0; k < recs[j].codes_.size(); ++k)
+					found = found || (recs[j].codes_[k] == code);
+			}
+		} else {
+			// the codes are at the end of the payload
+			uint32_t last = 0;
+			if (ev.data_.size() >= sizeof(last))
+				memcpy(&last, ev.data_.data() + ev.data_.size() - sizeof(last), sizeof(last));
+			found = found || (last == code);
+		}
+	}
+	return found;
+}
+
+static void testCapture(
+	__in bool batch)
+{
+	CountingSource source(STATE_CODE);
+	GUID guid = {};
+	EtwLogger logger(&guid, Logger::SV_DEBUG, batch);
+	etwStandIn.keepEvents(true);
+	std::vector<EtwStandIn::Event> events;
+
+	// Nobody is listening.
+	etwStandIn.captureState();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+
+	// The session wants only the errors, and the states still come
+	// through, while the regular records of the same severity don't.
+	etwStandIn.enable(TRACE_LEVEL_ERROR);
+	logger.log(TestSource.mkString(1, L"info"), Logger::SV_INFO, LogEntity::NONE);
+	logger.poll();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+
+	int before = source.calls_;
+	etwStandIn.captureState();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(source.calls_ == before + 1);
+	TEST_CHECK(hasCode(events, TRACE_LEVEL_ERROR, STATE_CODE));
+
+	// At a lower level they go as the information.
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE);
+	etwStandIn.captureState();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(hasCode(events, TRACE_LEVEL_INFORMATION, STATE_CODE));
+
+	etwStandIn.disable();
+	etwStandIn.captureState();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(events.empty());
+}
+
+static void testRegistering()
+{
+	CountingSource source(STATE_CODE);
+	RegisteringSource registering;
+	GUID guid = {};
+	EtwLogger logger(&guid, Logger::SV_DEBUG);
+	etwStandIn.keepEvents(true);
+	etwStandIn.enable(TRACE_LEVEL_VERBOSE);
+
+	std::vector<EtwStandIn::Event> events;
+	etwStandIn.captureState();
+	etwStandIn.takeEvents(events);
+	TEST_CHECK(hasCode(events, TRACE_LEVEL_INFORMATION, STATE_CODE));
+	// registered after the snapshot has started
+	TEST_CHECK(!hasCode(events, TRACE_LEVEL_INFORMATION, OTHER_CODE));
+
+	// Snapshots on one thread, the sources coming and going on another.
+	std::atomic<bool> done(false);
+	std::thread churn([&] {
+		while (!done) {
+			CountingSource other(OTHER_CODE);
+		}
+	});
+	for (int i = 0; i < 200; ++i) {
+		std::vector<Erref> states;
+		StateSources::capture(states);
+		TEST_CHECK(states.size() >= 1);
+	}
+	done = true;
+	churn.join();
+
+	etwStandIn.disable();
+}
+
+int main()
+{
+	testCapture(false);
+	testCapture(true);
+	testRegistering();
+	return TEST_RESULT();
+}
@@ -0,0 +1,93 @@
+#include "pch.h"
+#include <thread>
+#include "TestCheck.hpp"
+
+/**
+ *  StatusSnapshotTest: one thread keeps changing the state of a
+ *  Service, others keep bumping the checkpoints, and the readers
+ *  check that every statusSnapshot() is consistent: the state matches
+ *  its epoch, and within an epoch the checkpoints never go back and
+ *  never fall behind the published ones.
+ */
+
+enum { UPDATES = 20000, BUMPERS = 2, READERS = 2 };
+
+// The writer goes through the states in this order, over and over.
+static const DWORD STATES[] = {
+	SERVICE_RUNNING,
+	SERVICE_PAUSE_PENDING,
+	SERVICE_PAUSED,
+	SERVICE_CONTINUE_PENDING,
+};
+
+class TestService : public Service
+{
+public:
+	TestService() :
+		Service(L"TestService", true, true, true)
+	{
+		// publish every bump right away, under the lock
+		setPublishInterval(0);
+	}
+};
+
+// The state that the writer sets in an epoch.
+static DWORD stateOf(
+	__in DWORD epoch)
+{
+	if (epoch == 0)
+		return SERVICE_START_PENDING;
+	return STATES[(epoch - 1) % _countof(STATES)];
+}
+
+int main()
+{
+	TestService svc;
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> snaps(0);
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < BUMPERS; ++i) {
+		threads.emplace_back([&] {
+			while (!done)
+				svc.bump();
+		});
+	}
+	for (int i = 0; i < READERS; ++i) {
+		threads.emplace_back([&] {
+			Service::StatusSnapshot prev = svc.statusSnapshot();
+			while (!done) {
+				Service::StatusSnapshot snap = svc.statusSnapshot();
+				TEST_CHECK(snap.state_ == stateOf(snap.epoch_));
+				TEST_CHECK(snap.checkPoint_ >= snap.publishedCheckPoint_);
+				TEST_CHECK(snap.epoch_ >= prev.epoch_);
+				if (snap.epoch_ == prev.epoch_) {
+					TEST_CHECK(snap.checkPoint_ >= prev.checkPoint_);
+					TEST_CHECK(snap.publishedCheckPoint_ >= prev.publishedCheckPoint_);
+				}
+				prev = snap;
+				snaps.fetch_add(1, std::memory_order_relaxed);
+			}
+		});
+	}
+
+	// Let the readers start, and let them run between the updates
+	// even on a single CPU.
+	while (snaps.load() == 0)
+		std::this_thread::yield();
+	for (int i = 0; i < UPDATES; ++i) {
+		svc.setState(STATES[i % _countof(STATES)]);
+		if (i % 100 == 0)
+			std::this_thread::yield();
+	}
+	done = true;
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	Service::StatusSnapshot snap = svc.statusSnapshot();
+	TEST_CHECK(snap.epoch_ == UPDATES);
+	TEST_CHECK(snap.state_ == stateOf(UPDATES));
+	TEST_CHECK(snaps.load() > 0);
+
+	return TEST_RESULT();
+}
@@ -0,0 +1,116 @@
+#include "pch.h"
+#include <thread>
+#include "TestCheck.hpp"
+
+/**
+ *  SystemTextCacheTest: the first lookup of a code in systemTextCache
+ *  misses and adds an entry, the next ones hit and return the same
+ *  text. The threads looking up the same new codes at once all get the
+ *  right texts, and each code gets only one entry. When the cache is
+ *  full, the new codes keep missing.
+ */
+
+enum { THREADS = 8, CODES = 32, ROUNDS = 2000 };
+
+// The kinds get separate entries, even if the texts are the same,
+// which gives the fresh codes for each part of the test.
+static void testHitMiss()
+{
+	SystemTextCache::Stats before, after;
+	std::wstring first, second;
+
+	systemTextCache.getStats(before);
+	TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, EDOM, first));
+	systemTextCache.getStats(after);
+	TEST_CHECK(after.misses_ == before.misses_ + 1);
+	TEST_CHECK(after.hits_ == before.hits_);
+	TEST_CHECK(after.entries_ == before.entries_ + 1);
+	TEST_CHECK(!first.empty());
+
+	before = after;
+	TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, EDOM, second));
+	systemTextCache.getStats(after);
+	TEST_CHECK(after.misses_ == before.misses_);
+	TEST_CHECK(after.hits_ == before.hits_ + 1);
+	TEST_CHECK(after.entries_ == before.entries_);
+	TEST_CHECK(second == first);
+
+	// the message gets its text through the cache
+	Erref err = ErrorMsg::mkErrno(EDOM);
+	TEST_CHECK(err->getMsg() == first);
+	systemTextCache.getStats(before);
+	TEST_CHECK(before.hits_ == after.hits_ + 1);
+}
+
+static void testConcurrent()
+{
+	SystemTextCache::Stats before, after;
+	systemTextCache.getStats(before);
+
+	// The texts that each thread got for each code.
+	std::vector<std::vector<std::wstring> > seen(THREADS, std::vector<std::wstring>(CODES));
+	std::atomic<int> failed(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < THREADS; ++t) {
+		threads.emplace_back([&, t] {
+			std::wstring text;
+			for (int r = 0; r < ROUNDS; ++r) {
+				int c = (r + t) % CODES;
+				if (!systemTextCache.get(SystemTextCache::SK_SYSTEM, c + 1, text))
+					++failed;
+				if (seen[t][c].empty())
+					seen[t][c] = text;
+				else if (seen[t][c] != text)
+					++failed;
+			}
+		});
+	}
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+
+	systemTextCache.getStats(after);
+	TEST_CHECK(failed == 0);
+	TEST_CHECK(after.entries_ == before.entries_ + CODES);
+	TEST_CHECK(after.misses_ >= before.misses_ + CODES);
+	TEST_CHECK(after.hits_ + after.misses_ == before.hits_ + before.misses_ + THREADS * ROUNDS);
+
+	// All the threads got the same texts as the cache has now.
+	for (int c = 0; c < CODES; ++c) {
+		std::wstring text;
+		TEST_CHECK(systemTextCache.get(SystemTextCache::SK_SYSTEM, c + 1, text));
+		for (int t = 0; t < THREADS; ++t)
+			TEST_CHECK(seen[t][c] == text);
+	}
+}
+
+static void testFull()
+{
+	SystemTextCache::Stats st;
+	std::wstring text;
+
+	// Fill up the cache with the codes that nobody else uses.
+	DWORD code = 100000;
+	systemTextCache.getStats(st);
+	while (st.entries_ < SystemTextCache::CAPACITY) {
+		TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, code++, text));
+		systemTextCache.getStats(st);
+	}
+
+	SystemTextCache::Stats before, after;
+	systemTextCache.getStats(before);
+	TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, EDOM, text));
+	TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, code, text));
+	TEST_CHECK(systemTextCache.get(SystemTextCache::SK_ERRNO, code, text));
+	systemTextCache.getStats(after);
+	TEST_CHECK(after.entries_ == before.entries_);
+	TEST_CHECK(after.hits_ == before.hits_ + 1);
+	TEST_CHECK(after.misses_ == before.misses_ + 2);
+}
+
+int main()
+{
+	testHitMiss();
+	testConcurrent();
+	testFull();
+	return TEST_RESULT();
+}
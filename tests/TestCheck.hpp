@@ -0,0 +1,21 @@
+#pragma once
+
+// The minimal checking for the test programs, each built from one file:
+// a failed check prints the location and the condition, and makes
+// the test fail at the end.
+
+#include <stdio.h>
+
+static int testFailures = 0;
+
+#define TEST_CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			++testFailures; \
+		} \
+	} while (0)
+
+// The exit code for main().
+#define TEST_RESULT() \
+	(testFailures == 0 ? (printf("PASSED\n"), 0) : (printf("FAILED: %d checks\n", testFailures), 1))